@@ -11,12 +11,15 @@
 #ifndef CRC_H
 #define CRC_H
 
-#ifndef M4
-// AVR code
-#include "m_general.h"
-#else
+#if defined(M4)
 // M4 code
 #include "mGeneral.h"
+#elif defined(HOST)
+// PC tools (host_general.h makes PROGMEM and pgm_read_* work like the AVR)
+#include "host_general.h"
+#else
+// AVR code
+#include "m_general.h"
 #endif
 
 // 16-bit CRC for data blocks
@@ -30,7 +30,7 @@
         #define debuguint(u)    m_usb_tx_uint(u)
         #define debuglong(l)    m_usb_tx_long(l)
         #define debugulong(l)   m_usb_tx_ulong(l)
-    #elif defined(M4)
+    #elif defined(M4) || defined(HOST)
         #define debug(s)        printf(s)
         #define debugchar(c)    printf("%d", c)
         #define debughexchar(c) printf("%x", c)
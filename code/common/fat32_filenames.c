@@ -98,3 +98,49 @@ void filename_8_3_to_fs (const char *input_name,
     }
 }
 
+
+static char uppercase (char c)
+{
+    if (c >= (char)0x61 && c <= (char)0x7a)
+        c -= 0x20;
+    return c;
+}
+
+// whether a listed name matches a pattern with '*' and '?' wildcards
+bool filename_matches (const char *name,
+                       const char *pattern)
+{
+    // where to pick up again if the characters after the last '*' stop
+    // matching: that '*' takes one more character of the name instead
+    const char *star = 0;
+    const char *star_name = 0;
+    
+    while (*name != '\0')
+    {
+        if (*pattern == '*')
+        {
+            star = ++pattern;
+            star_name = name;
+        }
+        else if (*pattern == '?' || (*pattern != '\0' &&
+                                     uppercase (*pattern) == uppercase (*name)))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star != 0)
+        {
+            pattern = star;
+            name = ++star_name;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    
+    while (*pattern == '*')
+        pattern++;
+    
+    return (*pattern == '\0');
+}
@@ -1,6 +1,10 @@
 #ifndef _FAT32_FILENAMES_H
 #define _FAT32_FILENAMES_H
 
+#ifndef bool
+#include <stdbool.h>
+#endif
+
 // convert file names from their representation on disk
 // eg., "TEST    TXT" becomes "TEST.TXT"
 void filename_fs_to_8_3 (const char *input_name,
@@ -11,4 +15,10 @@ void filename_fs_to_8_3 (const char *input_name,
 void filename_8_3_to_fs (const char *input_name,
                          char output_name[13]);
 
+// whether a listed name (eg. "TEST.TXT") matches a pattern, in which '*'
+// stands for any run of characters and '?' for any one character, without
+// regard to case; eg. "LOG*.TXT" matches "LOG00012.TXT"
+bool filename_matches (const char *name,
+                       const char *pattern);
+
 #endif
@@ -11,6 +11,30 @@
 
 #define TWI_BUFFER_LEN 257
 
+// the longest response: a bulk read sends up to a sector at a time
+#define MBUS_FRAME_LEN 512
+
+// a directory entry response: found flag, size, directory flag and the name
+// (up to 15 characters on exFAT, and a terminator)
+#define DIR_ENTRY_RESPONSE 22
+
+// M_SD_LIST_DIR: the flags in a listed entry, and the longest name there can
+// be in one
+#define LISTED_DIRECTORY 0x01
+#define LISTED_NAME_MAX  15
+
+// frame headers are the code and an 8-bit data length, or once bulk frames
+// have been negotiated (in m_sd_init), a 16-bit one; queued frames also have
+// a sequence number after the code
+#define LEGACY_HEADER_LENGTH 2
+#define BULK_HEADER_LENGTH   3
+#define QUEUED_HEADER_LENGTH 4
+#define MAX_HEADER_LENGTH    QUEUED_HEADER_LENGTH
+
+// the response code in queued mode when the peripheral hasn't finished an
+// order since its last response
+#define NO_COMPLETION 0xff
+
 typedef enum m_microsd_command_type
 {
     M_SD_INIT = 0,
@@ -31,24 +55,58 @@ typedef enum m_microsd_command_type
     M_SD_READ_FILE,
     M_SD_WRITE_FILE,
     M_SD_COMMIT,
+    M_SD_TRUNCATE,
+    M_SD_FREE_SPACE,
+    M_SD_RINGLOG_CREATE,
+    M_SD_RINGLOG_OPEN,
+    M_SD_RINGLOG_CLOSE,
+    M_SD_RINGLOG_APPEND,
+    M_SD_RINGLOG_REWIND,
+    M_SD_RINGLOG_READ,
+    M_SD_SET_MODE,
+    M_SD_WRITE_MORE,
+    M_SD_BATCH,
+    M_SD_LIST_DIR,
+    
+    M_SD_NUM_COMMANDS,  // (not a command: for tables indexed by command)
     
     M_SD_NONE = 255
 } m_microsd_command_type;
 
+// frame formats for M_SD_SET_MODE
+typedef enum m_microsd_frame_mode
+{
+    MBUS_LEGACY_FRAMES = 0,
+    MBUS_BULK_FRAMES,
+    MBUS_QUEUED_FRAMES
+} m_microsd_frame_mode;
+
+// options for M_SD_SET_MODE, in an optional second byte
+#define MBUS_WRITE_BEHIND 0x01  // (queued frames only)
+
+// the frame on the bus is the header, built in (or received into) the end of
+// frame, followed directly by data
 typedef struct i2c_command
 {
-    uint8_t command;
-    uint8_t data_length;
-    uint8_t data[TWI_BUFFER_LEN];
+    uint8_t  command;
+    uint8_t  seq;
+    uint16_t data_length;
+    uint8_t  frame[MAX_HEADER_LENGTH];
+    uint8_t  data[TWI_BUFFER_LEN];
 } i2c_command;
 
 typedef struct i2c_response
 {
-    uint8_t response_code;
-    uint8_t data_length;
-    uint8_t data[TWI_BUFFER_LEN];
+    uint8_t  response_code;
+    uint8_t  seq;
+    uint16_t data_length;
+    uint8_t  frame[MAX_HEADER_LENGTH];
+    uint8_t  data[MBUS_FRAME_LEN];
 } i2c_response;
 
+#ifdef HOST
+static  // the peripheral's side of the simulation has its own
+#endif
 union m_sd_transmission
 {
     i2c_command  order;
@@ -57,6 +115,96 @@ union m_sd_transmission
 
 m_sd_errors m_sd_error_code;
 
+static uint8_t header_length = LEGACY_HEADER_LENGTH;
+
+// the most order data the peripheral takes in one frame
+static uint16_t order_space = TWI_BUFFER_LEN;
+
+// in queued mode: the sequence number for the next order (never 0, which is
+// what a restarted master's M_SD_INIT has, see m_sd_init), and the last one
+// sent; orders posted without waiting for their responses, and the first
+// error any of those responses had
+static uint8_t next_seq = 1;
+static uint8_t last_seq;
+static uint8_t posted = 0;
+static m_sd_errors posted_error = ERROR_NONE;
+
+// waiting for the peripheral: the first look for a response comes after the
+// shortest time the same kind of order is likely to take, going by the average
+// and spread of the times it took before.  Then the peripheral is polled
+// often while the order could be about to finish, and after that at intervals
+// that double up to POLL_MAX_US (set for each device below), until
+// RESPONSE_TIMEOUT_US has gone by
+#define POLL_MIN_US         20
+#define BYTE_US             23  // 8 bits and an ACK at 400 kHz
+#define RESPONSE_TIMEOUT_US 1000000
+
+// with a ready line (M_SD_READY_LINE), how often it's checked while waiting
+#define READY_STEP_US 5
+
+static uint16_t expected_us[M_SD_NUM_COMMANDS];  // learned for each command
+static uint16_t spread_us[M_SD_NUM_COMMANDS];
+static uint8_t  poll_command = M_SD_NONE;        // the order being waited on
+static uint32_t waited_us;                       // since it was sent
+static uint32_t poll_budget_us;
+static uint16_t poll_interval_us;
+
+static void poll_start (const uint8_t command);
+static bool poll_wait (const uint8_t looking_bytes);
+static void poll_done (void);
+
+
+// write the order's header in front of its data, and return where the frame
+// starts
+static uint8_t *order_frame (void)
+{
+    uint8_t *frame = transmission.order.frame + MAX_HEADER_LENGTH - header_length;
+    
+    frame[0] = transmission.order.command;
+    
+    if (header_length == QUEUED_HEADER_LENGTH)
+    {
+        frame[1] = transmission.order.seq;
+        frame[2] = (uint8_t)transmission.order.data_length;
+        frame[3] = (uint8_t)(transmission.order.data_length >> 8);
+    }
+    else
+    {
+        frame[1] = (uint8_t)transmission.order.data_length;
+        if (header_length == BULK_HEADER_LENGTH)
+            frame[2] = (uint8_t)(transmission.order.data_length >> 8);
+    }
+    
+    return frame;
+}
+
+// where to receive a response frame, so that its data lands in response.data
+static uint8_t *response_frame (void)
+{
+    return transmission.response.frame + MAX_HEADER_LENGTH - header_length;
+}
+
+// fill in the response code and data length from the received header
+static void parse_response_header (void)
+{
+    const uint8_t *frame = response_frame();
+    
+    transmission.response.response_code = frame[0];
+    
+    if (header_length == QUEUED_HEADER_LENGTH)
+    {
+        transmission.response.seq = frame[1];
+        transmission.response.data_length = (uint16_t)frame[2] |
+                                            ((uint16_t)frame[3] << 8);
+    }
+    else
+    {
+        transmission.response.data_length = frame[1];
+        if (header_length == BULK_HEADER_LENGTH)
+            transmission.response.data_length |= (uint16_t)frame[2] << 8;
+    }
+}
+
 
 
 
@@ -65,11 +213,31 @@ m_sd_errors m_sd_error_code;
 
 #define I2C_ADDR (0x5D)
 
-#define MAX_RESPONSE_RETRIES        500
-#define MS_BETWEEN_RESPONSE_RETRIES 2
+#define POLL_MAX_US 2000
 
 #define nop()  __asm__ __volatile__("nop")
 
+// the peripheral's optional ready line (READY_LINE in peripheral/m_microsd.c),
+// on pin B0 unless M_SD_READY_PINS and M_SD_READY_NUM are set in the makefile
+#ifdef M_SD_READY_LINE
+#ifndef M_SD_READY_PINS
+#define M_SD_READY_PINS PINB
+#define M_SD_READY_NUM  0
+#endif
+
+static inline bool ready_line (void)
+{
+    return check (M_SD_READY_PINS, M_SD_READY_NUM);
+}
+#endif
+
+static void wait_us (const uint16_t us)
+{
+    // _delay_us needs a constant
+    for (uint16_t i = 0; i < us; i += 10)
+        _delay_us (10);
+}
+
 unsigned char twi_start(unsigned char address, unsigned char readwrite);
 unsigned char twi_send_byte(unsigned char byte);
 void twi_stop(void);
@@ -96,7 +264,8 @@ inline uint8_t read_final_byte (void)
 	return TWDR;
 }
 
-static bool send_order (void)
+// send the order in one frame; false if the peripheral NACKs it (it's busy)
+static bool send_frame (void)
 {
     // wait at least one I2C clock cycle before starting
     for (uint16_t i = 0; i < (uint32_t)F_CPU / (uint32_t)400000; i++)
@@ -120,22 +289,22 @@ static bool send_order (void)
 		return false;
 	}
 	
-	// send the command type
-	TWDR = transmission.order.command;
-	TWCR = _BV (TWEN) | _BV (TWINT);
-	while (!(TWCR & _BV (TWINT)));
+	// send the header (command type and data length) and data
+	const uint8_t *frame = order_frame();
+	const uint16_t frame_length = header_length + transmission.order.data_length;
 	
-	// send the data length
-	TWDR = transmission.order.data_length;
-	TWCR = _BV (TWEN) | _BV (TWINT);
-	while (!(TWCR & _BV (TWINT)));
-    
-	// send data
-	for(uint8_t i = 0; i < transmission.order.data_length; i++)
+	for (uint16_t i = 0; i < frame_length; i++)
 	{
-		TWDR = transmission.order.data[i];
+		TWDR = frame[i];
 		TWCR = _BV (TWEN) | _BV (TWINT);
-    	while (!(TWCR & _BV (TWINT)));
+		while (!(TWCR & _BV (TWINT)));
+		
+		if ((TWSR & 0b11111000) == 0x30)
+		{  // a queued-mode peripheral NACKs the order when it has no room for it
+			TWCR = _BV (TWEN) | _BV (TWINT) | _BV (TWSTO);
+			sei();
+			return false;
+		}
 	}
 	
 	// send stop
@@ -147,17 +316,11 @@ static bool send_order (void)
     return true;
 }
 
-static bool receive_response (void)
+// receive a response frame, which should have at most max_length bytes of
+// data (the caller checks the length it got); false if the peripheral NACKs
+// its address (it's busy)
+static bool read_frame (const uint16_t max_length)
 {
-    uint16_t retries = 0;
-    
-retry:
-    if (retries > MAX_RESPONSE_RETRIES)
-    {
-        m_sd_error_code = ERROR_I2C_RESPONSE_TIMEOUT;
-        return false;
-    }
-    
     // wait at least one I2C clock cycle before starting
     for (uint16_t i = 0; i < (uint32_t)F_CPU / (uint32_t)400000; i++)
         nop();
@@ -165,19 +328,38 @@ retry:
     if (!twi_start (I2C_ADDR, READ))
     {
         twi_stop();
-        retries++;
-        m_wait (MS_BETWEEN_RESPONSE_RETRIES);
-        goto retry;
+        return false;
     }
     
     m_green (ON);
-    transmission.response.response_code = read_byte();
-    transmission.response.data_length = read_byte();
+    uint8_t *frame = response_frame();
+    for (uint8_t i = 0; i + 1 < header_length; i++)
+        frame[i] = read_byte();
     
-    uint8_t i;
-    for (i = 0; i < transmission.response.data_length - 1; i++)
-        transmission.response.data[i] = read_byte();
-    transmission.response.data[i] = read_final_byte();
+    // with no data wanted, the header's last byte is the last one read
+    if (max_length == 0)
+    {
+        frame[header_length - 1] = read_final_byte();
+        parse_response_header();
+    }
+    else
+    {
+        frame[header_length - 1] = read_byte();
+        parse_response_header();
+        
+        uint16_t length = transmission.response.data_length;
+        if (length > max_length)
+            length = max_length;
+        
+        uint16_t i;
+        for (i = 0; i + 1 < length; i++)
+            transmission.response.data[i] = read_byte();
+        
+        if (length > 0)
+            transmission.response.data[i] = read_final_byte();
+        else
+            read_final_byte();
+    }
     
     twi_stop();
     m_green (OFF);
@@ -198,11 +380,30 @@ extern CPAL_TransferTypeDef  mBusRx;
 #define I2C_ADDR_WRITE ((0x5D) << 1)
 #define I2C_ADDR_READ  (((0x5D) << 1) | 1)
 
-#define MAX_RESPONSE_RETRIES        1000
-#define MS_BETWEEN_RESPONSE_RETRIES 1
+#define POLL_MAX_US 1000
 
 #define nop()  __asm__ __volatile__("nop")
 
+// the peripheral's optional ready line (READY_LINE in peripheral/m_microsd.c),
+// on pin A0 unless M_SD_READY_GPIO and M_SD_READY_NUM are set in the makefile;
+// its GPIO port's clock has to be enabled
+#ifdef M_SD_READY_LINE
+#ifndef M_SD_READY_GPIO
+#define M_SD_READY_GPIO GPIOA
+#define M_SD_READY_NUM  0
+#endif
+
+static inline bool ready_line (void)
+{
+    return (M_SD_READY_GPIO->IDR & (1 << M_SD_READY_NUM)) != 0;
+}
+#endif
+
+static void wait_us (const uint16_t us)
+{
+    mWaitus (us);
+}
+
 #ifndef false
 #define false ((bool)0)
 #endif
@@ -268,7 +469,8 @@ static bool i2c_read (void)
     return true;
 }
 
-static bool send_order (void)
+// send the order in one frame; false if the peripheral NACKs it (it's busy)
+static bool send_frame (void)
 {
     if (mBusStruct.CPAL_State != CPAL_STATE_READY)
     {
@@ -279,8 +481,8 @@ static bool send_order (void)
     // send command type, data length, and data all in one go
     mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
     mBusStruct.pCPAL_TransferTx = &mBusTx; 
-    mBusStruct.pCPAL_TransferTx->wNumData = 2 + transmission.order.data_length;
-    mBusStruct.pCPAL_TransferTx->pbBuffer = (uint8_t*)&transmission.order;
+    mBusStruct.pCPAL_TransferTx->wNumData = header_length + transmission.order.data_length;
+    mBusStruct.pCPAL_TransferTx->pbBuffer = order_frame();
     mBusStruct.pCPAL_TransferTx->wAddr1   = (uint32_t)I2C_ADDR_WRITE;
     
     if (!i2c_write())
@@ -293,65 +495,393 @@ static bool send_order (void)
     return true;
 }
 
-static bool receive_response (void)
+// receive a response frame, which should have at most max_length bytes of
+// data (the caller checks the length it got); false if the peripheral NACKs
+// its address (it's busy), or the bus isn't ready
+static bool read_frame (const uint16_t max_length)
 {
-    uint16_t retries = 0;
-    
-retry:
-    if (retries > MAX_RESPONSE_RETRIES)
-    {
-        m_sd_error_code = ERROR_I2C_RESPONSE_TIMEOUT;
-        return false;
-    }
-    
     if (mBusStruct.CPAL_State != CPAL_STATE_READY ||
         mBusStruct.wCPAL_DevError != CPAL_I2C_ERR_NONE ||
         mBusGetLastError() != CPAL_I2C_ERR_NONE)
-    {
-        retries++;
-        mWaitms (MS_BETWEEN_RESPONSE_RETRIES);
-        goto retry;
-    }
+        return false;
     
-    // receive command code and data length
+    // receive the header and as much data as there can be in one read (the
+    // peripheral pads out a shorter response), rather than reading the
+    // header first and then reading it again with the data
     mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
     mBusStruct.pCPAL_TransferRx = &mBusRx; 
-    mBusStruct.pCPAL_TransferRx->wNumData = 2;
-    mBusStruct.pCPAL_TransferRx->pbBuffer = (uint8_t*)&transmission.response;
+    mBusStruct.pCPAL_TransferRx->wNumData = header_length + max_length;
+    mBusStruct.pCPAL_TransferRx->pbBuffer = response_frame();
     mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)I2C_ADDR_READ;
     
     if (!i2c_read())
+        return false;
+    
+    parse_response_header();
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+//!   END OF M4-SPECIFIC I2C CODE !=============================================
+
+#elif defined(HOST)
+
+//! START OF HOST SIMULATION I2C CODE !=========================================
+// the peripheral is peripheral/m_microsd.c, on the other end of mbus_sim.c's
+// simulated bus
+
+#define I2C_ADDR (0x5D)
+
+#define POLL_MAX_US 1000
+
+// the simulated bus can run at 100 kHz or 1 MHz too
+#undef BYTE_US
+#define BYTE_US mbus_sim_byte_us()
+
+#ifdef M_SD_READY_LINE
+static inline bool ready_line (void)
+{
+    return sim_ready_line();
+}
+#endif
+
+static void wait_us (const uint16_t us)
+{
+    sim_wait_us (us);
+}
+
+// send the order in one frame; false if the peripheral NACKs it (it's busy)
+static bool send_frame (void)
+{
+    if (!sim_i2c_start ((I2C_ADDR << 1) | I2C_WRITE))
     {
-        retries++;
-        mWaitms (MS_BETWEEN_RESPONSE_RETRIES);
-        goto retry;
+        sim_i2c_stop();
+        return false;
     }
     
-    // get data
-    if (transmission.response.data_length > 0)
+    const uint8_t *frame = order_frame();
+    const uint16_t frame_length = header_length + transmission.order.data_length;
+    
+    for (uint16_t i = 0; i < frame_length; i++)
     {
-        mBusStruct.wCPAL_Options = CPAL_OPT_NO_MEM_ADDR;
-        mBusStruct.pCPAL_TransferRx = &mBusRx; 
-        mBusStruct.pCPAL_TransferRx->wNumData = 2 + transmission.response.data_length;
-        mBusStruct.pCPAL_TransferRx->pbBuffer = (uint8_t*)&transmission.response;
-        mBusStruct.pCPAL_TransferRx->wAddr1   = (uint32_t)I2C_ADDR_READ;
-        
-        if (!i2c_read())
+        if (!sim_i2c_write (frame[i]))
         {
-            m_sd_error_code = ERROR_I2C_COMMAND;
+            sim_i2c_stop();
             return false;
         }
     }
     
+    sim_i2c_stop();
+    
     m_sd_error_code = ERROR_NONE;
     return true;
 }
-//!   END OF M4-SPECIFIC I2C CODE !=============================================
+
+// receive a response frame, which should have at most max_length bytes of
+// data (the caller checks the length it got); false if the peripheral NACKs
+// its address (it's busy)
+static bool read_frame (const uint16_t max_length)
+{
+    if (!sim_i2c_start ((I2C_ADDR << 1) | I2C_READ))
+    {
+        sim_i2c_stop();
+        return false;
+    }
+    
+    uint8_t *frame = response_frame();
+    for (uint8_t i = 0; i + 1 < header_length; i++)
+        frame[i] = sim_i2c_read (true);
+    
+    // with no data wanted, the header's last byte is the last one read
+    frame[header_length - 1] = sim_i2c_read (max_length > 0);
+    parse_response_header();
+    
+    if (max_length > 0)
+    {
+        uint16_t length = transmission.response.data_length;
+        if (length > max_length)
+            length = max_length;
+        
+        uint16_t i;
+        for (i = 0; i + 1 < length; i++)
+            transmission.response.data[i] = sim_i2c_read (true);
+        
+        if (length > 0)
+            transmission.response.data[i] = sim_i2c_read (false);
+        else
+            sim_i2c_read (false);
+    }
+    
+    sim_i2c_stop();
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+//!   END OF HOST SIMULATION I2C CODE !=========================================
 
 #else
  #error "Unknown device, you must define either M2 or M4 in the makefile"
 #endif
 
+// wait for up to us microseconds, or with a ready line, until the peripheral
+// raises it; returns how long it was
+static uint16_t poll_sleep (const uint16_t us)
+{
+    #ifdef M_SD_READY_LINE
+    uint16_t slept = 0;
+    
+    while (slept < us && !ready_line())
+    {
+        wait_us (READY_STEP_US);
+        slept += READY_STEP_US;
+    }
+    
+    return slept;
+    #else
+    wait_us (us);
+    return us;
+    #endif
+}
+
+// start timing the wait for the order just sent
+static void poll_start (const uint8_t command)
+{
+    poll_command = command;
+    waited_us = 0;
+    poll_budget_us = RESPONSE_TIMEOUT_US;
+    poll_interval_us = POLL_MIN_US;
+}
+
+// before looking for the order's response, wait for as long as that kind of
+// order is sure to take, or with a ready line, until it's raised
+static void poll_settle (void)
+{
+    if (waited_us > 0 || poll_command >= M_SD_NUM_COMMANDS)
+        return;
+    
+    #ifdef M_SD_READY_LINE
+    waited_us += poll_sleep (POLL_MAX_US);
+    #else
+    const uint16_t expected = expected_us[poll_command];
+    const uint32_t margin = 2 * (uint32_t)spread_us[poll_command] + expected / 8;
+    
+    if (expected > margin + POLL_MIN_US)
+        waited_us += poll_sleep (expected - margin);
+    #endif
+}
+
+// the peripheral was busy (it NACKed its address, after looking_bytes more
+// bytes of the frame): wait before trying again, or time out
+static bool poll_wait (const uint8_t looking_bytes)
+{
+    waited_us += (1 + looking_bytes) * BYTE_US;  // the look that found it busy
+    
+    if (poll_budget_us < poll_interval_us)
+    {
+        poll_command = M_SD_NONE;  // (not worth learning from)
+        m_sd_error_code = ERROR_I2C_RESPONSE_TIMEOUT;
+        return false;
+    }
+    
+    const uint16_t slept = poll_sleep (poll_interval_us);
+    waited_us += slept;
+    poll_budget_us -= slept;
+    
+    // keep the polls close together until the order is taking longer than
+    // it usually does
+    uint16_t longest = POLL_MAX_US;
+    
+    if (poll_command < M_SD_NUM_COMMANDS &&
+        waited_us < expected_us[poll_command] + 2 * (uint32_t)spread_us[poll_command])
+    {
+        longest = spread_us[poll_command] / 4;
+        if (longest < POLL_MIN_US)
+            longest = POLL_MIN_US;
+    }
+    
+    if (poll_interval_us < longest / 2)
+        poll_interval_us *= 2;
+    else
+        poll_interval_us = longest;
+    
+    return true;
+}
+
+// the peripheral has finished the order being waited on: fold the time it
+// took into the average and spread for that kind of order
+static void poll_done (void)
+{
+    if (poll_command < M_SD_NUM_COMMANDS)
+    {
+        const int32_t took = (waited_us > 0xffff) ? 0xffff : (int32_t)waited_us;
+        const int32_t expected = expected_us[poll_command];
+        const int32_t spread = spread_us[poll_command];
+        const int32_t deviation = (took > expected) ? took - expected : expected - took;
+        
+        expected_us[poll_command] = (uint16_t)(expected + (took - expected) / 4);
+        spread_us[poll_command] = (uint16_t)(spread + (deviation - spread) / 4);
+    }
+    
+    poll_command = M_SD_NONE;
+}
+
+// receive a response frame, trying again while the peripheral is busy
+static bool receive_frame (const uint16_t max_length)
+{
+    while (!read_frame (max_length))
+    {
+        if (!poll_wait (0))
+            return false;
+    }
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+// get the next response: in queued mode, the peripheral answers NO_COMPLETION
+// until it has finished another order
+static bool next_completion (const uint16_t max_length)
+{
+    for (;;)
+    {
+        if (!receive_frame (max_length))
+            return false;
+        
+        if (transmission.response.response_code != NO_COMPLETION)
+            return true;
+        
+        if (!poll_wait (header_length))
+            return false;
+    }
+}
+
+// a response to a posted order has come in, so the peripheral is getting on
+// with things: give the next one the whole timeout again
+static void posted_completion (void)
+{
+    if (posted > 0)
+        posted--;
+    
+    if (posted_error == ERROR_NONE)
+        posted_error = transmission.response.response_code;
+    
+    poll_budget_us = RESPONSE_TIMEOUT_US;
+    poll_interval_us = POLL_MIN_US;
+}
+
+// send an order; in queued mode it gets the next sequence number, and while
+// the peripheral has no room for it, responses to posted orders are collected
+// to make some
+static bool send_order (void)
+{
+    const uint8_t command = transmission.order.command;
+    
+    if (header_length != QUEUED_HEADER_LENGTH)
+    {
+        if (!send_frame())
+            return false;
+        
+        // the peripheral only takes an order once it's done with the last one
+        if (poll_command != M_SD_NONE)
+            poll_done();
+        
+        poll_start (command);
+        return true;
+    }
+    
+    // collecting a response overwrites the order's header fields
+    const uint16_t data_length = transmission.order.data_length;
+    
+    for (;;)
+    {
+        transmission.order.command = command;
+        transmission.order.seq = next_seq;
+        transmission.order.data_length = data_length;
+        
+        if (send_frame())
+            break;
+        
+        if (posted > 0)
+        {
+            if (!next_completion (0))
+                return false;
+            
+            posted_completion();
+        }
+        else if (!poll_wait (0))
+        {
+            return false;
+        }
+    }
+    
+    last_seq = next_seq++;
+    if (next_seq == 0)
+        next_seq = 1;
+    poll_start (command);
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+// in queued mode, wait for the response to the order with sequence number seq,
+// counting off the responses to posted orders that come before it
+static bool receive_completion (const uint8_t seq,
+                                const uint16_t max_length)
+{
+    for (;;)
+    {
+        if (!next_completion (max_length))
+            return false;
+        
+        if (transmission.response.seq == seq)
+            return true;
+        
+        posted_completion();
+    }
+}
+
+// receive the response to the order just sent, which should have at most
+// max_length bytes of data (the caller checks the length it got)
+static bool receive_response (const uint16_t max_length)
+{
+    // with posted orders ahead of this one, the wait is partly for them, so
+    // it's not a fair measure of this order
+    const bool alone = (posted == 0);
+    bool received;
+    
+    poll_settle();
+    
+    // (a peripheral left in queued mode by a master that's started again
+    // answers NO_COMPLETION until it gets to the M_SD_INIT)
+    if (header_length == QUEUED_HEADER_LENGTH)
+        received = receive_completion (last_seq, max_length);
+    else
+        received = next_completion (max_length);
+    
+    if (received && alone)
+        poll_done();
+    
+    return received;
+}
+
+// send an order without waiting for a response to the last one: the
+// peripheral NACKs its address until it's done with that, so keep trying
+static bool send_order_when_ready (void)
+{
+    if (header_length != QUEUED_HEADER_LENGTH)
+        poll_settle();
+    
+    while (!send_order())
+    {
+        if (!poll_wait (0))
+            return false;
+    }
+    
+    return true;
+}
+
+#ifndef HOST  // the PC tools have fat32_filenames.c
+
 // convert file names from their representation on disk
 // eg., "TEST    TXT" becomes "TEST.TXT"
 void filename_fs_to_8_3 (const char *input_name,
@@ -440,6 +970,7 @@ void filename_8_3_to_fs (const char *input_name,
         out_index++;
     }
 }
+#endif
 
 
 
@@ -458,6 +989,34 @@ void filename_8_3_to_fs (const char *input_name,
 //-----------------------------------------------
 // Startup and shutdown:
 
+// ask the peripheral for a frame format (with options, which are only sent
+// if there are any), and switch to it if it has it (a peripheral that doesn't
+// answers ERROR_I2C_COMMAND)
+static bool set_frame_mode (const m_microsd_frame_mode mode,
+                            const uint8_t new_header_length,
+                            const uint8_t options)
+{
+    transmission.order.command = M_SD_SET_MODE;
+    transmission.order.data_length = options ? 2 : 1;
+    transmission.order.data[0] = mode;
+    transmission.order.data[1] = options;
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response (3))
+        return false;
+    
+    if (transmission.response.response_code != ERROR_NONE ||
+        transmission.response.data_length < 2)
+        return false;
+    
+    header_length = new_header_length;
+    order_space = (uint16_t)transmission.response.data[0] |
+                  ((uint16_t)transmission.response.data[1] << 8);
+    return true;
+}
+
 // mount the microSD card's FAT32 filesystem
 bool m_sd_init (void)
 {
@@ -467,16 +1026,54 @@ bool m_sd_init (void)
     mBusInit();
     #endif
     
-    transmission.order.command = M_SD_INIT;
-    transmission.order.data_length = 0;
+    // the peripheral goes back to legacy frames on M_SD_INIT
+    header_length = LEGACY_HEADER_LENGTH;
+    order_space = TWI_BUFFER_LEN;
+    posted = 0;
+    posted_error = ERROR_NONE;
+    poll_command = M_SD_NONE;
     
-    if (!send_order())
-        return false;
+    // a peripheral still busy with the orders of a master that's started again
+    // only takes this once it's done, and one left in queued mode only once
+    // the responses the old master didn't collect have been read to free
+    // its slots
+    poll_start (M_SD_NONE);
     
-    if (!receive_response())
-        return false;
+    for (;;)
+    {
+        transmission.order.command = M_SD_INIT;
+        transmission.order.data_length = 0;
+        
+        if (send_order())
+            break;
+        
+        read_frame (0);
+        
+        if (!poll_wait (0))
+            return false;
+    }
+    
+    // such a peripheral also has the responses to the old master's last
+    // orders ahead of this one's; read as legacy frames, their sequence
+    // numbers look like lengths, where this order's (which had none) is 0
+    do
+    {
+        if (!receive_response (0))
+            return false;
+    } while (transmission.response.data_length != 0);
     
     m_sd_error_code = transmission.response.response_code;
+    if (m_sd_error_code != ERROR_NONE)
+        return false;
+    
+    // use queued frames if the peripheral has room for them, then bulk
+    // frames, and otherwise keep to legacy frames
+    if (!set_frame_mode (MBUS_QUEUED_FRAMES, QUEUED_HEADER_LENGTH, 0) &&
+        m_sd_error_code == ERROR_NONE)
+    {
+        set_frame_mode (MBUS_BULK_FRAMES, BULK_HEADER_LENGTH, 0);
+    }
+    
     return (m_sd_error_code == ERROR_NONE);
 }
 
@@ -489,7 +1086,7 @@ bool m_sd_shutdown (void)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -506,7 +1103,24 @@ bool m_sd_commit (void)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
+        return false;
+    
+    m_sd_error_code = transmission.response.response_code;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+// commit pending writes to one open file
+bool m_sd_sync_file (uint8_t file_id)
+{
+    transmission.order.command = M_SD_COMMIT;
+    transmission.order.data_length = 1;
+    transmission.order.data[0] = file_id;
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -541,7 +1155,7 @@ bool m_sd_get_size (const char *name,
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (4))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -586,7 +1200,7 @@ bool m_sd_object_exists (const char *name,
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (2))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -610,6 +1224,25 @@ bool m_sd_object_exists (const char *name,
 }
 
 
+// copy the name from a directory entry response (at most 12 characters of
+// it, which is all an 8.3 name needs)
+static void copy_listed_name (const bool found,
+                              char name[13])
+{
+    const uint16_t length = transmission.response.data_length;
+    uint8_t i = 0;
+    
+    while (found && i < 12 && 6 + i < length &&
+           transmission.response.data[6 + i] != '\0')
+    {
+        name[i] = (char)transmission.response.data[6 + i];
+        i++;
+    }
+    
+    name[i] = '\0';
+}
+
+
 // iterate through the current directory, reading the names of its objects
 // returns false when the end of the directory has been reached
 bool m_sd_get_dir_entry_first (char name[13], uint32_t *size, bool *is_directory)
@@ -620,7 +1253,7 @@ bool m_sd_get_dir_entry_first (char name[13], uint32_t *size, bool *is_directory
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (DIR_ENTRY_RESPONSE))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -649,14 +1282,7 @@ bool m_sd_get_dir_entry_first (char name[13], uint32_t *size, bool *is_directory
         *is_directory = (bool)transmission.response.data[5];
     
     if (name != NULL)
-    {
-        name[0] = '\0';
-        if (retval)
-        {
-            filename_fs_to_8_3 ((char*)&(transmission.response.data[6]),
-                                name);
-        }
-    }
+        copy_listed_name (retval, name);
     
     return retval;
 }
@@ -670,7 +1296,7 @@ bool m_sd_get_dir_entry_next (char name[13], uint32_t *size, bool *is_directory)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (DIR_ENTRY_RESPONSE))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -699,16 +1325,94 @@ bool m_sd_get_dir_entry_next (char name[13], uint32_t *size, bool *is_directory)
         *is_directory = (bool)transmission.response.data[5];
     
     if (name != NULL)
+        copy_listed_name (retval, name);
+    
+    return retval;
+}
+
+
+// list the current directory several entries to a frame, with the peripheral
+// leaving out the names that don't match pattern
+bool m_sd_list_dir (const char *pattern,
+                    m_sd_list_callback callback,
+                    void *context)
+{
+    const uint16_t pattern_length = (pattern != NULL) ? strlen (pattern) : 0;
+    
+    if (pattern_length > LISTED_NAME_MAX)
     {
-        name[0] = '\0';
-        if (retval)
+        m_sd_error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+    
+    m_sd_listed_object object;
+    bool first = true;
+    bool done = false;
+    
+    while (!done)
+    {  // each order carries on from where the last one left off
+        transmission.order.command = M_SD_LIST_DIR;
+        transmission.order.data_length = 1 + pattern_length;
+        transmission.order.data[0] = (uint8_t)first;
+        for (uint8_t i = 0; i < pattern_length; i++)
+            transmission.order.data[1 + i] = (uint8_t)pattern[i];
+        
+        if (!send_order())
+            return false;
+        
+        if (!receive_response ((order_space < MBUS_FRAME_LEN) ? order_space : MBUS_FRAME_LEN))
+            return false;
+        
+        m_sd_error_code = transmission.response.response_code;
+        if (m_sd_error_code != ERROR_NONE)
+            return false;
+        
+        const uint8_t *entry = transmission.response.data;
+        const uint8_t *end = entry + transmission.response.data_length;
+        
+        if (entry == end)
         {
-            filename_fs_to_8_3 ((char*)&(transmission.response.data[6]),
-                                name);
+            m_sd_error_code = ERROR_I2C_COMMAND;
+            return false;
+        }
+        
+        done = (*entry++ != 0);
+        first = false;
+        
+        while (entry < end)
+        {
+            if (end - entry < 10 || entry[9] > LISTED_NAME_MAX ||
+                end - entry < 10 + entry[9])
+            {
+                m_sd_error_code = ERROR_I2C_COMMAND;
+                return false;
+            }
+            
+            object.is_directory = (entry[0] & LISTED_DIRECTORY) != 0;
+            object.size = 0;
+            object.first_cluster = 0;
+            for (uint8_t i = 0; i < 4; i++)
+            {
+                object.size |= (uint32_t)entry[1 + i] << (8 * i);
+                object.first_cluster |= (uint32_t)entry[5 + i] << (8 * i);
+            }
+            
+            for (uint8_t i = 0; i < entry[9]; i++)
+                object.name[i] = (char)entry[10 + i];
+            object.name[entry[9]] = '\0';
+            
+            entry += 10 + entry[9];
+            
+            if (!callback (&object, context))
+            {  // the caller has seen enough
+                m_sd_error_code = ERROR_NONE;
+                return true;
+            }
         }
     }
     
-    return retval;
+    m_sd_error_code = ERROR_NONE;
+    return true;
 }
 
 
@@ -737,7 +1441,7 @@ bool m_sd_push (const char *name)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -753,7 +1457,7 @@ bool m_sd_pop (void)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -782,7 +1486,7 @@ bool m_sd_mkdir (const char *name)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -812,7 +1516,7 @@ bool m_sd_rmdir (const char *name)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -843,7 +1547,7 @@ bool m_sd_delete (const char *name)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -884,7 +1588,7 @@ bool m_sd_open_file (const char *name,
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (1))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -909,7 +1613,7 @@ bool m_sd_close_file (uint8_t file_id)
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -932,7 +1636,7 @@ bool m_sd_seek (uint8_t file_id,
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -950,7 +1654,7 @@ bool m_sd_get_seek_pos (uint8_t file_id,
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (4))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -979,10 +1683,60 @@ bool m_sd_read_file (uint8_t file_id,
                      uint32_t length,
                      uint8_t *buffer)
 {
+    if (header_length != LEGACY_HEADER_LENGTH)
+    {  // each order asks for all that's left, and gets back as much of it as
+       // the peripheral has in the sector at the seek position
+        if (length > 0xffff)
+        {
+            m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
+            return false;
+        }
+        
+        uint16_t done = 0;
+        
+        while (done < length)
+        {
+            const uint16_t remaining = (uint16_t)length - done;
+            
+            transmission.order.command = M_SD_READ_FILE;
+            transmission.order.data_length = 3;
+            transmission.order.data[0] = file_id;
+            transmission.order.data[1] = (uint8_t)remaining;
+            transmission.order.data[2] = (uint8_t)(remaining >> 8);
+            
+            if (!send_order())
+                return false;
+            
+            if (!receive_response ((remaining < MBUS_FRAME_LEN) ? remaining : MBUS_FRAME_LEN))
+                return false;
+            
+            m_sd_error_code = transmission.response.response_code;
+            
+            if (m_sd_error_code != ERROR_NONE)
+                return false;
+            
+            const uint16_t received = transmission.response.data_length;
+            
+            if (received == 0 || received > remaining || received > MBUS_FRAME_LEN)
+            {
+                m_sd_error_code = ERROR_I2C_COMMAND;
+                return false;
+            }
+            
+            for (uint16_t i = 0; i < received; i++)
+                buffer[done + i] = transmission.response.data[i];
+            
+            done += received;
+        }
+        
+        return true;
+    }
+    
     transmission.order.command = M_SD_READ_FILE;
     transmission.order.data_length = 2;
     
-    if (length > TWI_BUFFER_LEN - 1)
+    // the legacy length is a single byte
+    if (length > 0xff)
     {
         m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
         return false;
@@ -994,7 +1748,7 @@ bool m_sd_read_file (uint8_t file_id,
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (length))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -1015,15 +1769,122 @@ bool m_sd_read_file (uint8_t file_id,
 }
 
 
+// send a write in bulk or queued frames: the first frame has the length of
+// the whole write, and M_SD_WRITE_MORE frames carry on with the rest.  In
+// bulk mode they're sent straight after one another, and only the last one
+// has a response; in queued mode, each one is sent while the peripheral is
+// writing out the one before, and then that one's response is collected
+// (unless the write is being posted)
+static bool write_frames (uint8_t file_id,
+                          uint32_t length,
+                          const uint8_t *buffer,
+                          const bool post)
+{
+    if (length > 0xffff)
+    {
+        m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
+        return false;
+    }
+    
+    if (length == 0)
+        return true;
+    
+    const bool queued = (header_length == QUEUED_HEADER_LENGTH);
+    
+    uint16_t chunk = order_space - 3;
+    if (chunk > length)
+        chunk = (uint16_t)length;
+    
+    transmission.order.command = M_SD_WRITE_FILE;
+    transmission.order.data_length = 3 + chunk;
+    transmission.order.data[0] = file_id;
+    transmission.order.data[1] = (uint8_t)length;
+    transmission.order.data[2] = (uint8_t)(length >> 8);
+    
+    for (uint16_t i = 0; i < chunk; i++)
+        transmission.order.data[i + 3] = buffer[i];
+    
+    if (!send_order())
+        return false;
+    
+    uint16_t done = chunk;
+    uint8_t previous = last_seq;
+    m_sd_errors result = ERROR_NONE;
+    
+    while (done < length)
+    {
+        chunk = order_space;
+        if (chunk > length - done)
+            chunk = (uint16_t)length - done;
+        
+        transmission.order.command = M_SD_WRITE_MORE;
+        transmission.order.data_length = chunk;
+        
+        for (uint16_t i = 0; i < chunk; i++)
+            transmission.order.data[i] = buffer[done + i];
+        
+        if (!send_order_when_ready())
+            return false;
+        
+        done += chunk;
+        
+        if (post)
+        {
+            posted++;
+        }
+        else if (queued)
+        {
+            const uint8_t sent = last_seq;
+            
+            if (!receive_completion (previous, 0))
+                return false;
+            
+            previous = sent;
+            
+            // the peripheral drops the rest of a write after an error
+            result = transmission.response.response_code;
+            if (result != ERROR_NONE)
+                break;
+        }
+    }
+    
+    if (post)
+    {
+        posted++;
+        return true;
+    }
+    
+    if (queued)
+    {
+        if (!receive_completion (previous, 0))
+            return false;
+    }
+    else if (!receive_response (0))
+    {
+        return false;
+    }
+    
+    if (result == ERROR_NONE)
+        result = transmission.response.response_code;
+    
+    m_sd_error_code = result;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+
 // write to the current location in the file
 // updates the seek position
 bool m_sd_write_file (uint8_t file_id,
                       uint32_t length,
                       uint8_t *buffer)
 {
-    transmission.order.command = M_SD_WRITE_FILE;
+    if (header_length != LEGACY_HEADER_LENGTH)
+        return write_frames (file_id, length, buffer, false);
     
-    if (length > TWI_BUFFER_LEN - 1)
+    transmission.order.command = M_SD_WRITE_FILE;
+
+    // the legacy length is a single byte, and covers the file id too
+    if (length > 0xff - 1)
     {
         m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
         return false;
@@ -1035,13 +1896,472 @@ bool m_sd_write_file (uint8_t file_id,
     transmission.order.data_length = length + 1;
     transmission.order.data[0] = file_id;
     
+    for (uint16_t i = 0; i < length; i++)
+        transmission.order.data[i + 1] = (uint8_t)buffer[i];
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response (0))
+        return false;
+    
+    m_sd_error_code = transmission.response.response_code;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+
+// send a write and return without waiting for the peripheral to finish it
+// (a plain write unless queued frames are in use)
+bool m_sd_post_write_file (uint8_t file_id,
+                           uint32_t length,
+                           const uint8_t *buffer)
+{
+    if (header_length != QUEUED_HEADER_LENGTH)
+        return m_sd_write_file (file_id, length, (uint8_t*)buffer);
+    
+    return write_frames (file_id, length, buffer, true);
+}
+
+// collect the responses to posted writes that are finished, without waiting
+// for the rest
+bool m_sd_poll_posted (uint8_t *outstanding)
+{
+    while (posted > 0)
+    {
+        if (!receive_frame (0))
+            return false;
+        
+        if (transmission.response.response_code == NO_COMPLETION)
+            break;
+        
+        posted_completion();
+    }
+    
+    *outstanding = posted;
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+// wait for every posted write to finish, and report the first error any of
+// them had
+bool m_sd_wait_posted (void)
+{
+    while (posted > 0)
+    {
+        if (!next_completion (0))
+            return false;
+        
+        posted_completion();
+    }
+    
+    m_sd_error_code = posted_error;
+    posted_error = ERROR_NONE;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+// have the peripheral acknowledge writes before carrying them out, or stop
+bool m_sd_write_behind (bool enable)
+{
+    if (header_length != QUEUED_HEADER_LENGTH)
+    {
+        m_sd_error_code = ERROR_I2C_COMMAND;
+        return false;
+    }
+    
+    if (set_frame_mode (MBUS_QUEUED_FRAMES, QUEUED_HEADER_LENGTH,
+                        enable ? MBUS_WRITE_BEHIND : 0))
+    {
+        m_sd_error_code = ERROR_NONE;
+        return true;
+    }
+    
+    // refused, or refused with the error from a write that's just failed
+    if (m_sd_error_code == ERROR_NONE)
+    {
+        m_sd_error_code = transmission.response.response_code;
+        if (m_sd_error_code == ERROR_NONE)
+            m_sd_error_code = ERROR_I2C_COMMAND;
+    }
+    
+    return false;
+}
+
+
+// shrink the opened file to new_size bytes
+bool m_sd_truncate (uint8_t file_id,
+                    uint32_t new_size)
+{
+    transmission.order.command = M_SD_TRUNCATE;
+    transmission.order.data_length = 5;
+    
+    transmission.order.data[0] = file_id;
+    uint32_t *size_ptr = ((uint32_t*)&transmission.order.data[1]);
+    *size_ptr = new_size;
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response (0))
+        return false;
+    
+    m_sd_error_code = transmission.response.response_code;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+
+//-----------------------------------------------
+// Free space:
+
+// get the free space on the card, in kilobytes
+bool m_sd_free_space (uint32_t *free_kb)
+{
+    bool done = false;
+    
+    while (!done)
+    {  // the peripheral may need several orders to count the free clusters
+        transmission.order.command = M_SD_FREE_SPACE;
+        transmission.order.data_length = 0;
+        
+        if (!send_order())
+            return false;
+        
+        if (!receive_response (5))
+            return false;
+        
+        m_sd_error_code = transmission.response.response_code;
+        
+        if (m_sd_error_code != ERROR_NONE)
+            return false;
+        
+        if (transmission.response.data_length != 5)
+        {
+            m_sd_error_code = ERROR_I2C_COMMAND;
+            return false;
+        }
+        
+        done = (transmission.response.data[0] != 0);
+    }
+    
+    const uint32_t *free_ptr = ((uint32_t*)&transmission.response.data[1]);
+    *free_kb = *free_ptr;
+    
+    return true;
+}
+
+
+//-----------------------------------------------
+// Batches:
+
+#define MAX_BATCH_STEPS 8
+
+// the batch being built in transmission.order.data, and where each step's
+// response data goes
+static uint8_t  batch_steps = 0;
+static uint16_t batch_length = 0;
+static uint8_t *batch_outputs[MAX_BATCH_STEPS];
+static uint8_t  batch_output_lengths[MAX_BATCH_STEPS];
+
+// add a step with length bytes of data to the batch, with its response data
+// to go to output; returns where the caller puts the step's data, or 0 if
+// there's no room for it (or for its response, in the peripheral's buffer)
+static uint8_t *batch_step (const uint8_t command,
+                            const uint8_t length,
+                            uint8_t *output,
+                            const uint8_t output_length)
+{
+    if (batch_steps >= MAX_BATCH_STEPS ||
+        batch_length + 2 + length > order_space ||
+        2 + output_length > order_space)
+    {
+        m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
+        return 0;
+    }
+    
+    uint8_t *step = &transmission.order.data[batch_length];
+    step[0] = command;
+    step[1] = length;
+    
+    batch_outputs[batch_steps] = output;
+    batch_output_lengths[batch_steps] = output_length;
+    batch_steps++;
+    batch_length += 2 + length;
+    
+    m_sd_error_code = ERROR_NONE;
+    return &step[2];
+}
+
+// start a new batch
+bool m_sd_batch_begin (void)
+{
+    batch_steps = 0;
+    batch_length = 0;
+    
+    // a peripheral without bulk frames doesn't have batches either
+    if (header_length == LEGACY_HEADER_LENGTH)
+    {
+        m_sd_error_code = ERROR_I2C_COMMAND;
+        return false;
+    }
+    
+    m_sd_error_code = ERROR_NONE;
+    return true;
+}
+
+bool m_sd_batch_push (const char *name)
+{
+    const uint16_t len = strlen (name);
+    
+    if (len > 8)
+    {
+        m_sd_error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+    
+    uint8_t *data = batch_step (M_SD_PUSH, (uint8_t)len + 1, 0, 0);
+    if (!data)
+        return false;
+    
+    for (uint8_t i = 0; i < len; i++)
+        data[i] = (uint8_t)name[i];
+    data[len] = 0;
+    
+    return true;
+}
+
+bool m_sd_batch_pop (void)
+{
+    return (batch_step (M_SD_POP, 0, 0, 0) != 0);
+}
+
+bool m_sd_batch_open_file (const char *name,
+                           const open_option action,
+                           uint8_t *file_id)
+{
+    const uint16_t len = strlen (name);
+    
+    if (len > 12)
+    {
+        m_sd_error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+    
+    uint8_t *data = batch_step (M_SD_OPEN_FILE, 1 + (uint8_t)len + 1, file_id, 1);
+    if (!data)
+        return false;
+    
+    data[0] = (uint8_t)action;
+    
+    for (uint8_t i = 0; i < len; i++)
+        data[i + 1] = (uint8_t)name[i];
+    data[len + 1] = 0;
+    
+    return true;
+}
+
+bool m_sd_batch_close_file (uint8_t file_id)
+{
+    uint8_t *data = batch_step (M_SD_CLOSE_FILE, 1, 0, 0);
+    if (!data)
+        return false;
+    
+    data[0] = file_id;
+    return true;
+}
+
+bool m_sd_batch_seek (uint8_t file_id,
+                      uint32_t offset)
+{
+    uint8_t *data = batch_step (M_SD_SEEK, 5, 0, 0);
+    if (!data)
+        return false;
+    
+    data[0] = file_id;
+    for (uint8_t i = 0; i < 4; i++)
+        data[i + 1] = (uint8_t)(offset >> (8 * i));
+    
+    return true;
+}
+
+bool m_sd_batch_read_file (uint8_t file_id,
+                           uint8_t length,
+                           uint8_t *buffer)
+{
+    uint8_t *data = batch_step (M_SD_READ_FILE, 2, buffer, length);
+    if (!data)
+        return false;
+    
+    data[0] = file_id;
+    data[1] = length;
+    return true;
+}
+
+bool m_sd_batch_write_file (uint8_t file_id,
+                            uint8_t length,
+                            const uint8_t *buffer)
+{
+    // the step's length covers the file id too
+    if (length > 0xff - 1)
+    {
+        m_sd_error_code = ERROR_I2C_MESSAGE_TOO_LONG;
+        return false;
+    }
+    
+    uint8_t *data = batch_step (M_SD_WRITE_FILE, length + 1, 0, 0);
+    if (!data)
+        return false;
+    
+    data[0] = file_id;
     for (uint8_t i = 0; i < length; i++)
-        transmission.response.data[i + 1] = (uint8_t)buffer[i];
+        data[i + 1] = buffer[i];
+    
+    return true;
+}
+
+bool m_sd_batch_sync_file (uint8_t file_id)
+{
+    uint8_t *data = batch_step (M_SD_COMMIT, 1, 0, 0);
+    if (!data)
+        return false;
+    
+    data[0] = file_id;
+    return true;
+}
+
+// send the batch, and hand out the responses of the steps that were run
+bool m_sd_batch_run (uint8_t *steps_run)
+{
+    *steps_run = 0;
+    
+    if (batch_steps == 0)
+    {
+        m_sd_error_code = ERROR_NONE;
+        return true;
+    }
+    
+    transmission.order.command = M_SD_BATCH;
+    transmission.order.data_length = batch_length;
+    batch_steps = 0;
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response ((order_space < MBUS_FRAME_LEN) ? order_space : MBUS_FRAME_LEN))
+        return false;
     
+    const uint8_t *result = transmission.response.data;
+    const uint8_t *end = result + transmission.response.data_length;
+    
+    while (result + 2 <= end && result + 2 + result[1] <= end)
+    {
+        const uint8_t step = *steps_run;
+        
+        if (result[0] == ERROR_NONE && batch_outputs[step])
+        {
+            if (result[1] != batch_output_lengths[step])
+            {
+                m_sd_error_code = ERROR_I2C_COMMAND;
+                return false;
+            }
+            
+            for (uint8_t i = 0; i < result[1]; i++)
+                batch_outputs[step][i] = result[2 + i];
+        }
+        
+        (*steps_run)++;
+        result += 2 + result[1];
+    }
+    
+    m_sd_error_code = transmission.response.response_code;
+    return (m_sd_error_code == ERROR_NONE);
+}
+
+// open a file and seek in it with one order
+bool m_sd_open_file_at (const char *name,
+                        open_option action,
+                        uint32_t offset,
+                        uint8_t *file_id)
+{
+    if (header_length == LEGACY_HEADER_LENGTH)
+        return m_sd_open_file (name, action, file_id) &&
+               m_sd_seek (*file_id, offset);
+    
+    uint8_t steps_run;
+    
+    return m_sd_batch_begin() &&
+           m_sd_batch_open_file (name, action, file_id) &&
+           m_sd_batch_seek (M_SD_BATCH_FILE, offset) &&
+           m_sd_batch_run (&steps_run);
+}
+
+// seek and read with one order, or as much of the read as fits in its
+// response, and the rest as usual
+bool m_sd_read_file_at (uint8_t file_id,
+                        uint32_t offset,
+                        uint32_t length,
+                        uint8_t *buffer)
+{
+    if (header_length == LEGACY_HEADER_LENGTH)
+        return m_sd_seek (file_id, offset) &&
+               m_sd_read_file (file_id, length, buffer);
+    
+    // the response also has the seek's and the read's headers
+    uint16_t first = order_space - 4;
+    if (first > 0xff)
+        first = 0xff;
+    if (first > length)
+        first = (uint16_t)length;
+    
+    uint8_t steps_run;
+    
+    if (!m_sd_batch_begin() ||
+        !m_sd_batch_seek (file_id, offset) ||
+        !m_sd_batch_read_file (file_id, (uint8_t)first, buffer) ||
+        !m_sd_batch_run (&steps_run))
+        return false;
+    
+    return m_sd_read_file (file_id, length - first, buffer + first);
+}
+
+// write, and commit the file, with the last part of the write and the commit
+// in one order
+bool m_sd_write_file_sync (uint8_t file_id,
+                           uint32_t length,
+                           uint8_t *buffer)
+{
+    if (header_length == LEGACY_HEADER_LENGTH)
+        return m_sd_write_file (file_id, length, buffer) &&
+               m_sd_sync_file (file_id);
+    
+    // the order also has the steps' headers, and the file id twice
+    uint16_t last = order_space - 6;
+    if (last > 0xff - 1)
+        last = 0xff - 1;
+    if (last > length)
+        last = (uint16_t)length;
+    
+    if (!m_sd_write_file (file_id, length - last, buffer))
+        return false;
+    
+    uint8_t steps_run;
+    
+    return m_sd_batch_begin() &&
+           m_sd_batch_write_file (file_id, (uint8_t)last, buffer + length - last) &&
+           m_sd_batch_sync_file (file_id) &&
+           m_sd_batch_run (&steps_run);
+}
+
+
+//-----------------------------------------------
+// Ring-buffer logs:
+
+// send an order with no data back, and check its response code
+static bool simple_order (void)
+{
     if (!send_order())
         return false;
     
-    if (!receive_response())
+    if (!receive_response (0))
         return false;
     
     m_sd_error_code = transmission.response.response_code;
@@ -1049,3 +2369,123 @@ bool m_sd_write_file (uint8_t file_id,
 }
 
 
+// create a ring log of the given number of 512-byte blocks in the current
+// directory, replacing any file with the same name
+bool m_sd_ringlog_create (const char *name,
+                          uint32_t blocks)
+{
+    uint16_t len = strlen (name);
+    
+    if (len == 0 || len > 12)
+    {
+        m_sd_error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+    
+    transmission.order.command = M_SD_RINGLOG_CREATE;
+    transmission.order.data_length = 4 + (uint8_t)len + 1;
+    
+    uint32_t *blocks_ptr = ((uint32_t*)&transmission.order.data[0]);
+    *blocks_ptr = blocks;
+    
+    uint8_t i = 0;
+    for (i = 0; i < len; i++)
+        transmission.order.data[i + 4] = (uint8_t)name[i];
+    transmission.order.data[i + 4] = 0;
+    
+    return simple_order();
+}
+
+
+// open a ring log in the current directory (only one can be open at a time)
+bool m_sd_ringlog_open (const char *name)
+{
+    uint16_t len = strlen (name);
+    
+    if (len == 0 || len > 12)
+    {
+        m_sd_error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+    
+    transmission.order.command = M_SD_RINGLOG_OPEN;
+    transmission.order.data_length = (uint8_t)len + 1;
+    
+    uint8_t i = 0;
+    for (i = 0; i < len; i++)
+        transmission.order.data[i] = (uint8_t)name[i];
+    transmission.order.data[i] = 0;
+    
+    return simple_order();
+}
+
+
+// write out the ring log's records and close it
+bool m_sd_ringlog_close (void)
+{
+    transmission.order.command = M_SD_RINGLOG_CLOSE;
+    transmission.order.data_length = 0;
+    
+    return simple_order();
+}
+
+
+// add a record to the ring log
+bool m_sd_ringlog_append (const uint8_t *record,
+                          uint8_t length)
+{
+    if (length == 0)
+        return true;
+    
+    transmission.order.command = M_SD_RINGLOG_APPEND;
+    transmission.order.data_length = length;
+    
+    for (uint8_t i = 0; i < length; i++)
+        transmission.order.data[i] = record[i];
+    
+    return simple_order();
+}
+
+
+// go back to the oldest record in the ring log
+bool m_sd_ringlog_rewind (void)
+{
+    transmission.order.command = M_SD_RINGLOG_REWIND;
+    transmission.order.data_length = 0;
+    
+    return simple_order();
+}
+
+
+// read the next record from the ring log
+bool m_sd_ringlog_read (uint8_t *buffer,
+                        uint8_t max_length,
+                        uint8_t *length)
+{
+    transmission.order.command = M_SD_RINGLOG_READ;
+    transmission.order.data_length = 1;
+    transmission.order.data[0] = max_length;
+    
+    if (!send_order())
+        return false;
+    
+    if (!receive_response (max_length))
+        return false;
+    
+    m_sd_error_code = transmission.response.response_code;
+    if (m_sd_error_code != ERROR_NONE)
+        return false;
+    
+    if (transmission.response.data_length > max_length)
+    {
+        m_sd_error_code = ERROR_I2C_COMMAND;
+        return false;
+    }
+    
+    *length = transmission.response.data_length;
+    
+    for (uint8_t i = 0; i < *length; i++)
+        buffer[i] = transmission.response.data[i];
+    
+    return true;
+}
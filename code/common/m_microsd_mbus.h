@@ -18,6 +18,10 @@
  #include "mGeneral.h"
  #include "mBus.h"
  #include "mUSB.h"
+#elif defined (HOST)
+ #include <stddef.h>
+ #include <string.h>
+ #include "mbus_sim.h"
 #else
  #error "Unknown device, you must define either M2 or M4 in the makefile"
 #endif
@@ -92,7 +96,9 @@ extern m_sd_errors m_sd_error_code;
 //-----------------------------------------------
 // Startup and shutdown:
 
-// mount the microSD card's FAT32 filesystem
+// mount the microSD card's FAT32 filesystem, and switch to queued or bulk
+// frames (16-bit lengths, and reads of up to a sector at a time) if the
+// peripheral has them
 bool m_sd_init (void);
 
 // flush any pending writes and unmount the filesystem
@@ -102,6 +108,11 @@ bool m_sd_shutdown (void);
 // useful if you don't know when the system might be powered off
 bool m_sd_commit (void);
 
+// commit pending writes to one open file (and any pending directory and
+// FAT changes), leaving other files' data cached
+// cheaper than m_sd_commit for frequent checkpoints of a single log file
+bool m_sd_sync_file (uint8_t file_id);
+
 //-----------------------------------------------
 // File and directory information:
 
@@ -120,6 +131,34 @@ bool m_sd_object_exists (const char *name,
 bool m_sd_get_dir_entry_first (char name[13], uint32_t *size, bool *is_directory);
 bool m_sd_get_dir_entry_next  (char name[13], uint32_t *size, bool *is_directory);
 
+// an object in a listing from m_sd_list_dir
+typedef struct m_sd_listed_object
+{
+    char     name[16];        // 8.3 (exFAT names can be up to 15 characters)
+    uint32_t size;
+    uint32_t first_cluster;
+    bool     is_directory;
+} m_sd_listed_object;
+
+// called by m_sd_list_dir with each object, which is only valid for the
+// duration of the call; return false to stop listing early.  The callback
+// can't use the mMicroSD itself (the rest of the listing is in the same
+// buffer as the orders and responses)
+typedef bool (*m_sd_list_callback) (const m_sd_listed_object *object,
+                                    void *context);
+
+// list the objects in the current directory whose names match pattern, in
+// which '*' stands for any run of characters and '?' for any one character,
+// without regard to case (eg. "LOG*.TXT"; NULL or "" for everything), with
+// their sizes and first clusters.  The peripheral does the matching, and
+// sends as many objects as fit in a frame at a time, so this is much quicker
+// than m_sd_get_dir_entry_first/next on a big directory.  It shares the
+// peripheral's listing position with them.  context is passed through to
+// callback unchanged
+bool m_sd_list_dir (const char *pattern,
+                    m_sd_list_callback callback,
+                    void *context);
+
 
 //-----------------------------------------------
 // Directory traversal and modification:
@@ -174,6 +213,10 @@ bool m_sd_get_seek_pos (uint8_t file_id,
 //
 // if the length of the read would go beyond the end of the file, an
 // error is returned and nothing is read
+//
+// reads and writes can be up to 65535 bytes long with a peripheral that has
+// bulk frames (which m_sd_init sets up), or 255 bytes (reads) and 254 bytes
+// (writes) otherwise
 bool m_sd_read_file (uint8_t file_id,
                      uint32_t length,
                      uint8_t *buffer);
@@ -184,5 +227,150 @@ bool m_sd_write_file (uint8_t file_id,
                       uint32_t length,
                       uint8_t *buffer);
 
+// post a write: it's sent to the peripheral, which writes it out while the
+// master gets on with something else.  Its result comes back through
+// m_sd_poll_posted or m_sd_wait_posted; other calls wait for their own
+// results as usual.  The buffer can be reused as soon as this returns.
+// Writes are only posted with queued frames (with a peripheral that has room
+// for more than one order); otherwise, this is the same as m_sd_write_file
+bool m_sd_post_write_file (uint8_t file_id,
+                           uint32_t length,
+                           const uint8_t *buffer);
+
+// collect the results of posted writes that are finished, and set
+// *outstanding to the number of orders still in progress (a long write is
+// posted as several)
+bool m_sd_poll_posted (uint8_t *outstanding);
+
+// wait for every posted write to finish; returns false with the first error
+// any of them had
+bool m_sd_wait_posted (void);
+
+// turn write-behind on or off (it's off after m_sd_init).  With it on, the
+// peripheral acknowledges each write as soon as it takes it up and writes it
+// out afterwards, so m_sd_write_file only waits for the bus, and the card's
+// slow moments are taken up by the peripheral.  A write that fails there is
+// reported by the next call instead, which isn't carried out (unless it's
+// another write, which is); m_sd_commit or m_sd_sync_file after the last
+// write checks that everything got written.  Needs queued frames (a
+// peripheral with room for more than one order)
+bool m_sd_write_behind (bool enable);
+
+// shrink the opened file to new_size bytes
+// the seek position is moved back to the new end if it was past it
+bool m_sd_truncate (uint8_t file_id,
+                    uint32_t new_size);
+
+
+//-----------------------------------------------
+// Free space:
+
+// get the free space on the card, in kilobytes
+// the first call can take a while if the card's filesystem doesn't keep a
+// free cluster count (the peripheral has to count them)
+bool m_sd_free_space (uint32_t *free_kb);
+
+
+//-----------------------------------------------
+// Batches (with a peripheral that has bulk or queued frames):
+//
+// a batch is a list of steps sent to the peripheral as one order, which runs
+// them one after another and stops at the first one that fails, so a sequence
+// like push, open, seek, read, close, pop costs one round trip over the bus.
+// Start one with m_sd_batch_begin, add the steps in the order they're to run,
+// and send it with m_sd_batch_run; no other m_sd_ function can be called in
+// between.  Adding a step returns false if the batch has no room for it (up
+// to 8 steps, and about 250 bytes of names and data).  Reads and writes in a
+// batch are up to 254 bytes, and the steps' responses (a read's data, and 2
+// bytes for each step) have to fit in about 250 bytes as well.
+
+// as a step's file id: the file opened by an earlier step of the same batch
+#define M_SD_BATCH_FILE 0xfe
+
+bool m_sd_batch_begin (void);
+
+bool m_sd_batch_push (const char *name);
+bool m_sd_batch_pop (void);
+
+// *file_id is set when the batch is run
+bool m_sd_batch_open_file (const char *name,
+                           const open_option action,
+                           uint8_t *file_id);
+
+bool m_sd_batch_close_file (uint8_t file_id);
+
+bool m_sd_batch_seek (uint8_t file_id,
+                      uint32_t offset);
+
+// the buffer is filled in when the batch is run
+bool m_sd_batch_read_file (uint8_t file_id,
+                           uint8_t length,
+                           uint8_t *buffer);
+
+// the data is copied into the batch straight away
+bool m_sd_batch_write_file (uint8_t file_id,
+                            uint8_t length,
+                            const uint8_t *buffer);
+
+bool m_sd_batch_sync_file (uint8_t file_id);
+
+// run the batch: *steps_run is set to the number of steps that were run,
+// including one that failed, whose error is returned
+bool m_sd_batch_run (uint8_t *steps_run);
+
+// common pairs of orders, sent as batches (or as two orders to a peripheral
+// without them):
+
+// open a file and seek to offset in it (if the seek fails, the file is left
+// open, and *file_id is set)
+bool m_sd_open_file_at (const char *name,
+                        open_option action,
+                        uint32_t offset,
+                        uint8_t *file_id);
+
+// seek to offset in the file and read from there
+bool m_sd_read_file_at (uint8_t file_id,
+                        uint32_t offset,
+                        uint32_t length,
+                        uint8_t *buffer);
+
+// write to the file and commit it, as m_sd_sync_file does
+bool m_sd_write_file_sync (uint8_t file_id,
+                           uint32_t length,
+                           uint8_t *buffer);
+
+
+//-----------------------------------------------
+// Ring-buffer logs (if the peripheral is built with FAT32_RINGLOG):
+//
+// a ring log is a file with a fixed number of 512-byte blocks, allocated when
+// it's created; records are appended until it's full, then the oldest block
+// of records is overwritten for each new one.  Appending never changes the
+// FAT or the directory.  Records are 1 to 255 bytes long over the mBus.
+
+// create a ring log in the current directory, replacing any existing file
+bool m_sd_ringlog_create (const char *name,
+                          uint32_t blocks);
+
+// open a ring log in the current directory, ready to append to and read from
+// the oldest record; only one ring log can be open at a time
+bool m_sd_ringlog_open (const char *name);
+
+// write out the ring log's records and close it
+// (m_sd_commit also writes out the records, leaving the log open)
+bool m_sd_ringlog_close (void);
+
+bool m_sd_ringlog_append (const uint8_t *record,
+                          uint8_t length);
+
+// read the ring log's records, oldest first: *length is set to 0 once every
+// record has been read (more can be read after more are appended), and
+// m_sd_ringlog_rewind starts again from the oldest record
+bool m_sd_ringlog_read (uint8_t *buffer,
+                        uint8_t max_length,
+                        uint8_t *length);
+
+bool m_sd_ringlog_rewind (void);
+
 #endif
 
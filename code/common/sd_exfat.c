@@ -0,0 +1,2326 @@
+/*******************************************************************************
+* sd_exfat.c
+* version: 1.0
+* description: exFAT filesystem code for SDXC cards.  Free space is tracked by
+*              the allocation bitmap rather than the FAT, and files are created
+*              contiguous (NoFatChain): a contiguous file's clusters are found
+*              by arithmetic, so reading, writing and seeking never touch the
+*              FAT.  A file is only given a FAT chain if something else has
+*              taken the cluster it needs to grow into.
+*
+*              Compiled in only if EXFAT is defined.
+*******************************************************************************/
+
+#include "sd_exfat.h"
+#include "debug.h"
+
+#ifdef EXFAT
+
+// every timestamp is set to the date this code was written (April 16, 2013)
+#define EXFAT_TIMESTAMP ((uint32_t)0x42900000)
+
+bool exfat_initialized = false;
+
+uint32_t exfat_volume_start;     // first sector of the volume (its boot sector)
+uint32_t exfat_fat_start;        // first sector of the FAT
+uint32_t exfat_heap_start;       // first sector of cluster 2
+uint32_t exfat_cluster_count;
+uint8_t  exfat_sector_shift;     // log2 (sectors per cluster)
+uint8_t  exfat_cluster_shift;    // log2 (bytes per cluster)
+uint32_t exfat_bitmap_start;     // first sector of the (contiguous) allocation bitmap
+uint32_t exfat_next_free;        // where to start looking for a free cluster
+uint32_t exfat_free_clusters;     // 0xffffffff until sd_exfat_free_space counts them
+
+// the current path: [0] is the root, [exfat_depth] is the current directory
+exfat_dir exfat_dirs[EXFAT_MAX_DEPTH + 1];
+uint8_t   exfat_depth;
+
+exfat_dir_pos exfat_listing_pos;  // used by sd_exfat_get_dir_entry_first/next
+
+exfat_file exfat_files[MAX_FILES];
+
+
+static inline uint32_t cluster_to_sector (const uint32_t cluster)
+{
+    return exfat_heap_start + ((cluster - 2) << exfat_sector_shift);
+}
+
+static inline bool valid_cluster (const uint32_t cluster)
+{
+    return cluster >= 2 && cluster - 2 < exfat_cluster_count;
+}
+
+static inline uint32_t clusters_for_bytes (const uint32_t bytes)
+{
+    return (uint32_t)(((uint64_t)bytes + ((uint32_t)1 << exfat_cluster_shift) - 1) >> exfat_cluster_shift);
+}
+
+// the checksum used for entry sets and names (16 bits) and for the boot
+// region and up-case table (32 bits)
+static inline uint16_t checksum16 (uint16_t sum, const uint8_t byte)
+{
+    return (uint16_t)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + byte);
+}
+
+static inline uint32_t checksum32 (uint32_t sum, const uint8_t byte)
+{
+    return ((sum & 1) ? (uint32_t)0x80000000 : 0) + (sum >> 1) + byte;
+}
+
+// names are ASCII, and the up-case table has been checked to map them the
+// usual way (see check_upcase_table)
+static inline char upcase (const char c)
+{
+    return (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : c;
+}
+
+
+//------------------------------------------------------------------------------
+// FAT and allocation bitmap
+
+// get the next cluster in a FAT chain
+static bool fat_lookup (const uint32_t from_cluster,
+                        uint32_t *to_cluster)
+{
+    if (!read_partial_block (exfat_fat_start + (from_cluster >> 7),
+                             (uint16_t)((from_cluster & 127) * 4),
+                             (uint8_t*)to_cluster,
+                             4))
+    {
+        return false;
+    }
+
+    if (*to_cluster != EXFAT_END_OF_CHAIN && !valid_cluster (*to_cluster))
+    {
+        #ifdef FAT32_DEBUG
+        debug ("Bad exFAT entry for cluster ");
+        debugulong (from_cluster);
+        debug (": ");
+        debugulong (*to_cluster);
+        debug ("\n");
+        #endif
+
+        error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+        return false;
+    }
+
+    return true;
+}
+
+static bool fat_set (const uint32_t from_cluster,
+                     const uint32_t to_cluster)
+{
+    return write_partial_block (exfat_fat_start + (from_cluster >> 7),
+                                (uint16_t)((from_cluster & 127) * 4),
+                                (const uint8_t*)&to_cluster,
+                                4);
+}
+
+// mark a run of clusters as used or free, a whole byte at a time where possible
+static bool bitmap_set_range (uint32_t cluster,
+                              uint32_t count,
+                              const bool used)
+{
+    uint32_t index = cluster - 2;
+
+    if (exfat_free_clusters != (uint32_t)0xffffffff)
+    {  // (the clusters always change state, they're never set twice)
+        if (used)
+            exfat_free_clusters -= count;
+        else
+            exfat_free_clusters += count;
+    }
+
+    while (count > 0)
+    {
+        cached_sector *sector = load_block (exfat_bitmap_start + (index >> 12));
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        // everything up to the end of this sector
+        do
+        {
+            uint8_t *bits = &sector->data[(index >> 3) & 511];
+
+            if ((index & 7) == 0 && count >= 8)
+            {
+                *bits = used ? 0xff : 0x00;
+                index += 8;
+                count -= 8;
+            }
+            else
+            {
+                if (used)
+                    *bits |= (uint8_t)(1 << (index & 7));
+                else
+                    *bits &= (uint8_t)~(1 << (index & 7));
+                index++;
+                count--;
+            }
+        } while (count > 0 && (index & 4095) != 0);
+
+        sector->modified = true;
+    }
+
+    return true;
+}
+
+static bool bitmap_is_free (const uint32_t cluster,
+                            bool *is_free)
+{
+    const uint32_t index = cluster - 2;
+    uint8_t bits;
+
+    if (!read_partial_block (exfat_bitmap_start + (index >> 12),
+                             (uint16_t)((index >> 3) & 511),
+                             &bits,
+                             1))
+    {
+        return false;
+    }
+
+    *is_free = !(bits & (1 << (index & 7)));
+    return true;
+}
+
+// find the first free cluster at or after from, wrapping around to the start
+// of the bitmap if necessary
+static bool bitmap_find_free (const uint32_t from,
+                              uint32_t *found)
+{
+    uint32_t index = valid_cluster (from) ? from - 2 : 0;
+    uint32_t loaded_sector = INVALID_SECTOR;
+    cached_sector *sector = END_OF_CHAIN;
+
+    for (uint32_t checked = 0; checked < exfat_cluster_count; )
+    {
+        if (index >= exfat_cluster_count)
+            index = 0;
+
+        if (exfat_bitmap_start + (index >> 12) != loaded_sector)
+        {
+            loaded_sector = exfat_bitmap_start + (index >> 12);
+            sector = load_block (loaded_sector);
+            if (sector == END_OF_CHAIN)
+                return false;
+        }
+
+        const uint8_t bits = sector->data[(index >> 3) & 511];
+
+        if ((index & 7) == 0 && bits == 0xff)
+        {  // skip full bytes in one go
+            index += 8;
+            checked += 8;
+            continue;
+        }
+
+        if (!(bits & (1 << (index & 7))))
+        {
+            *found = index + 2;
+            return true;
+        }
+
+        index++;
+        checked++;
+    }
+
+    error_code = ERROR_FAT32_FULL;
+    return false;
+}
+
+
+//------------------------------------------------------------------------------
+// Cluster allocations (files and directories)
+
+// find the last cluster of an allocation, if it isn't known yet
+static bool find_last_cluster (exfat_alloc *alloc)
+{
+    if (alloc->last_cluster != 0 || alloc->clusters == 0)
+        return true;
+
+    if (alloc->flags & EXFAT_FLAG_NO_FAT_CHAIN)
+    {
+        alloc->last_cluster = alloc->first_cluster + alloc->clusters - 1;
+        return true;
+    }
+
+    uint32_t cluster = alloc->first_cluster;
+    for (uint32_t i = 1; i < alloc->clusters; i++)
+    {
+        if (!fat_lookup (cluster, &cluster))
+            return false;
+
+        if (cluster == EXFAT_END_OF_CHAIN)
+        {  // the chain is shorter than the entry's length says
+            error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+            return false;
+        }
+    }
+
+    alloc->last_cluster = cluster;
+    return true;
+}
+
+// add a cluster to the end of an allocation
+// the cluster right after the current last one is used if it's free, so that
+// a contiguous allocation stays contiguous; if it isn't, the allocation is
+// given a FAT chain covering the clusters it already has
+static bool append_cluster (exfat_alloc *alloc,
+                            uint32_t *added)
+{
+    uint32_t cluster;
+
+    if (!find_last_cluster (alloc))
+        return false;
+
+    if (alloc->clusters == 0)
+    {
+        if (!bitmap_find_free (exfat_next_free, &cluster))
+            return false;
+    }
+    else
+    {
+        bool is_free = false;
+        cluster = alloc->last_cluster + 1;
+
+        if (valid_cluster (cluster) && !bitmap_is_free (cluster, &is_free))
+            return false;
+
+        if (!is_free && !bitmap_find_free (cluster, &cluster))
+            return false;
+    }
+
+    if (!bitmap_set_range (cluster, 1, true))
+        return false;
+
+    if (alloc->clusters == 0)
+    {
+        alloc->first_cluster = cluster;
+        alloc->flags |= EXFAT_FLAG_ALLOCATION_POSSIBLE | EXFAT_FLAG_NO_FAT_CHAIN;
+    }
+    else
+    {
+        if ((alloc->flags & EXFAT_FLAG_NO_FAT_CHAIN) &&
+            cluster != alloc->last_cluster + 1)
+        {  // can't stay contiguous: chain up the clusters it has so far
+            #ifdef FAT32_DEBUG
+            debug ("Switching allocation at ");
+            debugulong (alloc->first_cluster);
+            debug (" to a FAT chain\n");
+            #endif
+
+            for (uint32_t c = alloc->first_cluster; c < alloc->last_cluster; c++)
+            {
+                if (!fat_set (c, c + 1))
+                    return false;
+            }
+
+            alloc->flags &= (uint8_t)~EXFAT_FLAG_NO_FAT_CHAIN;
+        }
+
+        if (!(alloc->flags & EXFAT_FLAG_NO_FAT_CHAIN))
+        {
+            if (!fat_set (alloc->last_cluster, cluster))
+                return false;
+            if (!fat_set (cluster, EXFAT_END_OF_CHAIN))
+                return false;
+        }
+    }
+
+    alloc->last_cluster = cluster;
+    alloc->clusters++;
+    exfat_next_free = cluster + 1;
+
+    *added = cluster;
+    return true;
+}
+
+// release every cluster of an allocation
+// (the FAT entries of a chain are left alone, they mean nothing once the
+// bitmap says the clusters are free)
+static bool free_alloc (const exfat_alloc *alloc)
+{
+    if (alloc->clusters == 0)
+        return true;
+
+    if (alloc->flags & EXFAT_FLAG_NO_FAT_CHAIN)
+        return bitmap_set_range (alloc->first_cluster, alloc->clusters, false);
+
+    uint32_t cluster = alloc->first_cluster;
+    for (uint32_t i = 0; i < alloc->clusters; i++)
+    {
+        if (!bitmap_set_range (cluster, 1, false))
+            return false;
+
+        if (i + 1 < alloc->clusters)
+        {
+            if (!fat_lookup (cluster, &cluster))
+                return false;
+
+            if (cluster == EXFAT_END_OF_CHAIN)
+                break;
+        }
+    }
+
+    return true;
+}
+
+// zero out a newly allocated directory cluster
+static bool clear_cluster (const uint32_t cluster)
+{
+    const uint8_t zero[32] = { 0 };
+
+    for (uint32_t i = 0; i < ((uint32_t)1 << exfat_sector_shift); i++)
+    {
+        if (!sd_fat32_fill_sector (cluster_to_sector (cluster) + i, zero, sizeof (zero)))
+            return false;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Directories
+
+// position a cursor at the first entry of a directory
+static void dir_start (exfat_dir_pos *pos,
+                       const exfat_alloc *dir)
+{
+    pos->cluster = dir->first_cluster;
+    pos->sector = (dir->clusters == 0) ? 0 : cluster_to_sector (dir->first_cluster);
+    pos->offset = 0;
+
+    if (dir->flags & EXFAT_FLAG_NO_FAT_CHAIN)
+        pos->remaining = dir->clusters - 1;
+    else
+        pos->remaining = EXFAT_CHAINED;
+}
+
+// move a cursor on to the next entry
+// at the end of the directory's clusters, this returns false with error_code
+// set to ERROR_FAT32_END_OF_DIR, and the cursor's sector is set to 0 (its
+// cluster is left as the directory's last cluster)
+static bool dir_next (exfat_dir_pos *pos)
+{
+    pos->offset += 32;
+    if (pos->offset < 512)
+        return true;
+
+    pos->offset = 0;
+    pos->sector++;
+
+    if (((pos->sector - exfat_heap_start) & (((uint32_t)1 << exfat_sector_shift) - 1)) != 0)
+        return true;
+
+    // on to the next cluster
+    uint32_t next;
+
+    if (pos->remaining == EXFAT_CHAINED)
+    {
+        if (!fat_lookup (pos->cluster, &next))
+            return false;
+    }
+    else if (pos->remaining == 0)
+    {
+        next = EXFAT_END_OF_CHAIN;
+    }
+    else
+    {
+        pos->remaining--;
+        next = pos->cluster + 1;
+    }
+
+    if (next == EXFAT_END_OF_CHAIN)
+    {
+        pos->sector = 0;
+        error_code = ERROR_FAT32_END_OF_DIR;
+        return false;
+    }
+
+    pos->cluster = next;
+    pos->sector = cluster_to_sector (next);
+    return true;
+}
+
+// read the entry set starting at the next in-use file entry, and move the
+// cursor past it
+// returns false at the end of the directory (error_code is
+// ERROR_FAT32_END_OF_DIR, and the cursor is left on the end marker if there
+// is one) or on error
+static bool read_set (exfat_dir_pos *pos,
+                      exfat_object *object)
+{
+    while (1)
+    {
+        if (pos->sector == 0)
+        {
+            error_code = ERROR_FAT32_END_OF_DIR;
+            return false;
+        }
+
+        cached_sector *sector = load_block (pos->sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        const exfat_file_entry *file = (const exfat_file_entry*)&sector->data[pos->offset];
+
+        if (file->type == EXFAT_ENTRY_END)
+        {
+            error_code = ERROR_FAT32_END_OF_DIR;
+            return false;
+        }
+
+        if (file->type != EXFAT_ENTRY_FILE || file->secondary_count < 2)
+        {  // unused, some other kind of entry, or the rest of a broken set
+            if (!dir_next (pos))
+                return false;
+            continue;
+        }
+
+        const uint8_t count = file->secondary_count;
+        object->entry = *pos;
+        object->attributes = file->attributes;
+        object->name_length = 0;
+        object->name[0] = '\0';
+
+        bool complete = true;
+        uint8_t name_chars = 0;
+
+        for (uint8_t i = 1; i <= count; i++)
+        {
+            if (!dir_next (pos))
+            {
+                if (error_code != ERROR_FAT32_END_OF_DIR)
+                    return false;
+                complete = false;
+                break;
+            }
+
+            sector = load_block (pos->sector);
+            if (sector == END_OF_CHAIN)
+                return false;
+
+            const uint8_t type = sector->data[pos->offset];
+
+            if (i == 1)
+            {
+                const exfat_stream_entry *stream = (const exfat_stream_entry*)&sector->data[pos->offset];
+
+                if (type != EXFAT_ENTRY_STREAM)
+                {
+                    complete = false;
+                    break;
+                }
+
+                object->flags = stream->flags;
+                object->name_length = stream->name_length;
+                object->name_hash = stream->name_hash;
+                object->first_cluster = stream->first_cluster;
+                object->valid_length = (uint32_t)stream->valid_data_length;
+                object->data_length = (uint32_t)stream->data_length;
+                object->too_big = (stream->data_length >> 32) != 0;
+            }
+            else if (type == EXFAT_ENTRY_NAME)
+            {
+                const exfat_name_entry *name = (const exfat_name_entry*)&sector->data[pos->offset];
+
+                for (uint8_t c = 0; c < EXFAT_NAME_LENGTH; c++)
+                {
+                    if (name_chars >= object->name_length || name_chars >= EXFAT_NAME_LENGTH)
+                        break;
+
+                    const uint16_t ch = name->name[c];
+                    object->name[name_chars++] = (ch >= 0x20 && ch < 0x7f) ? (char)ch : '?';
+                }
+                object->name[name_chars] = '\0';
+            }
+            else if (!(type & EXFAT_ENTRY_IN_USE))
+            {
+                complete = false;
+                break;
+            }
+        }
+
+        if (!complete)
+        {  // skip over whatever this was
+            if (pos->sector == 0)
+            {
+                error_code = ERROR_FAT32_END_OF_DIR;
+                return false;
+            }
+            continue;
+        }
+
+        // step past the set (running off the end of the directory is fine,
+        // the next read will report it)
+        if (!dir_next (pos) && error_code != ERROR_FAT32_END_OF_DIR)
+            return false;
+
+        error_code = ERROR_NONE;
+        return true;
+    }
+}
+
+// check a name, and work out its length and hash
+static bool verify_exfat_name (const char *name,
+                               uint8_t *length,
+                               uint16_t *hash)
+{
+    uint8_t i;
+    *hash = 0;
+
+    for (i = 0; name[i] != '\0'; i++)
+    {
+        const char c = name[i];
+
+        if (i >= EXFAT_NAME_LENGTH || c < 0x20 || c >= 0x7f ||
+            c == '"' || c == '*' || c == '/' || c == ':' || c == '<' ||
+            c == '>' || c == '?' || c == '\\' || c == '|')
+        {
+            error_code = ERROR_FAT32_INVALID_NAME;
+            return false;
+        }
+
+        // hash the up-cased name as UTF-16
+        *hash = checksum16 (*hash, (uint8_t)upcase (c));
+        *hash = checksum16 (*hash, 0);
+    }
+
+    if (i == 0 || (name[0] == '.' && (i == 1 || (i == 2 && name[1] == '.'))))
+    {
+        error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+
+    *length = i;
+    return true;
+}
+
+static bool names_match (const exfat_object *object,
+                         const char *name,
+                         const uint8_t length,
+                         const uint16_t hash)
+{
+    if (object->name_length != length || object->name_hash != hash)
+        return false;
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        if (upcase (object->name[i]) != upcase (name[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// look for a name in the current directory
+// returns false if it wasn't found (error_code is ERROR_FAT32_NOT_FOUND) or
+// on error
+static bool search_dir (const char *name,
+                        exfat_object *result)
+{
+    uint8_t length;
+    uint16_t hash;
+
+    if (!verify_exfat_name (name, &length, &hash))
+        return false;
+
+    exfat_dir_pos pos;
+    dir_start (&pos, &exfat_dirs[exfat_depth].alloc);
+
+    while (read_set (&pos, result))
+    {
+        if (names_match (result, name, length, hash))
+            return true;
+    }
+
+    if (error_code == ERROR_FAT32_END_OF_DIR)
+        error_code = ERROR_FAT32_NOT_FOUND;
+
+    return false;
+}
+
+// rewrite the stream entry of an entry set, and the set's checksum
+static bool update_set (const exfat_dir_pos *entry,
+                        const exfat_alloc *alloc,
+                        const uint32_t valid_length,
+                        const uint32_t data_length)
+{
+    exfat_dir_pos pos = *entry;
+
+    cached_sector *sector = load_block (pos.sector);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    const uint8_t *bytes = &sector->data[pos.offset];
+    if (bytes[0] != EXFAT_ENTRY_FILE)
+    {
+        error_code = ERROR_FAT32_NOT_FOUND;
+        return false;
+    }
+
+    const uint8_t count = ((const exfat_file_entry*)bytes)->secondary_count;
+    uint16_t sum = 0;
+
+    for (uint8_t i = 0; i < 32; i++)
+    {
+        if (i != 2 && i != 3)  // skip the checksum itself
+            sum = checksum16 (sum, bytes[i]);
+    }
+
+    for (uint8_t i = 1; i <= count; i++)
+    {
+        if (!dir_next (&pos))
+            return false;
+
+        sector = load_block (pos.sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        if (i == 1)
+        {
+            exfat_stream_entry *stream = (exfat_stream_entry*)&sector->data[pos.offset];
+
+            stream->flags = (uint8_t)((stream->flags & ~EXFAT_FLAG_NO_FAT_CHAIN) |
+                                      (alloc->flags & EXFAT_FLAG_NO_FAT_CHAIN) |
+                                      EXFAT_FLAG_ALLOCATION_POSSIBLE);
+            stream->first_cluster = alloc->first_cluster;
+            stream->valid_data_length = valid_length;
+            stream->data_length = data_length;
+            sector->modified = true;
+        }
+
+        bytes = &sector->data[pos.offset];
+        for (uint8_t b = 0; b < 32; b++)
+            sum = checksum16 (sum, bytes[b]);
+    }
+
+    sector = load_block (entry->sector);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    ((exfat_file_entry*)&sector->data[entry->offset])->set_checksum = sum;
+    sector->modified = true;
+
+    return true;
+}
+
+// mark every entry of a set as unused
+static bool remove_set (const exfat_dir_pos *entry)
+{
+    exfat_dir_pos pos = *entry;
+
+    cached_sector *sector = load_block (pos.sector);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    const uint8_t count = ((const exfat_file_entry*)&sector->data[pos.offset])->secondary_count;
+
+    for (uint8_t i = 0; i <= count; i++)
+    {
+        if (i > 0)
+        {
+            if (!dir_next (&pos))
+                return false;
+
+            sector = load_block (pos.sector);
+            if (sector == END_OF_CHAIN)
+                return false;
+        }
+
+        sector->data[pos.offset] &= (uint8_t)~EXFAT_ENTRY_IN_USE;
+        sector->modified = true;
+    }
+
+    return true;
+}
+
+// positions recorded in a contiguous directory know how many clusters were
+// left after theirs: once the directory has grown, bring one up to date
+static void refresh_dir_pos (exfat_dir_pos *pos,
+                             const exfat_alloc *dir,
+                             const uint32_t old_last_cluster)
+{
+    if (pos->sector == 0 || pos->remaining == EXFAT_CHAINED ||
+        pos->cluster < dir->first_cluster || pos->cluster > old_last_cluster)
+    {  // not in this directory (or already past its end)
+        return;
+    }
+
+    if (dir->flags & EXFAT_FLAG_NO_FAT_CHAIN)
+        pos->remaining = dir->last_cluster - pos->cluster;
+    else
+        pos->remaining = EXFAT_CHAINED;  // (the FAT now links all of its clusters)
+}
+
+// give a directory another (zeroed) cluster, and point pos at its first entry
+// other_pos is another position in the directory that the caller is holding
+// on to, which is kept up to date along with the open files' entries
+static bool extend_dir (exfat_dir *dir,
+                        exfat_dir_pos *pos,
+                        exfat_dir_pos *other_pos)
+{
+    const bool was_contiguous = (dir->alloc.flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0;
+    const uint32_t old_last_cluster = dir->alloc.first_cluster + dir->alloc.clusters - 1;
+    uint32_t cluster;
+
+    if (!append_cluster (&dir->alloc, &cluster))
+        return false;
+
+    if (!clear_cluster (cluster))
+        return false;
+
+    if (dir != &exfat_dirs[0])
+    {  // record the new length in the directory's own entry (the root has none)
+        const uint32_t length = dir->alloc.clusters << exfat_cluster_shift;
+
+        if (!update_set (&dir->entry, &dir->alloc, length, length))
+            return false;
+    }
+
+    if (was_contiguous)
+    {
+        for (uint8_t i = 0; i < MAX_FILES; i++)
+        {
+            if (exfat_files[i].open)
+                refresh_dir_pos (&exfat_files[i].entry, &dir->alloc, old_last_cluster);
+        }
+
+        refresh_dir_pos (&exfat_listing_pos, &dir->alloc, old_last_cluster);
+
+        if (other_pos != 0)
+            refresh_dir_pos (other_pos, &dir->alloc, old_last_cluster);
+    }
+
+    pos->cluster = cluster;
+    pos->sector = cluster_to_sector (cluster);
+    pos->offset = 0;
+    pos->remaining = (dir->alloc.flags & EXFAT_FLAG_NO_FAT_CHAIN) ? 0 : EXFAT_CHAINED;
+
+    return true;
+}
+
+// create a three-entry set (file, stream, name) in the current directory
+// unless name_is_new, the whole directory is checked for the name in the
+// same pass that looks for free entries; if it's found, error_code is
+// ERROR_FAT32_ALREADY_EXISTS and existing describes what has the name
+static bool add_set (const char *name,
+                     const uint16_t attributes,
+                     const exfat_alloc *alloc,
+                     const uint32_t length,
+                     const bool name_is_new,
+                     exfat_object *existing,
+                     exfat_dir_pos *added)
+{
+    exfat_dir *dir = &exfat_dirs[exfat_depth];
+    uint8_t name_length;
+    uint16_t hash;
+
+    if (!verify_exfat_name (name, &name_length, &hash))
+        return false;
+
+    // find three free entries in a row
+    exfat_dir_pos pos, start;
+    uint8_t run = 0;
+    bool at_end = false;
+
+    dir_start (&pos, &dir->alloc);
+
+    while (1)
+    {
+        if (pos.sector == 0)
+        {  // the directory is full, and has no end marker
+            at_end = true;
+            break;
+        }
+
+        cached_sector *sector = load_block (pos.sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        const uint8_t type = sector->data[pos.offset];
+
+        if (type == EXFAT_ENTRY_END)
+        {  // everything from here on is free
+            if (run == 0)
+                start = pos;
+            at_end = true;
+            break;
+        }
+
+        if (!(type & EXFAT_ENTRY_IN_USE))
+        {
+            if (run == 0)
+                start = pos;
+            if (run < 3)
+                run++;
+
+            if (run == 3 && name_is_new)
+                break;
+        }
+        else if (type == EXFAT_ENTRY_FILE && !name_is_new)
+        {
+            if (run < 3)
+                run = 0;
+
+            if (!read_set (&pos, existing))
+            {
+                if (error_code != ERROR_FAT32_END_OF_DIR)
+                    return false;
+                continue;  // (a broken set at the end)
+            }
+
+            if (names_match (existing, name, name_length, hash))
+            {
+                error_code = ERROR_FAT32_ALREADY_EXISTS;
+                return false;
+            }
+            continue;  // read_set has already moved past the set
+        }
+        else if (run < 3)
+        {
+            run = 0;
+        }
+
+        if (!dir_next (&pos))
+        {
+            if (error_code != ERROR_FAT32_END_OF_DIR)
+                return false;
+        }
+    }
+
+    if (run == 0 && at_end && pos.sector == 0)
+    {  // nowhere to start: add a cluster and start there
+        if (!extend_dir (dir, &start, 0))
+            return false;
+    }
+
+    // build the set
+    uint8_t set[3][32];
+    for (uint8_t i = 0; i < 3; i++)
+        for (uint8_t b = 0; b < 32; b++)
+            set[i][b] = 0;
+
+    exfat_file_entry *file = (exfat_file_entry*)set[0];
+    file->type = EXFAT_ENTRY_FILE;
+    file->secondary_count = 2;
+    file->attributes = attributes;
+    file->create_timestamp = EXFAT_TIMESTAMP;
+    file->modify_timestamp = EXFAT_TIMESTAMP;
+    file->access_timestamp = EXFAT_TIMESTAMP;
+
+    exfat_stream_entry *stream = (exfat_stream_entry*)set[1];
+    stream->type = EXFAT_ENTRY_STREAM;
+    stream->flags = (uint8_t)(alloc->flags | EXFAT_FLAG_ALLOCATION_POSSIBLE);
+    stream->name_length = name_length;
+    stream->name_hash = hash;
+    stream->valid_data_length = length;
+    stream->first_cluster = alloc->first_cluster;
+    stream->data_length = length;
+
+    exfat_name_entry *name_entry = (exfat_name_entry*)set[2];
+    name_entry->type = EXFAT_ENTRY_NAME;
+    for (uint8_t i = 0; i < name_length; i++)
+        name_entry->name[i] = (uint8_t)name[i];
+
+    uint16_t sum = 0;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        for (uint8_t b = 0; b < 32; b++)
+        {
+            if (i != 0 || (b != 2 && b != 3))
+                sum = checksum16 (sum, set[i][b]);
+        }
+    }
+    file->set_checksum = sum;
+
+    // write it out, running into a new cluster if the directory fills up
+    // (the entries after an end marker are all end markers too, so there's
+    // no need to write a new one)
+    pos = start;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        if (i > 0 && !dir_next (&pos))
+        {
+            if (error_code != ERROR_FAT32_END_OF_DIR)
+                return false;
+            if (!extend_dir (dir, &pos, &start))
+                return false;
+        }
+
+        if (!write_partial_block (pos.sector, pos.offset, set[i], 32))
+            return false;
+    }
+
+    *added = start;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+// the allocation described by an entry set
+static void object_alloc (const exfat_object *object,
+                          exfat_alloc *alloc)
+{
+    alloc->first_cluster = object->first_cluster;
+    alloc->flags = object->flags;
+    alloc->last_cluster = 0;
+
+    if (object->first_cluster == 0)
+        alloc->clusters = 0;
+    else
+        alloc->clusters = clusters_for_bytes (object->data_length);
+}
+
+
+//------------------------------------------------------------------------------
+// Mounting
+
+// find the exFAT volume: either the first partition of type 0x07, or the
+// whole card if it has no partition table
+static bool find_volume (void)
+{
+    cached_sector *sector = load_block (0);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    const exfat_boot_sector *boot = (const exfat_boot_sector*)sector->data;
+    const char *exfat_name = "EXFAT   ";
+    bool is_boot_sector = true;
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        if (boot->file_system_name[i] != exfat_name[i])
+            is_boot_sector = false;
+    }
+
+    if (is_boot_sector)
+    {
+        exfat_volume_start = 0;
+        return true;
+    }
+
+    const mbr_block *mbr = (const mbr_block*)sector->data;
+
+    if (mbr->signature != MBR_END_SIGNATURE)
+    {
+        error_code = ERROR_MBR;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (mbr->partition[i].type_code == EXFAT_PARTITION_TYPE &&
+            mbr->partition[i].start_sector != 0)
+        {
+            exfat_volume_start = mbr->partition[i].start_sector;
+            return true;
+        }
+    }
+
+    error_code = ERROR_NO_FAT32;
+    return false;
+}
+
+// read the boot sector and check the boot region's checksum
+static bool read_boot_sector (void)
+{
+    cached_sector *sector = load_block (exfat_volume_start);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    const exfat_boot_sector *boot = (const exfat_boot_sector*)sector->data;
+    const char *exfat_name = "EXFAT   ";
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        if (boot->file_system_name[i] != exfat_name[i])
+        {  // type 0x07 is NTFS too
+            error_code = ERROR_NO_FAT32;
+            return false;
+        }
+    }
+
+    if (boot->signature != FAT32_END_SIGNATURE ||
+        boot->bytes_per_sector_shift != 9 ||
+        boot->sectors_per_cluster_shift > 16 ||
+        boot->number_of_fats != 1 ||
+        boot->cluster_count == 0 ||
+        (uint64_t)boot->cluster_heap_offset +
+            ((uint64_t)boot->cluster_count << boot->sectors_per_cluster_shift) > boot->volume_length)
+    {
+        #ifdef FAT32_DEBUG
+        debug ("Unsupported exFAT volume\n");
+        #endif
+
+        error_code = ERROR_FAT32_VOLUME_ID;
+        return false;
+    }
+
+    exfat_fat_start = exfat_volume_start + boot->fat_offset;
+    exfat_heap_start = exfat_volume_start + boot->cluster_heap_offset;
+    exfat_cluster_count = boot->cluster_count;
+    exfat_sector_shift = boot->sectors_per_cluster_shift;
+    exfat_cluster_shift = (uint8_t)(boot->sectors_per_cluster_shift + 9);
+
+    const uint32_t root_cluster = boot->root_first_cluster;
+
+    // the boot region checksum covers the first 11 sectors, except for the
+    // volume flags and percent in use
+    uint32_t sum = 0;
+
+    for (uint8_t s = 0; s < 11; s++)
+    {
+        sector = load_block (exfat_volume_start + s);
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        for (uint16_t i = 0; i < 512; i++)
+        {
+            if (s == 0 && (i == EXFAT_VOLUME_FLAGS_OFFSET ||
+                           i == EXFAT_VOLUME_FLAGS_OFFSET + 1 ||
+                           i == EXFAT_PERCENT_IN_USE_OFFSET))
+            {
+                continue;
+            }
+            sum = checksum32 (sum, sector->data[i]);
+        }
+    }
+
+    uint32_t stored_sum;
+    if (!read_partial_block (exfat_volume_start + 11, 0, (uint8_t*)&stored_sum, 4))
+        return false;
+
+    if (sum != stored_sum || !valid_cluster (root_cluster))
+    {
+        #ifdef FAT32_DEBUG
+        debug ("Bad exFAT boot checksum\n");
+        #endif
+
+        error_code = ERROR_FAT32_VOLUME_ID;
+        return false;
+    }
+
+    // the root directory is always a FAT chain
+    exfat_dir *root = &exfat_dirs[0];
+    root->alloc.first_cluster = root_cluster;
+    root->alloc.flags = 0;
+    root->alloc.clusters = 1;
+    root->alloc.last_cluster = root_cluster;
+
+    uint32_t next;
+    if (!fat_lookup (root_cluster, &next))
+        return false;
+
+    while (next != EXFAT_END_OF_CHAIN)
+    {
+        if (root->alloc.clusters >= exfat_cluster_count)
+        {  // a loop in the chain
+            error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+            return false;
+        }
+
+        root->alloc.last_cluster = next;
+        root->alloc.clusters++;
+
+        if (!fat_lookup (next, &next))
+            return false;
+    }
+
+    return true;
+}
+
+// make sure the up-case table maps ASCII the usual way (a-z to A-Z, and
+// everything else to itself), and that its checksum is right
+// then names can be compared without keeping the table in RAM
+static bool check_upcase_table (const uint32_t first_cluster,
+                                const uint32_t length,
+                                const uint32_t table_checksum)
+{
+    uint32_t cluster = first_cluster;
+    uint32_t remaining = length;
+    uint32_t sum = 0;
+    uint32_t code_point = 0;
+    bool ascii_ok = true;
+    bool run_length_next = false;
+
+    while (remaining > 0)
+    {
+        if (!valid_cluster (cluster))
+        {
+            error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+            return false;
+        }
+
+        for (uint32_t s = 0; s < ((uint32_t)1 << exfat_sector_shift) && remaining > 0; s++)
+        {
+            cached_sector *sector = load_block (cluster_to_sector (cluster) + s);
+            if (sector == END_OF_CHAIN)
+                return false;
+
+            const uint16_t bytes = (remaining < 512) ? (uint16_t)remaining : 512;
+
+            for (uint16_t i = 0; i < bytes; i++)
+                sum = checksum32 (sum, sector->data[i]);
+
+            // the table is a list of mappings, where 0xffff is followed by
+            // the number of code points that map to themselves
+            for (uint16_t i = 0; i + 1 < bytes && code_point < 128; i += 2)
+            {
+                const uint16_t value = (uint16_t)(sector->data[i] | (sector->data[i + 1] << 8));
+
+                if (run_length_next)
+                {
+                    for (uint32_t c = code_point; c < code_point + value && c < 128; c++)
+                    {
+                        if (upcase ((char)c) != (char)c)
+                            ascii_ok = false;
+                    }
+                    code_point += value;
+                    run_length_next = false;
+                }
+                else if (value == 0xffff)
+                {
+                    run_length_next = true;
+                }
+                else
+                {
+                    if (value != (uint16_t)upcase ((char)code_point))
+                        ascii_ok = false;
+                    code_point++;
+                }
+            }
+
+            remaining -= bytes;
+        }
+
+        if (remaining > 0 && !fat_lookup (cluster, &cluster))
+            return false;
+    }
+
+    // anything past the end of the table maps to itself
+    if (code_point <= 'z')
+        ascii_ok = false;
+
+    if (sum != table_checksum || !ascii_ok)
+    {
+        #ifdef FAT32_DEBUG
+        debug ("Unsupported up-case table\n");
+        #endif
+
+        error_code = ERROR_FAT32_VOLUME_ID;
+        return false;
+    }
+
+    return true;
+}
+
+// find the allocation bitmap and up-case table in the root directory
+static bool read_root_tables (void)
+{
+    exfat_dir_pos pos;
+    bool have_bitmap = false;
+    bool have_upcase = false;
+
+    dir_start (&pos, &exfat_dirs[0].alloc);
+
+    while (!have_bitmap || !have_upcase)
+    {
+        cached_sector *sector = load_block (pos.sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        const exfat_alloc_entry *entry = (const exfat_alloc_entry*)&sector->data[pos.offset];
+
+        if (entry->type == EXFAT_ENTRY_END)
+            break;
+
+        if (entry->type == EXFAT_ENTRY_BITMAP && !(entry->flags & 1))
+        {  // (flag 1 marks the second bitmap of a TexFAT volume)
+            const uint32_t bitmap_cluster = entry->first_cluster;
+            const uint32_t bitmap_clusters = clusters_for_bytes ((uint32_t)entry->data_length);
+
+            if (!valid_cluster (bitmap_cluster) ||
+                entry->data_length < (exfat_cluster_count + 7) / 8)
+            {
+                error_code = ERROR_FAT32_VOLUME_ID;
+                return false;
+            }
+
+            // bitmap bits are found by arithmetic, so it has to be contiguous
+            // (formatting always makes it so)
+            uint32_t cluster = bitmap_cluster;
+            for (uint32_t i = 1; i < bitmap_clusters; i++)
+            {
+                uint32_t next;
+                if (!fat_lookup (cluster, &next))
+                    return false;
+
+                if (next != cluster + 1)
+                {
+                    error_code = ERROR_FAT32_VOLUME_ID;
+                    return false;
+                }
+                cluster = next;
+            }
+
+            exfat_bitmap_start = cluster_to_sector (bitmap_cluster);
+            have_bitmap = true;
+        }
+        else if (entry->type == EXFAT_ENTRY_UPCASE)
+        {
+            const uint32_t first_cluster = entry->first_cluster;
+            const uint32_t length = (uint32_t)entry->data_length;
+            const uint32_t table_checksum = entry->table_checksum;
+
+            if (!check_upcase_table (first_cluster, length, table_checksum))
+                return false;
+
+            have_upcase = true;
+        }
+
+        if (!dir_next (&pos))
+        {
+            if (error_code != ERROR_FAT32_END_OF_DIR)
+                return false;
+            break;
+        }
+    }
+
+    if (!have_bitmap || !have_upcase)
+    {
+        error_code = ERROR_FAT32_VOLUME_ID;
+        return false;
+    }
+
+    return true;
+}
+
+// set or clear the volume dirty flag, and mark the percent in use as unknown
+// (neither is covered by the boot checksum)
+static bool set_volume_dirty (const bool dirty)
+{
+    cached_sector *sector = load_block (exfat_volume_start);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    exfat_boot_sector *boot = (exfat_boot_sector*)sector->data;
+
+    if (dirty)
+        boot->volume_flags |= EXFAT_VOLUME_DIRTY;
+    else
+        boot->volume_flags &= (uint16_t)~EXFAT_VOLUME_DIRTY;
+
+    boot->percent_in_use = 0xff;
+    sector->modified = true;
+
+    return true;
+}
+
+static void clear_file (exfat_file *file)
+{
+    file->open = false;
+    file->access_type = READ_FILE;
+    file->entry.sector = 0;
+    file->entry.offset = 0;
+    file->alloc.first_cluster = 0;
+    file->alloc.last_cluster = 0;
+    file->alloc.clusters = 0;
+    file->alloc.flags = 0;
+    file->data_length = 0;
+    file->size = 0;
+    file->seek_offset = 0;
+    file->current_cluster = 0;
+    file->current_index = 0;
+}
+
+
+// mount the filesystem
+bool sd_exfat_init (void)
+{
+    #ifdef FAT32_DEBUG
+    debug ("initializing exFAT\n");
+    #endif
+
+    exfat_initialized = false;
+    if (!init_card (USE_CRC))
+        return false;  // error_code will have been set in init_card
+
+    if (!find_volume())
+        return false;
+
+    if (!read_boot_sector())
+        return false;
+
+    if (!read_root_tables())
+        return false;
+
+    // (cleared again at shutdown: if the card is pulled first, the next
+    // mount on a PC knows to check it)
+    if (!set_volume_dirty (true))
+        return false;
+
+    #ifdef FAT32_DEBUG
+    debug ("exFAT FS OK\n");
+    #endif
+
+    for (uint8_t i = 0; i < MAX_FILES; i++)
+        clear_file (&exfat_files[i]);
+
+    exfat_depth = 0;
+    exfat_next_free = 2;
+    exfat_free_clusters = (uint32_t)0xffffffff;
+    exfat_listing_pos.sector = 0;
+
+    exfat_initialized = true;
+
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// unmount the filesystem
+bool sd_exfat_shutdown (void)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < MAX_FILES; i++)
+    {
+        if (!sd_exfat_close_file (i))
+            return false;
+    }
+
+    // make sure everything else is on the card before the volume is
+    // marked clean
+    if (!commit_cache())
+        return false;
+
+    if (!set_volume_dirty (false))
+        return false;
+
+    if (!flush_cache())
+        return false;
+
+    exfat_initialized = false;
+
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+
+    // send the card a bunch of cycles to let it finish up anything it needs
+    attempt_resync();
+
+    // reset the card
+    if (reset_card() != SPI_OK)
+        return false;
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Free space
+
+// count the clear bits in the allocation bitmap the first time through;
+// after that the count is kept up to date as clusters are allocated and freed
+bool sd_exfat_free_space (uint32_t *free_kb)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (exfat_free_clusters == (uint32_t)0xffffffff)
+    {
+        uint32_t free_clusters = 0;
+        cached_sector *sector = END_OF_CHAIN;
+
+        for (uint32_t index = 0; index < exfat_cluster_count; index += 8)
+        {
+            if ((index & 4095) == 0)
+            {
+                sector = load_block (exfat_bitmap_start + (index >> 12));
+                if (sector == END_OF_CHAIN)
+                    return false;
+            }
+
+            uint8_t bits = sector->data[(index >> 3) & 511];
+
+            if (exfat_cluster_count - index < 8)
+            {  // past the last cluster counts as used
+                bits |= (uint8_t)(0xff << (exfat_cluster_count - index));
+            }
+
+            // 8 free, less one for each set bit
+            free_clusters += 8;
+            for (; bits != 0; bits &= (uint8_t)(bits - 1))
+                free_clusters--;
+        }
+
+        exfat_free_clusters = free_clusters;
+    }
+
+    if (exfat_cluster_shift >= 10)
+        *free_kb = exfat_free_clusters << (exfat_cluster_shift - 10);
+    else
+        *free_kb = exfat_free_clusters >> (10 - exfat_cluster_shift);
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// File and directory information
+
+bool sd_exfat_get_size (const char *name,
+                        uint32_t *size)
+{
+    exfat_object object;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (!search_dir (name, &object))
+        return false;
+
+    if (object.attributes & EXFAT_ATTR_DIRECTORY)
+    {
+        error_code = ERROR_FAT32_NOT_FILE;
+        return false;
+    }
+
+    if (object.too_big)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    *size = object.valid_length;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+bool sd_exfat_object_exists (const char *name,
+                             bool *is_directory)
+{
+    exfat_object object;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (!search_dir (name, &object))
+    {
+        if (error_code == ERROR_FAT32_NOT_FOUND)
+            error_code = ERROR_NONE;
+        return false;
+    }
+
+    *is_directory = (object.attributes & EXFAT_ATTR_DIRECTORY) != 0;
+    return true;
+}
+
+// the next visible entry from the listing cursor
+static bool next_listed_object (char name[EXFAT_NAME_LENGTH + 1],
+                                listed_object *listed)
+{
+    exfat_object object;
+
+    name[0] = '\0';  // make the name empty to start
+
+    do
+    {
+        if (!read_set (&exfat_listing_pos, &object))
+        {
+            if (error_code == ERROR_FAT32_END_OF_DIR)
+                error_code = ERROR_NONE;
+            return false;
+        }
+    } while (object.attributes & 0x02);  // hidden
+
+    for (uint8_t i = 0; i <= EXFAT_NAME_LENGTH; i++)
+        name[i] = object.name[i];
+
+    listed->size = object.too_big ? 0xffffffff : object.valid_length;
+    listed->first_cluster = object.first_cluster;
+    listed->is_directory = (object.attributes & EXFAT_ATTR_DIRECTORY) != 0;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+bool sd_exfat_list_dir_first (char name[EXFAT_NAME_LENGTH + 1],
+                              listed_object *object)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    dir_start (&exfat_listing_pos, &exfat_dirs[exfat_depth].alloc);
+    return next_listed_object (name, object);
+}
+
+bool sd_exfat_list_dir_next (char name[EXFAT_NAME_LENGTH + 1],
+                             listed_object *object)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    return next_listed_object (name, object);
+}
+
+bool sd_exfat_get_dir_entry_first (char name[EXFAT_NAME_LENGTH + 1])
+{
+    listed_object object;
+    return sd_exfat_list_dir_first (name, &object);
+}
+
+bool sd_exfat_get_dir_entry_next (char name[EXFAT_NAME_LENGTH + 1])
+{
+    listed_object object;
+    return sd_exfat_list_dir_next (name, &object);
+}
+
+
+//------------------------------------------------------------------------------
+// Directory traversal and modification
+
+bool sd_exfat_push (const char *name)
+{
+    exfat_object object;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (!search_dir (name, &object))
+        return false;
+
+    if (!(object.attributes & EXFAT_ATTR_DIRECTORY))
+    {
+        error_code = ERROR_FAT32_NOT_DIR;
+        return false;
+    }
+
+    if (exfat_depth >= EXFAT_MAX_DEPTH)
+    {  // no room to remember the way back
+        error_code = ERROR_FAT32_TOO_MANY_FILES;
+        return false;
+    }
+
+    exfat_depth++;
+    exfat_dirs[exfat_depth].entry = object.entry;
+    object_alloc (&object, &exfat_dirs[exfat_depth].alloc);
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+bool sd_exfat_pop (void)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (exfat_depth == 0)
+    {
+        error_code = ERROR_FAT32_AT_ROOT;
+        return false;
+    }
+
+    exfat_depth--;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+bool sd_exfat_mkdir (const char *name)
+{
+    exfat_alloc alloc;
+    exfat_object existing;
+    exfat_dir_pos added;
+    uint32_t cluster;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    alloc.first_cluster = 0;
+    alloc.last_cluster = 0;
+    alloc.clusters = 0;
+    alloc.flags = 0;
+
+    // the new directory gets a single empty cluster
+    if (!append_cluster (&alloc, &cluster))
+        return false;
+
+    if (!clear_cluster (cluster) ||
+        !add_set (name, EXFAT_ATTR_DIRECTORY, &alloc,
+                  (uint32_t)1 << exfat_cluster_shift,
+                  false, &existing, &added))
+    {  // give the cluster back
+        const uint8_t error = error_code;
+        free_alloc (&alloc);
+        error_code = error;
+        return false;
+    }
+
+    return true;
+}
+
+bool sd_exfat_rmdir (const char *name)
+{
+    exfat_object object, child;
+    exfat_alloc alloc;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (!search_dir (name, &object))
+        return false;
+
+    if (!(object.attributes & EXFAT_ATTR_DIRECTORY))
+    {
+        error_code = ERROR_FAT32_NOT_DIR;
+        return false;
+    }
+
+    object_alloc (&object, &alloc);
+
+    exfat_dir_pos pos;
+    dir_start (&pos, &alloc);
+
+    if (read_set (&pos, &child))
+    {
+        error_code = ERROR_FAT32_NOT_EMPTY;
+        return false;
+    }
+
+    if (error_code != ERROR_FAT32_END_OF_DIR)
+        return false;
+
+    if (!remove_set (&object.entry))
+        return false;
+
+    if (!free_alloc (&alloc))
+        return false;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+// find the open file using an entry set, or MAX_FILES if none is
+static uint8_t find_open_file (const exfat_dir_pos *entry)
+{
+    for (uint8_t i = 0; i < MAX_FILES; i++)
+    {
+        if (exfat_files[i].open &&
+            exfat_files[i].entry.sector == entry->sector &&
+            exfat_files[i].entry.offset == entry->offset)
+        {
+            return i;
+        }
+    }
+
+    return MAX_FILES;
+}
+
+// remove a file's entry set and free its clusters
+static bool remove_file (const exfat_object *object)
+{
+    exfat_alloc alloc;
+    object_alloc (object, &alloc);
+
+    if (!remove_set (&object->entry))
+        return false;
+
+    return free_alloc (&alloc);
+}
+
+bool sd_exfat_delete (const char *name)
+{
+    exfat_object object;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (!search_dir (name, &object))
+        return false;
+
+    if (object.attributes & EXFAT_ATTR_DIRECTORY)
+    {
+        error_code = ERROR_FAT32_NOT_FILE;
+        return false;
+    }
+
+    const uint8_t open_id = find_open_file (&object.entry);
+    if (open_id != MAX_FILES)
+    {  // close it first
+        if (!sd_exfat_close_file (open_id))
+            return false;
+
+        // closing may have changed its allocation
+        if (!search_dir (name, &object))
+            return false;
+    }
+
+    if (!remove_file (&object))
+        return false;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// File access and modification
+
+bool sd_exfat_open_file (const char *name,
+                         const open_option action,
+                         uint8_t *file_id)
+{
+    exfat_object object;
+    exfat_file *file;
+
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    // check for an empty file id
+    for (*file_id = 0; *file_id < MAX_FILES; (*file_id)++)
+    {
+        if (!exfat_files[*file_id].open)
+            break;
+    }
+
+    if (*file_id == MAX_FILES)
+    {  // no open file slots left
+        error_code = ERROR_FAT32_TOO_MANY_FILES;
+        return false;
+    }
+
+    file = &exfat_files[*file_id];
+
+    if (action == CREATE_FILE)
+    {
+        exfat_alloc alloc;
+        exfat_dir_pos added;
+
+        alloc.first_cluster = 0;
+        alloc.last_cluster = 0;
+        alloc.clusters = 0;
+        alloc.flags = EXFAT_FLAG_NO_FAT_CHAIN;
+
+        // add the set, looking for an existing file in the same pass
+        if (!add_set (name, EXFAT_ATTR_ARCHIVE, &alloc, 0, false, &object, &added))
+        {
+            if (error_code != ERROR_FAT32_ALREADY_EXISTS)
+                return false;
+
+            if (object.attributes & EXFAT_ATTR_DIRECTORY)
+            {
+                error_code = ERROR_FAT32_NOT_FILE;
+                return false;
+            }
+
+            if (find_open_file (&object.entry) != MAX_FILES)
+            {
+                error_code = ERROR_FAT32_ALREADY_OPEN;
+                return false;
+            }
+
+            // replace the existing file (its entries are free now, and
+            // the name is known to be unused)
+            if (!remove_file (&object) ||
+                !add_set (name, EXFAT_ATTR_ARCHIVE, &alloc, 0, true, &object, &added))
+            {
+                return false;
+            }
+        }
+
+        clear_file (file);
+        file->entry = added;
+        file->alloc = alloc;
+    }
+    else
+    {
+        if (!search_dir (name, &object))
+            return false;
+
+        if (object.attributes & EXFAT_ATTR_DIRECTORY)
+        {
+            error_code = ERROR_FAT32_NOT_FILE;
+            return false;
+        }
+
+        if (object.too_big)
+        {  // sizes are only 32 bits
+            error_code = ERROR_FAT32_TOO_FAR;
+            return false;
+        }
+
+        if (find_open_file (&object.entry) != MAX_FILES)
+        {
+            error_code = ERROR_FAT32_ALREADY_OPEN;
+            return false;
+        }
+
+        clear_file (file);
+        file->entry = object.entry;
+        object_alloc (&object, &file->alloc);
+        file->data_length = object.data_length;
+        file->size = object.valid_length;
+    }
+
+    file->open = true;
+    file->access_type = action;
+
+    #ifdef FAT32_DEBUG
+    debug ("Opened exFAT file in slot ");
+    debuguint ((uint16_t)*file_id);
+    debug ("\n");
+    #endif
+
+    if (action == APPEND_FILE)
+        file->seek_offset = file->size;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+// check a file id, and that its file is open
+static exfat_file *get_open_file (const uint8_t file_id)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return 0;
+    }
+
+    if (file_id >= MAX_FILES)
+    {
+        error_code = ERROR_FAT32_BAD_FILE_ID;
+        return 0;
+    }
+
+    if (!exfat_files[file_id].open)
+    {
+        error_code = ERROR_FAT32_NOT_OPEN;
+        return 0;
+    }
+
+    return &exfat_files[file_id];
+}
+
+bool sd_exfat_close_file (uint8_t file_id)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (file_id >= MAX_FILES)
+    {
+        error_code = ERROR_FAT32_BAD_FILE_ID;
+        return false;
+    }
+
+    exfat_file *file = &exfat_files[file_id];
+
+    if (!file->open)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+
+    bool result = true;
+
+    if (file->access_type != READ_FILE)
+    {  // record its allocation and size (close it anyway if that fails)
+        result = update_set (&file->entry, &file->alloc, file->size, file->data_length);
+    }
+
+    clear_file (file);
+
+    if (result)
+        error_code = ERROR_NONE;
+    return result;
+}
+
+bool sd_exfat_sync_file (uint8_t file_id)
+{
+    exfat_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+
+    if (file->access_type == READ_FILE)
+    {  // nothing to write
+        error_code = ERROR_NONE;
+        return true;
+    }
+
+    if (!update_set (&file->entry, &file->alloc, file->size, file->data_length))
+        return false;
+
+    // the file's data, plus the bitmap, FAT and directory sectors
+    return commit_owned_blocks (FILE_CACHE_OWNER (file_id));
+}
+
+bool sd_exfat_sync_all (void)
+{
+    if (!exfat_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < MAX_FILES; i++)
+    {
+        exfat_file *file = &exfat_files[i];
+
+        if (file->open && file->access_type != READ_FILE)
+        {
+            if (!update_set (&file->entry, &file->alloc, file->size, file->data_length))
+                return false;
+        }
+    }
+
+    return commit_cache();
+}
+
+// seeking just records the offset: the cluster is worked out when the file is
+// next read or written (by arithmetic, for a contiguous file)
+bool sd_exfat_seek (uint8_t file_id,
+                    uint32_t offset)
+{
+    exfat_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+
+    if (offset == FILE_END_POS)
+        offset = file->size;
+
+    if (offset > file->size)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    file->seek_offset = offset;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+bool sd_exfat_get_seek_pos (uint8_t file_id,
+                            uint32_t *offset)
+{
+    exfat_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+
+    *offset = file->seek_offset;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+// point current_cluster at the cluster holding the seek position
+// a FAT chain is followed from the current cluster if that's on the way,
+// otherwise from the start
+static bool locate_seek_cluster (exfat_file *file)
+{
+    const uint32_t index = file->seek_offset >> exfat_cluster_shift;
+
+    if (file->current_cluster != 0 && file->current_index == index)
+        return true;
+
+    if (index >= file->alloc.clusters)
+    {  // past the allocation
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    if (file->alloc.flags & EXFAT_FLAG_NO_FAT_CHAIN)
+    {
+        file->current_cluster = file->alloc.first_cluster + index;
+        file->current_index = index;
+        return true;
+    }
+
+    uint32_t cluster = file->alloc.first_cluster;
+    uint32_t i = 0;
+
+    if (file->current_cluster != 0 && file->current_index < index)
+    {
+        cluster = file->current_cluster;
+        i = file->current_index;
+    }
+
+    for ( ; i < index; i++)
+    {
+        if (!fat_lookup (cluster, &cluster))
+            return false;
+
+        if (cluster == EXFAT_END_OF_CHAIN)
+        {
+            error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+            return false;
+        }
+    }
+
+    file->current_cluster = cluster;
+    file->current_index = index;
+    return true;
+}
+
+// the sector holding the seek position, and the offset within it
+static inline uint32_t seek_sector (const exfat_file *file)
+{
+    const uint32_t in_cluster = file->seek_offset & (((uint32_t)1 << exfat_cluster_shift) - 1);
+    return cluster_to_sector (file->current_cluster) + (in_cluster >> 9);
+}
+
+bool sd_exfat_read_file (uint8_t file_id,
+                         uint32_t length,
+                         uint8_t *buffer)
+{
+    exfat_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+
+    if (file->seek_offset + length > file->size || file->seek_offset + length < length)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    while (length > 0)
+    {
+        if (!locate_seek_cluster (file))
+            return false;
+
+        const uint16_t offset = (uint16_t)(file->seek_offset & 511);
+        const uint16_t chunk = (length < (uint32_t)(512 - offset)) ? (uint16_t)length : (uint16_t)(512 - offset);
+
+        if (chunk == 512)
+        {  // a whole sector, straight into the buffer
+            if (!read_whole_block_uncached (seek_sector (file), buffer))
+                return false;
+        }
+        else if (!read_partial_block (seek_sector (file), offset, buffer, chunk))
+            return false;
+
+        buffer += chunk;
+        length -= chunk;
+        file->seek_offset += chunk;
+    }
+
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+bool sd_exfat_write_file (uint8_t file_id,
+                          uint32_t length,
+                          uint8_t *buffer)
+{
+    exfat_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+
+    if (file->access_type == READ_FILE)
+    {
+        error_code = ERROR_FAT32_FILE_READ_ONLY;
+        return false;
+    }
+
+    if (file->seek_offset + length < length)
+    {  // sizes are only 32 bits
+        error_code = ERROR_FAT32_FULL;
+        return false;
+    }
+
+    // allocate everything the write needs up front: for a contiguous file
+    // this is a bitmap update per cluster, and the FAT is never touched
+    const uint32_t end = file->seek_offset + length;
+    const uint32_t needed = clusters_for_bytes (end);
+
+    while (file->alloc.clusters < needed)
+    {
+        uint32_t added;
+        if (!append_cluster (&file->alloc, &added))
+            return false;
+    }
+
+    // the recorded length has to cover the allocation, even if the write
+    // doesn't get that far (the part past the valid length reads as zeros)
+    if (file->data_length < end)
+        file->data_length = end;
+
+    while (length > 0)
+    {
+        if (!locate_seek_cluster (file))
+            return false;
+
+        const uint16_t offset = (uint16_t)(file->seek_offset & 511);
+        const uint16_t chunk = (length < (uint32_t)(512 - offset)) ? (uint16_t)length : (uint16_t)(512 - offset);
+
+        // tag the data as the file's, for sd_exfat_sync_file
+        cache_owner = FILE_CACHE_OWNER (file_id);
+
+        bool result;
+        if (chunk == 512)
+            result = write_whole_block (seek_sector (file), buffer);
+        else
+            result = write_partial_block (seek_sector (file), offset, buffer, chunk);
+
+        cache_owner = CACHE_NO_OWNER;
+
+        if (!result)
+            return false;
+
+        buffer += chunk;
+        length -= chunk;
+        file->seek_offset += chunk;
+
+        if (file->seek_offset > file->size)
+            file->size = file->seek_offset;
+    }
+
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// shrink the file to new_size bytes, freeing the clusters beyond it
+bool sd_exfat_truncate (uint8_t file_id,
+                        uint32_t new_size)
+{
+    exfat_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+
+    if (file->access_type == READ_FILE)
+    {
+        error_code = ERROR_FAT32_FILE_READ_ONLY;
+        return false;
+    }
+
+    if (new_size > file->size)
+    {  // this only shrinks files
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    const uint32_t keep = clusters_for_bytes (new_size);
+
+    if (keep < file->alloc.clusters)
+    {
+        exfat_alloc tail;
+        tail.clusters = file->alloc.clusters - keep;
+        tail.last_cluster = 0;
+        tail.flags = file->alloc.flags;
+
+        if (file->alloc.flags & EXFAT_FLAG_NO_FAT_CHAIN)
+        {  // the tail is just the clusters after the ones kept
+            tail.first_cluster = file->alloc.first_cluster + keep;
+            file->alloc.last_cluster = file->alloc.first_cluster + keep - 1;
+        }
+        else if (keep == 0)
+        {
+            tail.first_cluster = file->alloc.first_cluster;
+        }
+        else
+        {  // find the last cluster kept and end the chain there
+            uint32_t last_kept = file->alloc.first_cluster;
+            for (uint32_t i = 1; i < keep; i++)
+            {
+                if (!fat_lookup (last_kept, &last_kept))
+                    return false;
+
+                if (last_kept == EXFAT_END_OF_CHAIN)
+                {
+                    error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+                    return false;
+                }
+            }
+
+            if (!fat_lookup (last_kept, &tail.first_cluster))
+                return false;
+
+            if (!fat_set (last_kept, EXFAT_END_OF_CHAIN))
+                return false;
+
+            file->alloc.last_cluster = last_kept;
+        }
+
+        if (tail.first_cluster != EXFAT_END_OF_CHAIN && !free_alloc (&tail))
+            return false;
+
+        file->alloc.clusters = keep;
+        if (keep == 0)
+        {
+            file->alloc.first_cluster = 0;
+            file->alloc.last_cluster = 0;
+        }
+
+        if (file->current_index >= keep)
+            file->current_cluster = 0;
+    }
+
+    file->size = new_size;
+    file->data_length = new_size;
+
+    if (file->seek_offset > new_size)
+        file->seek_offset = new_size;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+#endif
@@ -0,0 +1,309 @@
+/*******************************************************************************
+* sd_exfat.h
+* version: 1.0
+* description: Header file for the exFAT filesystem code, used for SDXC cards
+*              (64GB and up), which come formatted as exFAT instead of FAT32.
+*              User functions are at the bottom, and behave like their
+*              sd_fat32 counterparts.
+*
+*              Compiled in only if EXFAT is defined.
+*******************************************************************************/
+
+#ifndef SD_EXFAT_H
+#define SD_EXFAT_H
+
+// the error codes, open_option and FILE_END_POS are shared with the FAT32 code
+#include "sd_fat32.h"
+
+#ifdef EXFAT
+
+// Limitations:
+//   - names are ASCII only, and at most EXFAT_NAME_LENGTH characters long
+//     (a single name entry); entries with longer or non-ASCII names are
+//     listed with those characters replaced by '?', and can't be opened
+//   - files larger than 4GB can't be opened (sizes are 32 bits, like FAT32)
+//   - timestamps are left at a fixed date
+#define EXFAT_NAME_LENGTH 15
+
+// how deep the directory stack can go: exFAT directories have no ".." entry,
+// so the path back up to the root is kept in RAM
+#if defined(ATMEGA168)
+#define EXFAT_MAX_DEPTH 4
+#elif (defined(ATMEGA328) || defined(M2))
+#define EXFAT_MAX_DEPTH 8
+#elif (defined(M4) || defined(HOST))
+#define EXFAT_MAX_DEPTH 16
+#endif
+
+#define EXFAT_PARTITION_TYPE (0x07)  // shared with NTFS, check the boot sector
+
+// directory entry types
+#define EXFAT_ENTRY_END       0x00  // no entries in use from here to the end of the directory
+#define EXFAT_ENTRY_IN_USE    0x80  // bit set in the type of every entry that is in use
+#define EXFAT_ENTRY_BITMAP    0x81
+#define EXFAT_ENTRY_UPCASE    0x82
+#define EXFAT_ENTRY_LABEL     0x83
+#define EXFAT_ENTRY_FILE      0x85
+#define EXFAT_ENTRY_STREAM    0xc0
+#define EXFAT_ENTRY_NAME      0xc1
+#define EXFAT_ENTRY_BENIGN    0x20  // bit set in the types that can be skipped if unknown
+
+#define EXFAT_ATTR_DIRECTORY  0x10
+#define EXFAT_ATTR_ARCHIVE    0x20
+
+// stream extension entry flags
+#define EXFAT_FLAG_ALLOCATION_POSSIBLE 0x01
+#define EXFAT_FLAG_NO_FAT_CHAIN        0x02  // clusters are contiguous, the FAT isn't used
+
+// volume flags
+#define EXFAT_VOLUME_DIRTY    0x0002
+
+#define EXFAT_END_OF_CHAIN    ((uint32_t)0xffffffff)
+
+// clusters in a chained (not contiguous) allocation aren't counted
+#define EXFAT_CHAINED         ((uint32_t)0xffffffff)
+
+#pragma pack(1)
+
+typedef struct exfat_boot_sector
+{
+    uint8_t  jump_boot[3];
+    char     file_system_name[8];       // must be "EXFAT   "
+    uint8_t  must_be_zero[53];
+    uint64_t partition_offset;
+    uint64_t volume_length;
+    uint32_t fat_offset;                // in sectors, from the start of the volume
+    uint32_t fat_length;                // in sectors
+    uint32_t cluster_heap_offset;       // in sectors, from the start of the volume
+    uint32_t cluster_count;
+    uint32_t root_first_cluster;
+    uint32_t volume_serial_number;
+    uint16_t file_system_revision;
+    uint16_t volume_flags;              // not covered by the boot checksum
+    uint8_t  bytes_per_sector_shift;    // must be 9 (512-byte sectors)
+    uint8_t  sectors_per_cluster_shift;
+    uint8_t  number_of_fats;            // 1, or 2 for TexFAT (not supported)
+    uint8_t  drive_select;
+    uint8_t  percent_in_use;            // not covered by the boot checksum, 0xff if unknown
+    uint8_t  reserved[7];
+    uint8_t  boot_code[390];
+    uint16_t signature;                 // must be 0xaa55
+} exfat_boot_sector;
+#define EXFAT_VOLUME_FLAGS_OFFSET   106
+#define EXFAT_PERCENT_IN_USE_OFFSET 112
+
+typedef struct exfat_file_entry  // EXFAT_ENTRY_FILE, first entry of a set
+{
+    uint8_t  type;
+    uint8_t  secondary_count;    // entries in the set after this one
+    uint16_t set_checksum;
+    uint16_t attributes;
+    uint16_t reserved1;
+    uint32_t create_timestamp;
+    uint32_t modify_timestamp;
+    uint32_t access_timestamp;
+    uint8_t  create_10ms;
+    uint8_t  modify_10ms;
+    uint8_t  create_utc_offset;
+    uint8_t  modify_utc_offset;
+    uint8_t  access_utc_offset;
+    uint8_t  reserved2[7];
+} exfat_file_entry;
+
+typedef struct exfat_stream_entry  // EXFAT_ENTRY_STREAM, always second in a set
+{
+    uint8_t  type;
+    uint8_t  flags;              // EXFAT_FLAG_*
+    uint8_t  reserved1;
+    uint8_t  name_length;        // in characters
+    uint16_t name_hash;          // of the up-cased name
+    uint16_t reserved2;
+    uint64_t valid_data_length;  // bytes that have actually been written
+    uint32_t reserved3;
+    uint32_t first_cluster;
+    uint64_t data_length;        // bytes allocated (the clusters used cover this)
+} exfat_stream_entry;
+
+typedef struct exfat_name_entry  // EXFAT_ENTRY_NAME, the rest of the set
+{
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t name[EXFAT_NAME_LENGTH];  // UTF-16
+} exfat_name_entry;
+
+typedef struct exfat_alloc_entry  // EXFAT_ENTRY_BITMAP and EXFAT_ENTRY_UPCASE
+{
+    uint8_t  type;
+    uint8_t  flags;
+    uint8_t  reserved1[2];
+    uint32_t table_checksum;     // up-case table only
+    uint8_t  reserved2[12];
+    uint32_t first_cluster;
+    uint64_t data_length;
+} exfat_alloc_entry;
+
+// a location in a directory
+typedef struct exfat_dir_pos
+{
+    uint32_t cluster;    // cluster containing sector
+    uint32_t sector;
+    uint16_t offset;     // of the entry within sector
+    uint32_t remaining;  // clusters after this one in a contiguous directory,
+                         // or EXFAT_CHAINED
+} exfat_dir_pos;
+
+// the clusters belonging to a file or directory
+typedef struct exfat_alloc
+{
+    uint32_t first_cluster;  // 0 if nothing is allocated
+    uint32_t last_cluster;   // 0 if not known yet (chained allocations are
+                             // only walked when something is added)
+    uint32_t clusters;
+    uint8_t  flags;          // stream entry flags
+} exfat_alloc;
+
+// a directory on the current path
+typedef struct exfat_dir
+{
+    exfat_dir_pos entry;  // its entry set in the parent directory (unused for the root)
+    exfat_alloc   alloc;
+} exfat_dir;
+
+// what an entry set says about a file or directory
+typedef struct exfat_object
+{
+    exfat_dir_pos entry;      // the set's file entry
+    char     name[EXFAT_NAME_LENGTH + 1];
+    uint8_t  name_length;     // the real length, may be longer than name
+    uint16_t name_hash;
+    uint16_t attributes;
+    uint8_t  flags;           // stream entry flags
+    uint32_t first_cluster;
+    uint32_t valid_length;
+    uint32_t data_length;
+    bool     too_big;         // one of the lengths doesn't fit in 32 bits
+} exfat_object;
+
+typedef struct exfat_file
+{
+    bool open;
+    open_option access_type;
+
+    exfat_dir_pos entry;       // where the file's entry set is stored
+    exfat_alloc   alloc;
+
+    uint32_t data_length;      // bytes covered by the allocation, as recorded
+    uint32_t size;             // valid data length
+
+    uint32_t seek_offset;
+    uint32_t current_cluster;  // cluster holding the seek position, or 0
+    uint32_t current_index;    // which of the file's clusters current_cluster is
+} exfat_file;
+
+#pragma pack()
+
+extern bool exfat_initialized;
+extern exfat_file exfat_files[MAX_FILES];
+
+
+
+
+
+
+//==============================================================================
+//=============================== USER FUNCTIONS ===============================
+//==============================================================================
+// These work like the sd_fat32 functions of the same names, and use the same
+// error codes.  Names are up to EXFAT_NAME_LENGTH characters long, and are
+// matched without regard to case.
+
+
+//-----------------------------------------------
+// Startup and shutdown:
+
+// mount the filesystem (on the first exFAT partition, or a card with no
+// partition table at all)
+bool sd_exfat_init (void);
+
+// flush any pending writes and unmount the filesystem
+bool sd_exfat_shutdown (void);
+
+
+//-----------------------------------------------
+// Free space:
+
+// exFAT has no stored free cluster count: the allocation bitmap is counted on
+// the first call (32 times fewer sectors than a FAT32 count), and the count
+// is kept up to date after that
+bool sd_exfat_free_space (uint32_t *free_kb);
+
+
+//-----------------------------------------------
+// File and directory information:
+
+bool sd_exfat_get_size (const char *name,
+                        uint32_t *size);
+
+bool sd_exfat_object_exists (const char *name,
+                             bool *is_directory);
+
+// returns false when the end of the directory has been reached
+bool sd_exfat_get_dir_entry_first (char name[EXFAT_NAME_LENGTH + 1]);
+bool sd_exfat_get_dir_entry_next  (char name[EXFAT_NAME_LENGTH + 1]);
+
+// with each object's size (0xffffffff if it doesn't fit in 32 bits), first
+// cluster and whether it's a directory
+bool sd_exfat_list_dir_first (char name[EXFAT_NAME_LENGTH + 1],
+                              listed_object *object);
+bool sd_exfat_list_dir_next  (char name[EXFAT_NAME_LENGTH + 1],
+                              listed_object *object);
+
+
+//-----------------------------------------------
+// Directory traversal and modification:
+
+bool sd_exfat_push (const char *name);
+bool sd_exfat_pop (void);
+
+// new directories are a single contiguous cluster
+bool sd_exfat_mkdir (const char *name);
+bool sd_exfat_rmdir (const char *name);
+bool sd_exfat_delete (const char *name);
+
+
+//-----------------------------------------------
+// File access and modification:
+
+// files are created contiguous (NoFatChain): as long as the clusters after a
+// file are free when it grows, it is extended without touching the FAT, and
+// seeking is plain arithmetic.  If another file gets in the way, the file is
+// switched over to an ordinary FAT chain.
+bool sd_exfat_open_file (const char *name,
+                         const open_option action,
+                         uint8_t *file_id);
+
+bool sd_exfat_close_file (uint8_t file_id);
+
+bool sd_exfat_sync_file (uint8_t file_id);
+bool sd_exfat_sync_all (void);
+
+bool sd_exfat_seek (uint8_t file_id,
+                    uint32_t offset);
+
+bool sd_exfat_get_seek_pos (uint8_t file_id,
+                            uint32_t *offset);
+
+bool sd_exfat_read_file (uint8_t file_id,
+                         uint32_t length,
+                         uint8_t *buffer);
+
+bool sd_exfat_write_file (uint8_t file_id,
+                          uint32_t length,
+                          uint8_t *buffer);
+
+bool sd_exfat_truncate (uint8_t file_id,
+                        uint32_t new_size);
+
+#endif
+
+#endif
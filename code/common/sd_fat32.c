@@ -35,10 +35,30 @@ uint32_t fat32_cluster_start_sector;
 uint32_t fat32_root_first_cluster;
 
 uint32_t fat32_fs_info_sector;
+uint32_t fat32_fs_info_damaged_sector;  // FS info sector with bad signatures, rewritten by a free count
 uint32_t fat32_starting_free_cluster_count;
 uint32_t fat32_free_cluster_count;
 
+// a count of the free clusters in progress (only when the FS info count is unknown)
+uint32_t fat32_free_scan_cluster = 0;  // first cluster not counted yet, 0 if no count was started
+uint32_t fat32_free_scan_count;
+
 uint32_t current_dir_cluster;
+dir_cursor listing_cursor;  // used by sd_fat32_get_dir_entry_first/next
+
+fat_mirror_policy fat32_mirror_policy = MIRROR_IMMEDIATE;
+uint32_t fat32_unmirrored_sectors[FAT_MIRROR_SLOTS];  // first-FAT sectors with stale copies
+uint8_t  fat32_unmirrored_count = 0;
+
+// where to start looking for a free entry when adding to a directory
+typedef struct dir_free_hint
+{
+    uint32_t   dir_cluster;  // 0 if unused
+    dir_cursor slot;
+} dir_free_hint;
+
+dir_free_hint dir_free_hints[DIR_HINT_SLOTS];
+uint8_t dir_free_hint_next = 0;  // the hint to replace next
 
 opened_file files[MAX_FILES];
 
@@ -118,9 +138,148 @@ static inline uint32_t fat_cluster_sector_offset (const uint32_t cluster_num)
     return (cluster_num % (uint32_t)128) * (uint32_t)4;
 }
 
+// get the number one past the last valid cluster on the filesystem
+static inline uint32_t fat32_final_cluster (void)
+{
+    // data clusters begin at cluster 2 (normally the root directory's cluster)
+    const uint32_t data_sectors = fat32_number_of_sectors -
+                                  (fat32_cluster_start_sector - fat32_partition_start_sector);
+    uint32_t final_cluster = data_sectors / fat32_sectors_per_cluster + 2;
+    
+    // the FAT might not be big enough to describe every cluster
+    if (final_cluster > fat32_sectors_per_fat * 128)
+        final_cluster = fat32_sectors_per_fat * 128;
+    
+    return final_cluster;
+}
+
+// the cluster helpers above, for the other FAT32 modules
+bool sd_fat32_end_of_chain (const uint32_t cluster_num)
+{
+    return end_of_chain (cluster_num);
+}
+
+uint32_t sd_fat32_cluster_sector (const uint32_t cluster_num)
+{
+    return cluster_to_sector (cluster_num);
+}
+
+uint32_t sd_fat32_fat_sector (const uint32_t cluster_num)
+{
+    return fat_cluster_sector (cluster_num);
+}
+
+uint32_t sd_fat32_final_cluster (void)
+{
+    return fat32_final_cluster();
+}
+
+// copy a modified FAT sector (which must be in the cache) into the other FATs
+static bool copy_fat_sector (const cached_sector *fat_sector)
+{
+    uint32_t target_sector = fat_sector->block_number;
+    
+    for (uint8_t fat_index = 1; fat_index < fat32_number_of_fats; fat_index++)
+    {
+        target_sector += fat32_sectors_per_fat;
+        
+        // write_whole_block doesn't touch the cache unless the target is
+        // already in it, so fat_sector stays valid through this loop
+        if (!write_whole_block (target_sector, fat_sector->data))
+            return false;
+    }
+    
+    return true;
+}
+
+// copy the most recently deferred FAT sector (there must be one) to the
+// other FATs
+static bool mirror_last_deferred (void)
+{
+    const uint32_t fat_sector = fat32_unmirrored_sectors[fat32_unmirrored_count - 1];
+    
+    #ifdef FAT32_DEBUG
+    debug ("Mirroring FAT sector ");
+    debugulong (fat_sector);
+    debug ("\n");
+    #endif
+    
+    cached_sector *sector = load_block (fat_sector);
+    if (sector == END_OF_CHAIN)
+        return false;
+    
+    if (!copy_fat_sector (sector))
+        return false;
+    
+    // only forget about the sector once it has been copied, so a failed
+    // mirror can be retried later
+    fat32_unmirrored_count--;
+    return true;
+}
+
+// bring the other FATs up to date with any FAT sectors that
+// were modified while mirroring was deferred
+bool sd_fat32_mirror_fats (void)
+{
+    while (fat32_unmirrored_count > 0)
+    {
+        if (!mirror_last_deferred())
+            return false;
+    }
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+// mirror at most one of the FAT sectors that are waiting to be mirrored
+bool sd_fat32_mirror_one_fat (bool *mirrored)
+{
+    *mirrored = (fat32_unmirrored_count > 0);
+    
+    if (*mirrored && !mirror_last_deferred())
+        return false;
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+// remember that a first-FAT sector has been modified without being mirrored
+//
+// this can mirror other sectors (if the set is full), so any cached_sector
+// pointers held by the caller are invalid afterwards
+static bool defer_fat_mirror (const uint32_t fat_sector)
+{
+    for (uint8_t i = 0; i < fat32_unmirrored_count; i++)
+    {
+        if (fat32_unmirrored_sectors[i] == fat_sector)
+            return true;  // already pending
+    }
+    
+    if (fat32_unmirrored_count >= FAT_MIRROR_SLOTS)
+    {  // out of room: catch up on everything pending
+        if (!sd_fat32_mirror_fats())
+            return false;
+    }
+    
+    fat32_unmirrored_sectors[fat32_unmirrored_count++] = fat_sector;
+    return true;
+}
+
+// propagate a modified FAT sector (which must be in the cache) to the other
+// FATs, either immediately or later, depending on the mirroring policy
+//
+// with deferred mirroring, this might evict fat_sector from the cache
+static bool mirror_fat_sector (const cached_sector *fat_sector)
+{
+    if (fat32_mirror_policy == MIRROR_DEFERRED)
+        return defer_fat_mirror (fat_sector->block_number);
+    
+    return copy_fat_sector (fat_sector);
+}
+
 // look in the FAT for the cluster following this one
-static bool sd_fat32_cluster_lookup (const uint32_t from_cluster,
-                                     uint32_t *to_cluster)
+bool sd_fat32_cluster_lookup (const uint32_t from_cluster,
+                              uint32_t *to_cluster)
 {
     // each FAT sector contains 128 4-byte cluster entries
     const uint32_t fat_entry_sector = fat_cluster_sector (from_cluster);
@@ -159,67 +318,6 @@ static bool sd_fat32_cluster_lookup (const uint32_t from_cluster,
 }
 
 
-// look in the FAT for the next unused cluster
-static bool sd_fat32_next_empty_cluster (const uint32_t from_cluster,
-                                         uint32_t *empty_cluster)
-{
-    const uint32_t final_cluster =
-        (fat32_number_of_sectors - fat32_cluster_start_sector) /
-        fat32_sectors_per_cluster;
-    
-    *empty_cluster = from_cluster;
-    uint32_t cluster_value = FAT32_END_OF_CHAIN;  // dummy value
-    
-    uint32_t fat_entry_sector = fat32_start_sector + (from_cluster >> 7);
-    uint32_t fat_entry_offset = (from_cluster % 128) * 4;
-    
-    while (cluster_value != 0)
-    {
-        (*empty_cluster)++;
-        
-        if (*empty_cluster >= final_cluster)
-        {
-            *empty_cluster = 3;  // first cluster of root dir is 2
-            fat_entry_sector = fat32_start_sector;
-            fat_entry_offset = 12;
-        }
-        
-        if (*empty_cluster == from_cluster)
-        {  // we wrapped around all the way to where we began and didn't find anything
-            error_code = ERROR_FAT32_FULL;
-            return false;
-        }
-        
-        fat_entry_offset += 4;
-        if (fat_entry_offset >= 512)
-        {
-            fat_entry_offset = 0;
-            fat_entry_sector++;
-        }
-        
-        if (!read_partial_block (fat_entry_sector,
-                                 fat_entry_offset,
-                                 (uint8_t*)&cluster_value,
-                                 4))
-        {
-            return false;
-        }
-    }
-    
-    #ifdef FAT32_DEBUG
-    debug ("Next empty cluster: ");
-    debugulong (*empty_cluster);
-    debug ("\n");
-    #endif
-    
-    #ifdef FREE_RAM
-    free_ram();
-    #endif
-    
-    return true;
-}
-
-
 // set an entry in the FAT
 bool sd_fat32_set_cluster (const uint32_t from_cluster,
                            const uint32_t to_cluster)
@@ -243,6 +341,19 @@ bool sd_fat32_set_cluster (const uint32_t from_cluster,
     debug ("\n");
     #endif
     
+    if (fat32_mirror_policy == MIRROR_DEFERRED)
+    {  // only touch the first FAT now, and copy the sector over later
+        if (!write_partial_block (target_sector,
+                                  sector_offset,
+                                  (uint8_t*)&to_cluster,
+                                  4))
+        {
+            return false;
+        }
+        
+        return defer_fat_mirror (target_sector);
+    }
+    
     // need to set the entry in all FATs
     for (uint8_t fat_index = 0; fat_index < fat32_number_of_fats; fat_index++)
     {
@@ -262,16 +373,173 @@ bool sd_fat32_set_cluster (const uint32_t from_cluster,
 }
 
 
-// add a cluster to a cluster chain
+// claim count free clusters and link them into a chain
+// the new chain is attached to last_cluster, or started from scratch if
+// last_cluster is 0; *first_added is set to the first cluster claimed
+//
+// the search for free clusters begins just after search_from
+//
+// the FAT is scanned one sector at a time: every free entry found in a sector
+// is claimed and linked while the sector sits in the cache, so each FAT
+// sector is read once and written once per FAT copy, no matter how many
+// clusters it supplies
+//
+// if the card fills up partway through, the clusters that were claimed are
+// given back (leaving last_cluster the end of its chain again), *first_added
+// is left as FAT32_END_OF_CHAIN and ERROR_FAT32_FULL is returned
+bool sd_fat32_allocate_clusters (const uint32_t last_cluster,
+                                 const uint32_t search_from,
+                                 uint32_t count,
+                                 uint32_t *first_added)
+{
+    const uint32_t final_cluster = fat32_final_cluster();
+    
+    uint32_t link_from = last_cluster;  // cluster whose entry must point to the next claimed one
+    uint32_t cluster = search_from;      // search position
+    uint32_t searched = 0;
+    
+    #ifdef FAT32_DEBUG
+    debug ("Allocating ");
+    debugulong (count);
+    debug (" clusters after ");
+    debugulong (last_cluster);
+    debug ("\n");
+    #endif
+    
+    *first_added = FAT32_END_OF_CHAIN;
+    
+    if (count == 0)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    if (++cluster >= final_cluster || cluster < 2)
+        cluster = 2;
+    
+    while (count > 0)
+    {
+        if (searched >= final_cluster)
+        {  // we've looked at every entry in the FAT and came up short
+            if (!end_of_chain (*first_added))
+            {
+                if (last_cluster != 0 &&
+                    !sd_fat32_set_cluster (last_cluster, FAT32_END_OF_CHAIN))
+                    return false;
+                
+                if (!sd_fat32_free_chain (*first_added))
+                    return false;
+                
+                *first_added = FAT32_END_OF_CHAIN;
+            }
+            
+            error_code = ERROR_FAT32_FULL;
+            return false;
+        }
+        
+        const uint32_t fat_sector = fat_cluster_sector (cluster);
+        
+        cached_sector *sector = load_block (fat_sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+        
+        uint8_t *entries = sector->data;
+        
+        // a link from a cluster in an earlier FAT sector has to be written
+        // after we're done with this one (touching another sector now could
+        // evict this one from the cache)
+        uint32_t cross_link_from = 0;
+        uint32_t cross_link_to = 0;
+        bool modified = false;
+        
+        do
+        {
+            if (fat_entry (entries, cluster % 128) == 0)
+            {  // free cluster: claim it as the new end of the chain
+                set_fat_entry (entries, cluster % 128, FAT32_END_OF_CHAIN);
+                modified = true;
+                
+                if (*first_added == FAT32_END_OF_CHAIN)
+                    *first_added = cluster;
+                
+                if (link_from != 0)
+                {
+                    if (fat_cluster_sector (link_from) == fat_sector)
+                    {
+                        set_fat_entry (entries, link_from % 128, cluster);
+                    }
+                    else
+                    {
+                        cross_link_from = link_from;
+                        cross_link_to = cluster;
+                    }
+                }
+                
+                link_from = cluster;
+                
+                if (fat32_free_cluster_count != (uint32_t)0xffffffff)
+                {  // if the FS supports free cluster count
+                    fat32_free_cluster_count--;
+                }
+                else if (cluster < fat32_free_scan_cluster)
+                {  // already counted by sd_fat32_count_free_clusters
+                    fat32_free_scan_count--;
+                }
+                
+                count--;
+            }
+            
+            cluster++;
+            searched++;
+        } while (count > 0 &&
+                 searched < final_cluster &&
+                 cluster < final_cluster &&
+                 cluster % 128 != 0);
+        
+        if (modified)
+        {
+            sector->modified = true;
+            
+            if (!mirror_fat_sector (sector))
+                return false;
+        }
+        
+        if (cross_link_from != 0)
+        {
+            if (!sd_fat32_set_cluster (cross_link_from, cross_link_to))
+                return false;
+        }
+        
+        if (cluster >= final_cluster)
+            cluster = 2;  // wrap around to the first data cluster
+    }
+    
+    #ifdef FAT32_DEBUG
+    debug ("First allocated cluster: ");
+    debugulong (*first_added);
+    debug ("\n");
+    #endif
+    
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// add count clusters to a cluster chain
 // (where cluster_in_chain can be any cluster in the cluster chain)
-bool sd_fat32_append_cluster (const uint32_t cluster_in_chain,
-                              uint32_t *added_cluster)
+bool sd_fat32_append_clusters (const uint32_t cluster_in_chain,
+                               const uint32_t count,
+                               uint32_t *first_added)
 {
     uint32_t final_cluster = cluster_in_chain;
     uint32_t next_cluster;
     
     #ifdef FAT32_DEBUG
-    debug ("Append cluster to chain that includes ");
+    debug ("Append clusters to chain that includes ");
     debugulong (cluster_in_chain);
     debug ("\n");
     #endif
@@ -291,26 +559,67 @@ bool sd_fat32_append_cluster (const uint32_t cluster_in_chain,
     }
     
     // final_cluster is now the number of the last cluster in the object's chain
+    return sd_fat32_allocate_clusters (final_cluster, final_cluster, count, first_added);
+}
+
+
+// add a cluster to a cluster chain
+// (where cluster_in_chain can be any cluster in the cluster chain)
+bool sd_fat32_append_cluster (const uint32_t cluster_in_chain,
+                              uint32_t *added_cluster)
+{
+    return sd_fat32_append_clusters (cluster_in_chain, 1, added_cluster);
+}
+
+
+// release every cluster in the chain starting at first_cluster
+//
+// like sd_fat32_allocate_clusters, this works on one FAT sector at a time,
+// following the chain for as long as it stays within the cached sector
+bool sd_fat32_free_chain (const uint32_t first_cluster)
+{
+    uint32_t cluster = first_cluster;
     
-    // find the next empty cluster
-    if (!sd_fat32_next_empty_cluster (final_cluster, added_cluster))
-        return false;
-    
-    // set that cluster as the new end of the chain
-    if (!sd_fat32_set_cluster (*added_cluster, FAT32_END_OF_CHAIN))
-        return false;
+    while (!end_of_chain (cluster))
+    {
+        const uint32_t fat_sector = fat_cluster_sector (cluster);
+        
+        cached_sector *sector = load_block (fat_sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+        
+        uint8_t *entries = sector->data;
+        
+        do
+        {
+            const uint32_t next_cluster = fat_entry (entries, cluster % 128);
+            set_fat_entry (entries, cluster % 128, 0);
+            
+            if (fat32_free_cluster_count != (uint32_t)0xffffffff)
+            {  // if the FS supports free cluster count
+                fat32_free_cluster_count++;
+            }
+            else if (cluster < fat32_free_scan_cluster)
+            {  // already counted by sd_fat32_count_free_clusters
+                fat32_free_scan_count++;
+            }
+            
+            cluster = next_cluster;
+        } while (!end_of_chain (cluster) &&
+                 fat_cluster_sector (cluster) == fat_sector);
+        
+        sector->modified = true;
+        
+        if (!mirror_fat_sector (sector))
+            return false;
+    }
     
     #ifdef FREE_RAM
     free_ram();
     #endif
     
-    if (fat32_free_cluster_count != (uint32_t)0xffffffff)
-    {  // if the FS supports free cluster count
-        fat32_free_cluster_count--;
-    }
-    
-    // make the no-longer-final cluster to point to the no-longer-empty cluster
-    return sd_fat32_set_cluster (final_cluster, *added_cluster);
+    error_code = ERROR_NONE;
+    return true;
 }
 
 
@@ -341,49 +650,47 @@ bool sd_fat32_fill_sector (const uint32_t sector_num,
 // name, then call this with the updated object to remove the cluster chain
 bool sd_fat32_free_clusters (dir_entry_condensed *object)
 {
-    uint32_t current_cluster = object->first_cluster;
-    uint32_t next_cluster;
-    
-    if (end_of_chain (current_cluster))
-    {  // if the first cluster was invalid, the file was empty
-        return true;
-    }
+    #ifdef FAT32_DEFRAG
+    if (!defrag_abandon (object->first_cluster))
+        return false;
+    #endif
     
-    while (1)
+    // if the first cluster is invalid, the file was empty and this does nothing
+    return sd_fat32_free_chain (object->first_cluster);
+}
+
+
+bool fs_filenames_match (const char a[11], const char b[11])
+{
+    for (uint8_t i = 0; i < 11; i++)
     {
-        if (!sd_fat32_cluster_lookup (current_cluster, &next_cluster))
-            return false;
-        
-        if (!sd_fat32_set_cluster (current_cluster, 0))
+        if (a[i] != b[i])
             return false;
-        
-        if (fat32_free_cluster_count != (uint32_t)0xffffffff)
-        {  // if the FS supports free cluster count
-            fat32_free_cluster_count++;
-        }
-        
-        if (end_of_chain (next_cluster))
-            return true;
-        
-        current_cluster = next_cluster;
     }
-    
-    #ifdef FREE_RAM
-    free_ram();
-    #endif
-    
     return true;
 }
 
 
-bool fs_filenames_match (const char a[11], const char b[11])
+// copy the relevant parts of a directory entry into a dir_entry_condensed
+// (everything except the entry's location)
+void condense_entry (const dir_entry *entry,
+                     dir_entry_condensed *condensed)
 {
     for (uint8_t i = 0; i < 11; i++)
-    {
-        if (a[i] != b[i])
-            return false;
-    }
-    return true;
+        condensed->name[i] = entry->name[i];
+    
+    condensed->flags = 0;
+    if (entry->name[0] == (char)0xe5)  // unused entry
+        condensed->flags |= ENTRY_IS_EMPTY;
+    if (entry->attrib & 0x01)  // hidden entry (typically part of a long file name)
+        condensed->flags |= ENTRY_IS_HIDDEN;
+    if (entry->attrib & 0b00010000)  // entry is a directory
+        condensed->flags |= ENTRY_IS_DIR;
+    
+    condensed->first_cluster = (uint32_t)entry->first_cluster_high;
+    condensed->first_cluster <<= 16;
+    condensed->first_cluster |= entry->first_cluster_low;
+    condensed->file_size = entry->file_size;
 }
 
 
@@ -533,6 +840,9 @@ bool extract_fs_info (void)
     fat32_sectors_per_fat = volume->fat32_sectors_per_fat;
     fat32_number_of_fats = volume->number_of_fats;
     
+    fat32_fs_info_damaged_sector = 0;
+    fat32_free_scan_cluster = 0;
+    
     if (volume->fs_info_sector == (uint16_t)0 || volume->fs_info_sector == (uint16_t)0xffff)
     {  // free cluster count is unsupported
         #ifdef FAT32_DEBUG
@@ -549,6 +859,14 @@ bool extract_fs_info (void)
     {
         fat32_fs_info_sector = fat32_partition_start_sector + (uint32_t)volume->fs_info_sector;
         
+        // (decided now, as reading the FS info sector may evict the volume
+        // ID sector that volume points into: a free cluster count can
+        // rewrite a damaged FS info sector as long as it lies in the
+        // reserved sectors where one belongs)
+        const bool fs_info_rewritable =
+            volume->fs_info_sector < volume->reserved_sectors &&
+            volume->fs_info_sector != volume->backup_boot_sector;
+        
         #ifdef FAT32_DEBUG
         debug ("FAT32 info sector: sector ");
         debugulong ((uint32_t)volume->fs_info_sector);
@@ -592,6 +910,11 @@ bool extract_fs_info (void)
             debughex (FAT32_END_SIGNATURE);
             #endif
             
+            if (fs_info_rewritable)
+            {
+                fat32_fs_info_damaged_sector = fat32_fs_info_sector;
+            }
+            
             fat32_fs_info_sector = 0;
             fat32_starting_free_cluster_count = (uint32_t)0xffffffff;
             fat32_free_cluster_count = (uint32_t)0xffffffff;
@@ -601,6 +924,13 @@ bool extract_fs_info (void)
             fat32_free_cluster_count = fs_info->free_cluster_count;
             fat32_starting_free_cluster_count = fat32_free_cluster_count;
             
+            if (fat32_free_cluster_count != (uint32_t)0xffffffff &&
+                fat32_free_cluster_count > fat32_final_cluster() - 2)
+            {  // more free clusters than there are clusters: don't trust it
+                fat32_starting_free_cluster_count = (uint32_t)0xffffffff;
+                fat32_free_cluster_count = (uint32_t)0xffffffff;
+            }
+            
             #ifdef FAT32_DEBUG
             debug ("Free clusters: ");
             debugulong (fat32_free_cluster_count);
@@ -669,6 +999,8 @@ bool sd_fat32_init (void)
         for (uint8_t i = 0; i < 11; i++)
             file->name_on_fs[i] = ' ';
         
+        file->entry_sector = 0;
+        file->entry_offset = 0;
         file->first_cluster = 0;
         file->seek_offset = 0;
         file->current_cluster = 0;
@@ -679,6 +1011,19 @@ bool sd_fat32_init (void)
     
     current_dir_cluster = fat32_root_first_cluster;
     
+    fat32_unmirrored_count = 0;
+    
+    for (uint8_t i = 0; i < DIR_HINT_SLOTS; i++)
+        dir_free_hints[i].dir_cluster = 0;
+    
+    #ifdef DIR_INDEX
+    dir_index_clear();
+    #endif
+    
+    #ifdef FAT32_DEFRAG
+    defrag_clear();
+    #endif
+    
     #ifdef FREE_RAM
     free_ram();
     #endif
@@ -691,6 +1036,12 @@ bool sd_fat32_init (void)
 // unmount the filesystem
 bool sd_fat32_shutdown (void)
 {
+    #ifdef FAT32_DEFRAG
+    // give back the clusters reserved by an unfinished defrag
+    if (!sd_fat32_defrag_cancel())
+        return false;
+    #endif
+    
     // close any opened files
     for (uint8_t i = 0; i < MAX_FILES; i++)
     {
@@ -733,6 +1084,10 @@ bool sd_fat32_shutdown (void)
     }
     #endif
     
+    // bring the backup FATs up to date
+    if (!sd_fat32_mirror_fats())
+        return false;
+    
     // write out all modified cached sectors
     if (!flush_cache())
         return false;
@@ -756,14 +1111,334 @@ bool sd_fat32_shutdown (void)
 
 
 
+// choose whether the backup FATs are updated immediately or in bulk later
+bool sd_fat32_set_mirror_policy (const fat_mirror_policy policy)
+{
+    fat32_mirror_policy = policy;
+    
+    if (policy == MIRROR_IMMEDIATE && fat32_initialized)
+    {  // catch up on anything that was deferred
+        return sd_fat32_mirror_fats();
+    }
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+
+// count the free (zero) entries in part of a FAT sector
+static uint16_t count_free_entries (const uint8_t *entries,
+                                    uint8_t first,
+                                    const uint8_t end)
+{
+    uint16_t free_entries = 0;
+    
+    while (first < end)
+    {
+        if ((first & 3) == 0 && end - first >= 4 &&
+            (fat_entry (entries, first)     | fat_entry (entries, first + 1) |
+             fat_entry (entries, first + 2) | fat_entry (entries, first + 3)) == 0)
+        {  // four free entries at once (free space tends to come in long runs)
+            free_entries += 4;
+            first += 4;
+        }
+        else
+        {
+            if (fat_entry (entries, first) == 0)
+                free_entries++;
+            first++;
+        }
+    }
+    
+    return free_entries;
+}
+
+// store a newly counted free cluster count in the FS info sector, rebuilding
+// the sector if its signatures were bad
+static bool repair_fs_info (void)
+{
+    if (fat32_fs_info_damaged_sector != 0)
+    {
+        cached_sector *sector = load_block (fat32_fs_info_damaged_sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+        
+        fs_info_block *fs_info = (fs_info_block*)sector->data;
+        
+        #ifdef FAT32_DEBUG
+        debug ("Rebuilding FS info sector ");
+        debugulong (fat32_fs_info_damaged_sector);
+        debug ("\n");
+        #endif
+        
+        for (uint16_t i = 0; i < 512; i++)
+            sector->data[i] = 0;
+        
+        fs_info->lead_signature = (uint32_t)0x41615252;
+        fs_info->structure_signature = (uint32_t)0x61417272;
+        fs_info->free_cluster_count = fat32_free_cluster_count;
+        fs_info->next_free_cluster = (uint32_t)0xffffffff;  // unknown
+        fs_info->boot_signature = FAT32_END_SIGNATURE;
+        sector->modified = true;
+        
+        fat32_fs_info_sector = fat32_fs_info_damaged_sector;
+        fat32_fs_info_damaged_sector = 0;
+    }
+    else if (fat32_fs_info_sector != 0)
+    {
+        if (!write_partial_block (fat32_fs_info_sector,
+                                  FAT32_FREE_CLUSTER_COUNT_OFFSET,
+                                  (uint8_t*)&fat32_free_cluster_count,
+                                  4))
+        {
+            return false;
+        }
+    }
+    
+    fat32_starting_free_cluster_count = fat32_free_cluster_count;
+    return true;
+}
+
+
+// count the free clusters a few FAT sectors at a time (when they aren't
+// already known)
+bool sd_fat32_count_free_clusters (const uint16_t max_sectors,
+                                   bool *done)
+{
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+    
+    *done = (fat32_free_cluster_count != (uint32_t)0xffffffff);
+    if (*done)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    const uint32_t final_cluster = fat32_final_cluster();
+    
+    if (fat32_free_scan_cluster == 0)
+    {  // starting a new count
+        fat32_free_scan_cluster = 2;
+        fat32_free_scan_count = 0;
+    }
+    
+    for (uint16_t i = 0; i < max_sectors && fat32_free_scan_cluster < final_cluster; i++)
+    {
+        cached_sector *sector = load_block (fat_cluster_sector (fat32_free_scan_cluster));
+        if (sector == END_OF_CHAIN)
+            return false;  // the count so far is kept, so this can be retried
+        
+        // up to the end of this sector, or the end of the FAT
+        uint32_t end = (fat32_free_scan_cluster | 127) + 1;
+        if (end > final_cluster)
+            end = final_cluster;
+        
+        fat32_free_scan_count += count_free_entries (sector->data,
+                                                     (uint8_t)(fat32_free_scan_cluster % 128),
+                                                     (uint8_t)(end - (fat32_free_scan_cluster & ~(uint32_t)127)));
+        fat32_free_scan_cluster = end;
+    }
+    
+    if (fat32_free_scan_cluster >= final_cluster)
+    {  // finished
+        #ifdef FAT32_DEBUG
+        debug ("Counted free clusters: ");
+        debugulong (fat32_free_scan_count);
+        debug ("\n");
+        #endif
+        
+        fat32_free_cluster_count = fat32_free_scan_count;
+        fat32_free_scan_cluster = 0;
+        *done = true;
+        
+        if (!repair_fs_info())
+            return false;
+    }
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// get the amount of free space, in kilobytes
+bool sd_fat32_free_space (uint32_t *free_kb)
+{
+    bool done = false;
+    
+    while (!done)
+    {
+        if (!sd_fat32_count_free_clusters (0xffff, &done))
+            return false;
+    }
+    
+    if (fat32_sectors_per_cluster == 1)
+        *free_kb = fat32_free_cluster_count / 2;
+    else
+        *free_kb = fat32_free_cluster_count * (fat32_sectors_per_cluster / 2);
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+
+
+static dir_free_hint *find_free_hint (const uint32_t dir_cluster)
+{
+    for (uint8_t i = 0; i < DIR_HINT_SLOTS; i++)
+    {
+        if (dir_free_hints[i].dir_cluster == dir_cluster)
+            return &dir_free_hints[i];
+    }
+    return 0;
+}
+
+// remember a position in a directory where a free entry can be found
+// (either at that position, or somewhere after it)
+static void set_free_hint (const uint32_t dir_cluster,
+                           const dir_cursor *slot)
+{
+    dir_free_hint *hint = find_free_hint (dir_cluster);
+    
+    if (hint == 0)
+    {  // take over the oldest hint
+        hint = &dir_free_hints[dir_free_hint_next];
+        dir_free_hint_next = (dir_free_hint_next + 1) % DIR_HINT_SLOTS;
+        hint->dir_cluster = dir_cluster;
+    }
+    
+    hint->slot = *slot;
+}
+
+// forget about a directory's free slot (it's being removed or recycled)
+static void drop_free_hint (const uint32_t dir_cluster)
+{
+    dir_free_hint *hint = find_free_hint (dir_cluster);
+    
+    if (hint != 0)
+        hint->dir_cluster = 0;
+}
+
+
+// position a cursor at the first entry of a directory
+void sd_fat32_dir_start (dir_cursor *cursor,
+                         const uint32_t dir_cluster)
+{
+    cursor->cluster = dir_cluster;
+    cursor->sector = cluster_to_sector (dir_cluster);
+    cursor->offset = 0;
+}
+
+
+// move a cursor to the start of the next sector in its directory
+// if the directory's cluster chain ends and extend is true, a zeroed cluster
+// is appended to it; otherwise, error_code is set to ERROR_FAT32_END_OF_DIR
+static bool next_dir_sector (dir_cursor *cursor,
+                             const bool extend)
+{
+    const uint8_t fillvalue[16] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                   0, 0, 0, 0, 0, 0, 0, 0};
+    
+    cursor->sector++;
+    cursor->offset = 0;
+    
+    // (the data area doesn't have to start on a multiple of the cluster
+    // size, so this is counted from the start of the cluster)
+    if (cursor->sector - cluster_to_sector (cursor->cluster) < fat32_sectors_per_cluster)
+        return true;  // still in the same cluster
+    
+    // we reached the end of the cluster
+    uint32_t new_cluster = 0;
+    
+    if (!sd_fat32_cluster_lookup (cursor->cluster, &new_cluster))
+    {  // hit an error trying to read from the FAT
+        return false;
+    }
+    
+    if (end_of_chain (new_cluster))
+    {  // this is where the cluster chain stops
+        if (!extend)
+        {  // treat this as an end-of-dir marker
+            cursor->sector = 0;
+            error_code = ERROR_FAT32_END_OF_DIR;
+            return false;
+        }
+        
+        // add a new cluster to the chain
+        #ifdef FAT32_DEBUG
+        debug ("appending new cluster\n");
+        #endif
+        
+        if (!sd_fat32_append_cluster (cursor->cluster, &new_cluster))
+            return false;
+        
+        #ifdef FAT32_DEBUG
+        debug ("New final cluster: ");
+        debugulong (new_cluster);
+        debug ("\n");
+        #endif
+        
+        // fill the new cluster with zeroes
+        for (uint32_t n = 0; n < fat32_sectors_per_cluster; n++)
+        {
+            if (!sd_fat32_fill_sector (cluster_to_sector (new_cluster) + n,
+                                       fillvalue,
+                                       16))
+                return false;
+        }
+    }
+    
+    cursor->cluster = new_cluster;
+    cursor->sector = cluster_to_sector (new_cluster);
+    
+    return true;
+}
+
+
+// write a new entry into a free slot of the current directory
+// slot is left pointing at the following entry, which is where the next
+// search for a free slot will start
+static bool place_entry (dir_cursor *slot,
+                         dir_entry_condensed *buffer,
+                         const dir_entry *entry_to_add)
+{
+    if (!write_partial_block (slot->sector,
+                              slot->offset,
+                              (const uint8_t*)entry_to_add,
+                              sizeof (dir_entry)) )
+    {
+        return false;
+    }
+    
+    buffer->entry_sector = slot->sector;
+    buffer->entry_offset = slot->offset;
+    
+    #ifdef DIR_INDEX
+    dir_index_add (current_dir_cluster, buffer);
+    #endif
+    
+    slot->offset += sizeof (dir_entry);
+    set_free_hint (current_dir_cluster, slot);
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
 // begin or continue reading directory entries, or add/remove/update an entry
 // return value:
 //   read:
 //     true: the buffer has been filled with an entry's info
-//     false: all entries have been read, or error
+//     false: all entries have been read (error_code is ERROR_NONE), or error
 //   add:
 //     true: the entry has been added, and buffer's entry_* variables have been updated
-//     false: error adding the entry
+//     false: error adding the entry (ERROR_FAT32_ALREADY_EXISTS if ADD_ENTRY
+//            found an entry with the same name)
 //   remove:
 //     true: the entry has been removed, and buffer has had its first_cluster
 //           and file_size variables updated
@@ -772,36 +1447,68 @@ bool sd_fat32_shutdown (void)
 //     true: the entry's first_cluster and file_size have been updated
 //     false: couldn't find the entry or error modifying entry
 //
-// when reading: if you change directories, be sure to call this with READ_DIR_START,
-// or it will keep reading from the old directory
-bool sd_fat32_traverse_directory (dir_entry_condensed *buffer,
+// READ_DIR_START and the add/remove/update actions start the cursor at the
+// beginning of the current directory; READ_DIR_NEXT continues from wherever
+// the cursor was left, so several directories can be read at the same time
+// as long as each has its own cursor
+//
+// ADD_ENTRY checks for a duplicate name and finds a free slot in the same
+// pass; ADD_NEW_ENTRY skips the name checks and starts from the directory's
+// free slot hint, if it has one
+//
+// entries are examined in place in the cache, one sector at a time
+bool sd_fat32_traverse_directory (dir_cursor *cursor,
+                                  dir_entry_condensed *buffer,
                                   traverse_option action)
 {
-    static uint32_t current_cluster = 0;
-    static uint32_t current_sector = 0;
-    static uint16_t sector_offset = 0;
-    
-    uint32_t new_cluster = 0;
-    const uint8_t fillvalue[16] = {0, 0, 0, 0, 0, 0, 0, 0,
-                                   0, 0, 0, 0, 0, 0, 0, 0};
-    
     if (action != READ_DIR_NEXT)
     {  // start at the beginning of the entry list
-        current_cluster = current_dir_cluster;
-        current_sector = cluster_to_sector (current_cluster);
-        sector_offset = 0;
+        sd_fat32_dir_start (cursor, current_dir_cluster);
+    }
+    
+    #ifdef DIR_INDEX
+    if (action == ADD_ENTRY)
+    {  // the index can find (or rule out) a duplicate without a scan
+        dir_entry_condensed existing;
+        
+        switch (dir_index_search (current_dir_cluster, buffer->name, &existing))
+        {
+            case DIR_INDEX_HIT:
+                error_code = ERROR_FAT32_ALREADY_EXISTS;
+                return false;
+            
+            case DIR_INDEX_MISS:
+                action = ADD_NEW_ENTRY;
+                break;
+            
+            case DIR_INDEX_NONE:
+            default:
+                break;
+        }
+    }
+    #endif
+    
+    if (action == ADD_NEW_ENTRY)
+    {  // no names to check, so skip ahead to where the last add left off
+        const dir_free_hint *hint = find_free_hint (current_dir_cluster);
+        
+        if (hint != 0)
+            *cursor = hint->slot;
     }
     
-    if (current_sector == 0)
+    if (cursor->sector == 0)
     {  // this should only happen if READ_DIR_NEXT is used when it shouldn't be
         error_code = ERROR_FAT32_END_OF_DIR;
         return false;
     }
     
+    const bool adding = (action == ADD_ENTRY || action == ADD_NEW_ENTRY);
+    
+    dir_cursor free_slot;  // first unused entry found while adding
+    free_slot.sector = 0;
+    
     dir_entry entry_to_add;
-    uint32_t entry_add_sector = (uint32_t)0xffffffff;
-    uint16_t entry_add_offset = 0xffff;
-    if (action == ADD_ENTRY)  // if we need to add an entry
+    if (adding)  // if we need to add an entry
     {  // convert the dir_entry_condensed into a regular dir_entry
         for (uint8_t i = 0; i < 11; i++)
             entry_to_add.name[i] = buffer->name[i];
@@ -834,15 +1541,10 @@ bool sd_fat32_traverse_directory (dir_entry_condensed *buffer,
         entry_to_add.file_size = buffer->file_size;
     }
     
-    dir_entry entry;
-    bool extend_and_end = false;
-    
     while (1)
-    {  // continue reading entries until we find what want, or reach the end
-        if ( !read_partial_block (current_sector,
-                                  sector_offset,
-                                  (uint8_t*)&entry,
-                                  sizeof (dir_entry)) )
+    {  // continue reading sectors until we find what want, or reach the end
+        cached_sector *sector = load_block (cursor->sector);
+        if (sector == END_OF_CHAIN)
         {
             #ifdef FAT32_DEBUG
             debug ("Error reading entry: ");
@@ -852,219 +1554,150 @@ bool sd_fat32_traverse_directory (dir_entry_condensed *buffer,
             return false;
         }
         
-        if (entry.name[0] == (char)0xe5)  // unused entry
-        {
-            if (action == ADD_ENTRY)
-            {  // if we're trying to add an entry
-                // replace this unused entry with the new one
-                return write_partial_block (current_sector,
-                                            sector_offset,
-                                            (uint8_t*)&entry_to_add,
-                                            sizeof (dir_entry));
-            }
-        }
-        
-        if (entry.name[0] == (char)0x00)  // end of directory list
+        // look at every remaining entry in this sector without copying it
+        // (nothing else may touch the cache until we're done with sector)
+        for ( ; cursor->offset < 512; cursor->offset += sizeof (dir_entry))
         {
-            if (action == ADD_ENTRY)
+            dir_entry *entry = (dir_entry*)&sector->data[cursor->offset];
+            
+            if (entry->name[0] == (char)0x00)  // end of directory list
+                break;
+            
+            if (adding)
             {
-                // mark where the entry should be added
-                entry_add_sector = current_sector;
-                entry_add_offset = sector_offset;
-                
-                // then flag that a new end-of-dir entry must be created
-                extend_and_end = true;
-                
-                // (don't write the entry immediately; make sure we can
-                // extend the end-of-dir marker first so bad things don't
-                // happen in situations where free space is low)
+                if (entry->name[0] == (char)0xe5)
+                {  // an unused entry that the new one can replace
+                    if (action == ADD_NEW_ENTRY)
+                        return place_entry (cursor, buffer, &entry_to_add);
+                    
+                    // but keep checking the rest of the names first
+                    if (free_slot.sector == 0)
+                        free_slot = *cursor;
+                }
+                else if (action == ADD_ENTRY &&
+                         fs_filenames_match (buffer->name, entry->name))
+                {
+                    error_code = ERROR_FAT32_ALREADY_EXISTS;
+                    return false;
+                }
             }
             else if (action == REMOVE_ENTRY || action == UPDATE_ENTRY)
-            {  // we reached the end of the directory without finding the entry to remove
-                error_code = ERROR_FAT32_END_OF_DIR;
-                return false;
-            }
-            else  // reading directory entries
-            {  // indicate that we've reached the end
-                error_code = ERROR_NONE;
-                return false;
-            }
-        }
-        
-        if (action == REMOVE_ENTRY || action == UPDATE_ENTRY)
-        {  // if we want to remove or update an entry, check the name
-            if (fs_filenames_match (buffer->name, entry.name))
-            {  // we found the entry
-                if (action == REMOVE_ENTRY)
-                {
-                    // change the first character of the entry to make it indicate "empty"
-                    entry.name[0] = (uint8_t)0xe5;
+            {  // if we want to remove or update an entry, check the name
+                if (fs_filenames_match (buffer->name, entry->name))
+                {  // we found the entry
+                    buffer->entry_sector = cursor->sector;
+                    buffer->entry_offset = cursor->offset;
                     
-                    // gather information about the file getting removed
-                    buffer->first_cluster = (uint32_t)entry.first_cluster_high;
-                    buffer->first_cluster <<= 16;
-                    buffer->first_cluster |= (uint32_t)entry.first_cluster_low & (uint32_t)0x0000ffff;
-                    buffer->file_size = entry.file_size;
-                    
-                    if (!write_partial_block (current_sector,
-                                              sector_offset,
-                                              (uint8_t*)&entry,
-                                              sizeof (dir_entry)) )
+                    if (action == REMOVE_ENTRY)
                     {
-                        return false;
+                        // gather information about the file getting removed
+                        buffer->first_cluster = (uint32_t)entry->first_cluster_high;
+                        buffer->first_cluster <<= 16;
+                        buffer->first_cluster |= (uint32_t)entry->first_cluster_low & (uint32_t)0x0000ffff;
+                        buffer->file_size = entry->file_size;
+                        
+                        // change the first character of the entry to make it indicate "empty"
+                        entry->name[0] = (uint8_t)0xe5;
+                        sector->modified = true;
+                        
+                        #ifdef DIR_INDEX
+                        dir_index_remove (current_dir_cluster, buffer);
+                        #endif
+                        
+                        // the next entry added here can go straight into this slot
+                        set_free_hint (current_dir_cluster, cursor);
                     }
-                }
-                else
-                {  // update the entry's starting cluster and file size
-                    entry.file_size = buffer->file_size;
-                    entry.first_cluster_high = (uint16_t)((buffer->first_cluster >> 16) & (uint32_t)0x0000ffff);
-                    entry.first_cluster_low  = (uint16_t)(buffer->first_cluster & (uint32_t)0x0000ffff);
-                    
-                    if (!write_partial_block (current_sector,
-                                              sector_offset,
-                                              (uint8_t*)&entry,
-                                              sizeof (dir_entry)) )
-                    {
-                        return false;
+                    else
+                    {  // update the entry's starting cluster and file size
+                        entry->file_size = buffer->file_size;
+                        entry->first_cluster_high = (uint16_t)((buffer->first_cluster >> 16) & (uint32_t)0x0000ffff);
+                        entry->first_cluster_low  = (uint16_t)(buffer->first_cluster & (uint32_t)0x0000ffff);
+                        sector->modified = true;
                     }
-                }
+                    
+                    #ifdef FREE_RAM
+                    free_ram();
+                    #endif
+                    
+                    // finished removing or updating
+                    error_code = ERROR_NONE;
+                    return true;
+                }
+            }
+            else
+            {  // if we're just reading entries
+                // copy the relevant data into the buffer and return
+                condense_entry (entry, buffer);
+                
+                buffer->entry_sector = cursor->sector;
+                buffer->entry_offset = cursor->offset;
+                
+                cursor->offset += sizeof (dir_entry);
                 
                 #ifdef FREE_RAM
                 free_ram();
                 #endif
                 
-                // finished removing or updating
                 error_code = ERROR_NONE;
                 return true;
             }
         }
         
-        sector_offset += sizeof (dir_entry);  // increment the offset
-        if (sector_offset >= 512)
-        {  // if we hit the end of the sector
-            current_sector++;
-            sector_offset = 0;
-            
-            if (current_sector % fat32_sectors_per_cluster == 0)
-            {  // if we reached the end of the cluster
-                new_cluster = 0;
-                
-                if (!sd_fat32_cluster_lookup (current_cluster, &new_cluster))
-                {  // hit an error trying to read from the FAT
-                    return false;
-                }
-                
-                if (end_of_chain (new_cluster))
-                {  // this is where the cluster chain stops
-                    if (extend_and_end)
-                    {  // if we need to append a new end-of-dir marker
-                        // add a new cluster to the chain
-                        #ifdef FAT32_DEBUG
-                        debug ("appending new cluster\n");
-                        #endif
-                        
-                        if (!sd_fat32_append_cluster (current_cluster, &new_cluster))
-                            return false;
-                        
-                        current_cluster = new_cluster;
-                        current_sector = cluster_to_sector (current_cluster);
-                        
-                        #ifdef FAT32_DEBUG
-                        debug ("New final cluster: ");
-                        debugulong (new_cluster);
-                        debug ("\n");
-                        #endif
-                        
-                        // fill the new cluster with zeroes
-                        for (uint32_t n = 0; n < fat32_sectors_per_cluster; n++)
-                        {
-                            if (!sd_fat32_fill_sector (cluster_to_sector (new_cluster) + n,
-                                                       fillvalue,
-                                                       16))
-                                return false;
-                        }
-                    }
-                    else
-                    {  // if reading, treat this as an end-of-dir marker
-                        error_code = ERROR_FAT32_END_OF_DIR;
-                        return false;
-                    }
-                }
-                else
-                {
-                    current_cluster = new_cluster;
-                    current_sector = cluster_to_sector (current_cluster);
-                }
-            }
-        }
-        
-        if (extend_and_end)
-        {
-            // write the end-of-dir marker to the current location
-            entry.name[0] = 0;
-            if (!write_partial_block (current_sector,
-                                      sector_offset,
-                                      (uint8_t*)&entry,
-                                      sizeof (dir_entry)) )
+        if (cursor->offset < 512)
+        {  // we stopped at the end-of-dir marker
+            if (adding)
             {
-                return false;
+                if (free_slot.sector != 0)  // reuse the first unused entry
+                    return place_entry (&free_slot, buffer, &entry_to_add);
+                
+                break;  // the new entry goes here
             }
             
-            // then write the new entry to its marked location
-            if (!write_partial_block (entry_add_sector,
-                                      entry_add_offset,
-                                      (uint8_t*)&entry_to_add,
-                                      sizeof (dir_entry)) )
-            {
+            if (action == REMOVE_ENTRY || action == UPDATE_ENTRY)
+            {  // we reached the end of the directory without finding the entry
+                error_code = ERROR_FAT32_END_OF_DIR;
                 return false;
             }
             
-            #ifdef FREE_RAM
-            free_ram();
-            #endif
-            
-            // we've added the new entry and the new end
-            return true;
-        }
-        
-        // -----
-        // if we reached this point, we've read a valid entry
-        // -----
-        
-        if (action == ADD_ENTRY || action == REMOVE_ENTRY || action == UPDATE_ENTRY)
-        {  // if we want to add/remove/update something, skip entries here
-            continue;
-        }
-        else
-        {  // if we're just reading entries
-            // copy the relevant data into the buffer and return
-            for (uint8_t i = 0; i < 11; i++)
-                buffer->name[i] = entry.name[i];
-            
-            buffer->flags = 0;
-            if (entry.name[0] == (char)0xe5)  // unused entry
-                buffer->flags |= ENTRY_IS_EMPTY;
-            if (entry.attrib & 0x01)  // hidden entry (typically part of a long file name)
-                buffer->flags |= ENTRY_IS_HIDDEN;
-            if (entry.attrib & 0b00010000)  // entry is a directory
-                buffer->flags |= ENTRY_IS_DIR;
-                
-            buffer->first_cluster = (uint32_t)entry.first_cluster_high;
-            buffer->first_cluster <<= 16;
-            buffer->first_cluster |= entry.first_cluster_low;
-            buffer->file_size = entry.file_size;
-            
-            #ifdef FREE_RAM
-            free_ram();
-            #endif
-            
+            // reading: indicate that we've reached the end
             error_code = ERROR_NONE;
-            return true;
+            return false;
         }
+        
+        // on to the next sector
+        if (!next_dir_sector (cursor, false))
+            return false;
+    }
+    
+    // adding at the end of the directory: make sure the end-of-dir marker
+    // can be moved along one entry before using its old spot, so bad things
+    // don't happen in situations where free space is low
+    dir_cursor add_slot = *cursor;
+    
+    cursor->offset += sizeof (dir_entry);
+    if (cursor->offset >= 512)
+    {
+        if (!next_dir_sector (cursor, true))
+            return false;
     }
     
-    error_code = ERROR_FAT32_END_OF_DIR;
-    return false;  // we should never get here
+    // write the end-of-dir marker to the new location
+    // (the rest of the entry doesn't matter)
+    const char end_marker = 0;
+    if (!write_partial_block (cursor->sector,
+                              cursor->offset,
+                              (const uint8_t*)&end_marker,
+                              1))
+    {
+        return false;
+    }
+    
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+    
+    // then write the new entry to its marked location
+    return place_entry (&add_slot, buffer, &entry_to_add);
 }
 
 
@@ -1119,7 +1752,65 @@ bool sd_fat32_search_dir (const char *search_name,
     debug ("'\n");
     #endif
     
-    bool read_result = sd_fat32_traverse_directory (result, READ_DIR_START);
+    #ifdef DIR_INDEX
+    switch (dir_index_search (current_dir_cluster, name_8_3, result))
+    {
+        case DIR_INDEX_HIT:
+            error_code = ERROR_NONE;
+            return true;
+        
+        case DIR_INDEX_MISS:
+            // the directory is fully indexed, so the name isn't there
+            // (report it the same way as reaching the end-of-dir marker)
+            error_code = ERROR_NONE;
+            return false;
+        
+        case DIR_INDEX_NONE:
+        default:
+            break;
+    }
+    
+    // no index for this directory yet: scan the whole thing, building the
+    // index along the way (unless it won't fit)
+    const bool building_index = dir_index_begin (current_dir_cluster);
+    bool found = false;
+    dir_entry_condensed entry;
+    dir_cursor cursor;
+    
+    bool read_result = sd_fat32_traverse_directory (&cursor, &entry, READ_DIR_START);
+    while (read_result)
+    {
+        if (building_index)
+            dir_index_add (current_dir_cluster, &entry);
+        
+        if (!found && fs_filenames_match (entry.name, name_8_3))
+        {
+            *result = entry;
+            found = true;
+            
+            if (!building_index)
+                break;
+        }
+        
+        read_result = sd_fat32_traverse_directory (&cursor, &entry, READ_DIR_NEXT);
+    }
+    
+    if (building_index)
+    {
+        if (error_code == ERROR_NONE || error_code == ERROR_FAT32_END_OF_DIR)
+            dir_index_finish (current_dir_cluster);
+        else  // low-level error, the index can't be trusted
+            dir_index_drop (current_dir_cluster);
+    }
+    
+    if (found)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+    #else
+    dir_cursor cursor;
+    bool read_result = sd_fat32_traverse_directory (&cursor, result, READ_DIR_START);
     while (read_result)
     {
         // check this entry's name to see if it matches what we're looking for
@@ -1135,9 +1826,10 @@ bool sd_fat32_search_dir (const char *search_name,
         }
         else
         {
-            read_result = sd_fat32_traverse_directory (result, READ_DIR_NEXT);
+            read_result = sd_fat32_traverse_directory (&cursor, result, READ_DIR_NEXT);
         }
     }
+    #endif
     
     #ifdef FREE_RAM
     free_ram();
@@ -1262,7 +1954,11 @@ bool sd_fat32_object_exists (const char *name,
 
 // iterate through the current directory, reading the names of its objects
 // returns false when the end of the directory has been reached
-bool sd_fat32_get_dir_entry_first (char name[13])
+// read the next visible entry from the listing cursor, starting over at the
+// beginning of the current directory with READ_DIR_START
+static bool next_listed_object (const traverse_option action,
+                                char name[13],
+                                listed_object *object)
 {
     dir_entry_condensed entry;
     
@@ -1274,54 +1970,57 @@ bool sd_fat32_get_dir_entry_first (char name[13])
     
     name[0] = '\0';  // make the name empty to start
     
-    if (!sd_fat32_traverse_directory (&entry, READ_DIR_START))
+    if (!sd_fat32_traverse_directory (&listing_cursor, &entry, action))
         return false;
     
     while (entry.flags & (ENTRY_IS_EMPTY | ENTRY_IS_HIDDEN))
     {  // if this entry is empty or hidden, keep reading
-        if (!sd_fat32_traverse_directory (&entry, READ_DIR_NEXT))
+        if (!sd_fat32_traverse_directory (&listing_cursor, &entry, READ_DIR_NEXT))
             return false;
     }
     
     filename_fs_to_8_3 (entry.name, name);
     
+    object->size = entry.file_size;
+    object->first_cluster = entry.first_cluster;
+    object->is_directory = (entry.flags & ENTRY_IS_DIR) != 0;
+    
     error_code = ERROR_NONE;
     return true;
 }
 
+bool sd_fat32_get_dir_entry_first (char name[13])
+{
+    listed_object object;
+    return next_listed_object (READ_DIR_START, name, &object);
+}
+
 bool sd_fat32_get_dir_entry_next  (char name[13])
 {
-    dir_entry_condensed entry;
-    
-    if (!fat32_initialized)
-    {
-        error_code = ERROR_FAT32_INIT;
-        return false;
-    }
-    
-    name[0] = '\0';  // make the name empty to start
-    
-    if (!sd_fat32_traverse_directory (&entry, READ_DIR_NEXT))
-        return false;
-    
-    while (entry.flags & (ENTRY_IS_EMPTY | ENTRY_IS_HIDDEN))
-    {  // if this entry is empty or hidden, keep reading
-        if (!sd_fat32_traverse_directory (&entry, READ_DIR_NEXT))
-            return false;
-    }
-    
-    filename_fs_to_8_3 (entry.name, name);
-    
-    error_code = ERROR_NONE;
-    return true;
+    listed_object object;
+    return next_listed_object (READ_DIR_NEXT, name, &object);
+}
+
+bool sd_fat32_list_dir_first (char name[13],
+                              listed_object *object)
+{
+    return next_listed_object (READ_DIR_START, name, object);
+}
+
+bool sd_fat32_list_dir_next (char name[13],
+                             listed_object *object)
+{
+    return next_listed_object (READ_DIR_NEXT, name, object);
 }
 
 
 // create an object in the current directory
-bool sd_fat32_add_object (dir_entry_condensed *object)
+// if name_is_new, the caller has made sure that nothing in the directory
+// already has the object's name, and the check is skipped
+bool sd_fat32_add_object (dir_entry_condensed *object,
+                          const bool name_is_new)
 {
-    dir_entry_condensed new_obj;
-    uint32_t new_cluster;
+    uint32_t new_cluster = 0;
     
     #ifdef FREE_RAM
     free_ram();
@@ -1332,31 +2031,25 @@ bool sd_fat32_add_object (dir_entry_condensed *object)
     const uint8_t filler1[8] = {0x00, 0x00, 0x43, 0x8d, 0x6b, 0x42, 0x6b, 0x42};
     const uint8_t filler2[4] = {0x43, 0x8d, 0x6b, 0x42};
     
-    // make sure an object of this name doesn't already exist
-    if (sd_fat32_search_dir (object->name, true, &new_obj))
-    {
-        error_code = ERROR_FAT32_ALREADY_EXISTS;
-        return false;
-    }
-    else if (error_code != ERROR_NONE && error_code != ERROR_FAT32_END_OF_DIR)
-    {  // make sure the search function didn't return false for some other reason
-        return false;
-    }
+    // (adding the entry checks that an object of this name doesn't already exist)
     
     if (object->flags & ENTRY_IS_DIR)
     {  // if the new object is a directory
         
-        // find an empty cluster
-        if (!sd_fat32_next_empty_cluster (current_dir_cluster, &new_cluster))
-            return false;
-        
-        // set that cluster as the end of the cluster chain
-        if (!sd_fat32_set_cluster (new_cluster, FAT32_END_OF_CHAIN))
+        // claim an empty cluster as a new single-cluster chain
+        if (!sd_fat32_allocate_clusters (0, current_dir_cluster, 1, &new_cluster))
             return false;
         
         // make the entry contain its starting cluster
         object->first_cluster = new_cluster;
         
+        // in case the cluster used to belong to another directory
+        drop_free_hint (new_cluster);
+        
+        #ifdef DIR_INDEX
+        dir_index_drop (new_cluster);
+        #endif
+        
         // directly write entries for ".", "..", and the end-of-dir marker:
         
         dir_entry entry;
@@ -1442,7 +2135,21 @@ bool sd_fat32_add_object (dir_entry_condensed *object)
     #endif
     
     // add the entry to the current directory
-    return sd_fat32_traverse_directory (object, ADD_ENTRY);
+    dir_cursor cursor;
+    if (!sd_fat32_traverse_directory (&cursor,
+                                      object,
+                                      name_is_new ? ADD_NEW_ENTRY : ADD_ENTRY))
+    {
+        if (new_cluster != 0)
+        {  // don't leak the new directory's cluster
+            const uint8_t add_error = error_code;
+            sd_fat32_free_chain (new_cluster);
+            error_code = add_error;
+        }
+        return false;
+    }
+    
+    return true;
 }
 
 
@@ -1506,31 +2213,6 @@ bool sd_fat32_open_file (const char *name,
     #endif
     
     
-    if (sd_fat32_search_dir (name, false, &entry))
-    {  // the file exists
-        if (action == CREATE_FILE)
-        {  // delete the existing file
-            #ifdef FAT32_DEBUG
-            debug ("File exists, deleting");
-            debug ("\n");
-            #endif
-            
-            sd_fat32_delete (name);
-        }
-    }
-    else
-    {  // if the search failed
-        if (error_code != ERROR_NONE && error_code != ERROR_FAT32_END_OF_DIR)
-            return false;  // search failed due to a low-level error
-        
-        // otherwise, the search returned false because it didn't find anything
-        if (action == READ_FILE || action == APPEND_FILE)
-        {  // if we want to read or append to an existing file
-            error_code = ERROR_FAT32_NOT_FOUND;
-            return false;
-        }
-    }
-    
     if (action == CREATE_FILE)
     {
         // fill in entry info
@@ -1547,8 +2229,34 @@ bool sd_fat32_open_file (const char *name,
         #endif
         
         // add the entry to the current directory
-        if (!sd_fat32_add_object (&entry))
-            return false;
+        // (this looks for an existing file in the same pass)
+        if (!sd_fat32_add_object (&entry, false))
+        {
+            if (error_code != ERROR_FAT32_ALREADY_EXISTS)
+                return false;
+            
+            // delete the existing file, then add the entry again
+            // (its old slot is now free, and the name is known to be unused)
+            #ifdef FAT32_DEBUG
+            debug ("File exists, deleting");
+            debug ("\n");
+            #endif
+            
+            if (!sd_fat32_delete (name))
+                return false;
+            
+            if (!sd_fat32_add_object (&entry, true))
+                return false;
+        }
+    }
+    else if (!sd_fat32_search_dir (name, false, &entry))
+    {  // if the search failed
+        if (error_code != ERROR_NONE && error_code != ERROR_FAT32_END_OF_DIR)
+            return false;  // search failed due to a low-level error
+        
+        // otherwise, the search returned false because it didn't find anything
+        error_code = ERROR_FAT32_NOT_FOUND;
+        return false;
     }
     else if (entry.flags & ENTRY_IS_DIR)
     {
@@ -1556,11 +2264,18 @@ bool sd_fat32_open_file (const char *name,
         return false;
     }
     
+    #ifdef FAT32_DEFRAG
+    if (!defrag_abandon (entry.first_cluster))
+        return false;
+    #endif
+    
     file = &(files[*file_id]);
     file->open = true;
     file->access_type = action;
     file->directory_starting_cluster = current_dir_cluster;
     filename_8_3_to_fs (name, file->name_on_fs);
+    file->entry_sector = entry.entry_sector;
+    file->entry_offset = entry.entry_offset;
     file->first_cluster = entry.first_cluster;
     file->seek_offset = 0;
     file->current_cluster = entry.first_cluster;
@@ -1588,6 +2303,74 @@ bool sd_fat32_open_file (const char *name,
 
 // close the file
 // does nothing if the file is not open
+// write an open file's first cluster and size into its directory entry
+// the entry is normally updated in place, at the location recorded when the
+// file was opened; the directory is only searched if that entry no longer
+// holds the file
+static bool update_file_entry (const opened_file *file)
+{
+    #ifdef FAT32_DEBUG
+    debug ("Updating entry: first cluster = ");
+    debugulong (file->first_cluster);
+    debug (", file size = ");
+    debugulong (file->size);
+    debug ("\n");
+    #endif
+    
+    if (file->entry_sector != 0)
+    {
+        cached_sector *sector = load_block (file->entry_sector);
+        if (sector == END_OF_CHAIN)
+            return false;
+        
+        dir_entry *entry = (dir_entry*)&sector->data[file->entry_offset];
+        
+        if (fs_filenames_match (entry->name, file->name_on_fs))
+        {
+            entry->file_size = file->size;
+            entry->first_cluster_high = (uint16_t)((file->first_cluster >> 16) & (uint32_t)0x0000ffff);
+            entry->first_cluster_low  = (uint16_t)(file->first_cluster & (uint32_t)0x0000ffff);
+            sector->modified = true;
+            
+            error_code = ERROR_NONE;
+            return true;
+        }
+        
+        #ifdef FAT32_DEBUG
+        debug ("Entry moved, searching for it\n");
+        #endif
+    }
+    
+    dir_entry_condensed entry;
+    
+    for (uint8_t i = 0; i < 11; i++)
+        entry.name[i] = file->name_on_fs[i];
+    entry.first_cluster = file->first_cluster;
+    entry.file_size = file->size;
+    
+    // temporarily jump back into whatever directory the file is in
+    const uint32_t temp_dir_cluster = current_dir_cluster;
+    current_dir_cluster = file->directory_starting_cluster;
+    
+    dir_cursor cursor;
+    const bool result = sd_fat32_traverse_directory (&cursor, &entry, UPDATE_ENTRY);
+    
+    #ifdef FAT32_DEBUG
+    if (!result)
+    {
+        debug ("UPDATE FAILED: ");
+        debuguint (error_code);
+        debug ("\n");
+    }
+    #endif
+    
+    // jump back to the directory we're supposed to be in
+    current_dir_cluster = temp_dir_cluster;
+    
+    return result;
+}
+
+
 bool sd_fat32_close_file (uint8_t file_id)
 {
     #ifdef FREE_RAM
@@ -1615,44 +2398,13 @@ bool sd_fat32_close_file (uint8_t file_id)
     }
     
     bool result = true;
-    uint32_t temp_dir_cluster;
+    error_code = ERROR_NONE;
     
     if (file->access_type != READ_FILE)
     {  // if we were modifying the file
         // update the size of the file in the directory entry
-        dir_entry_condensed entry;
-        
-        for (uint8_t i = 0; i < 11; i++)
-            entry.name[i] = file->name_on_fs[i];
-        entry.first_cluster = file->first_cluster;
-        entry.file_size = file->size;
-        
-        #ifdef FAT32_DEBUG
-        debug ("Updating entry: first cluster = ");
-        debugulong (entry.first_cluster);
-        debug (", file size = ");
-        debugulong (entry.file_size);
-        debug ("\n");
-        #endif
-        
-        // temporarily jump back into whatever directory the file is in
-        temp_dir_cluster = current_dir_cluster;
-        current_dir_cluster = file->directory_starting_cluster;
-        
-        // if the update fails, continue closing the file anyway
-        result = sd_fat32_traverse_directory (&entry, UPDATE_ENTRY);
-        
-        #ifdef FAT32_DEBUG
-        if (!result)
-        {
-            debug ("UPDATE FAILED: ");
-            debuguint (error_code);
-            debug ("\n");
-        }
-        #endif
-        
-        // jump back to the directory we're supposed to be in
-        current_dir_cluster = temp_dir_cluster;
+        // (if the update fails, continue closing the file anyway)
+        result = update_file_entry (file);
     }
     
     // clear the file details
@@ -1662,6 +2414,8 @@ bool sd_fat32_close_file (uint8_t file_id)
     file->open = false;
     file->access_type = READ_FILE;
     file->directory_starting_cluster = 0;
+    file->entry_sector = 0;
+    file->entry_offset = 0;
     file->first_cluster = 0;
     file->seek_offset = 0;
     file->current_cluster = 0;
@@ -1677,6 +2431,76 @@ bool sd_fat32_close_file (uint8_t file_id)
 }
 
 
+// make sure everything written to the file so far is on the card, without
+// closing it
+bool sd_fat32_sync_file (uint8_t file_id)
+{
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+    
+    if (file_id >= MAX_FILES)
+    {
+        error_code = ERROR_FAT32_BAD_FILE_ID;
+        return false;
+    }
+    
+    opened_file *file = &files[file_id];
+    
+    if (!file->open)
+    {
+        error_code = ERROR_FAT32_NOT_OPEN;
+        return false;
+    }
+    
+    if (file->access_type == READ_FILE)
+    {  // nothing to write
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    // record the file's current size and first cluster
+    if (!update_file_entry (file))
+        return false;
+    
+    // bring the backup FATs up to date too, if they were left behind
+    if (!sd_fat32_mirror_fats())
+        return false;
+    
+    // then write out the file's data, and whatever FAT and directory
+    // sectors are waiting (the free cluster count is left for shutdown, it's
+    // only a hint)
+    return commit_owned_blocks (FILE_CACHE_OWNER (file_id));
+}
+
+
+// sync every open file, and commit anything else waiting in the cache
+bool sd_fat32_sync_all (void)
+{
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+    
+    for (uint8_t i = 0; i < MAX_FILES; i++)
+    {
+        if (files[i].open && files[i].access_type != READ_FILE)
+        {
+            if (!update_file_entry (&files[i]))
+                return false;
+        }
+    }
+    
+    if (!sd_fat32_mirror_fats())
+        return false;
+    
+    return commit_cache();
+}
+
+
 // seek to an offset in the opened file
 bool sd_fat32_seek (uint8_t file_id,
                     uint32_t offset)
@@ -1774,110 +2598,291 @@ bool sd_fat32_get_seek_pos (uint8_t file_id, uint32_t *offset)
 }
 
 
-// read data from the current position in the file
-// and update the seek position
-bool sd_fat32_read_file (uint8_t file_id,
-                         uint32_t length,
-                         uint8_t *buffer)
+// check that file_id refers to an open file and return it, or 0 on error
+static opened_file *get_open_file (const uint8_t file_id)
 {
-    uint16_t length_to_read;
-    uint32_t new_cluster;
-    
-    opened_file *file = &(files[file_id]);
-    
     if (!fat32_initialized)
     {
         error_code = ERROR_FAT32_INIT;
-        return false;
+        return 0;
     }
     
     if (file_id >= MAX_FILES)
     {
         error_code = ERROR_FAT32_BAD_FILE_ID;
-        return false;
+        return 0;
     }
     
-    if (!file->open)
+    if (!files[file_id].open)
     {
         error_code = ERROR_FAT32_NOT_OPEN;
-        return false;
+        return 0;
     }
     
-    if (file->seek_offset + length > file->size)
+    return &(files[file_id]);
+}
+
+
+// the sector holding the file's seek position
+static inline uint32_t seek_sector (const opened_file *file)
+{
+    return cluster_to_sector (file->current_cluster) + file->sector_in_cluster;
+}
+
+
+// move the seek position forward by length bytes, which must not go past the
+// end of the current sector, following the cluster chain if the seek position
+// ends up in the next cluster
+static bool advance_seek_pos (opened_file *file,
+                              const uint16_t length)
+{
+    file->seek_offset += length;
+    file->offset_in_sector += length;
+    
+    if (file->offset_in_sector < 512)
+        return true;
+    
+    file->offset_in_sector = 0;
+    file->sector_in_cluster++;
+    
+    if (file->sector_in_cluster >= fat32_sectors_per_cluster)
     {
-        error_code = ERROR_FAT32_TOO_FAR;
-        return false;
+        uint32_t new_cluster;
+        
+        if (!sd_fat32_cluster_lookup (file->current_cluster,
+                                      &new_cluster))
+        {  // this will only return false if a low-level error occurred
+            return false;
+        }
+        
+        file->current_cluster = new_cluster;
+        file->sector_in_cluster = 0;
     }
     
-    #ifdef FAT32_DEBUG
-    debug ("Reading ");
-    debugulong (length);
-    debug (" bytes from file id ");
-    debuguint ((uint16_t)file_id);
-    debug ("\n");
-    #endif
+    return true;
+}
+
+
+// read length bytes from a file's seek position, which has already been
+// checked against the size of the file
+static bool read_at_seek_pos (opened_file *file,
+                              uint8_t *buffer,
+                              uint32_t length)
+{
+    uint16_t length_to_read;
     
-    // read to the end of the sector while the read length would put us past the sector
-    while ((uint32_t)file->offset_in_sector + length >= 512)
+    while (length > 0)
     {
-        length_to_read = 512 - file->offset_in_sector;
-        
         if (end_of_chain (file->current_cluster))
         {  // if the current cluster isn't actually allocated to this file
             error_code = ERROR_FAT32_TOO_FAR;
             return false;
         }
         
-        if (!read_partial_block ( cluster_to_sector (file->current_cluster) +
-                                      file->sector_in_cluster,
-                                  file->offset_in_sector,
-                                  buffer,
-                                  length_to_read))
-        {  // this will only return false if a low-level error occurred
-            return false;
+        if (file->offset_in_sector == 0 && length >= 512)
+        {  // whole sectors go straight into the buffer, without displacing
+           // anything in the cache
+            length_to_read = 512;
+            
+            if (!read_whole_block_uncached (seek_sector (file), buffer))
+                return false;
+        }
+        else
+        {
+            length_to_read = 512 - file->offset_in_sector;
+            if (length < length_to_read)
+                length_to_read = (uint16_t)length;
+            
+            if (!read_partial_block (seek_sector (file),
+                                     file->offset_in_sector,
+                                     buffer,
+                                     length_to_read))
+            {  // this will only return false if a low-level error occurred
+                return false;
+            }
         }
         
         buffer += length_to_read;
         length -= length_to_read;
         
-        file->offset_in_sector = 0;
-        file->sector_in_cluster++;
+        if (!advance_seek_pos (file, length_to_read))
+            return false;
+    }
+    
+    return true;
+}
+
+
+// read data from the current position in the file
+// and update the seek position
+bool sd_fat32_read_file (uint8_t file_id,
+                         uint32_t length,
+                         uint8_t *buffer)
+{
+    opened_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+    
+    if (file->seek_offset + length > file->size)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+    
+    #ifdef FAT32_DEBUG
+    debug ("Reading ");
+    debugulong (length);
+    debug (" bytes from file id ");
+    debuguint ((uint16_t)file_id);
+    debug ("\n");
+    #endif
+    
+    if (!read_at_seek_pos (file, buffer, length))
+        return false;
+    
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// return a read-only view of the cached sector at the seek position: at most
+// max_length bytes, stopping at the end of the sector or the end of the file,
+// and move the seek position past them
+bool sd_fat32_read_view (uint8_t file_id,
+                         uint16_t max_length,
+                         const uint8_t **data,
+                         uint16_t *length)
+{
+    opened_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+    
+    *length = 0;
+    
+    uint32_t available = file->size - file->seek_offset;
+    if (available > (uint32_t)(512 - file->offset_in_sector))
+        available = 512 - file->offset_in_sector;
+    if (available > max_length)
+        available = max_length;
+    
+    if (available == 0)
+    {  // at the end of the file
+        *data = 0;
         
-        file->seek_offset += length_to_read;
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    if (end_of_chain (file->current_cluster))
+    {  // if the current cluster isn't actually allocated to this file
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+    
+    const uint32_t sector = seek_sector (file);
+    const uint16_t offset = file->offset_in_sector;
+    
+    // read the sector before moving the seek position, so that nothing has
+    // changed if it can't be read
+    if (load_block (sector) == END_OF_CHAIN)
+        return false;
+    
+    if (!advance_seek_pos (file, (uint16_t)available))
+        return false;
+    
+    // moving into the next cluster reads the FAT, which may have evicted the
+    // sector, so the view is taken from it last
+    cached_sector *node = load_block (sector);
+    if (node == END_OF_CHAIN)
+        return false;
+    
+    *data = node->data + offset;
+    *length = (uint16_t)available;
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// read the first sector that isn't cached yet of those holding the next
+// length bytes of a file that's open for reading, ahead of the read that will
+// want them
+bool sd_fat32_prefetch (uint8_t file_id,
+                        uint16_t length,
+                        bool *loaded)
+{
+    *loaded = false;
+    
+    opened_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+    
+    if (file->access_type != READ_FILE ||
+        file->seek_offset >= file->size ||
+        end_of_chain (file->current_cluster))
+    {  // nothing (more) to read
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    uint32_t sector = seek_sector (file);
+    cached_sector *node = cache_lookup (sector);
+    
+    if (node != END_OF_CHAIN &&
+        (uint32_t)file->offset_in_sector + length > 512 &&
+        file->seek_offset + (512 - file->offset_in_sector) < file->size &&
+        file->sector_in_cluster + 1 < fat32_sectors_per_cluster)
+    {  // the rest is in the next sector (one in the next cluster is left
+       // alone, finding it could take a FAT read); keep this one from being
+       // evicted to make room for it
+        if (!move_to_head (node))
+            return false;
         
-        if (file->sector_in_cluster >= fat32_sectors_per_cluster)
-        {
-            if (!sd_fat32_cluster_lookup (file->current_cluster,
-                                          &new_cluster))
-            {  // this will only return false if a low-level error occurred
-                return false;
-            }
-            
-            file->current_cluster = new_cluster;
-            file->sector_in_cluster = 0;
-        }
+        sector++;
+    }
+    
+    return prefetch_block (sector, loaded);
+}
+
+
+// hand length bytes from the seek position to callback, a sector's worth (or
+// less) at a time, straight out of the cache
+bool sd_fat32_read_stream (uint8_t file_id,
+                           uint32_t length,
+                           fat32_read_callback callback,
+                           void *context)
+{
+    const uint8_t *data;
+    uint16_t span;
+    
+    opened_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+    
+    if (file->seek_offset + length > file->size)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
     }
     
-    // read any remaining bytes from the current sector
-    if (length > 0)
+    while (length > 0)
     {
-        if (end_of_chain (file->current_cluster))
-        {  // if the current cluster isn't actually allocated to this file
-            error_code = ERROR_FAT32_TOO_FAR;
+        if (!sd_fat32_read_view (file_id,
+                                 (length < 512) ? (uint16_t)length : 512,
+                                 &data,
+                                 &span))
+        {
             return false;
         }
         
-        if (!read_partial_block ( cluster_to_sector (file->current_cluster) +
-                                      file->sector_in_cluster,
-                                  file->offset_in_sector,
-                                  buffer,
-                                  length))
-        {  // this will only return false if a low-level error occurred
-            return false;
-        }
+        length -= span;
         
-        file->offset_in_sector += length;
-        file->seek_offset += length;
+        if (!callback (data, span, context))
+            break;  // the caller has seen enough
     }
     
     #ifdef FREE_RAM
@@ -1888,6 +2893,49 @@ bool sd_fat32_read_file (uint8_t file_id,
     return true;
 }
 
+// read into each buffer of vector in turn, as a single read
+bool sd_fat32_readv (uint8_t file_id,
+                     const fat32_iovec *vector,
+                     uint8_t count)
+{
+    uint32_t length = 0;
+    
+    opened_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+    
+    for (uint8_t i = 0; i < count; i++)
+        length += vector[i].length;
+    
+    if (length > file->size - file->seek_offset)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+    
+    #ifdef FAT32_DEBUG
+    debug ("Reading ");
+    debugulong (length);
+    debug (" bytes in ");
+    debuguint ((uint16_t)count);
+    debug (" pieces from file id ");
+    debuguint ((uint16_t)file_id);
+    debug ("\n");
+    #endif
+    
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (!read_at_seek_pos (file, vector[i].buffer, vector[i].length))
+            return false;
+    }
+    
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+    
+    error_code = ERROR_NONE;
+    return true;
+}
 
 // create a subdirectory in the current directory
 bool sd_fat32_mkdir (const char *name)
@@ -1913,7 +2961,7 @@ bool sd_fat32_mkdir (const char *name)
     free_ram();
     #endif
     
-    return sd_fat32_add_object (&new_dir);
+    return sd_fat32_add_object (&new_dir, false);
 }
 
 
@@ -1934,14 +2982,15 @@ bool sd_fat32_rmdir (const char *name)
         return false;
     
     dir_entry_condensed entry;
+    dir_cursor cursor;
     
-    bool retval = sd_fat32_traverse_directory (&entry, READ_DIR_START);
+    bool retval = sd_fat32_traverse_directory (&cursor, &entry, READ_DIR_START);
     
     while (retval)
     {
-        if (entry.name[0] == '.')
-        {  // if the entry we read was "." or "..", they don't count, keep reading
-            retval = sd_fat32_traverse_directory (&entry, READ_DIR_NEXT);
+        if (entry.name[0] == '.' || (entry.flags & ENTRY_IS_EMPTY))
+        {  // "." and "..", and entries of deleted objects, don't count, keep reading
+            retval = sd_fat32_traverse_directory (&cursor, &entry, READ_DIR_NEXT);
         }
         else
         {  // an entry exists in the directory, we can't rmdir
@@ -1961,7 +3010,17 @@ bool sd_fat32_rmdir (const char *name)
     
     filename_8_3_to_fs (name, entry.name);
     
-    if (!sd_fat32_traverse_directory (&entry, REMOVE_ENTRY))
+    if (!sd_fat32_traverse_directory (&cursor, &entry, REMOVE_ENTRY))
+        return false;
+    
+    // the directory's clusters can be reused, so forget about its contents
+    drop_free_hint (entry.first_cluster);
+    
+    #ifdef DIR_INDEX
+    dir_index_drop (entry.first_cluster);
+    #endif
+    
+    if (!sd_fat32_free_clusters (&entry))
         return false;
     
     error_code = ERROR_NONE;
@@ -1969,8 +3028,9 @@ bool sd_fat32_rmdir (const char *name)
 }
 
 
-// add a cluster to a file
-bool extend_file_clusters (opened_file *file)
+// add count clusters to a file, and make the first new cluster current
+bool extend_file_clusters (opened_file *file,
+                           const uint32_t count)
 {
     uint32_t new_cluster;
     
@@ -1983,6 +3043,8 @@ bool extend_file_clusters (opened_file *file)
     debugulong (file->first_cluster);
     debug (", current is ");
     debugulong (file->current_cluster);
+    debug (", adding ");
+    debugulong (count);
     debug ("\n");
     #endif
     
@@ -1994,18 +3056,11 @@ bool extend_file_clusters (opened_file *file)
         debug ("\n");
         #endif
         
-        // find an empty cluster
-        if (!sd_fat32_next_empty_cluster (file->directory_starting_cluster, &new_cluster))
-            return false;
-        
-        #ifdef FAT32_DEBUG
-        debug ("  Next empty cluster: ");
-        debugulong (new_cluster);
-        debug ("\n");
-        #endif
-        
-        // mark the cluster as the final cluster in its chain
-        if (!sd_fat32_set_cluster (new_cluster, FAT32_END_OF_CHAIN))
+        // start a new chain near the file's directory
+        if (!sd_fat32_allocate_clusters (0,
+                                         file->directory_starting_cluster,
+                                         count,
+                                         &new_cluster))
             return false;
         
         // set it as the file's first cluster
@@ -2021,12 +3076,20 @@ bool extend_file_clusters (opened_file *file)
     else
     {  // if the file has a first cluster, and just needs to be extended
         #ifdef FAT32_DEBUG
-        debug ("Adding cluster to chain... ");
+        debug ("Adding clusters to chain... ");
         #endif
         
-        if (!sd_fat32_append_cluster (file->first_cluster, &file->current_cluster))
+        // when the current cluster is valid, it's the end of the chain
+        // (or close to it), which saves walking the chain from the start
+        const uint32_t cluster_in_chain = end_of_chain (file->current_cluster) ?
+                                          file->first_cluster :
+                                          file->current_cluster;
+        
+        if (!sd_fat32_append_clusters (cluster_in_chain, count, &new_cluster))
             return false;
         
+        file->current_cluster = new_cluster;
+        
         #ifdef FAT32_DEBUG
         debug ("added cluster ");
         debugulong (file->current_cluster);
@@ -2042,63 +3105,85 @@ bool extend_file_clusters (opened_file *file)
 }
 
 
-bool sd_fat32_write_file (uint8_t file_id,
-                          uint32_t length,
-                          uint8_t *buffer)
+// number of clusters needed to hold length more bytes, starting at the
+// beginning of a cluster (always at least 1)
+static inline uint32_t clusters_for_length (const uint32_t length)
 {
-    uint16_t length_to_write;
-    uint32_t new_cluster;
+    const uint32_t bytes_per_cluster = (uint32_t)fat32_sectors_per_cluster * 512;
     
-    opened_file *file = &(files[file_id]);
+    if (length <= bytes_per_cluster)
+        return 1;
     
-    if (!fat32_initialized)
-    {
-        error_code = ERROR_FAT32_INIT;
-        return false;
-    }
+    return (length + bytes_per_cluster - 1) / bytes_per_cluster;
+}
+
+
+// add clusters for the rest of a write; if the card can't hold all of them,
+// add just the next one, so that the write fills what room there is before
+// it fails
+static bool extend_for_write (opened_file *file,
+                              const uint32_t count)
+{
+    if (extend_file_clusters (file, count))
+        return true;
     
-    if (file_id >= MAX_FILES)
-    {
-        error_code = ERROR_FAT32_BAD_FILE_ID;
-        return false;
-    }
+    return count > 1 &&
+           error_code == ERROR_FAT32_FULL &&
+           extend_file_clusters (file, 1);
+}
+
+
+// write data at a file's current position, tagging the cached sector as the
+// file's so sd_fat32_sync_file can tell it apart from other files' data
+static bool write_file_data (const uint8_t file_id,
+                             const uint8_t *buffer,
+                             const uint16_t length)
+{
+    const opened_file *file = &(files[file_id]);
     
-    if (!file->open)
-    {
-        error_code = ERROR_FAT32_NOT_OPEN;
-        return false;
-    }
+    cache_owner = FILE_CACHE_OWNER (file_id);
     
-    if (file->access_type == READ_FILE)
-    {
-        error_code = ERROR_FAT32_FILE_READ_ONLY;
-        return false;
-    }
+    const bool result = write_partial_block (cluster_to_sector (file->current_cluster) +
+                                                 file->sector_in_cluster,
+                                             file->offset_in_sector,
+                                             buffer,
+                                             length);
     
-    #ifdef FAT32_DEBUG
-    debug ("Writing ");
-    debugulong (length);
-    debug (" bytes to file id ");
-    debuguint ((uint16_t)file_id);
-    debug ("\n");
-    #endif
+    cache_owner = CACHE_NO_OWNER;
     
-    // read to the end of the sector while the read length would put us past the sector
+    return result;
+}
+
+
+// write length bytes at a file's seek position, which has already been checked
+// as writable; following is how many more bytes the caller is about to write
+// straight after these, so that clusters are allocated for all of them at once
+static bool write_at_seek_pos (const uint8_t file_id,
+                               const uint8_t *buffer,
+                               uint32_t length,
+                               const uint32_t following)
+{
+    uint16_t length_to_write;
+    uint32_t new_cluster;
+    
+    opened_file *file = &(files[file_id]);
+    
+    // write to the end of the sector while the write length would put us past the sector
     while ((uint32_t)file->offset_in_sector + length >= 512)
     {
         length_to_write = 512 - file->offset_in_sector;
         
         if (end_of_chain (file->current_cluster))
         {  // if the current cluster isn't actually allocated to this file
-            if (!extend_file_clusters (file))
+            // allocate everything the rest of this write needs in one go
+            if (!extend_for_write (file,
+                                   clusters_for_length ((uint32_t)file->sector_in_cluster * 512 +
+                                                        file->offset_in_sector +
+                                                        length + following)))
                 return false;
         }
         
-        if (!write_partial_block ( cluster_to_sector (file->current_cluster) +
-                                       file->sector_in_cluster,
-                                   file->offset_in_sector,
-                                   buffer,
-                                   length_to_write))
+        if (!write_file_data (file_id, buffer, length_to_write))
         {  // this will only return false if a low-level error occurred
             return false;
         }
@@ -2122,9 +3207,14 @@ bool sd_fat32_write_file (uint8_t file_id,
             }
             
             if (end_of_chain (new_cluster))
-            {  // hit the end of the allocated clusters, need to add another
-                if (!extend_file_clusters (file))
+            {  // hit the end of the allocated clusters, need to add more
+                if (!extend_for_write (file, clusters_for_length (length + following)))
+                {  // (leaving the position as a seek to it would, past the
+                   // end of the chain, so a later write extends it there)
+                    file->current_cluster = new_cluster;
+                    file->sector_in_cluster = 0;
                     return false;
+                }
             }
             else
             {  // the file already has a cluster after this one
@@ -2140,15 +3230,15 @@ bool sd_fat32_write_file (uint8_t file_id,
     {
         if (end_of_chain (file->current_cluster))
         {  // if the current cluster isn't actually allocated to this file
-            if (!extend_file_clusters (file))
+            // allocate everything the rest of this write needs in one go
+            if (!extend_for_write (file,
+                                   clusters_for_length ((uint32_t)file->sector_in_cluster * 512 +
+                                                        file->offset_in_sector +
+                                                        length + following)))
                 return false;
         }
         
-        if (!write_partial_block ( cluster_to_sector (file->current_cluster) +
-                                       file->sector_in_cluster,
-                                   file->offset_in_sector,
-                                   buffer,
-                                   length))
+        if (!write_file_data (file_id, buffer, length))
         {  // this will only return false if a low-level error occurred
             return false;
         }
@@ -2160,6 +3250,51 @@ bool sd_fat32_write_file (uint8_t file_id,
             file->size = file->seek_offset;
     }
     
+    return true;
+}
+
+
+bool sd_fat32_write_file (uint8_t file_id,
+                          uint32_t length,
+                          uint8_t *buffer)
+{
+    opened_file *file = &(files[file_id]);
+    
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+    
+    if (file_id >= MAX_FILES)
+    {
+        error_code = ERROR_FAT32_BAD_FILE_ID;
+        return false;
+    }
+    
+    if (!file->open)
+    {
+        error_code = ERROR_FAT32_NOT_OPEN;
+        return false;
+    }
+    
+    if (file->access_type == READ_FILE)
+    {
+        error_code = ERROR_FAT32_FILE_READ_ONLY;
+        return false;
+    }
+    
+    #ifdef FAT32_DEBUG
+    debug ("Writing ");
+    debugulong (length);
+    debug (" bytes to file id ");
+    debuguint ((uint16_t)file_id);
+    debug ("\n");
+    #endif
+    
+    if (!write_at_seek_pos (file_id, buffer, length, 0))
+        return false;
+    
     #ifdef FREE_RAM
     free_ram();
     #endif
@@ -2169,6 +3304,54 @@ bool sd_fat32_write_file (uint8_t file_id,
 }
 
 
+// write each buffer of vector in turn, as a single write
+bool sd_fat32_writev (uint8_t file_id,
+                      const fat32_iovec *vector,
+                      uint8_t count)
+{
+    uint32_t length = 0;
+    
+    opened_file *file = get_open_file (file_id);
+    if (file == 0)
+        return false;
+    
+    if (file->access_type == READ_FILE)
+    {
+        error_code = ERROR_FAT32_FILE_READ_ONLY;
+        return false;
+    }
+    
+    for (uint8_t i = 0; i < count; i++)
+        length += vector[i].length;
+    
+    #ifdef FAT32_DEBUG
+    debug ("Writing ");
+    debugulong (length);
+    debug (" bytes in ");
+    debuguint ((uint16_t)count);
+    debug (" pieces to file id ");
+    debuguint ((uint16_t)file_id);
+    debug ("\n");
+    #endif
+    
+    for (uint8_t i = 0; i < count; i++)
+    {
+        length -= vector[i].length;
+        
+        // clusters for the whole vector are allocated by the first write
+        // that needs any
+        if (!write_at_seek_pos (file_id, vector[i].buffer, vector[i].length, length))
+            return false;
+    }
+    
+    #ifdef FREE_RAM
+    free_ram();
+    #endif
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
 // delete a file from the current directory
 // if you delete an open file, the file will be closed first
 bool sd_fat32_delete (const char *name)
@@ -2213,7 +3396,8 @@ bool sd_fat32_delete (const char *name)
         }
     }
     
-    if (!sd_fat32_traverse_directory (&to_remove, REMOVE_ENTRY))
+    dir_cursor cursor;
+    if (!sd_fat32_traverse_directory (&cursor, &to_remove, REMOVE_ENTRY))
     {
         if (error_code == ERROR_FAT32_END_OF_DIR)
             error_code = ERROR_FAT32_NOT_FOUND;
@@ -2242,3 +3426,122 @@ bool sd_fat32_delete (const char *name)
     return true;
 }
 
+
+// cut a file down to new_size bytes, freeing the clusters it no longer needs
+bool sd_fat32_truncate (uint8_t file_id,
+                        uint32_t new_size)
+{
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+    
+    if (file_id >= MAX_FILES)
+    {
+        error_code = ERROR_FAT32_BAD_FILE_ID;
+        return false;
+    }
+    
+    opened_file *file = &(files[file_id]);
+    
+    if (!file->open)
+    {
+        error_code = ERROR_FAT32_NOT_OPEN;
+        return false;
+    }
+    
+    if (file->access_type == READ_FILE)
+    {
+        error_code = ERROR_FAT32_FILE_READ_ONLY;
+        return false;
+    }
+    
+    if (new_size > file->size)
+    {  // this only shrinks files
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+    
+    #ifdef FAT32_DEBUG
+    debug ("Truncating file id ");
+    debuguint ((uint16_t)file_id);
+    debug (" to ");
+    debugulong (new_size);
+    debug (" bytes\n");
+    #endif
+    
+    const uint32_t keep = (new_size == 0) ? 0 : clusters_for_length (new_size);
+    
+    if (keep == 0)
+    {  // nothing left: the whole chain goes, and the file has no first cluster
+        if (!end_of_chain (file->first_cluster))
+        {
+            if (!sd_fat32_free_chain (file->first_cluster))
+                return false;
+        }
+        
+        file->first_cluster = 0;
+    }
+    else
+    {
+        // find the last cluster to keep, starting from the file's current
+        // cluster instead of the first one if that's no further along
+        const uint32_t cluster_bytes = (uint32_t)fat32_sectors_per_cluster * 512;
+        uint32_t last_kept = file->first_cluster;
+        uint32_t index = 0;  // position of last_kept in the chain
+        
+        if (!end_of_chain (file->current_cluster) &&
+            file->sector_in_cluster < fat32_sectors_per_cluster)
+        {
+            const uint32_t current_index =
+                (file->seek_offset -
+                 ((uint32_t)file->sector_in_cluster * 512 + file->offset_in_sector)) /
+                cluster_bytes;
+            
+            if (current_index < keep)
+            {
+                last_kept = file->current_cluster;
+                index = current_index;
+            }
+        }
+        
+        while (index < keep - 1)
+        {
+            if (!sd_fat32_cluster_lookup (last_kept, &last_kept))
+                return false;
+            
+            if (end_of_chain (last_kept))
+            {  // the chain is shorter than the file's size says it is
+                error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+                return false;
+            }
+            
+            index++;
+        }
+        
+        // cut the chain after it, then free everything that followed
+        uint32_t tail;
+        if (!sd_fat32_cluster_lookup (last_kept, &tail))
+            return false;
+        
+        if (!end_of_chain (tail))
+        {
+            if (!sd_fat32_set_cluster (last_kept, FAT32_END_OF_CHAIN))
+                return false;
+            
+            if (!sd_fat32_free_chain (tail))
+                return false;
+        }
+    }
+    
+    file->size = new_size;
+    
+    // the current position might have been in (or right at the start of) a
+    // cluster that was just freed
+    if (file->seek_offset >= new_size)
+        return sd_fat32_seek (file_id, new_size);
+    
+    error_code = ERROR_NONE;
+    return true;
+}
@@ -47,17 +47,86 @@ extern uint8_t error_code;
 #define MAX_FILES 2
 #elif (defined(ATMEGA328) || defined(M2))
 #define MAX_FILES 8
-#elif (defined(M4))
+#elif (defined(M4) || defined(HOST))
 #define MAX_FILES 32
 #else
 #error Unknown target
 #endif
 
+// how many FAT sectors can have stale copies in the other FATs before
+// they're forced to be mirrored (only used with MIRROR_DEFERRED)
+#if defined(ATMEGA168)
+#define FAT_MIRROR_SLOTS 4
+#elif (defined(ATMEGA328) || defined(M2))
+#define FAT_MIRROR_SLOTS 8
+#elif (defined(M4) || defined(HOST))
+#define FAT_MIRROR_SLOTS 64
+#endif
+
+// how many directories remember where their next free entry slot is
+#if defined(ATMEGA168)
+#define DIR_HINT_SLOTS 1
+#elif (defined(ATMEGA328) || defined(M2))
+#define DIR_HINT_SLOTS 2
+#elif (defined(M4) || defined(HOST))
+#define DIR_HINT_SLOTS 8
+#endif
+
+// in-RAM directory index size (only used if DIR_INDEX is defined)
+// DIR_INDEX_SLOTS is the total number of names that can be indexed, across
+// DIR_INDEX_DIRS directories, and must be a power of 2 (each slot is 8 bytes)
+#ifdef DIR_INDEX
+#ifndef DIR_INDEX_SLOTS
+#if defined(ATMEGA168)
+#define DIR_INDEX_SLOTS 16
+#elif (defined(ATMEGA328) || defined(M2))
+#define DIR_INDEX_SLOTS 64
+#elif (defined(M4) || defined(HOST))
+#define DIR_INDEX_SLOTS 1024
+#endif
+#endif
+
+#ifndef DIR_INDEX_DIRS
+#if defined(ATMEGA168)
+#define DIR_INDEX_DIRS 1
+#elif (defined(ATMEGA328) || defined(M2))
+#define DIR_INDEX_DIRS 2
+#elif (defined(M4) || defined(HOST))
+#define DIR_INDEX_DIRS 8
+#endif
+#endif
+
+#if (DIR_INDEX_SLOTS & (DIR_INDEX_SLOTS - 1)) != 0
+#error DIR_INDEX_SLOTS must be a power of 2
+#endif
+#endif
+
 #define MBR_END_SIGNATURE   (0xaa55)
 #define FAT32_END_SIGNATURE (0xaa55)
 
 #define FAT32_END_OF_CHAIN ((uint32_t)0xffffffff)
 
+// entry index (0-127) of a FAT sector held in the cache, read or written a byte
+// at a time so the sector data never has to be 32-bit aligned
+static inline uint32_t fat_entry (const uint8_t *fat_sector, const uint8_t index)
+{
+    const uint8_t *entry = &fat_sector[(uint16_t)index * 4];
+    
+    return (uint32_t)entry[0]         | ((uint32_t)entry[1] << 8) |
+           ((uint32_t)entry[2] << 16) | ((uint32_t)entry[3] << 24);
+}
+
+static inline void set_fat_entry (uint8_t *fat_sector, const uint8_t index,
+                                  const uint32_t value)
+{
+    uint8_t *entry = &fat_sector[(uint16_t)index * 4];
+    
+    entry[0] = (uint8_t)value;
+    entry[1] = (uint8_t)(value >> 8);
+    entry[2] = (uint8_t)(value >> 16);
+    entry[3] = (uint8_t)(value >> 24);
+}
+
 #pragma pack(1)
 
 typedef struct partition_entry
@@ -145,17 +214,44 @@ typedef struct dir_entry_condensed
     uint8_t flags;
     uint32_t first_cluster;  // first cluster of the file/dir
     uint32_t file_size;
+    
+    uint32_t entry_sector;   // where the entry itself is stored in its directory
+    uint16_t entry_offset;
 } dir_entry_condensed;
 
 typedef enum traverse_option
 {
     READ_DIR_START,
     READ_DIR_NEXT,
-    ADD_ENTRY,
+    ADD_ENTRY,      // add an entry, failing if its name is already used
     REMOVE_ENTRY,
-    UPDATE_ENTRY
+    UPDATE_ENTRY,
+    ADD_NEW_ENTRY   // add an entry whose name is known not to be in the directory
 } traverse_option;
 
+// what a directory listing gives for each object, besides its name
+typedef struct listed_object
+{
+    uint32_t size;
+    uint32_t first_cluster;
+    bool     is_directory;
+} listed_object;
+
+// position within a directory's entry list
+typedef struct dir_cursor
+{
+    uint32_t cluster;  // cluster containing sector
+    uint32_t sector;   // sector of the next entry (0 once past the end of the chain)
+    uint16_t offset;   // offset of the next entry within sector
+} dir_cursor;
+
+typedef enum fat_mirror_policy
+{
+    MIRROR_IMMEDIATE = 0,  // every FAT change is written to all FATs right away
+    MIRROR_DEFERRED        // only the first FAT is kept current, the others are
+                           // brought up to date by sd_fat32_mirror_fats
+} fat_mirror_policy;
+
 typedef enum open_option
 {
     READ_FILE = 0,
@@ -171,6 +267,9 @@ typedef struct opened_file
     uint32_t directory_starting_cluster;
     char name_on_fs[11];
     
+    uint32_t entry_sector;  // where the file's directory entry is stored
+    uint16_t entry_offset;
+    
     uint32_t first_cluster;
     
     uint32_t seek_offset;
@@ -186,6 +285,14 @@ typedef struct opened_file
 
 extern opened_file files[MAX_FILES];
 
+// cache owner tag for an open file's data sectors
+#define FILE_CACHE_OWNER(file_id) ((uint8_t)((file_id) + 1))
+
+
+// set when the filesystem is mounted
+extern bool    fat32_initialized;
+extern uint8_t fat32_sectors_per_cluster;
+
 
 // internal functions:
 
@@ -195,22 +302,49 @@ bool verify_name (const char *name,
 bool fs_filenames_match (const char a[11], const char b[11]);
 
 // get the next cluster from the current cluster
-//static bool sd_fat32_cluster_lookup (const uint32_t from_cluster,
-//                                     uint32_t *to_cluster);
+bool sd_fat32_cluster_lookup (const uint32_t from_cluster,
+                              uint32_t *to_cluster);
+
+// cluster arithmetic
+bool     sd_fat32_end_of_chain (const uint32_t cluster_num);     // is this a chain terminator?
+uint32_t sd_fat32_cluster_sector (const uint32_t cluster_num);   // first sector of a data cluster
+uint32_t sd_fat32_fat_sector (const uint32_t cluster_num);       // FAT sector holding its entry
+uint32_t sd_fat32_final_cluster (void);                          // one past the last valid cluster
+
+// bring the other FATs up to date with any FAT sectors that
+// were modified while mirroring was deferred
+bool sd_fat32_mirror_fats (void);
 
-// look in the FAT for the next unused cluster
-//static bool sd_fat32_next_empty_cluster (const uint32_t from_cluster,
-//                                         uint32_t *empty_cluster);
+// the same, but for at most one of those sectors, so the mirroring can be
+// spread out over idle time; *mirrored is cleared if none were waiting
+bool sd_fat32_mirror_one_fat (bool *mirrored);
 
 // set an entry in the FAT
 bool sd_fat32_set_cluster (const uint32_t from_cluster,
                            const uint32_t to_cluster);
 
+// claim count free clusters (searching from just after search_from) and
+// link them onto last_cluster, or into a new chain if last_cluster is 0
+// each FAT sector is read and written once, however many entries change in it
+// (if there aren't count free clusters, none are claimed: ERROR_FAT32_FULL)
+bool sd_fat32_allocate_clusters (const uint32_t last_cluster,
+                                 const uint32_t search_from,
+                                 uint32_t count,
+                                 uint32_t *first_added);
+
 // add a cluster to a cluster chain
 // (where cluster_in_chain can be any cluster in the cluster chain)
 bool sd_fat32_append_cluster (const uint32_t cluster_in_chain,
                               uint32_t *added_cluster);
 
+// add count clusters to a cluster chain in one batch
+bool sd_fat32_append_clusters (const uint32_t cluster_in_chain,
+                               const uint32_t count,
+                               uint32_t *first_added);
+
+// release every cluster in a chain, one FAT sector at a time
+bool sd_fat32_free_chain (const uint32_t first_cluster);
+
 // destroy the cluster chain of a file or directory
 // MAKE SURE DIRECTORIES ARE EMPTY BEFORE CALLING THIS ON THEM!
 // this does NOT remove the object from its directory: the idea is to call
@@ -224,14 +358,19 @@ bool sd_fat32_fill_sector (const uint32_t sector_num,
                            const uint8_t *pattern,
                            const uint16_t length);
 
+// position a cursor at the first entry of a directory
+void sd_fat32_dir_start (dir_cursor *cursor,
+                         const uint32_t dir_cluster);
+
 // begin or continue reading directory entries, or add/remove/update an entry
 // return value:
 //   read:
 //     true: the buffer has been filled with an entry's info
-//     false: all entries have been read
+//     false: all entries have been read (error_code is ERROR_NONE), or error
 //   add:
 //     true: the entry has been added, and buffer's entry_* variables have been updated
-//     false: error adding the entry
+//     false: error adding the entry (ERROR_FAT32_ALREADY_EXISTS if ADD_ENTRY
+//            found an entry with the same name)
 //   remove:
 //     true: the entry has been removed, and buffer has had its first_cluster
 //           and file_size variables updated
@@ -240,11 +379,18 @@ bool sd_fat32_fill_sector (const uint32_t sector_num,
 //     true: the entry's first_cluster and file_size have been updated
 //     false: couldn't find the entry or error modifying entry
 //
-// when reading: if you change directories, be sure to call this with READ_DIR_START,
-// or it will keep reading from the old directory
-bool sd_fat32_traverse_directory (dir_entry_condensed *buffer,
+// READ_DIR_START and the add/remove/update actions start the cursor at the
+// beginning of the current directory; READ_DIR_NEXT continues from wherever
+// the cursor was left, so each concurrent listing needs its own cursor
+bool sd_fat32_traverse_directory (dir_cursor *cursor,
+                                  dir_entry_condensed *buffer,
                                   traverse_option action);
 
+// copy the relevant parts of a directory entry into a dir_entry_condensed
+// (everything except the entry's location)
+void condense_entry (const dir_entry *entry,
+                     dir_entry_condensed *condensed);
+
 // search the current directory for an object with the given name
 // if the object was found, it fills in result and returns true
 // returns false if nothing was found, and the contents of result are undefined
@@ -253,10 +399,71 @@ bool sd_fat32_search_dir (const char *name,
                           dir_entry_condensed *result);
 
 // create an object in the current directory
-bool sd_fat32_add_object (dir_entry_condensed *object);
+// if name_is_new, the caller has made sure that nothing in the directory
+// already has the object's name, and the check is skipped
+bool sd_fat32_add_object (dir_entry_condensed *object,
+                          const bool name_is_new);
 
-// add a cluster to a file
-bool extend_file_clusters (opened_file *file);
+#ifdef DIR_INDEX
+//-----------------------------------------------
+// In-RAM directory name index (sd_fat32_dir_index.c)
+//
+// Maps the names in recently used directories to the location of their
+// entries, so searching a directory doesn't mean reading every entry in it.
+// A directory is indexed the first time it's searched, then kept up to date
+// as entries are added and removed.  When the slots run out, whole
+// directories are evicted, least recently used first.
+
+typedef enum dir_index_result
+{
+    DIR_INDEX_NONE,  // no index for this directory: scan it
+    DIR_INDEX_HIT,   // found the name, result has been filled in
+    DIR_INDEX_MISS   // the directory is indexed and doesn't contain the name
+} dir_index_result;
+
+// forget everything (the filesystem is being mounted)
+void dir_index_clear (void);
+
+// look up a name (in FAT format) in a directory's index
+dir_index_result dir_index_search (const uint32_t dir_cluster,
+                                   const char name[11],
+                                   dir_entry_condensed *result);
+
+// start building an index for a directory
+// returns false if the directory shouldn't or can't be indexed right now
+bool dir_index_begin (const uint32_t dir_cluster);
+
+// the whole directory has been scanned, its index can be used for lookups
+void dir_index_finish (const uint32_t dir_cluster);
+
+// record an entry (which must have its entry_sector and entry_offset set)
+// does nothing if the directory isn't indexed
+void dir_index_add (const uint32_t dir_cluster,
+                    const dir_entry_condensed *entry);
+
+// forget an entry that was removed from its directory
+void dir_index_remove (const uint32_t dir_cluster,
+                       const dir_entry_condensed *entry);
+
+// forget a directory's index entirely
+void dir_index_drop (const uint32_t dir_cluster);
+#endif
+
+#ifdef FAT32_DEFRAG
+//-----------------------------------------------
+// Defragmentation (sd_fat32_defrag.c)
+
+// forget any job in progress (the filesystem is being mounted)
+void defrag_clear (void);
+
+// a file is about to be opened or deleted: if it's being defragmented,
+// give up on it
+bool defrag_abandon (const uint32_t first_cluster);
+#endif
+
+// add count clusters to a file
+bool extend_file_clusters (opened_file *file,
+                           const uint32_t count);
 
 
 
@@ -279,6 +486,78 @@ bool sd_fat32_init (void);
 // flush any pending writes and unmount the filesystem
 bool sd_fat32_shutdown (void);
 
+// choose how the backup copies of the FAT are maintained:
+//   MIRROR_IMMEDIATE: every FAT update is written to all FATs (the default)
+//   MIRROR_DEFERRED:  only the first FAT is updated as files grow and shrink,
+//                     and its modified sectors are copied to the other FATs
+//                     in bulk at shutdown, when too many have piled up, or
+//                     whenever sd_fat32_mirror_fats is called
+//
+// deferring roughly halves the FAT traffic of allocation-heavy workloads, but
+// if power is lost before the copies are mirrored the backup FATs will be out
+// of date (the first FAT, which is the one actually used, is still valid)
+//
+// switching back to MIRROR_IMMEDIATE mirrors anything still pending
+bool sd_fat32_set_mirror_policy (const fat_mirror_policy policy);
+
+
+//-----------------------------------------------
+// Free space:
+
+// get the free space on the card, in kilobytes
+//
+// this is instant if the filesystem's FS info sector has a free cluster
+// count (it's kept up to date as clusters are allocated and freed); if not,
+// the whole FAT is read to count the free clusters, which can take a while
+// on a large card
+bool sd_fat32_free_space (uint32_t *free_kb);
+
+// count the free clusters in steps, reading at most max_sectors FAT sectors
+// per call, so the count can be spread out over idle time; *done is set once
+// the count is complete (after which sd_fat32_free_space returns at once)
+//
+// the count is kept correct as files change between steps, and when it
+// finishes it's written to the FS info sector (which is rebuilt if its
+// signatures were bad)
+bool sd_fat32_count_free_clusters (const uint16_t max_sectors,
+                                   bool *done);
+
+#ifdef FAT32_DEFRAG
+//-----------------------------------------------
+// Fragmentation (only if FAT32_DEFRAG is defined):
+
+// count the clusters of a file or directory in the current directory, and
+// the contiguous runs (extents) they're split into: 1 extent means it's
+// contiguous, which makes reading it and seeking in it cheapest
+bool sd_fat32_file_extents (const char *name,
+                            uint32_t *clusters,
+                            uint32_t *extents);
+
+// count the runs of free clusters, and the length of the longest one
+// (reads the whole FAT)
+bool sd_fat32_free_extents (uint32_t *free_runs,
+                            uint32_t *largest_run);
+
+// move a fragmented file in the current directory into a single run of free
+// clusters, which has to be as long as the file
+//
+// sd_fat32_defrag_begin picks the file (doing nothing if it's contiguous
+// already), and each sd_fat32_defrag_step reads or copies at most
+// max_sectors sectors; *done is set once the file has been moved.  The file
+// can't be open when the job is started, and opening or deleting it before
+// the job is done cancels the job.  Only one file is moved at a time.
+//
+// if the card loses power partway through, the file is untouched, but the
+// run it was being copied into stays allocated until a PC checks the card
+bool sd_fat32_defrag_begin (const char *name);
+bool sd_fat32_defrag_step (const uint16_t max_sectors,
+                           bool *done);
+bool sd_fat32_defrag_cancel (void);
+
+// defragment a file in one go
+bool sd_fat32_defrag_file (const char *name);
+#endif
+
 
 //-----------------------------------------------
 // File and directory information:
@@ -297,6 +576,13 @@ bool sd_fat32_object_exists (const char *name,
 bool sd_fat32_get_dir_entry_first (char name[13]);
 bool sd_fat32_get_dir_entry_next  (char name[13]);
 
+// the same, along with what the directory entry says about each object (the
+// listing position is shared, so there's one listing at a time either way)
+bool sd_fat32_list_dir_first (char name[13],
+                              listed_object *object);
+bool sd_fat32_list_dir_next  (char name[13],
+                              listed_object *object);
+
 
 //-----------------------------------------------
 // Directory traversal and modification:
@@ -336,6 +622,15 @@ bool sd_fat32_open_file (const char *name,
 // does nothing if the file is not open
 bool sd_fat32_close_file (uint8_t file_id);
 
+// make sure everything written to the file so far is on the card, without
+// closing it: updates its directory entry, then commits its modified data
+// sectors along with any modified FAT and directory sectors
+// (other files' data is left in the cache)
+bool sd_fat32_sync_file (uint8_t file_id);
+
+// sync every open file, and commit anything else waiting in the cache
+bool sd_fat32_sync_all (void);
+
 // seek to a location within the opened file
 // an offset of FILE_END_POS will seek to the end of the file
 #define FILE_END_POS ((uint32_t)0xffffffff)
@@ -349,18 +644,269 @@ bool sd_fat32_get_seek_pos (uint8_t file_id,
 // read from the current location in the file
 // updates the seek position
 //
+// whole sectors of the file that fall inside the read are read straight into
+// buffer, without going through (or displacing anything from) the cache
+//
 // if the length of the read would go beyond the end of the file, an
 // error is returned and nothing is read
 bool sd_fat32_read_file (uint8_t file_id,
                          uint32_t length,
                          uint8_t *buffer);
 
+// read from the current location in the file without copying: data is set
+// to point into the cached sector at the seek position, and length to the
+// number of bytes there, at most max_length (the view stops at the end of the
+// sector and at the end of the file, and length is 0 at the end of the file)
+// updates the seek position past the viewed bytes
+//
+// the view is read-only, and is only valid until the next call to any of the
+// sd_fat32 functions (any card access might evict the sector it points into)
+bool sd_fat32_read_view (uint8_t file_id,
+                         uint16_t max_length,
+                         const uint8_t **data,
+                         uint16_t *length);
+
+// if the file is open for reading and has more to read, load a sector holding
+// part of the next length bytes from its seek position into the cache, ahead
+// of the read that will want it (see prefetch_block): the first of them that
+// isn't cached yet, so call this until *loaded is left clear, which happens
+// once nothing more is needed (or can be done)
+//
+// only the seek position's sector and the one after it are looked at, and
+// the one after it only if it's in the same cluster
+bool sd_fat32_prefetch (uint8_t file_id,
+                        uint16_t length,
+                        bool *loaded);
+
+// called by sd_fat32_read_stream with each piece of the file, which is only
+// valid for the duration of the call; return false to stop reading early
+typedef bool (*fat32_read_callback) (const uint8_t *data,
+                                     uint16_t length,
+                                     void *context);
+
+// read length bytes from the current location in the file, handing them to
+// callback a sector (or the part of one that's wanted) at a time, with no
+// copying; context is passed through to callback unchanged
+// updates the seek position past the bytes handed over, so stopping early
+// leaves it just after the last piece the callback saw
+//
+// if the length of the read would go beyond the end of the file, an
+// error is returned and nothing is read
+bool sd_fat32_read_stream (uint8_t file_id,
+                           uint32_t length,
+                           fat32_read_callback callback,
+                           void *context);
+
 // write to the current location in the file
 // updates the seek position
 bool sd_fat32_write_file (uint8_t file_id,
                           uint32_t length,
                           uint8_t *buffer);
 
+// one piece of a vectored read or write
+typedef struct fat32_iovec
+{
+    uint8_t *buffer;
+    uint16_t length;
+} fat32_iovec;
+
+// read into (or write from) each of the count buffers in vector in turn,
+// just like a single sd_fat32_read_file (or sd_fat32_write_file) of all of
+// them, without gathering them into one buffer first
+//
+// a read that would go beyond the end of the file reads nothing; a write
+// allocates the clusters for the whole vector at once
+bool sd_fat32_readv (uint8_t file_id,
+                     const fat32_iovec *vector,
+                     uint8_t count);
+
+bool sd_fat32_writev (uint8_t file_id,
+                      const fat32_iovec *vector,
+                      uint8_t count);
+
+// shrink the file to new_size bytes, freeing the clusters beyond it
+// the clusters that are kept stay where they are, so rewriting the file
+// from the start reuses them; the seek position is moved back to the new
+// end if it was past it
+bool sd_fat32_truncate (uint8_t file_id,
+                        uint32_t new_size);
+
+
+#ifdef FAT32_RINGLOG
+//-----------------------------------------------
+// Ring-buffer logs (only if FAT32_RINGLOG is defined):
+//
+// a ring log is a file of a fixed number of 512-byte blocks, all allocated
+// when it's created; records are appended to it until it's full, and then
+// the oldest block of records is overwritten to make room for each new one.
+// Appending writes only the log's own sectors (never the FAT or the file's
+// directory entry), straight by sector number if the file is contiguous.
+
+// longest record that can be appended (a record never spans two blocks)
+#define RINGLOG_MAX_RECORD 502
+
+typedef struct fat32_ringlog
+{
+    uint8_t  file_id;        // the log file, held open (read-only) by the log
+    uint32_t blocks;
+
+    bool     contiguous;     // blocks are found from first_sector, otherwise
+    uint32_t first_sector;   // by following the chain (map_* is the last
+    uint32_t map_cluster;    // cluster looked up, and its index in the chain)
+    uint32_t map_index;
+
+    uint32_t head;           // block being filled
+    uint32_t head_sequence;  // its sequence number, 0 if the log is empty
+    uint16_t head_used;      // bytes of it in use
+} fat32_ringlog;
+
+// a position in a ring log, for reading it back
+typedef struct fat32_ringlog_reader
+{
+    uint32_t block;
+    uint32_t sequence;       // the sequence number block should have
+    uint16_t offset;         // of the next record in block
+} fat32_ringlog_reader;
+
+// create a ring log of the given number of blocks in the current directory
+// (replacing any file of the same name), as contiguous as free space allows
+bool sd_fat32_ringlog_create (const char *name,
+                              const uint32_t blocks);
+
+// open a ring log in the current directory, and find the block being filled
+// with a binary search of the blocks' sequence numbers
+//
+// the file stays open until sd_fat32_ringlog_close, and mustn't be deleted
+// or truncated in the meantime
+bool sd_fat32_ringlog_open (const char *name,
+                            fat32_ringlog *log);
+
+// add a record of 1 to RINGLOG_MAX_RECORD bytes to the log
+bool sd_fat32_ringlog_append (fat32_ringlog *log,
+                              const uint8_t *record,
+                              const uint16_t length);
+
+// write out the log's appended records (without touching anything else in
+// the cache)
+bool sd_fat32_ringlog_sync (fat32_ringlog *log);
+
+bool sd_fat32_ringlog_close (fat32_ringlog *log);
+
+// read the log back, from the oldest record still in it: rewind a reader,
+// then call sd_fat32_ringlog_read until *length is 0 (more records can be
+// read with the same reader after more are appended)
+//
+// if the reader falls so far behind that the records it would read next are
+// overwritten, it skips ahead to the oldest record left; a record longer than
+// max_length is an error, and the reader stays put
+void sd_fat32_ringlog_rewind (const fat32_ringlog *log,
+                              fat32_ringlog_reader *reader);
+
+bool sd_fat32_ringlog_read (fat32_ringlog *log,
+                            fat32_ringlog_reader *reader,
+                            uint8_t *buffer,
+                            const uint16_t max_length,
+                            uint16_t *length);
+#endif
+
+
+#ifdef FAT32_TSLOG
+//-----------------------------------------------
+// Time-series logs (only if FAT32_TSLOG is defined):
+//
+// a time-series log is a file of timestamped records packed into 512-byte
+// blocks (a record never spans two blocks), each block starting with a
+// header giving the first and last timestamps in it, and an index file of
+// the same name with the extension IDX holding the first timestamp of every
+// Nth block.  Finding a time reads a few index entries and block headers
+// instead of the whole log.  Timestamps are in whatever unit the caller
+// likes, but mustn't go backwards.
+
+// longest record that can be appended
+#define TSLOG_MAX_RECORD 490
+
+// blocks per index entry for an index that had to be rebuilt
+#define TSLOG_DEFAULT_INTERVAL 16
+
+#pragma pack(1)
+
+typedef struct tslog_block_header
+{
+    uint16_t magic;
+    uint16_t count;        // of records in the block
+    uint32_t first_time;
+    uint32_t last_time;
+    uint16_t used;         // bytes of the block in use, header included
+    uint16_t reserved;
+} tslog_block_header;
+
+#pragma pack()
+
+#define TSLOG_BLOCK_HEADER ((uint16_t)sizeof (tslog_block_header))
+
+typedef struct fat32_tslog
+{
+    uint8_t  data_id;       // the log and index files, held open by the log
+    uint8_t  index_id;
+    uint16_t interval;      // blocks per index entry
+    uint32_t blocks;
+    uint32_t entries;       // in the index
+    uint32_t end;           // size of the log file
+
+    uint32_t block_sector;  // the block being filled, and a copy of its
+    tslog_block_header header;  // header (used is 512 if there isn't one)
+} fat32_tslog;
+
+// a position in a time-series log, for reading it back
+typedef struct fat32_tslog_reader
+{
+    uint32_t position;      // of the next record in the log file
+    uint16_t used;          // bytes in use in its block
+} fat32_tslog_reader;
+
+// create an empty time-series log and its index in the current directory
+// (replacing any files of the same names), with an index entry every
+// interval blocks; the name mustn't have the extension IDX
+bool sd_fat32_tslog_create (const char *name,
+                            const uint16_t interval);
+
+// open a time-series log in the current directory, adding any index entries
+// that were lost (or rebuilding the index if it's missing)
+//
+// both files stay open until sd_fat32_tslog_close, and mustn't be written by
+// anything else in the meantime
+bool sd_fat32_tslog_open (const char *name,
+                          fat32_tslog *log);
+
+// add a record of 1 to TSLOG_MAX_RECORD bytes to the log
+bool sd_fat32_tslog_append (fat32_tslog *log,
+                            const uint32_t timestamp,
+                            const uint8_t *record,
+                            const uint16_t length);
+
+bool sd_fat32_tslog_sync (fat32_tslog *log);
+
+bool sd_fat32_tslog_close (fat32_tslog *log);
+
+// read the log back from a point in time: seek a reader to the first record
+// with a timestamp of at least time (or the end of the log if there are none
+// yet), then call sd_fat32_tslog_read until *length is 0, or the timestamp is
+// past the end of the range wanted (more records can be read with the same
+// reader after more are appended)
+//
+// a record longer than max_length is an error, and the reader stays put
+bool sd_fat32_tslog_seek_time (fat32_tslog *log,
+                               fat32_tslog_reader *reader,
+                               const uint32_t time);
+
+bool sd_fat32_tslog_read (fat32_tslog *log,
+                          fat32_tslog_reader *reader,
+                          uint32_t *timestamp,
+                          uint8_t *buffer,
+                          const uint16_t max_length,
+                          uint16_t *length);
+#endif
+
 
 
 #endif
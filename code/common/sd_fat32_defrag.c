@@ -0,0 +1,495 @@
+/*******************************************************************************
+* sd_fat32_defrag.c
+* version: 1.0
+* description: Optional fragmentation analysis and file defragmentation.  A
+*              file is defragmented by reserving a contiguous run of free
+*              clusters big enough to hold it, copying its data over a few
+*              sectors at a time, then pointing its directory entry at the new
+*              copy and freeing the old chain.  The work is split into steps
+*              so it can be spread out over idle time on the device; the PC
+*              tool in code/host runs the same code against card images.
+*
+*              Compiled in only if FAT32_DEFRAG is defined.
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "debug.h"
+
+#ifdef FAT32_DEFRAG
+
+typedef enum defrag_state
+{
+    DEFRAG_IDLE = 0,
+    DEFRAG_SEARCHING,  // looking for a free run to move the file into
+    DEFRAG_COPYING     // the run is reserved, copying the file's data into it
+} defrag_state;
+
+typedef struct defrag_job
+{
+    uint8_t  state;
+
+    uint32_t entry_sector;    // the file's directory entry
+    uint16_t entry_offset;
+    char     name[11];
+
+    uint32_t old_first;       // the file's current (fragmented) chain
+    uint32_t clusters;        // length of the chain
+    uint32_t sectors;         // sectors holding file data (the rest aren't copied)
+
+    uint32_t search_cluster;  // next FAT entry to look at
+    uint32_t run_start;       // free run found so far
+    uint32_t run_length;
+
+    uint32_t new_first;       // start of the reserved run
+    uint32_t from_cluster;    // cluster of the old chain being copied
+    uint32_t copied;          // sectors copied so far
+} defrag_job;
+
+defrag_job defrag;
+
+
+// count the clusters in a chain, and the contiguous runs they form
+static bool chain_extents (const uint32_t first_cluster,
+                           uint32_t *clusters,
+                           uint32_t *extents)
+{
+    uint32_t cluster = first_cluster;
+    uint32_t next_cluster;
+
+    *clusters = 0;
+    *extents = 0;
+
+    if (first_cluster == 0)
+        return true;  // nothing allocated
+
+    *extents = 1;
+
+    while (!sd_fat32_end_of_chain (cluster))
+    {
+        (*clusters)++;
+
+        if (!sd_fat32_cluster_lookup (cluster, &next_cluster))
+            return false;
+
+        if (!sd_fat32_end_of_chain (next_cluster) && next_cluster != cluster + 1)
+            (*extents)++;
+
+        cluster = next_cluster;
+    }
+
+    return true;
+}
+
+
+// release the reserved run and forget the job
+static bool abandon_job (void)
+{
+    const uint8_t state = defrag.state;
+
+    defrag.state = DEFRAG_IDLE;
+
+    if (state == DEFRAG_COPYING)
+    {
+        #ifdef FAT32_DEBUG
+        debug ("Abandoning defrag, freeing ");
+        debugulong (defrag.new_first);
+        debug ("\n");
+        #endif
+
+        return sd_fat32_free_chain (defrag.new_first);
+    }
+
+    return true;
+}
+
+
+// check that a run of clusters is still free, then claim it as a chain
+// returns false with ERROR_NONE if part of it has been taken since it was
+// found (defrag.search_cluster is moved past the used cluster)
+static bool reserve_run (void)
+{
+    const uint32_t end = defrag.run_start + defrag.clusters;
+    uint32_t cluster = defrag.run_start;
+
+    while (cluster < end)
+    {
+        cached_sector *sector = load_block (sd_fat32_fat_sector (cluster));
+        if (sector == END_OF_CHAIN)
+            return false;
+
+        const uint8_t *entries = sector->data;
+
+        do
+        {
+            if (fat_entry (entries, cluster % 128) != 0)
+            {  // something else has been allocated here, keep looking
+                defrag.search_cluster = cluster + 1;
+                defrag.run_length = 0;
+                error_code = ERROR_NONE;
+                return false;
+            }
+
+            cluster++;
+        } while (cluster < end && cluster % 128 != 0);
+    }
+
+    // every cluster in the run is free, so the allocation takes exactly them
+    if (!sd_fat32_allocate_clusters (0, defrag.run_start - 1, defrag.clusters, &defrag.new_first))
+        return false;
+
+    #ifdef FAT32_DEBUG
+    debug ("Defrag: moving ");
+    debugulong (defrag.clusters);
+    debug (" clusters to ");
+    debugulong (defrag.new_first);
+    debug ("\n");
+    #endif
+
+    defrag.state = DEFRAG_COPYING;
+    defrag.from_cluster = defrag.old_first;
+    defrag.copied = 0;
+
+    return true;
+}
+
+
+// look through one FAT sector for a big enough free run
+static bool search_step (void)
+{
+    const uint32_t final_cluster = sd_fat32_final_cluster();
+
+    if (defrag.search_cluster >= final_cluster)
+    {  // no room to make the file contiguous
+        defrag.state = DEFRAG_IDLE;
+        error_code = ERROR_FAT32_FULL;
+        return false;
+    }
+
+    cached_sector *sector = load_block (sd_fat32_fat_sector (defrag.search_cluster));
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    const uint8_t *entries = sector->data;
+
+    do
+    {
+        if (fat_entry (entries, defrag.search_cluster % 128) == 0)
+        {
+            if (defrag.run_length == 0)
+                defrag.run_start = defrag.search_cluster;
+            defrag.run_length++;
+        }
+        else
+        {
+            defrag.run_length = 0;
+        }
+
+        defrag.search_cluster++;
+    } while (defrag.run_length < defrag.clusters &&
+             defrag.search_cluster < final_cluster &&
+             defrag.search_cluster % 128 != 0);
+
+    if (defrag.run_length == defrag.clusters)
+    {
+        if (!reserve_run() && error_code != ERROR_NONE)
+            return false;
+    }
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// point the file's entry at the new chain and free the old one
+static bool finish_job (void)
+{
+    cached_sector *sector = load_block (defrag.entry_sector);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    dir_entry *entry = (dir_entry*)&sector->data[defrag.entry_offset];
+    const uint32_t first_cluster = ((uint32_t)entry->first_cluster_high << 16) |
+                                   entry->first_cluster_low;
+
+    if (!fs_filenames_match (entry->name, defrag.name) ||
+        first_cluster != defrag.old_first)
+    {  // the file changed without us hearing about it
+        if (!abandon_job())
+            return false;
+
+        error_code = ERROR_FAT32_NOT_FOUND;
+        return false;
+    }
+
+    entry->first_cluster_high = (uint16_t)((defrag.new_first >> 16) & (uint32_t)0x0000ffff);
+    entry->first_cluster_low  = (uint16_t)(defrag.new_first & (uint32_t)0x0000ffff);
+    sector->modified = true;
+
+    defrag.state = DEFRAG_IDLE;
+
+    #ifdef FAT32_DEBUG
+    debug ("Defrag done\n");
+    #endif
+
+    return sd_fat32_free_chain (defrag.old_first);
+}
+
+
+// copy one sector of the file into the reserved run
+static bool copy_step (void)
+{
+    const uint32_t cluster_index = defrag.copied / fat32_sectors_per_cluster;
+    const uint8_t  sector_index = (uint8_t)(defrag.copied % fat32_sectors_per_cluster);
+
+    cached_sector *sector = load_block (sd_fat32_cluster_sector (defrag.from_cluster) + sector_index);
+    if (sector == END_OF_CHAIN)
+        return false;
+
+    // (if the destination isn't cached, this goes straight to the card and
+    // leaves the source node alone)
+    if (!write_whole_block (sd_fat32_cluster_sector (defrag.new_first + cluster_index) + sector_index,
+                            sector->data))
+    {
+        return false;
+    }
+
+    defrag.copied++;
+
+    if (defrag.copied == defrag.sectors)
+        return finish_job();
+
+    if (defrag.copied % fat32_sectors_per_cluster == 0)
+    {  // on to the next cluster of the old chain
+        uint32_t next_cluster;
+
+        if (!sd_fat32_cluster_lookup (defrag.from_cluster, &next_cluster))
+            return false;
+
+        if (sd_fat32_end_of_chain (next_cluster))
+        {  // the chain is shorter than it was when we measured it
+            if (!abandon_job())
+                return false;
+
+            error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+            return false;
+        }
+
+        defrag.from_cluster = next_cluster;
+    }
+
+    return true;
+}
+
+
+// forget any job in progress (the filesystem is being mounted)
+void defrag_clear (void)
+{
+    defrag.state = DEFRAG_IDLE;
+}
+
+
+// a file is about to be opened or deleted: if it's being defragmented,
+// give up on it (whatever happens to it next would be missed by the copy)
+bool defrag_abandon (const uint32_t first_cluster)
+{
+    if (defrag.state == DEFRAG_IDLE || first_cluster != defrag.old_first)
+        return true;
+
+    return abandon_job();
+}
+
+
+bool sd_fat32_file_extents (const char *name,
+                            uint32_t *clusters,
+                            uint32_t *extents)
+{
+    dir_entry_condensed entry;
+
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    if (!sd_fat32_search_dir (name, false, &entry))
+    {
+        if (error_code == ERROR_NONE || error_code == ERROR_FAT32_END_OF_DIR)
+            error_code = ERROR_FAT32_NOT_FOUND;
+        return false;
+    }
+
+    if (!chain_extents (entry.first_cluster, clusters, extents))
+        return false;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+bool sd_fat32_free_extents (uint32_t *free_runs,
+                            uint32_t *largest_run)
+{
+    const uint32_t final_cluster = sd_fat32_final_cluster();
+    cached_sector *sector = END_OF_CHAIN;
+    uint32_t run = 0;
+
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    *free_runs = 0;
+    *largest_run = 0;
+
+    for (uint32_t cluster = 2; cluster < final_cluster; cluster++)
+    {
+        if (sector == END_OF_CHAIN || cluster % 128 == 0)
+        {
+            sector = load_block (sd_fat32_fat_sector (cluster));
+            if (sector == END_OF_CHAIN)
+                return false;
+        }
+
+        if (fat_entry (sector->data, cluster % 128) == 0)
+        {
+            if (run == 0)
+                (*free_runs)++;
+
+            if (++run > *largest_run)
+                *largest_run = run;
+        }
+        else
+        {
+            run = 0;
+        }
+    }
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+bool sd_fat32_defrag_begin (const char *name)
+{
+    dir_entry_condensed entry;
+    uint32_t extents;
+
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    // only one file at a time
+    if (!sd_fat32_defrag_cancel())
+        return false;
+
+    if (!sd_fat32_search_dir (name, false, &entry))
+    {
+        if (error_code == ERROR_NONE || error_code == ERROR_FAT32_END_OF_DIR)
+            error_code = ERROR_FAT32_NOT_FOUND;
+        return false;
+    }
+
+    if (entry.flags & ENTRY_IS_DIR)
+    {  // moving a directory would mean fixing up its subdirectories' ".." entries
+        error_code = ERROR_FAT32_NOT_FILE;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < MAX_FILES; i++)
+    {
+        if (files[i].open &&
+            files[i].entry_sector == entry.entry_sector &&
+            files[i].entry_offset == entry.entry_offset)
+        {
+            error_code = ERROR_FAT32_ALREADY_OPEN;
+            return false;
+        }
+    }
+
+    if (!chain_extents (entry.first_cluster, &defrag.clusters, &extents))
+        return false;
+
+    if (extents > 1)
+    {
+        // only the sectors the file's data reaches need to be copied
+        defrag.sectors = (entry.file_size + 511) / 512;
+        if (defrag.sectors == 0)
+            defrag.sectors = 1;  // (a chain with no data, copy something anyway)
+        if (defrag.sectors > defrag.clusters * fat32_sectors_per_cluster)
+            defrag.sectors = defrag.clusters * fat32_sectors_per_cluster;
+
+        for (uint8_t i = 0; i < 11; i++)
+            defrag.name[i] = entry.name[i];
+
+        defrag.entry_sector = entry.entry_sector;
+        defrag.entry_offset = entry.entry_offset;
+        defrag.old_first = entry.first_cluster;
+        defrag.search_cluster = 2;
+        defrag.run_length = 0;
+        defrag.state = DEFRAG_SEARCHING;
+    }
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+bool sd_fat32_defrag_step (const uint16_t max_sectors,
+                           bool *done)
+{
+    if (!fat32_initialized)
+    {
+        error_code = ERROR_FAT32_INIT;
+        return false;
+    }
+
+    for (uint16_t i = 0; i < max_sectors && defrag.state != DEFRAG_IDLE; i++)
+    {
+        if (defrag.state == DEFRAG_SEARCHING)
+        {
+            if (!search_step())
+                return false;
+        }
+        else if (!copy_step())
+        {
+            return false;
+        }
+    }
+
+    *done = (defrag.state == DEFRAG_IDLE);
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+bool sd_fat32_defrag_cancel (void)
+{
+    if (!abandon_job())
+        return false;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+bool sd_fat32_defrag_file (const char *name)
+{
+    bool done = false;
+
+    if (!sd_fat32_defrag_begin (name))
+        return false;
+
+    while (!done)
+    {
+        if (!sd_fat32_defrag_step (0xffff, &done))
+            return false;
+    }
+
+    return true;
+}
+
+#endif
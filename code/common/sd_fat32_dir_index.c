@@ -0,0 +1,388 @@
+/*******************************************************************************
+* sd_fat32_dir_index.c
+* version: 1.0
+* description: Optional in-RAM index of directory entry names, used by
+*              sd_fat32_search_dir to find an entry without reading the whole
+*              directory.  All indexed directories share a single open
+*              addressing hash table; each slot maps a (directory, name hash)
+*              pair to the sector and offset of the entry on the card.  When
+*              the table fills up, the least recently used directory is evicted
+*              as a whole.
+*
+*              Compiled in only if DIR_INDEX is defined.
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "debug.h"
+
+#ifdef DIR_INDEX
+
+#define DIR_INDEX_MASK      ((uint16_t)(DIR_INDEX_SLOTS - 1))
+
+// don't let the table get more than 3/4 full, to keep probe sequences short
+#define DIR_INDEX_MAX_NAMES ((uint16_t)(DIR_INDEX_SLOTS - DIR_INDEX_SLOTS / 4))
+
+#define EMPTY_SLOT ((uint32_t)0)  // sector 0 is the MBR, never a directory
+
+typedef enum dir_index_state
+{
+    DIR_UNUSED = 0,
+    DIR_BUILDING,  // names are being added by a directory scan
+    DIR_COMPLETE,  // every name in the directory is in the table
+    DIR_TOO_BIG    // doesn't fit: don't try again until it's evicted
+} dir_index_state;
+
+typedef struct dir_index_slot
+{
+    uint32_t entry_sector;  // EMPTY_SLOT if unused
+    uint16_t hash;
+    uint8_t  dir;           // index into indexed_dirs
+    uint8_t  entry_number;  // entry within the sector (offset / 32)
+} dir_index_slot;
+
+typedef struct indexed_dir
+{
+    uint32_t cluster;    // first cluster of the directory
+    uint16_t names;      // number of slots used by this directory
+    uint16_t last_used;
+    uint8_t  state;
+} indexed_dir;
+
+dir_index_slot dir_index_slots[DIR_INDEX_SLOTS];
+indexed_dir indexed_dirs[DIR_INDEX_DIRS];
+uint16_t dir_index_names;  // slots used in total
+uint16_t dir_index_clock;  // incremented on each use, for LRU eviction
+
+
+// 16-bit FNV-1a style hash of an 11-character name
+static uint16_t hash_name (const char name[11])
+{
+    uint16_t hash = 0x811c;
+    for (uint8_t i = 0; i < 11; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x0193;
+    }
+    return hash;
+}
+
+// first slot to probe for a name in a given directory
+static inline uint16_t home_slot (const uint16_t hash, const uint8_t dir)
+{
+    return (hash ^ ((uint16_t)dir * 0x9e37)) & DIR_INDEX_MASK;
+}
+
+static indexed_dir *find_dir (const uint32_t dir_cluster)
+{
+    for (uint8_t i = 0; i < DIR_INDEX_DIRS; i++)
+    {
+        if (indexed_dirs[i].state != DIR_UNUSED &&
+            indexed_dirs[i].cluster == dir_cluster)
+        {
+            return &indexed_dirs[i];
+        }
+    }
+    return 0;
+}
+
+static void touch (indexed_dir *dir)
+{
+    dir->last_used = ++dir_index_clock;
+}
+
+// empty a slot, shifting later members of its probe sequence back so that
+// lookups never stop early at the hole
+static void delete_slot (uint16_t hole)
+{
+    uint16_t next = hole;
+
+    dir_index_slots[hole].entry_sector = EMPTY_SLOT;
+    dir_index_names--;
+
+    while (1)
+    {
+        next = (next + 1) & DIR_INDEX_MASK;
+
+        if (dir_index_slots[next].entry_sector == EMPTY_SLOT)
+            return;
+
+        const uint16_t home = home_slot (dir_index_slots[next].hash,
+                                         dir_index_slots[next].dir);
+
+        // leave the slot where it is if its home lies cyclically in (hole, next]
+        if (hole <= next)
+        {
+            if (hole < home && home <= next)
+                continue;
+        }
+        else
+        {
+            if (hole < home || home <= next)
+                continue;
+        }
+
+        dir_index_slots[hole] = dir_index_slots[next];
+        dir_index_slots[next].entry_sector = EMPTY_SLOT;
+        hole = next;
+    }
+}
+
+// remove every slot belonging to a directory, and free the directory
+static void evict (indexed_dir *dir)
+{
+    const uint8_t dir_number = (uint8_t)(dir - indexed_dirs);
+
+    #ifdef FAT32_DEBUG
+    debug ("Dropping index of directory ");
+    debugulong (dir->cluster);
+    debug ("\n");
+    #endif
+
+    uint16_t i = 0;
+    while (i < DIR_INDEX_SLOTS && dir->names > 0)
+    {
+        if (dir_index_slots[i].entry_sector != EMPTY_SLOT &&
+            dir_index_slots[i].dir == dir_number)
+        {  // (re-check this slot, something else may have been shifted into it)
+            delete_slot (i);
+            dir->names--;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    dir->state = DIR_UNUSED;
+    dir->names = 0;
+}
+
+// evict the least recently used directory other than keep
+// returns false if there was nothing to evict
+static bool evict_least_used (const indexed_dir *keep)
+{
+    indexed_dir *oldest = 0;
+
+    for (uint8_t i = 0; i < DIR_INDEX_DIRS; i++)
+    {
+        indexed_dir *dir = &indexed_dirs[i];
+
+        if (dir == keep || dir->state == DIR_UNUSED)
+            continue;
+
+        if (oldest == 0 ||
+            (uint16_t)(dir_index_clock - dir->last_used) >
+            (uint16_t)(dir_index_clock - oldest->last_used))
+        {
+            oldest = dir;
+        }
+    }
+
+    if (oldest == 0)
+        return false;
+
+    evict (oldest);
+    return true;
+}
+
+
+// forget everything (the filesystem is being mounted)
+void dir_index_clear (void)
+{
+    for (uint16_t i = 0; i < DIR_INDEX_SLOTS; i++)
+        dir_index_slots[i].entry_sector = EMPTY_SLOT;
+
+    for (uint8_t i = 0; i < DIR_INDEX_DIRS; i++)
+    {
+        indexed_dirs[i].state = DIR_UNUSED;
+        indexed_dirs[i].names = 0;
+    }
+
+    dir_index_names = 0;
+    dir_index_clock = 0;
+}
+
+
+// look up a name (in FAT format) in a directory's index
+dir_index_result dir_index_search (const uint32_t dir_cluster,
+                                   const char name[11],
+                                   dir_entry_condensed *result)
+{
+    indexed_dir *dir = find_dir (dir_cluster);
+
+    if (dir == 0 || dir->state != DIR_COMPLETE)
+        return DIR_INDEX_NONE;
+
+    touch (dir);
+
+    const uint8_t dir_number = (uint8_t)(dir - indexed_dirs);
+    const uint16_t hash = hash_name (name);
+    uint16_t slot = home_slot (hash, dir_number);
+
+    while (dir_index_slots[slot].entry_sector != EMPTY_SLOT)
+    {
+        const dir_index_slot *s = &dir_index_slots[slot];
+
+        if (s->dir == dir_number && s->hash == hash)
+        {  // probably the right name, check the entry itself
+            dir_entry entry;
+            const uint16_t offset = (uint16_t)s->entry_number * sizeof (dir_entry);
+
+            if (!read_partial_block (s->entry_sector,
+                                     offset,
+                                     (uint8_t*)&entry,
+                                     sizeof (dir_entry)))
+            {  // let the caller's scan run into (and report) the error
+                return DIR_INDEX_NONE;
+            }
+
+            if (fs_filenames_match (entry.name, name))
+            {
+                condense_entry (&entry, result);
+                result->entry_sector = s->entry_sector;
+                result->entry_offset = offset;
+                return DIR_INDEX_HIT;
+            }
+        }
+
+        slot = (slot + 1) & DIR_INDEX_MASK;
+    }
+
+    return DIR_INDEX_MISS;
+}
+
+
+// start building an index for a directory
+// returns false if the directory shouldn't or can't be indexed right now
+bool dir_index_begin (const uint32_t dir_cluster)
+{
+    indexed_dir *dir = find_dir (dir_cluster);
+
+    if (dir != 0)
+    {
+        if (dir->state == DIR_TOO_BIG)
+        {  // we already know it won't fit
+            touch (dir);
+            return false;
+        }
+
+        // a partial index left over from a failed scan: start over
+        evict (dir);
+    }
+
+    for (uint8_t i = 0; i < DIR_INDEX_DIRS; i++)
+    {
+        if (indexed_dirs[i].state == DIR_UNUSED)
+        {
+            dir = &indexed_dirs[i];
+            break;
+        }
+    }
+
+    if (dir == 0)
+    {  // no free directory slots, make one
+        if (!evict_least_used (0))
+            return false;
+        return dir_index_begin (dir_cluster);
+    }
+
+    dir->cluster = dir_cluster;
+    dir->names = 0;
+    dir->state = DIR_BUILDING;
+    touch (dir);
+
+    return true;
+}
+
+
+// the whole directory has been scanned, its index can be used for lookups
+void dir_index_finish (const uint32_t dir_cluster)
+{
+    indexed_dir *dir = find_dir (dir_cluster);
+
+    if (dir != 0 && dir->state == DIR_BUILDING)
+        dir->state = DIR_COMPLETE;
+}
+
+
+// record an entry (which must have its entry_sector and entry_offset set)
+// does nothing if the directory isn't indexed
+void dir_index_add (const uint32_t dir_cluster,
+                    const dir_entry_condensed *entry)
+{
+    indexed_dir *dir = find_dir (dir_cluster);
+
+    if (dir == 0 || (dir->state != DIR_BUILDING && dir->state != DIR_COMPLETE))
+        return;
+
+    if (entry->name[0] == (char)0xe5 || entry->name[0] == (char)0x00)
+        return;  // unused entries are never searched for
+
+    while (dir_index_names >= DIR_INDEX_MAX_NAMES)
+    {  // make room by throwing out other directories
+        if (!evict_least_used (dir))
+        {  // this directory is too big to index on its own
+            evict (dir);
+            dir->cluster = dir_cluster;
+            dir->state = DIR_TOO_BIG;
+            touch (dir);
+            return;
+        }
+    }
+
+    const uint8_t dir_number = (uint8_t)(dir - indexed_dirs);
+    const uint16_t hash = hash_name (entry->name);
+    uint16_t slot = home_slot (hash, dir_number);
+
+    while (dir_index_slots[slot].entry_sector != EMPTY_SLOT)
+        slot = (slot + 1) & DIR_INDEX_MASK;
+
+    dir_index_slots[slot].entry_sector = entry->entry_sector;
+    dir_index_slots[slot].hash = hash;
+    dir_index_slots[slot].dir = dir_number;
+    dir_index_slots[slot].entry_number = (uint8_t)(entry->entry_offset / sizeof (dir_entry));
+
+    dir->names++;
+    dir_index_names++;
+}
+
+
+// forget an entry that was removed from its directory
+void dir_index_remove (const uint32_t dir_cluster,
+                       const dir_entry_condensed *entry)
+{
+    indexed_dir *dir = find_dir (dir_cluster);
+
+    if (dir == 0 || (dir->state != DIR_BUILDING && dir->state != DIR_COMPLETE))
+        return;
+
+    const uint8_t dir_number = (uint8_t)(dir - indexed_dirs);
+    const uint8_t entry_number = (uint8_t)(entry->entry_offset / sizeof (dir_entry));
+    uint16_t slot = home_slot (hash_name (entry->name), dir_number);
+
+    while (dir_index_slots[slot].entry_sector != EMPTY_SLOT)
+    {
+        if (dir_index_slots[slot].dir == dir_number &&
+            dir_index_slots[slot].entry_sector == entry->entry_sector &&
+            dir_index_slots[slot].entry_number == entry_number)
+        {
+            delete_slot (slot);
+            dir->names--;
+            return;
+        }
+
+        slot = (slot + 1) & DIR_INDEX_MASK;
+    }
+}
+
+
+// forget a directory's index entirely
+void dir_index_drop (const uint32_t dir_cluster)
+{
+    indexed_dir *dir = find_dir (dir_cluster);
+
+    if (dir != 0)
+        evict (dir);
+}
+
+#endif
@@ -0,0 +1,501 @@
+/*******************************************************************************
+* sd_fat32_ringlog.c
+* version: 1.0
+* description: Optional fixed-size circular log files.  The file is created
+*              with all of its clusters allocated up front, and after that
+*              records are written straight to its sectors: appending never
+*              touches the FAT or the file's directory entry.  Every block
+*              starts with a sequence number, so the block being filled can
+*              be found by a binary search when the log is opened, and once
+*              the log is full the oldest block is overwritten.
+*
+*              Compiled in only if FAT32_RINGLOG is defined.
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "debug.h"
+
+#ifdef FAT32_RINGLOG
+
+#define RINGLOG_MAGIC ((uint16_t)0x4c52)  // "RL"
+
+#pragma pack(1)
+
+// at the start of every block of the log
+typedef struct ringlog_block_header
+{
+    uint16_t magic;     // RINGLOG_MAGIC, anything else means the block is unused
+    uint32_t sequence;  // 1 for the first block ever written, counting up
+    uint16_t used;      // bytes of the block in use, including this header
+} ringlog_block_header;
+
+#pragma pack()
+
+// each record is stored as a 16-bit length followed by its data, and
+// never crosses into the next block
+#define RINGLOG_HEADER_SIZE ((uint16_t)sizeof (ringlog_block_header))
+#define RINGLOG_USED_OFFSET 6
+
+
+// the sector holding a block of the log
+static bool block_sector (fat32_ringlog *log,
+                          const uint32_t block,
+                          uint32_t *sector)
+{
+    if (log->contiguous)
+    {
+        *sector = log->first_sector + block;
+        return true;
+    }
+
+    // a fragmented file: follow the chain, from the last cluster looked up
+    // if the block is at or beyond it (the log is mostly written in order)
+    const uint32_t index = block / fat32_sectors_per_cluster;
+
+    if (index < log->map_index)
+    {
+        log->map_index = 0;
+        log->map_cluster = files[log->file_id].first_cluster;
+    }
+
+    while (log->map_index < index)
+    {
+        if (!sd_fat32_cluster_lookup (log->map_cluster, &log->map_cluster))
+            return false;
+
+        if (sd_fat32_end_of_chain (log->map_cluster))
+        {  // the file is shorter than its size says
+            error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+            return false;
+        }
+
+        log->map_index++;
+    }
+
+    *sector = sd_fat32_cluster_sector (log->map_cluster) +
+              block % fat32_sectors_per_cluster;
+    return true;
+}
+
+
+static bool read_header (fat32_ringlog *log,
+                         const uint32_t block,
+                         ringlog_block_header *header)
+{
+    uint32_t sector;
+
+    if (!block_sector (log, block, &sector))
+        return false;
+
+    return read_partial_block (sector, 0, (uint8_t*)header, RINGLOG_HEADER_SIZE);
+}
+
+
+// a block written during the lap that block 0 was last written in
+static inline bool header_in_lap (const ringlog_block_header *header,
+                                  const uint32_t first_sequence,
+                                  const uint32_t block)
+{
+    return header->magic == RINGLOG_MAGIC &&
+           header->sequence == first_sequence + block;
+}
+
+
+// write into the log's blocks, tagged as the log file's data so that
+// sd_fat32_sync_file and sd_fat32_ringlog_sync commit them
+static bool write_log_data (fat32_ringlog *log,
+                            const uint32_t block,
+                            const uint16_t offset,
+                            const uint8_t *buffer,
+                            const uint16_t length)
+{
+    uint32_t sector;
+
+    if (!block_sector (log, block, &sector))
+        return false;
+
+    cache_owner = FILE_CACHE_OWNER (log->file_id);
+
+    const bool result = write_partial_block (sector, offset, buffer, length);
+
+    cache_owner = CACHE_NO_OWNER;
+
+    return result;
+}
+
+
+// blank the first count blocks of a file, whatever was in their sectors
+// before: the first block is zeroed in the cache and copied into the rest,
+// each uncached block going straight to the card without being read first
+static bool blank_blocks (const opened_file *file,
+                          const uint32_t count)
+{
+    uint32_t cluster = file->first_cluster;
+    uint32_t block = 0;
+    uint32_t blank_sector = INVALID_SECTOR;
+    cached_sector *blank = 0;
+
+    while (block < count)
+    {
+        for (uint8_t i = 0; i < fat32_sectors_per_cluster && block < count; i++, block++)
+        {
+            const uint32_t sector = sd_fat32_cluster_sector (cluster) + i;
+
+            if (blank == 0)
+            {
+                blank = load_block (sector);
+                if (blank == END_OF_CHAIN)
+                    return false;
+
+                for (uint16_t j = 0; j < 512; j++)
+                    blank->data[j] = 0;
+                blank->modified = true;
+                blank_sector = sector;
+            }
+            else if (!write_whole_block (sector, blank->data))
+            {
+                return false;
+            }
+        }
+
+        if (block < count)
+        {
+            if (!sd_fat32_cluster_lookup (cluster, &cluster))
+                return false;
+
+            if (blank->block_number != blank_sector)
+            {  // the FAT sector took the blank block's place in the cache
+                blank = load_block (blank_sector);
+                if (blank == END_OF_CHAIN)
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+// create a ring log of the given number of blocks in the current directory,
+// replacing any file with the same name
+bool sd_fat32_ringlog_create (const char *name,
+                              const uint32_t blocks)
+{
+    uint8_t file_id;
+
+    if (blocks == 0)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    if (!sd_fat32_open_file (name, CREATE_FILE, &file_id))
+        return false;
+
+    opened_file *file = &(files[file_id]);
+
+    // allocate every cluster in one go, which gives a contiguous file
+    // whenever there's a long enough run of free clusters
+    const uint32_t clusters = (blocks + fat32_sectors_per_cluster - 1) / fat32_sectors_per_cluster;
+
+    if (!extend_file_clusters (file, clusters) ||
+        !blank_blocks (file, blocks))
+    {
+        const uint8_t error = error_code;
+        sd_fat32_close_file (file_id);
+        error_code = error;
+        return false;
+    }
+
+    file->size = blocks * 512;
+
+    #ifdef FAT32_DEBUG
+    debug ("Created ring log of ");
+    debugulong (blocks);
+    debug (" blocks\n");
+    #endif
+
+    return sd_fat32_close_file (file_id);
+}
+
+
+// work out how the log's blocks are laid out, and find its write head
+static bool find_head (fat32_ringlog *log)
+{
+    const opened_file *file = &(files[log->file_id]);
+    ringlog_block_header header;
+
+    // check whether the file is contiguous, in which case its blocks can be
+    // found without reading the FAT
+    const uint32_t clusters = (log->blocks + fat32_sectors_per_cluster - 1) / fat32_sectors_per_cluster;
+    uint32_t cluster = file->first_cluster;
+    uint32_t next_cluster;
+
+    log->contiguous = true;
+
+    for (uint32_t i = 1; i < clusters; i++)
+    {
+        if (!sd_fat32_cluster_lookup (cluster, &next_cluster))
+            return false;
+
+        if (next_cluster != cluster + 1)
+        {
+            log->contiguous = false;
+            break;
+        }
+
+        cluster = next_cluster;
+    }
+
+    log->first_sector = sd_fat32_cluster_sector (file->first_cluster);
+    log->map_index = 0;
+    log->map_cluster = file->first_cluster;
+
+    // blocks are written in order, so the blocks from 0 up to the write head
+    // carry consecutive sequence numbers, and the ones after it belong to the
+    // previous lap (or are unused): binary search for the last one in the
+    // same lap as block 0
+    if (!read_header (log, 0, &header))
+        return false;
+
+    if (header.magic != RINGLOG_MAGIC)
+    {  // nothing has been written
+        log->head = 0;
+        log->head_sequence = 0;
+        log->head_used = 0;
+        return true;
+    }
+
+    const uint32_t first_sequence = header.sequence;
+    uint32_t low = 0;              // in the lap
+    uint32_t high = log->blocks;   // not in the lap (or past the end)
+
+    while (high - low > 1)
+    {
+        const uint32_t middle = low + (high - low) / 2;
+
+        if (!read_header (log, middle, &header))
+            return false;
+
+        if (header_in_lap (&header, first_sequence, middle))
+            low = middle;
+        else
+            high = middle;
+    }
+
+    if (!read_header (log, low, &header))
+        return false;
+
+    log->head = low;
+    log->head_sequence = first_sequence + low;
+    log->head_used = header.used;
+
+    if (log->head_used < RINGLOG_HEADER_SIZE || log->head_used > 512)
+        log->head_used = 512;  // damaged, start a new block on the next append
+
+    return true;
+}
+
+
+// open a ring log in the current directory, and find its write head
+bool sd_fat32_ringlog_open (const char *name,
+                            fat32_ringlog *log)
+{
+    // opened read-only, so closing or syncing the file never rewrites its
+    // directory entry; the log's blocks are written directly
+    if (!sd_fat32_open_file (name, READ_FILE, &log->file_id))
+        return false;
+
+    log->blocks = files[log->file_id].size / 512;
+
+    if (log->blocks == 0)
+        error_code = ERROR_FAT32_TOO_FAR;
+
+    if (log->blocks == 0 || !find_head (log))
+    {
+        const uint8_t error = error_code;
+        sd_fat32_close_file (log->file_id);
+        error_code = error;
+        return false;
+    }
+
+    #ifdef FAT32_DEBUG
+    debug ("Ring log head is block ");
+    debugulong (log->head);
+    debug (", sequence ");
+    debugulong (log->head_sequence);
+    debug ("\n");
+    #endif
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// add a record to the end of the log
+bool sd_fat32_ringlog_append (fat32_ringlog *log,
+                              const uint8_t *record,
+                              const uint16_t length)
+{
+    if (length > RINGLOG_MAX_RECORD)
+    {
+        error_code = ERROR_TOO_FAR;
+        return false;
+    }
+
+    if (length == 0)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+
+    if (log->head_sequence == 0 ||
+        log->head_used + 2 + length > 512)
+    {  // start the next block, overwriting the oldest one once the log is full
+        ringlog_block_header header;
+
+        const uint32_t block = (log->head_sequence == 0) ? 0 : (log->head + 1) % log->blocks;
+
+        header.magic = RINGLOG_MAGIC;
+        header.sequence = log->head_sequence + 1;
+        header.used = RINGLOG_HEADER_SIZE;
+
+        if (!write_log_data (log, block, 0, (uint8_t*)&header, RINGLOG_HEADER_SIZE))
+            return false;
+
+        log->head = block;
+        log->head_sequence = header.sequence;
+        log->head_used = RINGLOG_HEADER_SIZE;
+    }
+
+    const uint16_t record_offset = log->head_used;
+    const uint16_t new_used = record_offset + 2 + length;
+
+    if (!write_log_data (log, log->head, record_offset, (uint8_t*)&length, 2) ||
+        !write_log_data (log, log->head, record_offset + 2, record, length) ||
+        !write_log_data (log, log->head, RINGLOG_USED_OFFSET, (uint8_t*)&new_used, 2))
+    {
+        return false;
+    }
+
+    log->head_used = new_used;
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// write the log's modified blocks to the card
+bool sd_fat32_ringlog_sync (fat32_ringlog *log)
+{
+    return commit_owned_blocks (FILE_CACHE_OWNER (log->file_id));
+}
+
+
+bool sd_fat32_ringlog_close (fat32_ringlog *log)
+{
+    if (!sd_fat32_ringlog_sync (log))
+        return false;
+
+    return sd_fat32_close_file (log->file_id);
+}
+
+
+// point a reader at the oldest record still in the log
+void sd_fat32_ringlog_rewind (const fat32_ringlog *log,
+                              fat32_ringlog_reader *reader)
+{
+    reader->offset = RINGLOG_HEADER_SIZE;
+
+    if (log->head_sequence >= log->blocks)
+    {  // every block is in use, the oldest is the one after the head
+        reader->block = (log->head + 1) % log->blocks;
+        reader->sequence = log->head_sequence - log->blocks + 1;
+    }
+    else
+    {  // block 0 is the oldest (or nothing has been written, and the
+       // reader's sequence is past the head's)
+        reader->block = 0;
+        reader->sequence = 1;
+    }
+}
+
+
+// read the next record into buffer, which holds max_length bytes; *length is
+// set to 0 when there are no more records
+bool sd_fat32_ringlog_read (fat32_ringlog *log,
+                            fat32_ringlog_reader *reader,
+                            uint8_t *buffer,
+                            const uint16_t max_length,
+                            uint16_t *length)
+{
+    ringlog_block_header header;
+    uint32_t sector;
+    uint16_t record_length;
+    bool overrun = false;
+
+    *length = 0;
+
+    while (reader->sequence <= log->head_sequence)
+    {
+        if (!read_header (log, reader->block, &header))
+            return false;
+
+        if (header.magic != RINGLOG_MAGIC || header.sequence != reader->sequence)
+        {  // the writer has gone all the way around and overwritten this
+           // block: carry on from the oldest record that's left
+            if (overrun)
+            {  // already tried that
+                error_code = ERROR_FAT32_CLUSTER_LOOKUP;
+                return false;
+            }
+
+            overrun = true;
+            sd_fat32_ringlog_rewind (log, reader);
+            continue;
+        }
+
+        if (reader->offset + 2 <= header.used && header.used <= 512)
+        {
+            if (!block_sector (log, reader->block, &sector) ||
+                !read_partial_block (sector, reader->offset, (uint8_t*)&record_length, 2))
+            {
+                return false;
+            }
+
+            if (reader->offset + 2 + record_length > header.used)
+            {  // damaged, skip the rest of the block
+                reader->offset = 512;
+                continue;
+            }
+
+            if (record_length > max_length)
+            {  // leave the reader where it is, so it can be retried
+                error_code = ERROR_TOO_FAR;
+                return false;
+            }
+
+            if (!read_partial_block (sector, reader->offset + 2, buffer, record_length))
+                return false;
+
+            reader->offset += 2 + record_length;
+            *length = record_length;
+
+            error_code = ERROR_NONE;
+            return true;
+        }
+
+        if (reader->sequence == log->head_sequence)
+            break;  // caught up with the writer
+
+        // on to the next block
+        reader->block = (reader->block + 1) % log->blocks;
+        reader->sequence++;
+        reader->offset = RINGLOG_HEADER_SIZE;
+    }
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+#endif
@@ -0,0 +1,579 @@
+/*******************************************************************************
+* sd_fat32_tslog.c
+* version: 1.0
+* description: Optional time-series logs.  Timestamped records are packed
+*              into 512-byte blocks, each starting with a header giving the
+*              first and last timestamps in the block, and every Nth block's
+*              first timestamp is added to a sidecar index file (NAME.IDX).
+*              A time range is found by a binary search of the index, a few
+*              block headers, and then a read of just the records wanted,
+*              instead of reading the whole log.
+*
+*              Compiled in only if FAT32_TSLOG is defined.
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "fat32_filenames.h"
+#include "debug.h"
+
+#ifdef FAT32_TSLOG
+
+#define TSLOG_BLOCK_MAGIC ((uint16_t)0x4254)  // "TB"
+#define TSLOG_INDEX_MAGIC ((uint16_t)0x4954)  // "TI"
+
+// each record is a 32-bit timestamp and a 16-bit length, then the data
+#define TSLOG_RECORD_HEAD 6
+
+#pragma pack(1)
+
+typedef struct tslog_index_header
+{
+    uint16_t magic;     // TSLOG_INDEX_MAGIC
+    uint16_t interval;  // blocks per index entry
+} tslog_index_header;
+
+#pragma pack()
+
+#define TSLOG_INDEX_HEADER ((uint32_t)sizeof (tslog_index_header))
+
+static const uint8_t padding[16] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                    0, 0, 0, 0, 0, 0, 0, 0};
+
+
+// the name of a log's index file: the same name, with the extension IDX
+static bool index_name (const char *name,
+                        char index[13])
+{
+    char fs_name[13];
+
+    if (!verify_name (name, false))
+        return false;
+
+    filename_8_3_to_fs (name, fs_name);
+
+    if (fs_name[8] == 'I' && fs_name[9] == 'D' && fs_name[10] == 'X')
+    {  // the log and its index would be the same file
+        error_code = ERROR_FAT32_INVALID_NAME;
+        return false;
+    }
+
+    fs_name[8] = 'I';
+    fs_name[9] = 'D';
+    fs_name[10] = 'X';
+
+    filename_fs_to_8_3 (fs_name, index);
+    return true;
+}
+
+
+// move a file's seek position to offset, without reading the chain from
+// the start if it's just a little way ahead (the rest of the current
+// sector is skipped over in the cache)
+static bool move_to (const uint8_t file_id,
+                     const uint32_t offset)
+{
+    uint32_t position;
+    const uint8_t *view;
+    uint16_t viewed;
+
+    if (!sd_fat32_get_seek_pos (file_id, &position))
+        return false;
+
+    if (offset >= position && offset - position < 512)
+    {
+        while (position < offset)
+        {
+            if (!sd_fat32_read_view (file_id, (uint16_t)(offset - position), &view, &viewed))
+                return false;
+
+            if (viewed == 0)
+                break;
+
+            position += viewed;
+        }
+
+        if (position == offset)
+            return true;
+    }
+
+    return sd_fat32_seek (file_id, offset);
+}
+
+
+static bool read_at (const uint8_t file_id,
+                     const uint32_t offset,
+                     void *buffer,
+                     const uint16_t length)
+{
+    if (!move_to (file_id, offset))
+        return false;
+
+    return sd_fat32_read_file (file_id, length, (uint8_t*)buffer);
+}
+
+
+// append to a file, going back to its end first if it was read from
+static bool append (const uint8_t file_id,
+                    const uint32_t end,
+                    const void *buffer,
+                    const uint16_t length)
+{
+    uint32_t position;
+
+    if (!sd_fat32_get_seek_pos (file_id, &position))
+        return false;
+
+    if (position != end && !sd_fat32_seek (file_id, FILE_END_POS))
+        return false;
+
+    return sd_fat32_write_file (file_id, length, (uint8_t*)buffer);
+}
+
+
+// the sector the data file's seek position is in, which is the sector of
+// the block being filled right after some of it has been written
+static uint32_t current_sector (const uint8_t file_id)
+{
+    const opened_file *file = &(files[file_id]);
+
+    return sd_fat32_cluster_sector (file->current_cluster) + file->sector_in_cluster;
+}
+
+
+// rewrite the header of the block being filled, in place in its sector
+// (tagged as the data file's, so syncing the file writes it out)
+static bool update_header (fat32_tslog *log)
+{
+    cache_owner = FILE_CACHE_OWNER (log->data_id);
+
+    const bool result = write_partial_block (log->block_sector,
+                                             0,
+                                             (uint8_t*)&log->header,
+                                             TSLOG_BLOCK_HEADER);
+
+    cache_owner = CACHE_NO_OWNER;
+
+    return result;
+}
+
+
+// add index entries for any blocks that don't have them yet (after power
+// was lost between writing a block and its index entry)
+static bool catch_up_index (fat32_tslog *log)
+{
+    tslog_block_header header;
+
+    while (log->entries * log->interval < log->blocks)
+    {
+        if (!read_at (log->data_id, log->entries * log->interval * 512,
+                      &header, TSLOG_BLOCK_HEADER))
+            return false;
+
+        if (!append (log->index_id, TSLOG_INDEX_HEADER + log->entries * 4,
+                     &header.first_time, 4))
+            return false;
+
+        log->entries++;
+    }
+
+    return true;
+}
+
+
+// open (or rebuild) a log's index file
+static bool open_index (fat32_tslog *log,
+                        const char *name)
+{
+    tslog_index_header index_header;
+    uint32_t size;
+    char index[13];
+
+    if (!index_name (name, index))
+        return false;
+
+    if (sd_fat32_open_file (index, APPEND_FILE, &log->index_id))
+    {
+        if (sd_fat32_get_seek_pos (log->index_id, &size) &&
+            size >= TSLOG_INDEX_HEADER &&
+            read_at (log->index_id, 0, &index_header, TSLOG_INDEX_HEADER) &&
+            index_header.magic == TSLOG_INDEX_MAGIC &&
+            index_header.interval != 0)
+        {
+            log->interval = index_header.interval;
+            log->entries = (size - TSLOG_INDEX_HEADER) / 4;
+
+            // entries for blocks that never made it to the card are dropped
+            const uint32_t wanted = (log->blocks + log->interval - 1) / log->interval;
+            if (log->entries > wanted)
+            {
+                log->entries = wanted;
+                if (!sd_fat32_truncate (log->index_id, TSLOG_INDEX_HEADER + wanted * 4))
+                    return false;
+            }
+
+            return catch_up_index (log);
+        }
+
+        if (!sd_fat32_close_file (log->index_id))
+            return false;
+    }
+    else if (error_code != ERROR_FAT32_NOT_FOUND)
+    {
+        return false;
+    }
+
+    // missing or damaged: start it again
+    #ifdef FAT32_DEBUG
+    debug ("Rebuilding time-series index\n");
+    #endif
+
+    if (!sd_fat32_open_file (index, CREATE_FILE, &log->index_id))
+        return false;
+
+    index_header.magic = TSLOG_INDEX_MAGIC;
+    index_header.interval = TSLOG_DEFAULT_INTERVAL;
+
+    if (!sd_fat32_write_file (log->index_id, TSLOG_INDEX_HEADER, (uint8_t*)&index_header))
+        return false;
+
+    log->interval = TSLOG_DEFAULT_INTERVAL;
+    log->entries = 0;
+
+    return catch_up_index (log);
+}
+
+
+// create an empty time-series log in the current directory
+bool sd_fat32_tslog_create (const char *name,
+                            const uint16_t interval)
+{
+    tslog_index_header index_header;
+    char index[13];
+    uint8_t file_id;
+
+    if (interval == 0)
+    {
+        error_code = ERROR_FAT32_TOO_FAR;
+        return false;
+    }
+
+    if (!index_name (name, index))
+        return false;
+
+    if (!sd_fat32_open_file (name, CREATE_FILE, &file_id) ||
+        !sd_fat32_close_file (file_id))
+        return false;
+
+    if (!sd_fat32_open_file (index, CREATE_FILE, &file_id))
+        return false;
+
+    index_header.magic = TSLOG_INDEX_MAGIC;
+    index_header.interval = interval;
+
+    if (!sd_fat32_write_file (file_id, TSLOG_INDEX_HEADER, (uint8_t*)&index_header))
+    {
+        const uint8_t error = error_code;
+        sd_fat32_close_file (file_id);
+        error_code = error;
+        return false;
+    }
+
+    return sd_fat32_close_file (file_id);
+}
+
+
+// open a time-series log in the current directory for appending and queries
+bool sd_fat32_tslog_open (const char *name,
+                          fat32_tslog *log)
+{
+    uint32_t size;
+
+    if (!sd_fat32_open_file (name, APPEND_FILE, &log->data_id))
+        return false;
+
+    // APPEND_FILE leaves the seek position at the end
+    if (!sd_fat32_get_seek_pos (log->data_id, &size))
+        return false;
+
+    log->blocks = (size + 511) / 512;
+    log->end = size;
+
+    if (size % 512 != 0 &&
+        read_at (log->data_id, (log->blocks - 1) * 512, &log->header, TSLOG_BLOCK_HEADER) &&
+        log->header.magic == TSLOG_BLOCK_MAGIC &&
+        log->header.used == size % 512)
+    {  // carry on filling the last block
+        if (!move_to (log->data_id, size))
+            return false;
+
+        log->block_sector = current_sector (log->data_id);
+    }
+    else
+    {  // the next record starts a new block
+        log->header.magic = 0;
+        log->header.used = 512;
+    }
+
+    if (error_code != ERROR_NONE || !open_index (log, name))
+    {
+        const uint8_t error = error_code;
+        sd_fat32_close_file (log->data_id);
+        error_code = error;
+        return false;
+    }
+
+    #ifdef FAT32_DEBUG
+    debug ("Time-series log has ");
+    debugulong (log->blocks);
+    debug (" blocks, ");
+    debugulong (log->entries);
+    debug (" index entries\n");
+    #endif
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// add a record, which mustn't have an earlier timestamp than the last one
+bool sd_fat32_tslog_append (fat32_tslog *log,
+                            const uint32_t timestamp,
+                            const uint8_t *record,
+                            const uint16_t length)
+{
+    uint8_t head[TSLOG_RECORD_HEAD];
+
+    if (length == 0 || length > TSLOG_MAX_RECORD)
+    {
+        error_code = ERROR_TOO_FAR;
+        return false;
+    }
+
+    if (log->header.used + TSLOG_RECORD_HEAD + length > 512)
+    {  // start a new block: pad out the current one first
+        while (log->end % 512 != 0)
+        {
+            const uint16_t gap = 512 - (uint16_t)(log->end % 512);
+            const uint16_t chunk = (gap < sizeof (padding)) ? gap : sizeof (padding);
+
+            if (!append (log->data_id, log->end, padding, chunk))
+                return false;
+
+            log->end += chunk;
+        }
+
+        log->header.magic = TSLOG_BLOCK_MAGIC;
+        log->header.count = 0;
+        log->header.first_time = timestamp;
+        log->header.last_time = timestamp;
+        log->header.used = TSLOG_BLOCK_HEADER;
+
+        if (!append (log->data_id, log->end, &log->header, TSLOG_BLOCK_HEADER))
+            return false;
+
+        log->end += TSLOG_BLOCK_HEADER;
+        log->block_sector = current_sector (log->data_id);
+        log->blocks++;
+
+        if ((log->blocks - 1) % log->interval == 0)
+        {  // this block gets an index entry
+            if (!append (log->index_id, TSLOG_INDEX_HEADER + log->entries * 4,
+                         &timestamp, 4))
+                return false;
+
+            log->entries++;
+        }
+    }
+
+    head[0] = (uint8_t)timestamp;
+    head[1] = (uint8_t)(timestamp >> 8);
+    head[2] = (uint8_t)(timestamp >> 16);
+    head[3] = (uint8_t)(timestamp >> 24);
+    head[4] = (uint8_t)length;
+    head[5] = (uint8_t)(length >> 8);
+
+    if (!append (log->data_id, log->end, head, TSLOG_RECORD_HEAD))
+        return false;
+
+    if (!sd_fat32_write_file (log->data_id, length, (uint8_t*)record))
+        return false;
+
+    log->end += TSLOG_RECORD_HEAD + length;
+
+    log->header.count++;
+    log->header.last_time = timestamp;
+    log->header.used += TSLOG_RECORD_HEAD + length;
+
+    return update_header (log);
+}
+
+
+bool sd_fat32_tslog_sync (fat32_tslog *log)
+{
+    return sd_fat32_sync_file (log->data_id) &&
+           sd_fat32_sync_file (log->index_id);
+}
+
+
+bool sd_fat32_tslog_close (fat32_tslog *log)
+{
+    const bool data_closed = sd_fat32_close_file (log->data_id);
+    const uint8_t error = error_code;
+
+    if (!sd_fat32_close_file (log->index_id))
+        return false;
+
+    error_code = error;
+    return data_closed;
+}
+
+
+// point a reader at the first record with a timestamp of at least time
+bool sd_fat32_tslog_seek_time (fat32_tslog *log,
+                               fat32_tslog_reader *reader,
+                               const uint32_t time)
+{
+    tslog_block_header header;
+    uint32_t entry_time;
+    uint8_t head[TSLOG_RECORD_HEAD];
+
+    // the last index entry with a first timestamp before time (records
+    // with the same timestamp can carry on from the block before)
+    uint32_t low = 0;
+    uint32_t high = log->entries;
+
+    while (high - low > 1)
+    {
+        const uint32_t middle = low + (high - low) / 2;
+
+        if (!read_at (log->index_id, TSLOG_INDEX_HEADER + middle * 4, &entry_time, 4))
+            return false;
+
+        if (entry_time < time)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    // then the first block after it that goes up to time
+    uint32_t block = low * log->interval;
+
+    for (; block < log->blocks; block++)
+    {
+        if (!read_at (log->data_id, block * 512, &header, TSLOG_BLOCK_HEADER))
+            return false;
+
+        if (header.magic == TSLOG_BLOCK_MAGIC && header.last_time >= time)
+            break;
+    }
+
+    if (block >= log->blocks)
+    {  // nothing that late yet: wait at the end of the log
+        reader->position = log->end;
+        reader->used = (uint16_t)(log->end % 512);
+
+        error_code = ERROR_NONE;
+        return true;
+    }
+
+    // and the first record in that block that's late enough
+    reader->position = block * 512 + TSLOG_BLOCK_HEADER;
+    reader->used = header.used;
+
+    while (reader->position % 512 < reader->used)
+    {
+        if (!read_at (log->data_id, reader->position, head, TSLOG_RECORD_HEAD))
+            return false;
+
+        const uint32_t record_time = (uint32_t)head[0] | ((uint32_t)head[1] << 8) |
+                                     ((uint32_t)head[2] << 16) | ((uint32_t)head[3] << 24);
+
+        if (record_time >= time)
+            break;
+
+        reader->position += TSLOG_RECORD_HEAD + ((uint16_t)head[4] | ((uint16_t)head[5] << 8));
+    }
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// read the record at a reader's position, and move past it; *length is set
+// to 0 when there are no more records
+bool sd_fat32_tslog_read (fat32_tslog *log,
+                          fat32_tslog_reader *reader,
+                          uint32_t *timestamp,
+                          uint8_t *buffer,
+                          const uint16_t max_length,
+                          uint16_t *length)
+{
+    tslog_block_header header;
+    uint8_t head[TSLOG_RECORD_HEAD];
+
+    *length = 0;
+
+    while (reader->position < log->end)
+    {
+        const uint16_t in_block = (uint16_t)(reader->position % 512);
+
+        if (in_block == 0)
+        {  // entering a block
+            if (!read_at (log->data_id, reader->position, &header, TSLOG_BLOCK_HEADER))
+                return false;
+
+            if (header.magic != TSLOG_BLOCK_MAGIC ||
+                header.used < TSLOG_BLOCK_HEADER || header.used > 512)
+            {  // damaged, skip it
+                reader->position += 512;
+                continue;
+            }
+
+            reader->used = header.used;
+            reader->position += TSLOG_BLOCK_HEADER;
+            continue;
+        }
+
+        if (reader->position / 512 == log->blocks - 1)
+            reader->used = log->header.used;  // the block being filled
+
+        if (in_block >= reader->used)
+        {  // on to the next block
+            reader->position += 512 - in_block;
+            continue;
+        }
+
+        if (!read_at (log->data_id, reader->position, head, TSLOG_RECORD_HEAD))
+            return false;
+
+        const uint16_t record_length = (uint16_t)head[4] | ((uint16_t)head[5] << 8);
+
+        if (in_block + TSLOG_RECORD_HEAD + record_length > reader->used)
+        {  // damaged, skip the rest of the block
+            reader->position += 512 - in_block;
+            continue;
+        }
+
+        if (record_length > max_length)
+        {  // leave the reader where it is, so it can be retried
+            error_code = ERROR_TOO_FAR;
+            return false;
+        }
+
+        if (!sd_fat32_read_file (log->data_id, record_length, buffer))
+            return false;
+
+        *timestamp = (uint32_t)head[0] | ((uint32_t)head[1] << 8) |
+                     ((uint32_t)head[2] << 16) | ((uint32_t)head[3] << 24);
+        *length = record_length;
+        reader->position += TSLOG_RECORD_HEAD + record_length;
+
+        error_code = ERROR_NONE;
+        return true;
+    }
+
+    error_code = ERROR_NONE;
+    return true;
+}
+
+#endif
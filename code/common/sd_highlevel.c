@@ -156,58 +156,13 @@ bool init_card (crc_option crc_type)
 
 
 
-// reads an entire block into the cache
-// intended for use only by read_partial_block and write_partial_block
-bool read_whole_block (const uint32_t block_number)
+// Read a block's data from the SD card, retrying on errors
+static bool fetch_block (const uint32_t block_number,
+                         uint8_t *data)
 {
     uint8_t crc_retries = CRC_RETRIES;
     uint8_t timeout_retries = TIMEOUT_RETRIES;
-    uint8_t unknown_retries = UNKNOWN_RETRIES;    
-    
-    ret status;
-    
-    cached_sector *sector = cache_lookup (block_number);
-    
-    if (sector != END_OF_CHAIN)
-    {  // we already have this sector in the cache
-        // move it to the head of the cache chain, to mark it as most recently accessed
-        if (!move_to_head (sector))
-            return false;
-        
-        error_code = ERROR_NONE;
-        return true;
-    }
-    
-    #ifdef LOWLEVEL_DEBUG
-    debug ("cache miss for ");
-    debugulong (block_number);
-    debug ("\n");
-    #endif
-    
-    // if the sector is not cached, remove the oldest cached sector
-    sector = remove_least_used();
-    
-    if (sector->block_number != INVALID_SECTOR && sector->modified)
-    {  // if the oldest cached sector was valid and modified, write it out
-        #ifdef HIGHLEVEL_DEBUG
-        debug ("loading block ");
-        debugulong (block_number);
-        debug (" forced commit of cached block ");
-        debugulong (sector->block_number);
-        debug ("\n");
-        #endif
-        
-        if (!write_to_card (sector))
-        {  // write failed, re-add this sector to the cache chain and fail
-            add_as_head (sector);
-            return false;
-        }
-    }
-    
-    // use the sector to store the block to be read, and make it the new head
-    sector->block_number = block_number;
-    sector->modified = false;
-    add_as_head (sector);
+    uint8_t unknown_retries = UNKNOWN_RETRIES;
     
     #ifdef LOWLEVEL_DEBUG
     debug ("reading ");
@@ -215,8 +170,9 @@ bool read_whole_block (const uint32_t block_number)
     debug (" from SD card\n");
     #endif
     
+    ret status;
 read:
-    status = read_block (block_number, sector->data);
+    status = read_block (block_number, data);
     
     switch (status)
     {
@@ -230,9 +186,6 @@ read:
             }
             else
             {
-                // give the sector a bad sector number so it isn't treated as valid data
-                sector->block_number = INVALID_SECTOR;
-                
                 error_code = ERROR_CRC;
                 return false;
             }
@@ -245,9 +198,6 @@ read:
             }
             else
             {
-                // give the sector a bad sector number so it isn't treated as valid data
-                sector->block_number = INVALID_SECTOR;
-                
                 error_code = ERROR_TIMEOUT;
                 return false;
             }
@@ -267,9 +217,6 @@ read:
                 }
                 else
                 {
-                    // give the sector a bad sector number so it isn't treated as valid data
-                    sector->block_number = INVALID_SECTOR;
-                    
                     error_code = ERROR_UNKNOWN;
                     return false;
                 }
@@ -282,6 +229,66 @@ read:
 }
 
 
+// reads an entire block into the cache
+// intended for use only by read_partial_block and write_partial_block
+bool read_whole_block (const uint32_t block_number)
+{
+    cached_sector *sector = cache_lookup (block_number);
+    
+    if (sector != END_OF_CHAIN)
+    {  // we already have this sector in the cache
+        // move it to the head of the cache chain, to mark it as most recently accessed
+        if (!move_to_head (sector))
+            return false;
+        
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    #ifdef LOWLEVEL_DEBUG
+    debug ("cache miss for ");
+    debugulong (block_number);
+    debug ("\n");
+    #endif
+    
+    // if the sector is not cached, remove the oldest cached sector
+    sector = remove_least_used();
+    
+    if (sector->block_number != INVALID_SECTOR && sector->modified)
+    {  // if the oldest cached sector was valid and modified, write it out
+        #ifdef HIGHLEVEL_DEBUG
+        debug ("loading block ");
+        debugulong (block_number);
+        debug (" forced commit of cached block ");
+        debugulong (sector->block_number);
+        debug ("\n");
+        #endif
+        
+        if (!write_to_card (sector))
+        {  // write failed, re-add this sector to the cache chain and fail
+            add_as_head (sector);
+            return false;
+        }
+    }
+    
+    // use the sector to store the block to be read, and make it the new head
+    sector->block_number = block_number;
+    sector->modified = false;
+    sector->owner = CACHE_NO_OWNER;
+    add_as_head (sector);
+    
+    if (!fetch_block (block_number, sector->data))
+    {
+        // give the sector a bad sector number so it isn't treated as valid data
+        sector->block_number = INVALID_SECTOR;
+        return false;
+    }
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
 
 
 // reads data, blocks are 512 bytes long
@@ -330,6 +337,41 @@ bool read_partial_block (const uint32_t block_number,
 }
 
 
+// read an entire block into buffer
+//
+// if the block is cached, the cached copy is used (it may be newer than what
+// is on the card); otherwise the data comes straight from the card, without
+// evicting anything from the cache
+bool read_whole_block_uncached (const uint32_t block_number,
+                                uint8_t *buffer)
+{
+    if (!initialized)
+    {
+        error_code = ERROR_CARD_UNINIT;
+        return false;
+    }
+    
+    if (buffer == 0)
+    {
+        error_code = ERROR_NULL_BUFFER;
+        return false;
+    }
+    
+    cached_sector *sector = cache_lookup (block_number);
+    
+    if (sector != END_OF_CHAIN)
+    {
+        for (uint16_t i = 0; i < 512; i++)
+            buffer[i] = sector->data[i];
+        
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    return fetch_block (block_number, buffer);
+}
+
+
 // reads a block's CRC value without storing block data
 // (this function is not affected by caching)
 bool read_block_crc (const uint32_t block_number,
@@ -484,40 +526,16 @@ bool write_partial_block (const uint32_t block_number,
     #endif
     
     sector->modified = true;
+    sector->owner = cache_owner;
     
     return true;
 }
 
 
-// Write a modified cached sector to the SD card
-bool write_to_card (cached_sector *sector)
+// Write a block's data to the SD card, retrying on errors
+static bool commit_block (const uint32_t block_number,
+                          uint8_t *data)
 {
-    // ignore attempts to write to an invalid sector number
-    // this usually happens when flushing if the cache has not been fully used
-    if (sector->block_number == INVALID_SECTOR)
-    {
-        error_code = ERROR_NONE;
-        return true;
-    }
-    
-    if (!sector->modified)
-    {
-        #ifdef HIGHLEVEL_DEBUG
-        debug ("Block ");
-        debugulong (sector->block_number);
-        debug (" unmodified, not writing\n");
-        #endif
-        
-        error_code = ERROR_NONE;
-        return true;
-    }
-    
-    #ifdef HIGHLEVEL_DEBUG
-    debug ("Committing write to block ");
-    debugulong (sector->block_number);
-    debug ("\n");
-    #endif
-    
     uint8_t crc_retries = CRC_RETRIES;
     uint8_t timeout_retries = TIMEOUT_RETRIES;
     uint8_t unknown_retries = UNKNOWN_RETRIES;
@@ -525,7 +543,7 @@ bool write_to_card (cached_sector *sector)
     // write the whole block to the card
     ret status;
 write:
-    status = write_block (sector->block_number, sector->data);
+    status = write_block (block_number, data);
     
     switch (status)
     {
@@ -582,9 +600,9 @@ write:
     debug ("WRITE VERIFICATION\n");
     #endif
     
-    uint16_t written_crc = crc16_ccitt (sector->data, block_length);
+    uint16_t written_crc = crc16_ccitt (data, block_length);
     uint16_t returned_crc;
-    if (!read_block_crc (sector->block_number, &returned_crc))
+    if (!read_block_crc (block_number, &returned_crc))
         return false;
     
     if (written_crc != returned_crc)
@@ -616,6 +634,42 @@ write:
     
     #endif
     
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// Write a modified cached sector to the SD card
+bool write_to_card (cached_sector *sector)
+{
+    // ignore attempts to write to an invalid sector number
+    // this usually happens when flushing if the cache has not been fully used
+    if (sector->block_number == INVALID_SECTOR)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    if (!sector->modified)
+    {
+        #ifdef HIGHLEVEL_DEBUG
+        debug ("Block ");
+        debugulong (sector->block_number);
+        debug (" unmodified, not writing\n");
+        #endif
+        
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    #ifdef HIGHLEVEL_DEBUG
+    debug ("Committing write to block ");
+    debugulong (sector->block_number);
+    debug ("\n");
+    #endif
+    
+    if (!commit_block (sector->block_number, sector->data))
+        return false;
     
     sector->modified = false;
     
@@ -623,3 +677,100 @@ write:
     return true;
 }
 
+
+// read a block into the cache (if it isn't there already) and return its node
+//
+// the returned node is only valid until the next block access, since any
+// read or write could evict it from the cache
+cached_sector *load_block (const uint32_t block_number)
+{
+    if (!initialized)
+    {
+        error_code = ERROR_CARD_UNINIT;
+        return END_OF_CHAIN;
+    }
+    
+    if (!read_whole_block (block_number))
+        return END_OF_CHAIN;
+    
+    // read_whole_block always leaves the block at the head of the cache chain
+    return head;
+}
+
+
+// read a block into the cache ahead of time, if that doesn't mean writing out
+// the least used sector to make room for it
+bool prefetch_block (const uint32_t block_number,
+                     bool *loaded)
+{
+    *loaded = false;
+    
+    if (!initialized)
+    {
+        error_code = ERROR_CARD_UNINIT;
+        return false;
+    }
+    
+    if (cache_lookup (block_number) != END_OF_CHAIN)
+    {  // already cached
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    cached_sector *least_used = head;
+    while (least_used->next != END_OF_CHAIN)
+        least_used = least_used->next;
+    
+    if (least_used->modified && least_used->block_number != INVALID_SECTOR)
+    {  // leave it to be written out first
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    *loaded = true;
+    return read_whole_block (block_number);
+}
+
+
+// overwrite an entire block
+//
+// if the block is cached, the cached copy is replaced and marked as modified;
+// otherwise the data goes straight to the card, without reading the old
+// contents of the block into the cache first
+bool write_whole_block (const uint32_t block_number,
+                        const uint8_t *buffer)
+{
+    if (!initialized)
+    {
+        error_code = ERROR_CARD_UNINIT;
+        return false;
+    }
+    
+    if (buffer == 0)
+    {
+        error_code = ERROR_NULL_BUFFER;
+        return false;
+    }
+    
+    cached_sector *sector = cache_lookup (block_number);
+    
+    if (sector != END_OF_CHAIN)
+    {  // keep the cached copy coherent
+        for (uint16_t i = 0; i < 512; i++)
+            sector->data[i] = buffer[i];
+        
+        sector->modified = true;
+        sector->owner = cache_owner;
+        
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    #ifdef HIGHLEVEL_DEBUG
+    debug ("Writing whole block ");
+    debugulong (block_number);
+    debug ("\n");
+    #endif
+    
+    return commit_block (block_number, (uint8_t*)buffer);
+}
@@ -27,7 +27,7 @@
 #define CACHED_SECTORS 1
 #elif (defined(ATMEGA328) || defined(M2))
 #define CACHED_SECTORS 2
-#elif (defined(M4))
+#elif (defined(M4) || defined(HOST))
 #define CACHED_SECTORS 8
 #else
 #error Unknown target
@@ -42,17 +42,26 @@
 typedef struct cached_sector
 {
     uint32_t block_number;
+    uint8_t  data[512];  // kept word-aligned, FAT and directory code index it in place
     bool     modified;
-    uint8_t  data[512];
+    uint8_t  owner;      // cache_owner at the time of the last partial/whole block write
     struct cached_sector *next;
 } cached_sector;
 
 #define INVALID_SECTOR ((uint32_t)0xffffffff)
 #define END_OF_CHAIN ((cached_sector*)0)
 
+// blocks that don't belong to anything in particular (filesystem metadata)
+#define CACHE_NO_OWNER 0
+
 extern cached_sector cache[CACHED_SECTORS];
 extern cached_sector *head;
 
+// blocks modified by write_partial_block and write_whole_block are tagged with
+// this value, so that a subset of the modified blocks can be committed later
+// (leave it as CACHE_NO_OWNER except around writes that belong to something)
+extern uint8_t cache_owner;
+
 // initialize the cache chain, each node containing block 0xffffffff
 void init_cache (void);
 
@@ -71,6 +80,18 @@ void add_as_head (cached_sector *node);
 // write out any modified cached sectors, then re-initialize the cache chain
 bool flush_cache (void);
 
+// write out the modified cached sectors tagged with either owner or
+// CACHE_NO_OWNER, and keep everything in the cache
+bool commit_owned_blocks (const uint8_t owner);
+
+// write out every modified cached sector, and keep everything in the cache
+bool commit_cache (void);
+
+// write out the least recently used modified cached sector other than the
+// head (which is the one most likely to be modified again), and keep it in
+// the cache; *committed is cleared if there was nothing to write
+bool commit_least_used (bool *committed);
+
 // end of sector caching
 //------------------------------------------------------------------------------
 
@@ -121,6 +142,13 @@ bool read_partial_block (const uint32_t block_number,
                          uint8_t *buffer,
                          const uint16_t length);
 
+// reads an entire block straight into buffer, bypassing the cache
+//
+// meant for bulk reads: a cached copy of the block is used if there is one,
+// but a block that isn't cached is not added to the cache
+bool read_whole_block_uncached (const uint32_t block_number,
+                                uint8_t *buffer);
+
 // reads the CRC value of a block, without storing any block data
 // (this function is not affected by caching)
 bool read_block_crc (const uint32_t block_number,
@@ -140,5 +168,27 @@ bool write_partial_block (const uint32_t block_number,
 // Write a modified cached sector to the SD card
 bool write_to_card (cached_sector *sector);
 
+
+// read a block into the cache and return its cache node, or END_OF_CHAIN on
+// error
+//
+// this allows a whole cached sector to be examined or modified in place; the
+// node is only valid until the next block access (any other read or write
+// might evict it), and it must be marked as modified if it was changed
+cached_sector *load_block (const uint32_t block_number);
+
+// read a block into the cache ahead of time, unless it's there already or
+// making room for it would mean writing out a modified sector first (so this
+// costs at most one block read); *loaded is set if the block was read
+bool prefetch_block (const uint32_t block_number,
+                     bool *loaded);
+
+// overwrite an entire block
+//
+// if the block is not already cached, it is written directly to the card
+// (there's no need to read the old contents first)
+bool write_whole_block (const uint32_t block_number,
+                        const uint8_t *buffer);
+
 #endif
 
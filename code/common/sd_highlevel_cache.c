@@ -15,6 +15,7 @@
 
 cached_sector cache[CACHED_SECTORS];
 cached_sector *head;
+uint8_t cache_owner = CACHE_NO_OWNER;
 
 // initialize the cache chain, each node containing block 0xffffffff
 void init_cache (void)
@@ -23,6 +24,7 @@ void init_cache (void)
     {
         cache[i].block_number = INVALID_SECTOR;
         cache[i].modified = false;
+        cache[i].owner = CACHE_NO_OWNER;
         
         if (i == 0)
             head = &cache[i];
@@ -143,3 +145,58 @@ bool flush_cache (void)
     return result;
 }
 
+
+// write out the modified cached sectors tagged with either owner or
+// CACHE_NO_OWNER, and keep everything in the cache
+bool commit_owned_blocks (const uint8_t owner)
+{
+    for (uint8_t i = 0; i < CACHED_SECTORS; i++)
+    {
+        if (cache[i].modified &&
+            (cache[i].owner == owner || cache[i].owner == CACHE_NO_OWNER))
+        {
+            if (!write_to_card (&cache[i]))
+                return false;
+        }
+    }
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// write out every modified cached sector, and keep everything in the cache
+bool commit_cache (void)
+{
+    for (uint8_t i = 0; i < CACHED_SECTORS; i++)
+    {
+        if (!write_to_card (&cache[i]))
+            return false;
+    }
+    
+    error_code = ERROR_NONE;
+    return true;
+}
+
+
+// write out the least recently used modified cached sector other than the
+// head, and keep it in the cache
+bool commit_least_used (bool *committed)
+{
+    cached_sector *oldest = END_OF_CHAIN;
+    
+    for (cached_sector *c = head->next; c != END_OF_CHAIN; c = c->next)
+    {
+        if (c->modified && c->block_number != INVALID_SECTOR)
+            oldest = c;
+    }
+    
+    *committed = (oldest != END_OF_CHAIN);
+    if (!*committed)
+    {
+        error_code = ERROR_NONE;
+        return true;
+    }
+    
+    return write_to_card (oldest);
+}
@@ -19,8 +19,11 @@
 #elif defined(M4)
 // M4 code
 #include "mGeneral.h"
+#elif defined(HOST)
+// PC tools, working on a card image (see code/host)
+#include "host_general.h"
 #else
-#error "Unknown device, use -DM2, -DATMEGA168, -DATMEGA328, or -DM4 in your makefile"
+#error "Unknown device, use -DM2, -DATMEGA168, -DATMEGA328, -DM4, or -DHOST in your makefile"
 #endif
 
 #ifndef bool
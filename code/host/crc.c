@@ -0,0 +1 @@
+../common/crc.c
\ No newline at end of file
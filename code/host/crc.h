@@ -0,0 +1 @@
+../common/crc.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/debug.h
\ No newline at end of file
@@ -0,0 +1,205 @@
+/*******************************************************************************
+* defrag.c
+* description: PC tool that reports how fragmented the files on a card image
+*              are, and defragments them with the same code the device uses.
+*
+*              usage: defrag [-n] image
+*                -n  only report, don't move anything
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// an object in a directory listing, with its name
+typedef struct directory_entry
+{
+    char name[13];
+    listed_object object;
+} directory_entry;
+
+static bool analyze_only = false;
+static uint32_t fragmented_files = 0;
+static uint32_t moved_files = 0;
+
+
+static void report_error (const char *what, const char *path)
+{
+    fprintf (stderr, "defrag: %s %s failed, error %u\n", what, path, error_code);
+}
+
+// read the current directory's listing into a new array (which the caller
+// frees), so it isn't disturbed by going into subdirectories
+static directory_entry *list_directory (uint32_t *count)
+{
+    directory_entry *objects = 0;
+    uint32_t allocated = 0;
+    char name[13];
+    listed_object object;
+
+    *count = 0;
+
+    bool found = sd_fat32_list_dir_first (name, &object);
+    while (found)
+    {
+        if (name[0] != '.')  // skip "." and ".."
+        {
+            if (*count == allocated)
+            {
+                allocated = allocated ? allocated * 2 : 16;
+                objects = realloc (objects, allocated * sizeof (directory_entry));
+                if (objects == 0)
+                {
+                    fprintf (stderr, "defrag: out of memory\n");
+                    exit (1);
+                }
+            }
+
+            strcpy (objects[*count].name, name);
+            objects[*count].object = object;
+            (*count)++;
+        }
+
+        found = sd_fat32_list_dir_next (name, &object);
+    }
+
+    return objects;
+}
+
+static bool process_directory (const char *path)
+{
+    uint32_t count;
+    directory_entry *objects = list_directory (&count);
+    bool ok = true;
+
+    for (uint32_t i = 0; i < count && ok; i++)
+    {
+        char object_path[256];
+        uint32_t clusters, extents;
+
+        snprintf (object_path, sizeof (object_path), "%s/%s", path, objects[i].name);
+
+        if (objects[i].object.is_directory)
+        {
+            if (!sd_fat32_push (objects[i].name))
+            {
+                report_error ("entering", object_path);
+                ok = false;
+                break;
+            }
+
+            ok = process_directory (object_path);
+
+            if (!sd_fat32_pop())
+            {
+                report_error ("leaving", object_path);
+                ok = false;
+            }
+            continue;
+        }
+
+        if (!sd_fat32_file_extents (objects[i].name, &clusters, &extents))
+        {
+            report_error ("reading", object_path);
+            ok = false;
+            break;
+        }
+
+        printf ("%-40s %8u clusters %6u extents", object_path, clusters, extents);
+
+        if (extents > 1)
+        {
+            fragmented_files++;
+
+            if (!analyze_only)
+            {
+                if (sd_fat32_defrag_file (objects[i].name))
+                {
+                    moved_files++;
+                    printf ("  -> 1 extent");
+                }
+                else if (error_code == ERROR_FAT32_FULL)
+                {
+                    printf ("  (no free run long enough)");
+                }
+                else
+                {
+                    printf ("\n");
+                    report_error ("moving", object_path);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        printf ("\n");
+    }
+
+    free (objects);
+    return ok;
+}
+
+static bool report_free_space (const char *when)
+{
+    uint32_t free_kb, free_runs, largest_run;
+
+    if (!sd_fat32_free_space (&free_kb) ||
+        !sd_fat32_free_extents (&free_runs, &largest_run))
+    {
+        report_error ("reading", "free space");
+        return false;
+    }
+
+    printf ("free space %s: %u KB in %u runs, longest run %u clusters\n",
+            when, free_kb, free_runs, largest_run);
+    return true;
+}
+
+int main (int argc, char **argv)
+{
+    const char *image_path = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp (argv[i], "-n") == 0)
+            analyze_only = true;
+        else
+            image_path = argv[i];
+    }
+
+    if (image_path == 0)
+    {
+        fprintf (stderr, "usage: defrag [-n] image\n");
+        return 2;
+    }
+
+    if (!sd_image_open (image_path))
+    {
+        perror (image_path);
+        return 1;
+    }
+
+    if (!sd_fat32_init())
+    {
+        report_error ("mounting", image_path);
+        return 1;
+    }
+
+    bool ok = report_free_space ("before") && process_directory ("");
+
+    if (ok && !analyze_only)
+        ok = report_free_space ("after");
+
+    printf ("%u fragmented files, %u defragmented\n", fragmented_files, moved_files);
+
+    if (!sd_fat32_shutdown())
+    {
+        report_error ("unmounting", image_path);
+        ok = false;
+    }
+
+    sd_image_close();
+    return ok ? 0 : 1;
+}
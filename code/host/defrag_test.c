@@ -0,0 +1,218 @@
+/*******************************************************************************
+* defrag_test.c
+* description: Regression test for the fragmentation report and the
+*              incremental defragmenter (sd_fat32_defrag.c).  Two files are
+*              written a piece at a time in turn, so that each is split into
+*              dozens of extents, and one of them is moved a few sectors per
+*              step: cancelled partway, abandoned by opening or deleting it
+*              partway, and then carried through.  Its contents and the
+*              image (no leaked or cross-linked clusters, right free count)
+*              are checked after each.
+*
+*              The same is done in a subdirectory, switching between it
+*              and the root.  Built with DIR_INDEX as defrag_index_test, it
+*              runs with the directory name index keeping track of it all.
+*
+*              usage: defrag_test (leaves defrag_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <stdio.h>
+
+#ifdef DIR_INDEX
+#define TEST_NAME "defrag_index_test"
+#else
+#define TEST_NAME "defrag_test"
+#endif
+#define IMAGE TEST_NAME ".img"
+
+#define PIECE  700
+#define PIECES 40
+#define SIZE   (PIECE * PIECES)
+
+static uint8_t buffer[SIZE];
+
+
+static uint8_t pattern (const uint32_t offset, const uint8_t seed)
+{
+    return (uint8_t)(offset * 5 + offset / 257 + seed);
+}
+
+// write two files a piece at a time in turn, so their clusters interleave
+static bool write_interleaved (const char *first, const char *second,
+                               const uint8_t seed)
+{
+    uint8_t ids[2];
+
+    if (!sd_fat32_open_file (first, CREATE_FILE, &ids[0]) ||
+        !sd_fat32_open_file (second, CREATE_FILE, &ids[1]))
+        return false;
+
+    for (uint32_t piece = 0; piece < PIECES; piece++)
+    {
+        for (uint8_t f = 0; f < 2; f++)
+        {
+            for (uint32_t i = 0; i < PIECE; i++)
+                buffer[i] = pattern (piece * PIECE + i, (uint8_t)(seed + f));
+
+            if (!sd_fat32_write_file (ids[f], PIECE, buffer))
+                return false;
+        }
+    }
+
+    return sd_fat32_close_file (ids[0]) && sd_fat32_close_file (ids[1]);
+}
+
+static bool contents_intact (const char *name, const uint8_t seed)
+{
+    uint8_t file_id;
+    bool intact = sd_fat32_open_file (name, READ_FILE, &file_id) &&
+                  sd_fat32_read_file (file_id, SIZE, buffer);
+
+    for (uint32_t i = 0; intact && i < SIZE; i++)
+        intact = (buffer[i] == pattern (i, seed));
+
+    return sd_fat32_close_file (file_id) && intact;
+}
+
+static uint32_t extents_of (const char *name)
+{
+    uint32_t clusters, extents;
+
+    if (!sd_fat32_file_extents (name, &clusters, &extents))
+        return 0;
+    return extents;
+}
+
+// unmount and check the image, then mount it again
+static void check_image (void)
+{
+    uint32_t free_clusters;
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+    CHECK (test_image_check_fat32 (IMAGE, &free_clusters));
+    CHECK (sd_image_open (IMAGE) && sd_fat32_init());
+}
+
+// run a job's steps until it's done, counting them
+static uint32_t run_steps (const uint16_t max_sectors)
+{
+    uint32_t steps = 0;
+    bool done = false;
+
+    while (!done && CHECK (sd_fat32_defrag_step (max_sectors, &done)))
+        steps++;
+
+    return steps;
+}
+
+
+int main (void)
+{
+    uint32_t free_before, free_after, free_runs, largest_run;
+    uint8_t file_id;
+    bool done;
+
+    if (!CHECK (test_image_fat32 (IMAGE, 16, 1)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_fat32_init()))
+        return test_summary (TEST_NAME);
+
+    CHECK (write_interleaved ("A.BIN", "B.BIN", 1));
+    CHECK (write_interleaved ("C.BIN", "D.BIN", 3));
+    CHECK (sd_fat32_mkdir ("DIR"));
+
+    // deleting B leaves a gap after each of A's pieces, too short for A
+    CHECK (sd_fat32_delete ("B.BIN"));
+    CHECK (!sd_fat32_open_file ("B.BIN", READ_FILE, &file_id) &&
+           error_code == ERROR_FAT32_NOT_FOUND);
+    CHECK (extents_of ("A.BIN") > PIECES / 2);
+    CHECK (sd_fat32_free_extents (&free_runs, &largest_run) && free_runs > PIECES / 2);
+    CHECK (sd_fat32_free_space (&free_before));
+
+    // what can't be defragmented
+    CHECK (!sd_fat32_defrag_begin ("DIR") && error_code == ERROR_FAT32_NOT_FILE);
+    CHECK (!sd_fat32_defrag_begin ("NONE.BIN") && error_code == ERROR_FAT32_NOT_FOUND);
+    CHECK (sd_fat32_open_file ("A.BIN", READ_FILE, &file_id));
+    CHECK (!sd_fat32_defrag_begin ("A.BIN") && error_code == ERROR_FAT32_ALREADY_OPEN);
+    CHECK (sd_fat32_close_file (file_id));
+
+    // cancelled after some of it has been copied: the file is left alone,
+    // and the run it was going into is given back
+    CHECK (sd_fat32_defrag_begin ("A.BIN"));
+    for (uint8_t i = 0; i < 5; i++)
+        CHECK (sd_fat32_defrag_step (4, &done) && !done);
+    CHECK (sd_fat32_defrag_cancel());
+    CHECK (extents_of ("A.BIN") > PIECES / 2);
+    CHECK (contents_intact ("A.BIN", 1));
+    CHECK (sd_fat32_free_space (&free_after) && free_after == free_before);
+    check_image();
+
+    // opening the file partway gives up on the job
+    CHECK (sd_fat32_defrag_begin ("A.BIN"));
+    CHECK (sd_fat32_defrag_step (30, &done) && !done);
+    CHECK (sd_fat32_open_file ("A.BIN", READ_FILE, &file_id));
+    CHECK (sd_fat32_defrag_step (30, &done) && done);
+    CHECK (sd_fat32_close_file (file_id));
+    CHECK (extents_of ("A.BIN") > PIECES / 2);
+    CHECK (contents_intact ("A.BIN", 1));
+    check_image();
+
+    // and so does deleting it
+    CHECK (sd_fat32_defrag_begin ("C.BIN"));
+    CHECK (sd_fat32_defrag_step (30, &done) && !done);
+    CHECK (sd_fat32_delete ("C.BIN"));
+    CHECK (sd_fat32_defrag_step (30, &done) && done);
+    check_image();
+    CHECK (sd_fat32_free_space (&free_before));
+
+    // carried through a few sectors at a time
+    CHECK (sd_fat32_defrag_begin ("A.BIN"));
+    CHECK (run_steps (8) > SIZE / 512 / 8);
+    CHECK (extents_of ("A.BIN") == 1);
+    CHECK (contents_intact ("A.BIN", 1));
+    CHECK (sd_fat32_free_space (&free_after) && free_after == free_before);
+
+    // a contiguous file is done straight away
+    CHECK (sd_fat32_defrag_begin ("A.BIN"));
+    CHECK (sd_fat32_defrag_step (1, &done) && done);
+
+    // and one moved in a single call
+    CHECK (extents_of ("D.BIN") > PIECES / 2);
+    CHECK (sd_fat32_defrag_file ("D.BIN"));
+    CHECK (extents_of ("D.BIN") == 1);
+    CHECK (contents_intact ("D.BIN", 4));
+
+    // in the subdirectory, going back to the root partway
+    CHECK (sd_fat32_push ("DIR"));
+    CHECK (write_interleaved ("E.BIN", "F.BIN", 5));
+    CHECK (sd_fat32_delete ("F.BIN"));
+    CHECK (!sd_fat32_delete ("F.BIN") && error_code == ERROR_FAT32_NOT_FOUND);
+    CHECK (extents_of ("E.BIN") > PIECES / 2);
+    CHECK (sd_fat32_defrag_file ("E.BIN"));
+    CHECK (sd_fat32_pop());
+    CHECK (contents_intact ("A.BIN", 1));
+    CHECK (extents_of ("E.BIN") == 0 && error_code == ERROR_FAT32_NOT_FOUND);
+    CHECK (sd_fat32_push ("DIR"));
+    CHECK (extents_of ("E.BIN") == 1);
+    CHECK (contents_intact ("E.BIN", 5));
+    CHECK (sd_fat32_delete ("E.BIN"));
+    CHECK (sd_fat32_pop());
+    CHECK (sd_fat32_rmdir ("DIR"));
+    CHECK (!sd_fat32_push ("DIR") && error_code == ERROR_FAT32_NOT_FOUND);
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+
+    uint32_t free_clusters;
+    CHECK (test_image_check_fat32 (IMAGE, &free_clusters));
+
+    const int status = test_summary (TEST_NAME);
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
@@ -0,0 +1,308 @@
+/*******************************************************************************
+* exfat_test.c
+* description: Regression test for the exFAT driver (sd_exfat.c), on an
+*              image formatted by test_image.c.  It mounts the volume, grows
+*              a contiguous (NoFatChain) file, has another file block it so
+*              that it's converted to a FAT chain, truncates both kinds,
+*              works in a subdirectory, and then runs a fixed sequence of
+*              random appends, rewrites and truncates on a few files against
+*              copies kept in RAM, remounting along the way.  The image's
+*              entry set checksums, name hashes, allocations and bitmap are
+*              checked at the end, along with the free space.
+*
+*              usage: exfat_test (leaves exfat_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_exfat.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define IMAGE "exfat_test.img"
+
+#define FILES    3
+#define MAX_SIZE 65536
+#define ROUNDS   300
+
+typedef struct model_file
+{
+    const char *name;
+    uint8_t  data[MAX_SIZE];
+    uint32_t size;
+} model_file;
+
+static model_file model[FILES] = {{"Alpha.dat"}, {"beta_file.bin"}, {"GAMMA"}};
+static uint8_t buffer[MAX_SIZE];
+
+
+// write length bytes at offset (where the seek position has to be), keeping
+// the copy in step
+static bool write_at (model_file *file, const uint8_t file_id,
+                      const uint32_t offset, const uint32_t length,
+                      const uint8_t seed)
+{
+    for (uint32_t i = 0; i < length; i++)
+        buffer[i] = (uint8_t)((offset + i) * 13 + (offset + i) / 251 + seed);
+
+    if (!sd_exfat_write_file (file_id, length, buffer))
+        return false;
+
+    for (uint32_t i = 0; i < length; i++)
+        file->data[offset + i] = buffer[i];
+    if (offset + length > file->size)
+        file->size = offset + length;
+
+    return true;
+}
+
+static bool contents_match (const model_file *file, const uint8_t file_id)
+{
+    uint32_t size;
+
+    if (!sd_exfat_seek (file_id, 0) ||
+        !sd_exfat_read_file (file_id, file->size, buffer))
+        return false;
+
+    for (uint32_t i = 0; i < file->size; i++)
+    {
+        if (buffer[i] != file->data[i])
+        {
+            fprintf (stderr, "%s differs at byte %u\n", file->name, i);
+            return false;
+        }
+    }
+
+    return !sd_exfat_read_file (file_id, 1, buffer) &&
+           sd_exfat_get_seek_pos (file_id, &size) && size == file->size;
+}
+
+// the size in the file's directory entry (which is up to date once the file
+// is closed or synced)
+static bool recorded_size_matches (const model_file *file)
+{
+    uint32_t size;
+
+    return sd_exfat_get_size (file->name, &size) && size == file->size;
+}
+
+static bool same_name (const char *a, const char *b)
+{
+    while (*a && toupper ((unsigned char)*a) == toupper ((unsigned char)*b))
+    {
+        a++;
+        b++;
+    }
+
+    return (*a == *b);
+}
+
+static bool first_cluster_of (const char *name, uint32_t *first_cluster)
+{
+    char listed[EXFAT_NAME_LENGTH + 1];
+    listed_object object;
+
+    bool found = sd_exfat_list_dir_first (listed, &object);
+    while (found)
+    {
+        if (same_name (listed, name))
+        {
+            *first_cluster = object.first_cluster;
+            return true;
+        }
+        found = sd_exfat_list_dir_next (listed, &object);
+    }
+
+    return false;
+}
+
+static bool remount (void)
+{
+    return sd_exfat_shutdown() && sd_exfat_init();
+}
+
+// unmount and check the image as it stands, expecting the given number of
+// contiguous files, then mount it again
+static void check_image (const uint32_t expected_contiguous)
+{
+    uint32_t free_clusters, contiguous;
+
+    CHECK (sd_exfat_shutdown());
+    sd_image_close();
+
+    if (CHECK (test_image_check_exfat (IMAGE, &free_clusters, &contiguous)))
+        CHECK (contiguous == expected_contiguous);
+
+    CHECK (sd_image_open (IMAGE) && sd_exfat_init());
+}
+
+
+// a contiguous file, blocked by another so it has to become a chain
+static void contiguous_then_chained (void)
+{
+    model_file *a = &model[0];
+    model_file *b = &model[1];
+    uint8_t a_id, b_id;
+    uint32_t a_first, b_first;
+
+    CHECK (sd_exfat_open_file (a->name, CREATE_FILE, &a_id));
+    for (uint32_t offset = 0; offset < 20000; offset += 2500)
+        CHECK (write_at (a, a_id, offset, 2500, 1));
+    CHECK (sd_exfat_close_file (a_id));
+
+    CHECK (sd_exfat_open_file (b->name, CREATE_FILE, &b_id));
+    CHECK (write_at (b, b_id, 0, 6000, 2));
+    CHECK (sd_exfat_close_file (b_id));
+
+    // 1 KB clusters: b starts right after a's 20, and both are contiguous
+    CHECK (first_cluster_of (a->name, &a_first));
+    CHECK (first_cluster_of (b->name, &b_first) && b_first == a_first + 20);
+    check_image (2);
+
+    // names match without regard to case
+    CHECK (sd_exfat_open_file ("ALPHA.DAT", APPEND_FILE, &a_id));
+    CHECK (sd_exfat_seek (a_id, a->size));
+    CHECK (write_at (a, a_id, a->size, 9000, 3));
+    CHECK (contents_match (a, a_id));
+
+    // cut back inside the chain, and inside the contiguous file
+    CHECK (sd_exfat_truncate (a_id, 24321));
+    a->size = 24321;
+    CHECK (contents_match (a, a_id));
+    CHECK (!sd_exfat_truncate (a_id, 24322) && error_code == ERROR_FAT32_TOO_FAR);
+    CHECK (sd_exfat_close_file (a_id));
+    check_image (1);  // a is a chain now
+
+    CHECK (sd_exfat_open_file (b->name, APPEND_FILE, &b_id));
+    CHECK (sd_exfat_truncate (b_id, 1500));
+    b->size = 1500;
+    CHECK (contents_match (b, b_id));
+    CHECK (sd_exfat_close_file (b_id));
+    CHECK (recorded_size_matches (a) && recorded_size_matches (b));
+
+    CHECK (remount());
+
+    CHECK (sd_exfat_open_file (a->name, READ_FILE, &a_id));
+    CHECK (contents_match (a, a_id));
+    CHECK (!sd_exfat_truncate (a_id, 0) && error_code == ERROR_FAT32_FILE_READ_ONLY);
+    CHECK (sd_exfat_close_file (a_id));
+}
+
+// a file with a full-length lower-case name, in a subdirectory (it runs into
+// the first file's chain, so it's chained too)
+static void subdirectory (void)
+{
+    model_file sub = {"lower_name15chr"};
+    uint8_t file_id;
+    bool is_directory;
+
+    CHECK (sd_exfat_mkdir ("Sub"));
+    CHECK (sd_exfat_object_exists ("SUB", &is_directory) && is_directory);
+    CHECK (sd_exfat_push ("sub"));
+    CHECK (sd_exfat_open_file (sub.name, CREATE_FILE, &file_id));
+    CHECK (write_at (&sub, file_id, 0, 5000, 4));
+    CHECK (sd_exfat_close_file (file_id));
+    CHECK (sd_exfat_open_file ("LOWER_NAME15CHR", READ_FILE, &file_id));
+    CHECK (contents_match (&sub, file_id));
+    CHECK (sd_exfat_close_file (file_id));
+    CHECK (sd_exfat_pop());
+
+    CHECK (!sd_exfat_rmdir ("Sub"));  // it isn't empty
+}
+
+// random appends, rewrites and truncates, the same ones every run
+static void random_rounds (void)
+{
+    srand (1);
+
+    for (uint32_t round = 0; round < ROUNDS; round++)
+    {
+        model_file *file = &model[rand() % FILES];
+        uint8_t file_id;
+
+        if (!CHECK (sd_exfat_open_file (file->name, APPEND_FILE, &file_id)))
+            continue;
+
+        const int action = rand() % 4;
+        if (action <= 1 && file->size < MAX_SIZE)
+        {  // append
+            const uint32_t length = 1 + (uint32_t)rand() % (MAX_SIZE - file->size);
+            CHECK (sd_exfat_seek (file_id, file->size) &&
+                   write_at (file, file_id, file->size, length < 3000 ? length : 3000,
+                             (uint8_t)round));
+        }
+        else if (action == 2 && file->size > 0)
+        {  // rewrite part of it
+            const uint32_t offset = (uint32_t)rand() % file->size;
+            const uint32_t length = 1 + (uint32_t)rand() % (file->size - offset);
+            CHECK (sd_exfat_seek (file_id, offset) &&
+                   write_at (file, file_id, offset, length, (uint8_t)round));
+        }
+        else
+        {
+            const uint32_t size = file->size ? (uint32_t)rand() % file->size : 0;
+            if (CHECK (sd_exfat_truncate (file_id, size)))
+                file->size = size;
+        }
+
+        if (round % 50 == 49)
+            CHECK (contents_match (file, file_id));
+
+        CHECK (sd_exfat_close_file (file_id));
+
+        if (round % 100 == 99)
+            CHECK (remount());
+    }
+
+    for (uint8_t i = 0; i < FILES; i++)
+    {
+        uint8_t file_id;
+
+        CHECK (sd_exfat_open_file (model[i].name, READ_FILE, &file_id) &&
+               contents_match (&model[i], file_id) &&
+               sd_exfat_close_file (file_id));
+        CHECK (recorded_size_matches (&model[i]));
+    }
+}
+
+
+int main (void)
+{
+    uint32_t free_kb, free_clusters, contiguous;
+
+    if (!CHECK (test_image_exfat (IMAGE, 16, 2)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_exfat_init()))
+        return test_summary ("exfat_test");
+
+    contiguous_then_chained();
+    subdirectory();
+
+    // the third file is created empty, and only grows in the random rounds
+    uint8_t file_id;
+    CHECK (sd_exfat_open_file (model[2].name, CREATE_FILE, &file_id) &&
+           sd_exfat_close_file (file_id));
+
+    random_rounds();
+
+    // a bigger file written in one go, into whatever space is free
+    model_file last = {"Last.bin"};
+    CHECK (sd_exfat_open_file (last.name, CREATE_FILE, &file_id) &&
+           write_at (&last, file_id, 0, 40000, 5) &&
+           contents_match (&last, file_id) &&
+           sd_exfat_close_file (file_id));
+
+    CHECK (sd_exfat_free_space (&free_kb));
+    CHECK (sd_exfat_shutdown());
+    sd_image_close();
+
+    if (CHECK (test_image_check_exfat (IMAGE, &free_clusters, &contiguous)))
+        CHECK (free_clusters == free_kb);  // 1 KB clusters
+
+    const int status = test_summary ("exfat_test");
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
@@ -0,0 +1 @@
+../common/fat32_filenames.c
\ No newline at end of file
@@ -0,0 +1 @@
+../common/fat32_filenames.h
\ No newline at end of file
@@ -0,0 +1,164 @@
+/*******************************************************************************
+* full_test.c
+* description: Regression test for writes that fill the card.  A file is
+*              grown in large writes until the card is full: the write that
+*              runs out of room has to fill every cluster that was left, and
+*              leave the file's cluster chain no longer than its size.  A new
+*              file written on the full card has to stay empty.  Once some
+*              room is freed the file is grown again, and read back whole
+*              against the pattern it was written with.
+*
+*              usage: full_test (leaves full_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <stdio.h>
+
+#define IMAGE "full_test.img"
+
+// 2 KB clusters; an odd write length, so no write ends on a cluster boundary
+#define CLUSTER_BYTES 2048
+#define PIECE         99999
+
+static uint8_t buffer[PIECE];
+
+
+static uint8_t pattern (const uint32_t offset)
+{
+    return (uint8_t)(offset * 7 + offset / 509 + 3);
+}
+
+// write length bytes of the pattern at the file's seek position (offset)
+static bool write_pattern (const uint8_t file_id, const uint32_t offset,
+                           const uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++)
+        buffer[i] = pattern (offset + i);
+
+    return sd_fat32_write_file (file_id, length, buffer);
+}
+
+// the whole file reads back as the pattern, and is size bytes long
+static bool contents_match (const char *name, const uint32_t size)
+{
+    uint8_t file_id;
+    uint32_t offset = 0;
+
+    if (!sd_fat32_open_file (name, READ_FILE, &file_id))
+        return false;
+
+    bool intact = true;
+    while (intact && offset < size)
+    {
+        const uint32_t length = (size - offset < PIECE) ? size - offset : PIECE;
+
+        intact = sd_fat32_read_file (file_id, length, buffer);
+        for (uint32_t i = 0; intact && i < length; i++)
+        {
+            if (buffer[i] != pattern (offset + i))
+            {
+                fprintf (stderr, "byte %u differs\n", offset + i);
+                intact = false;
+            }
+        }
+
+        offset += length;
+    }
+
+    intact = intact && !sd_fat32_read_file (file_id, 1, buffer) &&
+             error_code == ERROR_FAT32_TOO_FAR;
+
+    return sd_fat32_close_file (file_id) && intact;
+}
+
+// grow the file until a write fails; *size is set to how big it got
+static bool fill_card (const uint8_t file_id, uint32_t *size)
+{
+    if (!sd_fat32_get_seek_pos (file_id, size))
+        return false;
+
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        const bool written = write_pattern (file_id, *size, PIECE);
+        const uint8_t error = error_code;
+
+        if (!sd_fat32_get_seek_pos (file_id, size))
+            return false;
+
+        if (!written)
+            return error == ERROR_FAT32_FULL;
+    }
+
+    return false;
+}
+
+static void check_image (void)
+{
+    uint32_t free_clusters;
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+    if (CHECK (test_image_check_fat32 (IMAGE, &free_clusters)))
+        CHECK (free_clusters == 0);
+    CHECK (sd_image_open (IMAGE) && sd_fat32_init());
+}
+
+
+int main (void)
+{
+    uint8_t file_id, empty_id;
+    uint32_t size, free_kb, spare_kb;
+
+    if (!CHECK (test_image_fat32 (IMAGE, 8, 4)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_fat32_init()))
+        return test_summary ("full_test");
+
+    // a file to delete later, to make some room
+    CHECK (sd_fat32_open_file ("SPARE.BIN", CREATE_FILE, &file_id));
+    CHECK (write_pattern (file_id, 0, 10 * CLUSTER_BYTES + 1));
+    CHECK (sd_fat32_close_file (file_id));
+
+    // the write that runs out of room fills every cluster there was, though
+    // it wanted more than that at once
+    CHECK (sd_fat32_free_space (&free_kb));
+    CHECK (sd_fat32_open_file ("FILL.BIN", CREATE_FILE, &file_id));
+    CHECK (fill_card (file_id, &size));
+    CHECK (size == free_kb * 1024);
+    CHECK (sd_fat32_free_space (&free_kb) && free_kb == 0);
+
+    // as do writes on the full card, which leave the file where it was
+    CHECK (!write_pattern (file_id, size, 10) && error_code == ERROR_FAT32_FULL);
+    CHECK (sd_fat32_close_file (file_id));
+
+    // a new file gets no clusters at all
+    CHECK (sd_fat32_open_file ("EMPTY.BIN", CREATE_FILE, &empty_id));
+    CHECK (!write_pattern (empty_id, 0, 3 * CLUSTER_BYTES) && error_code == ERROR_FAT32_FULL);
+    CHECK (sd_fat32_close_file (empty_id));
+
+    check_image();
+    CHECK (contents_match ("FILL.BIN", size));
+
+    // with room again, the file carries on from its end
+    CHECK (sd_fat32_delete ("SPARE.BIN"));
+    CHECK (sd_fat32_free_space (&spare_kb) && spare_kb == 11 * CLUSTER_BYTES / 1024);
+    CHECK (sd_fat32_open_file ("FILL.BIN", APPEND_FILE, &file_id));
+    CHECK (write_pattern (file_id, size, 5 * CLUSTER_BYTES + 7));
+    CHECK (fill_card (file_id, &size));
+    CHECK (sd_fat32_close_file (file_id));
+
+    check_image();
+    CHECK (contents_match ("FILL.BIN", size));
+    CHECK (contents_match ("EMPTY.BIN", 0));
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+
+    const int status = test_summary ("full_test");
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
@@ -0,0 +1,19 @@
+/*******************************************************************************
+* host_general.h
+* description: Stand-in for m_general.h/mGeneral.h when the filesystem code is
+*              built for a PC (-DHOST), to work on card images.  Tables the
+*              AVR keeps in flash are ordinary constants here.
+*******************************************************************************/
+
+#ifndef HOST_GENERAL_H
+#define HOST_GENERAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+
+#endif
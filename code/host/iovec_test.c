@@ -0,0 +1,183 @@
+/*******************************************************************************
+* iovec_test.c
+* description: Regression test for sd_fat32_readv and sd_fat32_writev.
+*              Vectors of uneven pieces (empty ones, and ones that straddle
+*              sector and cluster boundaries) are written and read at
+*              various seek positions against a copy of the file kept in
+*              RAM.  A read past the end must leave everything as it was,
+*              and vectored writes that grow the file while another file
+*              grows alongside it must each get a single run of clusters.
+*
+*              usage: iovec_test (leaves iovec_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <stdio.h>
+
+#define IMAGE "iovec_test.img"
+
+#define MAX_SIZE 65536
+#define PIECES   6
+
+static uint8_t expected[MAX_SIZE];
+static uint32_t expected_size = 0;
+
+// the pieces' buffers, one after another
+static uint8_t pieces[MAX_SIZE];
+
+// uneven lengths, with an empty piece and pieces longer than a sector
+static const uint16_t lengths[PIECES] = {1, 511, 0, 1537, 77, 2048};
+#define VECTOR_LENGTH (1 + 511 + 0 + 1537 + 77 + 2048)
+
+
+static void make_vector (fat32_iovec *vector)
+{
+    uint32_t offset = 0;
+
+    for (uint8_t i = 0; i < PIECES; i++)
+    {
+        vector[i].buffer = &pieces[offset];
+        vector[i].length = lengths[i];
+        offset += lengths[i];
+    }
+}
+
+// write the vector at offset (the seek position), from a fresh pattern
+static bool writev_at (const uint8_t file_id, const uint32_t offset,
+                       const uint8_t seed)
+{
+    fat32_iovec vector[PIECES];
+
+    make_vector (vector);
+    for (uint32_t i = 0; i < VECTOR_LENGTH; i++)
+        pieces[i] = (uint8_t)(i * 11 + i / 263 + seed);
+
+    if (!sd_fat32_seek (file_id, offset) ||
+        !sd_fat32_writev (file_id, vector, PIECES))
+        return false;
+
+    for (uint32_t i = 0; i < VECTOR_LENGTH; i++)
+        expected[offset + i] = pieces[i];
+    if (offset + VECTOR_LENGTH > expected_size)
+        expected_size = offset + VECTOR_LENGTH;
+
+    uint32_t position;
+    return sd_fat32_get_seek_pos (file_id, &position) &&
+           position == offset + VECTOR_LENGTH;
+}
+
+// read the vector from offset, and compare it with the copy
+static bool readv_matches (const uint8_t file_id, const uint32_t offset)
+{
+    fat32_iovec vector[PIECES];
+    uint32_t position;
+
+    make_vector (vector);
+
+    if (!sd_fat32_seek (file_id, offset) ||
+        !sd_fat32_readv (file_id, vector, PIECES) ||
+        !sd_fat32_get_seek_pos (file_id, &position) ||
+        position != offset + VECTOR_LENGTH)
+        return false;
+
+    for (uint32_t i = 0; i < VECTOR_LENGTH; i++)
+    {
+        if (pieces[i] != expected[offset + i])
+        {
+            fprintf (stderr, "byte %u differs\n", offset + i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint32_t extents_of (const char *name)
+{
+    uint32_t clusters, extents;
+
+    if (!sd_fat32_file_extents (name, &clusters, &extents))
+        return 0;
+    return extents;
+}
+
+
+int main (void)
+{
+    uint8_t file_id, other_id;
+    uint32_t position;
+
+    if (!CHECK (test_image_fat32 (IMAGE, 16, 1)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_fat32_init()))
+        return test_summary ("iovec_test");
+
+    CHECK (sd_fat32_open_file ("VEC.BIN", CREATE_FILE, &file_id));
+
+    // growing the file from the start, then from the middle of a sector
+    CHECK (writev_at (file_id, 0, 1));
+    CHECK (writev_at (file_id, 3000, 2));
+
+    // over part of what's there, running past the end
+    CHECK (writev_at (file_id, 5000, 3));
+
+    // read back from each of those places, and from places in between
+    CHECK (readv_matches (file_id, 0));
+    CHECK (readv_matches (file_id, 3000));
+    CHECK (readv_matches (file_id, 5000));
+    CHECK (readv_matches (file_id, 777));
+    CHECK (readv_matches (file_id, expected_size - VECTOR_LENGTH));
+
+    // a read that would go past the end reads nothing and doesn't move
+    fat32_iovec vector[PIECES];
+    make_vector (vector);
+    for (uint32_t i = 0; i < VECTOR_LENGTH; i++)
+        pieces[i] = 0xa5;
+    CHECK (sd_fat32_seek (file_id, expected_size - VECTOR_LENGTH + 1));
+    CHECK (!sd_fat32_readv (file_id, vector, PIECES) && error_code == ERROR_FAT32_TOO_FAR);
+    CHECK (sd_fat32_get_seek_pos (file_id, &position) &&
+           position == expected_size - VECTOR_LENGTH + 1);
+    CHECK (pieces[0] == 0xa5 && pieces[VECTOR_LENGTH - 1] == 0xa5);
+
+    // an empty vector does nothing
+    CHECK (sd_fat32_readv (file_id, vector, 0) && sd_fat32_writev (file_id, vector, 0));
+    CHECK (sd_fat32_get_seek_pos (file_id, &position) &&
+           position == expected_size - VECTOR_LENGTH + 1);
+
+    // with another file growing in step with it, each vector still gets a
+    // single run of clusters (the first carries on from the file's own run,
+    // as the other file is still empty then)
+    CHECK (sd_fat32_close_file (file_id));
+    CHECK (extents_of ("VEC.BIN") == 1);
+    CHECK (sd_fat32_open_file ("VEC.BIN", APPEND_FILE, &file_id));
+    CHECK (sd_fat32_open_file ("OTHER.BIN", CREATE_FILE, &other_id));
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        CHECK (writev_at (file_id, expected_size, (uint8_t)(4 + i)));
+        CHECK (sd_fat32_write_file (other_id, 600, pieces));
+    }
+    CHECK (sd_fat32_close_file (file_id));
+    CHECK (sd_fat32_close_file (other_id));
+    CHECK (extents_of ("VEC.BIN") == 4);
+
+    CHECK (sd_fat32_open_file ("VEC.BIN", READ_FILE, &file_id));
+    CHECK (!sd_fat32_writev (file_id, vector, PIECES) &&
+           error_code == ERROR_FAT32_FILE_READ_ONLY);
+    for (uint32_t offset = 0; offset + VECTOR_LENGTH <= expected_size; offset += 1999)
+        CHECK (readv_matches (file_id, offset));
+    CHECK (sd_fat32_close_file (file_id));
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+
+    uint32_t free_clusters;
+    CHECK (test_image_check_fat32 (IMAGE, &free_clusters));
+
+    const int status = test_summary ("iovec_test");
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
@@ -0,0 +1 @@
+../common/m_microsd_mbus.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/m_microsd_mbus.c
\ No newline at end of file
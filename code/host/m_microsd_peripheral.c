@@ -0,0 +1 @@
+../peripheral/m_microsd.c
\ No newline at end of file
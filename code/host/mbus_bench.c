@@ -0,0 +1,627 @@
+/*******************************************************************************
+* mbus_bench.c
+* description: PC tool that runs the mBus master code (m_microsd_mbus.c)
+*              against the peripheral code (peripheral/m_microsd.c) over the
+*              simulated I2C bus in mbus_sim.c, with a card image as the
+*              card.  It writes a file with plain writes, another with
+*              posted writes and a third with write-behind, reads them back
+*              and checks them, and reports
+*              how long each took in simulated time, along with the time a
+*              small order (getting the seek position) takes.  Then it lists
+*              a directory of 300 files and a subdirectory three ways: names
+*              with m_sd_get_dir_entry_first/next and then a lookup of each,
+*              the whole directory with m_sd_list_dir, and just the files
+*              matching LOG*.TXT.  It reads part of a file with a batch and
+*              then with separate calls, checks that a batch stops at the
+*              step that fails, tries the fused calls, and checks that an
+*              error held after a write-behind write is reported when
+*              write-behind is turned off.  The files are deleted again at
+*              the end.  Last comes the latency of each kind of m_sd_* call
+*              made, and the bus traffic it took.
+*
+*              Every result is checked, so it doubles as a regression test
+*              of the mBus protocol: a check that fails is reported and the
+*              run carries on, and it ends with a count of checks and
+*              failures (and exits with 1 if any failed).
+*
+*              usage: mbus_bench image [kilobytes [bus kHz]]
+*              (the bus runs at 100, 400 (the default) or 1000 kHz)
+*******************************************************************************/
+
+#include "m_microsd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK 4096
+
+#define SMALL_ORDERS 100
+
+// files in the directory that's listed, a third of them DATnnnnn.BIN and
+// the rest LOGnnnnn.TXT, each nnnnn % 500 bytes long
+#define LISTED_FILES 300
+#define LISTED_LOGS  (LISTED_FILES - (LISTED_FILES + 2) / 3)
+
+// room for the names listed: the files, SUB, . and .., and one more to
+// catch any that shouldn't be there
+#define LISTED_NAMES (LISTED_FILES + 4)
+
+// the file read with batches, and the part of it read each time
+#define BATCH_FILE_SIZE 3000
+#define BATCH_READ      100
+#define BATCH_RUNS      20
+
+static uint8_t chunk[CHUNK];
+static uint8_t check[CHUNK];
+
+static uint64_t started_us;
+
+typedef enum write_kind
+{
+    PLAIN_WRITES,
+    POSTED_WRITES,
+    BEHIND_WRITES
+} write_kind;
+
+// each kind of call timed, for the latency report
+typedef enum call_kind
+{
+    CALL_INIT,
+    CALL_OPEN,
+    CALL_WRITE,
+    CALL_POSTED_WRITE,
+    CALL_WAIT_POSTED,
+    CALL_BEHIND_WRITE,
+    CALL_WRITE_BEHIND,
+    CALL_READ,
+    CALL_GET_SEEK_POS,
+    CALL_DIR_ENTRY,
+    CALL_OBJECT_EXISTS,
+    CALL_GET_SIZE,
+    CALL_LIST_DIR,
+    CALL_BATCH,
+    CALL_OPEN_AT,
+    CALL_READ_AT,
+    CALL_WRITE_SYNC,
+    CALL_CLOSE,
+    CALL_DELETE,
+    CALL_SHUTDOWN,
+    NUM_CALLS
+} call_kind;
+
+typedef struct call_stats
+{
+    const char *name;
+    uint32_t calls;
+    uint64_t total_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t bytes;   // on the bus
+    uint32_t nacks;   // looks that found the peripheral busy
+} call_stats;
+
+static call_stats stats[NUM_CALLS] =
+{
+    [CALL_INIT]          = { .name = "init" },
+    [CALL_OPEN]          = { .name = "open" },
+    [CALL_WRITE]         = { .name = "write" },
+    [CALL_POSTED_WRITE]  = { .name = "posted write" },
+    [CALL_WAIT_POSTED]   = { .name = "wait posted" },
+    [CALL_BEHIND_WRITE]  = { .name = "behind write" },
+    [CALL_WRITE_BEHIND]  = { .name = "write-behind" },
+    [CALL_READ]          = { .name = "read" },
+    [CALL_GET_SEEK_POS]  = { .name = "get seek pos" },
+    [CALL_DIR_ENTRY]     = { .name = "dir entry" },
+    [CALL_OBJECT_EXISTS] = { .name = "object exists" },
+    [CALL_GET_SIZE]      = { .name = "get size" },
+    [CALL_LIST_DIR]      = { .name = "list dir" },
+    [CALL_BATCH]         = { .name = "batch" },
+    [CALL_OPEN_AT]       = { .name = "open at" },
+    [CALL_READ_AT]       = { .name = "read at" },
+    [CALL_WRITE_SYNC]    = { .name = "write sync" },
+    [CALL_CLOSE]         = { .name = "close" },
+    [CALL_DELETE]        = { .name = "delete" },
+    [CALL_SHUTDOWN]      = { .name = "shutdown" }
+};
+
+static uint64_t call_started_us;
+static mbus_sim_counts call_started;
+
+// time a call: TIMED (CALL_READ, m_sd_read_file (...)) gives the call's result
+#define TIMED(call, expression) (call_start(), call_end (call, (expression)))
+
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+// count a check, reporting it (and carrying on) if it failed
+static bool expect (const bool passed, const char *what)
+{
+    checks++;
+
+    if (!passed)
+    {
+        failures++;
+        fprintf (stderr, "mbus_bench: %s failed, error %u\n", what, m_sd_error_code);
+    }
+
+    return passed;
+}
+
+// the pattern written to each file, different for each chunk
+static void fill_chunk (const uint32_t number)
+{
+    for (uint32_t i = 0; i < CHUNK; i++)
+        chunk[i] = (uint8_t)(i * 7 + number * 13 + i / 251);
+}
+
+static void start_timing (void)
+{
+    started_us = mbus_sim_time_us();
+}
+
+static void call_start (void)
+{
+    call_started_us = mbus_sim_time_us();
+    mbus_sim_get_counts (&call_started);
+}
+
+static bool call_end (const call_kind call, const bool result)
+{
+    const uint64_t us = mbus_sim_time_us() - call_started_us;
+    call_stats *const s = &stats[call];
+    mbus_sim_counts now;
+
+    mbus_sim_get_counts (&now);
+
+    if (s->calls == 0 || us < s->min_us)
+        s->min_us = us;
+    if (us > s->max_us)
+        s->max_us = us;
+
+    s->calls++;
+    s->total_us += us;
+    s->bytes += now.bytes - call_started.bytes;
+    s->nacks += now.nacked_starts - call_started.nacked_starts;
+
+    return result;
+}
+
+static void report (const char *what, const uint32_t kilobytes)
+{
+    const uint64_t us = mbus_sim_time_us() - started_us;
+
+    printf ("%-14s %6u KB in %8.1f ms, %6.1f KB/s\n", what, kilobytes,
+            us / 1000.0, us ? kilobytes * 1000000.0 / us : 0.0);
+}
+
+static void write_file (const char *name, const uint32_t kilobytes, const write_kind kind)
+{
+    const bool post = (kind == POSTED_WRITES);
+    uint8_t file_id;
+
+    if (!expect (TIMED (CALL_OPEN, m_sd_open_file (name, CREATE_FILE, &file_id)),
+                 "open for writing"))
+        return;
+
+    if (kind == BEHIND_WRITES)
+        expect (TIMED (CALL_WRITE_BEHIND, m_sd_write_behind (true)), "write-behind");
+
+    start_timing();
+
+    for (uint32_t i = 0; i < kilobytes * 1024 / CHUNK; i++)
+    {
+        fill_chunk (i);
+
+        if (post)
+        {
+            if (!expect (TIMED (CALL_POSTED_WRITE, m_sd_post_write_file (file_id, CHUNK, chunk)),
+                         "posted write"))
+                break;
+        }
+        else if (!expect (TIMED ((kind == BEHIND_WRITES) ? CALL_BEHIND_WRITE : CALL_WRITE,
+                                 m_sd_write_file (file_id, CHUNK, chunk)),
+                          "write"))
+        {
+            break;
+        }
+    }
+
+    if (post)
+        expect (TIMED (CALL_WAIT_POSTED, m_sd_wait_posted()), "posted write");
+
+    report (post ? "posted writes" :
+            (kind == BEHIND_WRITES) ? "behind writes" : "writes", kilobytes);
+
+    // (which also reports any error a write ran into after it was acknowledged)
+    if (kind == BEHIND_WRITES)
+        expect (TIMED (CALL_WRITE_BEHIND, m_sd_write_behind (false)), "write-behind");
+
+    expect (TIMED (CALL_CLOSE, m_sd_close_file (file_id)), "close");
+}
+
+static void read_file (const char *name, const uint32_t kilobytes)
+{
+    uint8_t file_id;
+
+    if (!expect (TIMED (CALL_OPEN, m_sd_open_file (name, READ_FILE, &file_id)),
+                 "open for reading"))
+        return;
+
+    start_timing();
+
+    for (uint32_t i = 0; i < kilobytes * 1024 / CHUNK; i++)
+    {
+        if (!expect (TIMED (CALL_READ, m_sd_read_file (file_id, CHUNK, check)), "read"))
+            break;
+
+        fill_chunk (i);
+
+        uint32_t j = 0;
+        while (j < CHUNK && check[j] == chunk[j])
+            j++;
+
+        if (j < CHUNK)
+            fprintf (stderr, "mbus_bench: %s differs at byte %u\n", name, i * CHUNK + j);
+        if (!expect (j == CHUNK, "reading back what was written"))
+            break;
+    }
+
+    report ("reads", kilobytes);
+
+    expect (TIMED (CALL_CLOSE, m_sd_close_file (file_id)), "close");
+}
+
+static void small_orders (const char *name)
+{
+    uint8_t file_id;
+    uint32_t offset;
+
+    if (!expect (TIMED (CALL_OPEN, m_sd_open_file (name, READ_FILE, &file_id)),
+                 "open for reading"))
+        return;
+
+    start_timing();
+
+    for (uint32_t i = 0; i < SMALL_ORDERS; i++)
+    {
+        if (!expect (TIMED (CALL_GET_SEEK_POS, m_sd_get_seek_pos (file_id, &offset)) &&
+                     offset == 0,
+                     "get seek position"))
+            break;
+    }
+
+    printf ("%-14s %6u x     %8.1f us\n", "small orders", SMALL_ORDERS,
+            (double)(mbus_sim_time_us() - started_us) / SMALL_ORDERS);
+
+    expect (TIMED (CALL_CLOSE, m_sd_close_file (file_id)), "close");
+}
+
+// the size a listed file should have, from the number in its name
+static bool listed_size_matches (const char *name, const uint32_t size)
+{
+    return (strncmp (name, "LOG", 3) == 0 || strncmp (name, "DAT", 3) == 0) &&
+           (uint32_t)atoi (name + 3) % 500 == size;
+}
+
+typedef struct listing
+{
+    uint32_t objects;
+    uint32_t wrong;   // files with the wrong size, or directories that aren't
+} listing;
+
+static bool count_listed (const m_sd_listed_object *object, void *context)
+{
+    listing *const l = (listing*)context;
+
+    const bool directory_expected = (object->name[0] == '.' ||
+                                     strcmp (object->name, "SUB") == 0);
+
+    if (object->is_directory != directory_expected ||
+        (!directory_expected && !listed_size_matches (object->name, object->size)))
+        l->wrong++;
+
+    l->objects++;
+    return true;
+}
+
+static void list_directory (void)
+{
+    static char names[LISTED_NAMES][13];
+    uint8_t file_id;
+    uint32_t size;
+    bool is_directory;
+    char name[13];
+
+    // set up outside the timings
+    if (!expect (m_sd_mkdir ("LISTING") && m_sd_push ("LISTING"),
+                 "making the listed directory"))
+        return;
+
+    for (uint32_t i = 0; i < LISTED_FILES; i++)
+    {
+        sprintf (name, (i % 3) ? "LOG%05u.TXT" : "DAT%05u.BIN", i);
+
+        if (!expect (m_sd_open_file (name, CREATE_FILE, &file_id) &&
+                     m_sd_write_file (file_id, i % 500, chunk) &&
+                     m_sd_close_file (file_id),
+                     "making a listed file"))
+            break;
+    }
+
+    expect (m_sd_mkdir ("SUB"), "making a listed directory");
+
+    // every name, and then whether each is a directory and its size
+    uint32_t listed = 0;
+    start_timing();
+
+    bool more = TIMED (CALL_DIR_ENTRY, m_sd_get_dir_entry_first (names[0], NULL, NULL));
+    while (more && ++listed < LISTED_NAMES)
+        more = TIMED (CALL_DIR_ENTRY, m_sd_get_dir_entry_next (names[listed], NULL, NULL));
+
+    for (uint32_t i = 0; i < listed; i++)
+    {
+        if (names[i][0] == '.')
+            continue;
+
+        if (!expect (TIMED (CALL_OBJECT_EXISTS, m_sd_object_exists (names[i], &is_directory)),
+                     "object exists"))
+            break;
+
+        if (!is_directory &&
+            !expect (TIMED (CALL_GET_SIZE, m_sd_get_size (names[i], &size)) &&
+                     listed_size_matches (names[i], size),
+                     "get size"))
+            break;
+    }
+
+    printf ("%-14s %6u objects in %8.1f ms\n", "names, lookups", listed,
+            (mbus_sim_time_us() - started_us) / 1000.0);
+
+    expect (listed == LISTED_FILES + 3, "listing names");
+
+    // all of them, with their sizes, in as few frames as they fit
+    listing all = {0, 0};
+    start_timing();
+
+    expect (TIMED (CALL_LIST_DIR, m_sd_list_dir (NULL, count_listed, &all)), "list dir");
+
+    printf ("%-14s %6u objects in %8.1f ms\n", "list dir", all.objects,
+            (mbus_sim_time_us() - started_us) / 1000.0);
+
+    expect (all.objects == LISTED_FILES + 3 && all.wrong == 0, "listing everything");
+
+    // the peripheral sends only the ones that match
+    listing logs = {0, 0};
+    start_timing();
+
+    expect (TIMED (CALL_LIST_DIR, m_sd_list_dir ("LOG*.TXT", count_listed, &logs)),
+            "list dir LOG*.TXT");
+
+    printf ("%-14s %6u objects in %8.1f ms\n", "list LOG*.TXT", logs.objects,
+            (mbus_sim_time_us() - started_us) / 1000.0);
+
+    expect (logs.objects == LISTED_LOGS && logs.wrong == 0, "listing LOG*.TXT");
+
+    for (uint32_t i = 0; i < listed; i++)
+    {
+        if (names[i][0] != '.' && strcmp (names[i], "SUB") != 0 &&
+            !expect (m_sd_delete (names[i]), "deleting a listed file"))
+            break;
+    }
+
+    expect (m_sd_rmdir ("SUB") && m_sd_pop() && m_sd_rmdir ("LISTING"),
+            "removing the listed directory");
+}
+
+// part of the batch file, read into check, matches what was written
+static bool batch_read_matches (const uint32_t offset, const uint32_t length)
+{
+    return memcmp (check, &chunk[offset], length) == 0;
+}
+
+static void batches (void)
+{
+    uint8_t file_id, steps;
+    uint32_t offset;
+
+    // a file in a directory of its own, written and committed in one go
+    fill_chunk (BATCH_RUNS);
+
+    if (!expect (m_sd_mkdir ("BATCH") && m_sd_push ("BATCH"), "making the batch directory"))
+        return;
+
+    expect (m_sd_open_file ("CONFIG.DAT", CREATE_FILE, &file_id) &&
+            TIMED (CALL_WRITE_SYNC, m_sd_write_file_sync (file_id, BATCH_FILE_SIZE, chunk)) &&
+            m_sd_close_file (file_id),
+            "write sync");
+    expect (m_sd_pop(), "pop");
+
+    // from the root directory, part of it read with one batch each time
+    start_timing();
+
+    for (uint32_t i = 0; i < BATCH_RUNS; i++)
+    {
+        offset = i * 131;
+
+        if (!expect (m_sd_batch_begin() &&
+                     m_sd_batch_push ("BATCH") &&
+                     m_sd_batch_open_file ("CONFIG.DAT", READ_FILE, &file_id) &&
+                     m_sd_batch_seek (M_SD_BATCH_FILE, offset) &&
+                     m_sd_batch_read_file (M_SD_BATCH_FILE, BATCH_READ, check) &&
+                     m_sd_batch_close_file (M_SD_BATCH_FILE) &&
+                     m_sd_batch_pop() &&
+                     TIMED (CALL_BATCH, m_sd_batch_run (&steps)) && steps == 6 &&
+                     batch_read_matches (offset, BATCH_READ),
+                     "batched read"))
+            break;
+    }
+
+    printf ("%-14s %6u x     %8.1f us\n", "batched read", BATCH_RUNS,
+            (double)(mbus_sim_time_us() - started_us) / BATCH_RUNS);
+
+    // and with the same calls one at a time
+    start_timing();
+
+    for (uint32_t i = 0; i < BATCH_RUNS; i++)
+    {
+        offset = i * 131;
+
+        if (!expect (m_sd_push ("BATCH") &&
+                     m_sd_open_file ("CONFIG.DAT", READ_FILE, &file_id) &&
+                     m_sd_seek (file_id, offset) &&
+                     m_sd_read_file (file_id, BATCH_READ, check) &&
+                     m_sd_close_file (file_id) &&
+                     m_sd_pop() &&
+                     batch_read_matches (offset, BATCH_READ),
+                     "separate reads"))
+            break;
+    }
+
+    printf ("%-14s %6u x     %8.1f us\n", "separate read", BATCH_RUNS,
+            (double)(mbus_sim_time_us() - started_us) / BATCH_RUNS);
+
+    // a batch stops at the step that fails, so it's left in the directory
+    // it pushed into
+    expect (m_sd_batch_begin() &&
+            m_sd_batch_push ("BATCH") &&
+            m_sd_batch_open_file ("NONE.DAT", READ_FILE, &file_id) &&
+            m_sd_batch_pop(),
+            "making a batch");
+    expect (!TIMED (CALL_BATCH, m_sd_batch_run (&steps)) && steps == 2 &&
+            m_sd_error_code == ERROR_FAT32_NOT_FOUND,
+            "a batch stopping at its second step");
+    expect (m_sd_pop() && !m_sd_pop() && m_sd_error_code == ERROR_FAT32_AT_ROOT,
+            "popping out after the batch");
+
+    // the fused calls
+    expect (m_sd_push ("BATCH"), "push");
+
+    if (expect (TIMED (CALL_OPEN_AT, m_sd_open_file_at ("CONFIG.DAT", READ_FILE, 2500, &file_id)),
+                "open at"))
+    {
+        expect (m_sd_read_file (file_id, 500, check) && batch_read_matches (2500, 500),
+                "read after open at");
+        expect (TIMED (CALL_READ_AT, m_sd_read_file_at (file_id, 5, 2000, check)) &&
+                batch_read_matches (5, 2000),
+                "read at");
+        expect (!m_sd_read_file_at (file_id, BATCH_FILE_SIZE - 5, 10, check) &&
+                m_sd_error_code == ERROR_FAT32_TOO_FAR,
+                "read at past the end");
+        expect (m_sd_close_file (file_id), "close");
+    }
+
+    expect (m_sd_delete ("CONFIG.DAT") && m_sd_pop() && m_sd_rmdir ("BATCH"),
+            "removing the batch directory");
+}
+
+// a write-behind write that fails after it's acknowledged (to a file opened
+// read-only) has its error held, and reported when write-behind is turned
+// off
+static void held_error (const char *name)
+{
+    uint8_t file_id;
+    uint32_t offset;
+
+    if (!expect (m_sd_open_file (name, READ_FILE, &file_id), "open for reading"))
+        return;
+
+    if (expect (TIMED (CALL_WRITE_BEHIND, m_sd_write_behind (true)), "write-behind"))
+    {
+        expect (m_sd_write_file (file_id, 10, chunk), "acknowledging a write-behind write");
+        expect (!TIMED (CALL_WRITE_BEHIND, m_sd_write_behind (false)) &&
+                m_sd_error_code == ERROR_FAT32_FILE_READ_ONLY,
+                "reporting the held error");
+
+        // only once
+        expect (TIMED (CALL_WRITE_BEHIND, m_sd_write_behind (false)), "write-behind");
+    }
+
+    expect (m_sd_get_seek_pos (file_id, &offset) && offset == 0, "get seek position");
+    expect (m_sd_close_file (file_id), "close");
+}
+
+static void report_calls (void)
+{
+    printf ("\n%-14s %6s %9s %9s %9s %9s %7s\n", "call", "calls",
+            "avg us", "min us", "max us", "bytes", "NACKs");
+
+    for (uint8_t i = 0; i < NUM_CALLS; i++)
+    {
+        const call_stats *const s = &stats[i];
+
+        if (s->calls == 0)
+            continue;
+
+        printf ("%-14s %6u %9.1f %9llu %9llu %9.1f %7.2f\n", s->name, s->calls,
+                (double)s->total_us / s->calls, (unsigned long long)s->min_us,
+                (unsigned long long)s->max_us, (double)s->bytes / s->calls,
+                (double)s->nacks / s->calls);
+    }
+}
+
+
+int main (int argc, char **argv)
+{
+    if (argc < 2 || argc > 4)
+    {
+        fprintf (stderr, "usage: mbus_bench image [kilobytes [bus kHz]]\n");
+        return 2;
+    }
+
+    uint32_t kilobytes = (argc >= 3) ? (uint32_t)atoi (argv[2]) : 64;
+    kilobytes -= kilobytes % (CHUNK / 1024);
+    if (kilobytes == 0)
+        kilobytes = CHUNK / 1024;
+
+    const uint32_t khz = (argc == 4) ? (uint32_t)atoi (argv[3]) : 400;
+    if (khz != 100 && khz != 400 && khz != 1000)
+    {
+        fprintf (stderr, "mbus_bench: the bus runs at 100, 400 or 1000 kHz\n");
+        return 2;
+    }
+
+    mbus_sim_set_clock (khz * 1000);
+    printf ("bus at %u kHz\n", khz);
+
+    if (!mbus_sim_open (argv[1]))
+    {
+        fprintf (stderr, "mbus_bench: can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    start_timing();
+    if (!expect (TIMED (CALL_INIT, m_sd_init()), "init"))
+    {
+        mbus_sim_close();
+        return 1;
+    }
+    report ("init", 0);
+
+    write_file ("BENCH1.BIN", kilobytes, PLAIN_WRITES);
+    write_file ("BENCH2.BIN", kilobytes, POSTED_WRITES);
+    write_file ("BENCH3.BIN", kilobytes, BEHIND_WRITES);
+    read_file ("BENCH1.BIN", kilobytes);
+    read_file ("BENCH2.BIN", kilobytes);
+    read_file ("BENCH3.BIN", kilobytes);
+    small_orders ("BENCH1.BIN");
+    list_directory();
+    batches();
+    held_error ("BENCH1.BIN");
+
+    expect (TIMED (CALL_DELETE, m_sd_delete ("BENCH1.BIN")) &&
+            TIMED (CALL_DELETE, m_sd_delete ("BENCH2.BIN")) &&
+            TIMED (CALL_DELETE, m_sd_delete ("BENCH3.BIN")),
+            "delete");
+
+    expect (TIMED (CALL_SHUTDOWN, m_sd_shutdown()), "shutdown");
+
+    report_calls();
+
+    printf ("\nmbus_bench: %u checks, %u failed: %s\n", checks, failures,
+            failures ? "FAIL" : "PASS");
+
+    mbus_sim_close();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+/*******************************************************************************
+* mbus_sim.c
+* description: The simulated I2C bus and ATmega TWI slave hardware for
+*              mbus_sim.h.  Time only moves forward when something uses it
+*              up: each byte on the bus, the master's waits, and the
+*              peripheral's card accesses.  The peripheral's main loop runs
+*              in its own context, and is switched to whenever the master's
+*              clock has caught up with it, so an order can be processed
+*              while the master is busy on the bus.
+*******************************************************************************/
+
+#define _XOPEN_SOURCE 600  // for ucontext.h
+
+#include "mbus_sim.h"
+#include "sd_image.h"
+
+#include <ucontext.h>
+
+// the bus clock, 400 kHz unless mbus_sim_set_clock says otherwise
+#define DEFAULT_CLOCK_HZ 400000ul
+
+// the time the peripheral's TWI ISR takes to deal with a byte; the TWI
+// hardware holds the clock low (stretches it) after each byte until the ISR
+// is done, which only holds the master up once the clock's low half is
+// shorter than that
+#define TWI_ISR_NS 5000ull
+
+// peripheral timing: an order's decoding and dispatch, one pass of an idle
+// main loop, and the card's time to read or program a block
+#define ORDER_NS       30000ull
+#define IDLE_NS         2000ull
+#define CARD_READ_NS  800000ull
+#define CARD_WRITE_NS 1500000ull
+
+#define PERIPHERAL_STACK (256 * 1024)
+
+volatile uint8_t TWCR, TWSR, TWDR, TWAR, TWBR;
+volatile uint8_t PORTC, DDRC;
+volatile uint8_t PORTD, DDRD;
+
+extern volatile bool new_order;
+
+static uint64_t master_ns = 0;      // the master's clock, which is "now"
+static uint64_t peripheral_ns = 0;  // how far the peripheral has got
+
+static ucontext_t master_context;
+static ucontext_t peripheral_context;
+static uint8_t peripheral_stack[PERIPHERAL_STACK];
+
+static bool addressed = false;      // the peripheral is in a transfer
+static bool transmitting = false;   // and sending
+
+// a bit, and a byte: 8 bits and an ACK, plus any stretching (a start or stop
+// takes about a bit)
+static uint64_t bit_ns;
+static uint64_t byte_ns;
+
+static mbus_sim_counts counts;
+
+
+// use up time in the peripheral, letting the master run in the meantime
+static void peripheral_spend (const uint64_t ns)
+{
+    peripheral_ns += ns;
+    swapcontext (&peripheral_context, &master_context);
+}
+
+static void card_access (const bool write)
+{
+    peripheral_spend (write ? CARD_WRITE_NS : CARD_READ_NS);
+}
+
+void mbus_sim_order_time (void)
+{
+    peripheral_spend (ORDER_NS);
+}
+
+static void peripheral_loop (void)
+{
+    for (;;)
+    {
+        check_for_order();
+
+        // nothing more to do until the master does something
+        peripheral_ns = master_ns + IDLE_NS;
+        swapcontext (&peripheral_context, &master_context);
+
+        if (peripheral_ns < master_ns)
+            peripheral_ns = master_ns;
+    }
+}
+
+// run the peripheral until it has caught up with the master
+static void run_peripheral (void)
+{
+    while (peripheral_ns <= master_ns)
+        swapcontext (&master_context, &peripheral_context);
+}
+
+// the TWI hardware setting TWSR and calling the peripheral's ISR
+static void twi_event (const uint8_t status)
+{
+    TWSR = status;
+    mbus_sim_twi_isr();
+}
+
+// whether the TWI hardware will ACK the next address or data byte
+static bool twi_acks (void)
+{
+    return (TWCR & _BV (TWEN)) && (TWCR & _BV (TWEA));
+}
+
+
+bool sim_i2c_start (const uint8_t address_rw)
+{
+    run_peripheral();
+    master_ns += bit_ns + byte_ns;
+    counts.starts++;
+    counts.bytes++;
+
+    addressed = false;
+
+    if ((address_rw >> 1) != (TWAR >> 1) || !twi_acks())
+    {
+        counts.nacked_starts++;
+        return false;
+    }
+
+    addressed = true;
+    transmitting = (address_rw & 1) == I2C_READ;
+
+    // the ISR loads the first byte to send, or gets ready to receive
+    twi_event (transmitting ? 0xA8 : 0x60);
+    return true;
+}
+
+bool sim_i2c_write (const uint8_t byte)
+{
+    run_peripheral();
+    master_ns += byte_ns;
+    counts.bytes++;
+
+    if (!addressed || transmitting)
+        return false;
+
+    TWDR = byte;
+
+    if (twi_acks())
+    {
+        twi_event (0x80);
+        return true;
+    }
+
+    // NACKed, and the peripheral drops out of the transfer
+    twi_event (0x88);
+    addressed = false;
+    return false;
+}
+
+uint8_t sim_i2c_read (const bool ack)
+{
+    run_peripheral();
+    master_ns += byte_ns;
+    counts.bytes++;
+
+    if (!addressed || !transmitting)
+        return 0xff;  // nobody driving the bus
+
+    const uint8_t byte = TWDR;
+
+    twi_event (ack ? 0xB8 : 0xC0);
+    if (!ack)
+        addressed = false;
+
+    return byte;
+}
+
+void sim_i2c_stop (void)
+{
+    run_peripheral();
+    master_ns += bit_ns;
+
+    if (addressed && !transmitting)
+        twi_event (0xA0);
+
+    addressed = false;
+}
+
+void sim_wait_us (const uint16_t us)
+{
+    master_ns += (uint64_t)us * 1000ull;
+    run_peripheral();
+}
+
+bool sim_ready_line (void)
+{
+    run_peripheral();
+    return (DDRD & _BV (READY_NUM)) && (PORTD & _BV (READY_NUM));
+}
+
+
+bool mbus_sim_open (const char *image_path)
+{
+    if (!sd_image_open (image_path))
+        return false;
+
+    sd_image_access_hook = card_access;
+
+    master_ns = 0;
+    peripheral_ns = 0;
+    addressed = false;
+
+    if (bit_ns == 0)
+        mbus_sim_set_clock (DEFAULT_CLOCK_HZ);
+    mbus_sim_reset_counts();
+
+    // what the peripheral's main() sets up before its loop
+    PORTD = 0;
+    DDRD = _BV (READY_NUM);  // (and it stays low without READY_LINE)
+    TWAR = 0x5D << 1;
+    TWCR = _BV (TWIE) | _BV (TWINT) | _BV (TWEN) | _BV (TWEA);
+    new_order = false;
+
+    getcontext (&peripheral_context);
+    peripheral_context.uc_stack.ss_sp = peripheral_stack;
+    peripheral_context.uc_stack.ss_size = sizeof (peripheral_stack);
+    peripheral_context.uc_link = 0;
+    makecontext (&peripheral_context, peripheral_loop, 0);
+
+    return true;
+}
+
+void mbus_sim_close (void)
+{
+    sd_image_access_hook = 0;
+    sd_image_close();
+}
+
+uint64_t mbus_sim_time_us (void)
+{
+    return master_ns / 1000;
+}
+
+void mbus_sim_set_clock (const uint32_t hz)
+{
+    bit_ns = 1000000000ull / hz;
+    byte_ns = 9 * bit_ns;
+
+    if (TWI_ISR_NS > bit_ns / 2)
+        byte_ns += TWI_ISR_NS - bit_ns / 2;
+}
+
+uint16_t mbus_sim_byte_us (void)
+{
+    return (uint16_t)((byte_ns + 999) / 1000);
+}
+
+void mbus_sim_get_counts (mbus_sim_counts *result)
+{
+    *result = counts;
+}
+
+void mbus_sim_reset_counts (void)
+{
+    counts.bytes = 0;
+    counts.starts = 0;
+    counts.nacked_starts = 0;
+}
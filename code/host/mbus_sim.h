@@ -0,0 +1,116 @@
+/*******************************************************************************
+* mbus_sim.h
+* description: A simulated I2C bus between the mBus master code
+*              (m_microsd_mbus.c) and the peripheral (peripheral/m_microsd.c),
+*              both built for a PC with -DHOST, with a card image as the card.
+*
+*              The peripheral's TWI_vect ISR is driven byte by byte by the
+*              master's bus calls, through stand-ins for the ATmega's TWI
+*              registers, and its main loop runs as a coroutine that uses up
+*              simulated time for every card access, so bus traffic and card
+*              work overlap the way they do on the real hardware.  The bus
+*              runs at 100 kHz, 400 kHz or 1 MHz (see mbus_sim_set_clock).
+*******************************************************************************/
+
+#ifndef MBUS_SIM_H
+#define MBUS_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//-----------------------------------------------
+// Master side:
+
+#define I2C_WRITE 0
+#define I2C_READ  1
+
+// start a transfer with address_rw (7-bit address << 1 | direction), and
+// return whether the peripheral ACKed it
+bool sim_i2c_start (const uint8_t address_rw);
+
+// send a byte to the peripheral, and return whether it was ACKed
+bool sim_i2c_write (const uint8_t byte);
+
+// read a byte from the peripheral, ACKing it if more are wanted
+uint8_t sim_i2c_read (const bool ack);
+
+void sim_i2c_stop (void);
+
+void sim_wait_us (const uint16_t us);
+
+// the peripheral's ready line, for a master built with M_SD_READY_LINE (it's
+// only ever raised if the peripheral is built with READY_LINE)
+bool sim_ready_line (void);
+
+
+//-----------------------------------------------
+// Simulation setup and timing:
+
+// use a card image as the peripheral's card, and start the peripheral
+bool mbus_sim_open (const char *image_path);
+
+void mbus_sim_close (void);
+
+// simulated time since mbus_sim_open, in microseconds
+uint64_t mbus_sim_time_us (void);
+
+// set the bus clock (100000, 400000 or 1000000 Hz, say); it's 400 kHz unless
+// this is called before mbus_sim_open, and can be changed at any time
+void mbus_sim_set_clock (const uint32_t hz);
+
+// the time a byte takes on the bus, rounded up to a microsecond (for the
+// master's polling, which allows for the time its looks take)
+uint16_t mbus_sim_byte_us (void);
+
+// what has happened on the bus since mbus_sim_open or the last reset: bytes
+// sent either way (addresses included), transfers started, and those that
+// the peripheral didn't ACK (because it was busy, or had nothing to send)
+typedef struct mbus_sim_counts
+{
+    uint64_t bytes;
+    uint32_t starts;
+    uint32_t nacked_starts;
+} mbus_sim_counts;
+
+void mbus_sim_get_counts (mbus_sim_counts *result);
+void mbus_sim_reset_counts (void);
+
+
+//-----------------------------------------------
+// Peripheral side: stand-ins for the ATmega registers and macros that
+// m_microsd.c uses
+
+extern volatile uint8_t TWCR, TWSR, TWDR, TWAR, TWBR;
+extern volatile uint8_t PORTC, DDRC;
+extern volatile uint8_t PORTD, DDRD;
+
+#define READY_DDR  DDRD
+#define READY_PORT PORTD
+#define READY_NUM  2
+
+#define TWINT 7
+#define TWEA  6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC  3
+#define TWEN  2
+#define TWIE  0
+
+#define _BV(bit) (1 << (bit))
+
+#define sei()
+#define cli()
+
+#define ISR(vector) void vector (void)
+#define TWI_vect mbus_sim_twi_isr
+
+void mbus_sim_twi_isr (void);
+
+// the peripheral's main loop body, run by the simulation
+void check_for_order (void);
+
+// called by the peripheral as it starts on an order, to take up the time the
+// ATmega needs to decode and dispatch it
+void mbus_sim_order_time (void);
+
+#endif
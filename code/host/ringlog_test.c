@@ -0,0 +1,258 @@
+/*******************************************************************************
+* ringlog_test.c
+* description: Regression test for ring logs (sd_fat32_ringlog.c).  Numbered
+*              records of varying length are appended to a log until it has
+*              wrapped around several times, and the log is closed and opened
+*              again every so often: the binary search on opening has to
+*              find the same write head the log had, wherever it is.  Reading
+*              from a rewind has to start at the oldest block's first record
+*              and run unbroken to the newest, and a reader that falls a lap
+*              behind has to skip ahead.  All of it is done on a contiguous
+*              log, and again on one whose clusters are scattered.
+*
+*              usage: ringlog_test (leaves ringlog_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define IMAGE "ringlog_test.img"
+
+// every block starts with an 8-byte header, and every record with its length
+#define BLOCK_HEADER 8
+
+// what the test expects of the log: which record starts each block that's
+// still in it (up to MAX_BLOCKS), and where the head is
+#define MAX_BLOCKS 64
+
+typedef struct expected_log
+{
+    uint32_t blocks;
+    uint32_t records;                 // the last record's number
+    uint32_t sequence;                // the head block's sequence number
+    uint16_t used;                    // bytes of the head block in use
+    uint32_t first_record[MAX_BLOCKS];  // by sequence % blocks
+} expected_log;
+
+static uint8_t record[RINGLOG_MAX_RECORD];
+
+
+// record n holds n followed by bytes derived from it, and is 4 to 100 bytes
+// long (once in a while, as long as a record can be)
+static uint16_t make_record (const uint32_t n)
+{
+    const uint16_t length = (n % 53 == 0) ? RINGLOG_MAX_RECORD : (uint16_t)(4 + n % 97);
+
+    memcpy (record, &n, 4);
+    for (uint16_t i = 4; i < length; i++)
+        record[i] = (uint8_t)(n * 7 + i);
+
+    return length;
+}
+
+static bool append_records (fat32_ringlog *log, expected_log *expected,
+                            const uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint32_t n = expected->records + 1;
+        const uint16_t length = make_record (n);
+
+        if (!sd_fat32_ringlog_append (log, record, length))
+            return false;
+
+        if (expected->sequence == 0 || expected->used + 2 + length > 512)
+        {
+            expected->sequence++;
+            expected->used = BLOCK_HEADER;
+            expected->first_record[expected->sequence % expected->blocks] = n;
+        }
+        expected->used += 2 + length;
+        expected->records = n;
+    }
+
+    return log->head_sequence == expected->sequence &&
+           log->head == (expected->sequence - 1) % expected->blocks &&
+           log->head_used == expected->used;
+}
+
+// the oldest record the log still holds
+static uint32_t oldest_record (const expected_log *expected)
+{
+    if (expected->sequence < expected->blocks)
+        return 1;
+
+    return expected->first_record[(expected->sequence + 1) % expected->blocks];
+}
+
+// read records until there are no more, checking that each is intact and
+// follows the one before; *first and *last are set to the first and last
+// numbers read (0 if there were none)
+static bool read_to_end (fat32_ringlog *log, fat32_ringlog_reader *reader,
+                         uint32_t *first, uint32_t *last)
+{
+    static uint8_t buffer[RINGLOG_MAX_RECORD];
+    uint16_t length;
+    uint32_t n;
+
+    *first = 0;
+    *last = 0;
+
+    for (;;)
+    {
+        if (!sd_fat32_ringlog_read (log, reader, buffer, sizeof (buffer), &length))
+            return false;
+        if (length == 0)
+            return true;
+
+        memcpy (&n, buffer, 4);
+        if (length != make_record (n) || memcmp (buffer, record, length) != 0 ||
+            (*last != 0 && n != *last + 1))
+        {
+            fprintf (stderr, "record %u read after %u is wrong\n", n, *last);
+            return false;
+        }
+
+        if (*first == 0)
+            *first = n;
+        *last = n;
+    }
+}
+
+// close the log and open it again: it has to find the head where it was
+static bool reopen (fat32_ringlog *log, const char *name)
+{
+    const fat32_ringlog before = *log;
+
+    return sd_fat32_ringlog_close (log) &&
+           sd_fat32_ringlog_open (name, log) &&
+           log->head == before.head &&
+           log->head_sequence == before.head_sequence &&
+           log->head_used == before.head_used &&
+           log->contiguous == before.contiguous;
+}
+
+
+// run a log of the given number of blocks through several laps
+static void exercise (const char *name, const uint32_t blocks,
+                      const bool contiguous)
+{
+    expected_log expected = {.blocks = blocks};
+    fat32_ringlog log;
+    fat32_ringlog_reader reader;
+    uint32_t first, last;
+
+    if (!CHECK (sd_fat32_ringlog_open (name, &log)))
+        return;
+    CHECK (log.blocks == blocks && log.contiguous == contiguous);
+
+    // an empty log has nothing to read, and opens empty again
+    CHECK (log.head_sequence == 0);
+    sd_fat32_ringlog_rewind (&log, &reader);
+    CHECK (read_to_end (&log, &reader, &first, &last) && last == 0);
+    CHECK (reopen (&log, name) && log.head_sequence == 0);
+
+    // before it's full: everything from the first record on
+    CHECK (append_records (&log, &expected, 30));
+    CHECK (reopen (&log, name));
+    sd_fat32_ringlog_rewind (&log, &reader);
+    CHECK (read_to_end (&log, &reader, &first, &last) && first == 1 && last == 30);
+
+    // a reader that has caught up picks up new records as they come
+    CHECK (append_records (&log, &expected, 3));
+    CHECK (read_to_end (&log, &reader, &first, &last) && first == 31 && last == 33);
+
+    // on past the end several times, reopening at a different head each time
+    // (the number appended between reopens is prime, so the head goes
+    // through all sorts of places, the last block among them)
+    for (uint8_t i = 0; i < 60; i++)
+    {
+        CHECK (append_records (&log, &expected, 23));
+        CHECK (reopen (&log, name));
+
+        sd_fat32_ringlog_rewind (&log, &reader);
+        CHECK (read_to_end (&log, &reader, &first, &last) &&
+               first == oldest_record (&expected) && last == expected.records);
+    }
+    CHECK (expected.sequence > 3 * blocks);
+
+    // a reader a lap behind skips to the oldest record that's left
+    sd_fat32_ringlog_rewind (&log, &reader);
+    CHECK (read_to_end (&log, &reader, &first, &last));
+    CHECK (append_records (&log, &expected, blocks * 12));
+    const uint32_t behind = last;
+    CHECK (read_to_end (&log, &reader, &first, &last) &&
+           first == oldest_record (&expected) && first > behind + 1 &&
+           last == expected.records);
+
+    // a record that doesn't fit the buffer is left to be read again
+    uint8_t small[3];
+    uint16_t length;
+    CHECK (append_records (&log, &expected, 1));
+    CHECK (!sd_fat32_ringlog_read (&log, &reader, small, sizeof (small), &length) &&
+           error_code == ERROR_TOO_FAR);
+    CHECK (read_to_end (&log, &reader, &first, &last) && first == expected.records);
+
+    // records too long or empty
+    CHECK (!sd_fat32_ringlog_append (&log, record, RINGLOG_MAX_RECORD + 1) &&
+           error_code == ERROR_TOO_FAR);
+    CHECK (sd_fat32_ringlog_append (&log, record, 0));
+    CHECK (reopen (&log, name));
+
+    CHECK (sd_fat32_ringlog_close (&log));
+}
+
+
+int main (void)
+{
+    uint8_t file_ids[2];
+    uint32_t clusters, extents, free_clusters;
+
+    if (!CHECK (test_image_fat32 (IMAGE, 16, 1)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_fat32_init()))
+        return test_summary ("ringlog_test");
+
+    CHECK (!sd_fat32_ringlog_create ("EMPTY.LOG", 0) && error_code == ERROR_FAT32_TOO_FAR);
+
+    CHECK (sd_fat32_ringlog_create ("RING.LOG", 24));
+    exercise ("RING.LOG", 24, true);
+
+    // two files grown about a cluster at a time in turn, then one deleted,
+    // leaves gaps of a cluster or so for the next log to be scattered over
+    CHECK (sd_fat32_open_file ("KEEP.BIN", CREATE_FILE, &file_ids[0]));
+    CHECK (sd_fat32_open_file ("GAPS.BIN", CREATE_FILE, &file_ids[1]));
+    for (uint8_t i = 0; i < 40; i++)
+    {
+        CHECK (sd_fat32_write_file (file_ids[0], 500, record));
+        CHECK (sd_fat32_write_file (file_ids[1], 500, record));
+    }
+    CHECK (sd_fat32_close_file (file_ids[0]) && sd_fat32_close_file (file_ids[1]));
+    CHECK (sd_fat32_delete ("GAPS.BIN"));
+
+    CHECK (sd_fat32_ringlog_create ("SCATTER.LOG", 37));
+    CHECK (sd_fat32_file_extents ("SCATTER.LOG", &clusters, &extents) &&
+           clusters == 37 && extents > 30);
+    exercise ("SCATTER.LOG", 37, false);
+
+    // creating a log over an old one starts it afresh
+    fat32_ringlog log;
+    CHECK (sd_fat32_ringlog_create ("RING.LOG", 24));
+    CHECK (sd_fat32_ringlog_open ("RING.LOG", &log) && log.head_sequence == 0 &&
+           sd_fat32_ringlog_close (&log));
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+
+    // the logs are as long as their sizes say, and nothing leaked
+    CHECK (test_image_check_fat32 (IMAGE, &free_clusters));
+
+    const int status = test_summary ("ringlog_test");
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
@@ -0,0 +1 @@
+../common/sd_fat32.c
\ No newline at end of file
@@ -0,0 +1 @@
+../common/sd_fat32.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/sd_fat32_tslog.c
\ No newline at end of file
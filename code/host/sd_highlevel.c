@@ -0,0 +1 @@
+../common/sd_highlevel.c
\ No newline at end of file
@@ -0,0 +1 @@
+../common/sd_highlevel.h
\ No newline at end of file
@@ -0,0 +1 @@
+../common/sd_highlevel_cache.c
\ No newline at end of file
@@ -0,0 +1,117 @@
+/*******************************************************************************
+* sd_image.c
+* description: The sd_lowlevel.h functions, reading and writing 512-byte
+*              blocks of a card image instead of talking to a card over SPI.
+*              There's nothing to initialize and nothing ever times out.
+*******************************************************************************/
+
+#include "sd_image.h"
+
+uint32_t total_block_accesses = 0;
+uint16_t last_crc = 0;
+uint16_t block_length = 0;
+
+void (*sd_image_access_hook) (bool write) = 0;
+
+static FILE *image = 0;
+
+
+bool sd_image_open (const char *path)
+{
+    sd_image_close();
+
+    image = fopen (path, "r+b");
+    return (image != 0);
+}
+
+void sd_image_close (void)
+{
+    if (image != 0)
+    {
+        fclose (image);
+        image = 0;
+    }
+}
+
+
+void start_spi (enum spi_speed speed)
+{
+    (void)speed;
+}
+
+void attempt_resync (void)
+{
+}
+
+ret reset_card (void)
+{
+    return (image != 0) ? SPI_OK : SPI_ERROR;
+}
+
+ret initialize_card (void)
+{
+    return SPI_OK;
+}
+
+ret enable_crc (void)
+{
+    return SPI_OK;
+}
+
+ret set_block_length (const uint16_t length)
+{
+    if (length > MAX_BLOCK_LENGTH)
+        return SPI_ERROR;
+
+    block_length = length;
+    return SPI_OK;
+}
+
+static bool seek_block (const uint32_t block_number)
+{
+    total_block_accesses++;
+
+    return (image != 0 &&
+            fseek (image, (long)block_number * 512, SEEK_SET) == 0);
+}
+
+ret read_block (const uint32_t block_number, uint8_t *block)
+{
+    if (sd_image_access_hook != 0)
+        sd_image_access_hook (false);
+
+    if (!seek_block (block_number) ||
+        fread (block, 1, 512, image) != 512)
+    {
+        return SPI_ERROR;
+    }
+
+    last_crc = crc16_ccitt (block, 512);
+    return SPI_OK;
+}
+
+ret read_block_crc_only (const uint32_t block_number, uint16_t *crc)
+{
+    uint8_t block[512];
+
+    if (read_block (block_number, block) != SPI_OK)
+        return SPI_ERROR;
+
+    *crc = last_crc;
+    return SPI_OK;
+}
+
+ret write_block (const uint32_t block_number, uint8_t *block)
+{
+    if (sd_image_access_hook != 0)
+        sd_image_access_hook (true);
+
+    if (!seek_block (block_number) ||
+        fwrite (block, 1, 512, image) != 512 ||
+        fflush (image) != 0)
+    {
+        return SPI_ERROR;
+    }
+
+    return SPI_OK;
+}
@@ -0,0 +1,24 @@
+/*******************************************************************************
+* sd_image.h
+* description: A card image file standing in for the SD card, for the PC
+*              builds of the filesystem code.  sd_image.c implements the
+*              functions in sd_lowlevel.h on top of it.
+*******************************************************************************/
+
+#ifndef SD_IMAGE_H
+#define SD_IMAGE_H
+
+#include "sd_lowlevel.h"
+
+// use an image of a whole card (MBR and all) as the card
+// must be called before sd_fat32_init
+bool sd_image_open (const char *path);
+
+// stop using the image (after sd_fat32_shutdown)
+void sd_image_close (void);
+
+// if set, called before every block is read or written (the mBus simulator
+// uses it to take up the card's time)
+extern void (*sd_image_access_hook) (bool write);
+
+#endif
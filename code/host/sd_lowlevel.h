@@ -0,0 +1 @@
+../common/sd_lowlevel.h
\ No newline at end of file
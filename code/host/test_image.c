@@ -0,0 +1,745 @@
+/*******************************************************************************
+* test_image.c
+* description: The card images and checks in test_image.h.  The checks read
+*              the image file directly, not through the filesystem code
+*              they're checking.
+*******************************************************************************/
+
+#include "test_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PARTITION_START 2048  // sectors
+#define RESERVED        32    // sectors before the first FAT
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+
+bool test_check (const bool passed, const char *what, const char *file,
+                 const int line)
+{
+    checks++;
+
+    if (!passed)
+    {
+        failures++;
+        fprintf (stderr, "%s:%d: check failed: %s\n", file, line, what);
+    }
+
+    return passed;
+}
+
+int test_summary (const char *test_name)
+{
+    printf ("%s: %u checks, %u failed: %s\n", test_name, checks, failures,
+            failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
+
+static void problem (const char *path, const char *what, const uint32_t value)
+{
+    failures++;
+    fprintf (stderr, "%s: %s %u\n", path, what, value);
+}
+
+
+static uint16_t get16 (const uint8_t *data)
+{
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+static uint32_t get32 (const uint8_t *data)
+{
+    return (uint32_t)data[0]         | ((uint32_t)data[1] << 8) |
+           ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void put16 (uint8_t *data, const uint16_t value)
+{
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+}
+
+static void put32 (uint8_t *data, const uint32_t value)
+{
+    put16 (data, (uint16_t)value);
+    put16 (data + 2, (uint16_t)(value >> 16));
+}
+
+static bool write_image (const char *path, const uint8_t *image, const uint32_t sectors)
+{
+    FILE *file = fopen (path, "wb");
+    if (file == 0)
+        return false;
+
+    const bool ok = (fwrite (image, 512, sectors, file) == sectors);
+    return (fclose (file) == 0) && ok;
+}
+
+static uint8_t *read_image (const char *path, uint32_t *sectors)
+{
+    FILE *file = fopen (path, "rb");
+    if (file == 0)
+        return 0;
+
+    fseek (file, 0, SEEK_END);
+    *sectors = (uint32_t)(ftell (file) / 512);
+    fseek (file, 0, SEEK_SET);
+
+    uint8_t *image = malloc ((size_t)*sectors * 512);
+    if (image != 0 && fread (image, 512, *sectors, file) != *sectors)
+    {
+        free (image);
+        image = 0;
+    }
+
+    fclose (file);
+    return image;
+}
+
+// an MBR with one partition of the given type from PARTITION_START to the end
+static void write_mbr (uint8_t *image, const uint32_t sectors, const uint8_t type)
+{
+    uint8_t *partition = &image[446];
+
+    partition[4] = type;
+    put32 (&partition[8], PARTITION_START);
+    put32 (&partition[12], sectors - PARTITION_START);
+    put16 (&image[510], 0xaa55);
+}
+
+
+bool test_image_fat32 (const char *path, const uint32_t megabytes,
+                       const uint8_t sectors_per_cluster)
+{
+    const uint32_t sectors = megabytes * 2048;
+    const uint32_t volume_sectors = sectors - PARTITION_START;
+
+    // the FATs take room from the clusters they describe
+    uint32_t fat_sectors = 1;
+    uint32_t clusters;
+    for (;;)
+    {
+        clusters = (volume_sectors - RESERVED - 2 * fat_sectors) / sectors_per_cluster;
+        const uint32_t needed = ((clusters + 2) * 4 + 511) / 512;
+
+        if (needed <= fat_sectors)
+            break;
+        fat_sectors = needed;
+    }
+
+    uint8_t *image = calloc (sectors, 512);
+    if (image == 0)
+        return false;
+
+    write_mbr (image, sectors, 0x0c);
+
+    uint8_t *boot = &image[PARTITION_START * 512];
+    memcpy (boot, "\xeb\x58\x90MSWIN4.1", 11);
+    put16 (&boot[11], 512);
+    boot[13] = sectors_per_cluster;
+    put16 (&boot[14], RESERVED);
+    boot[16] = 2;                       // FATs
+    boot[21] = 0xf8;                    // media
+    put32 (&boot[28], PARTITION_START); // hidden sectors
+    put32 (&boot[32], volume_sectors);
+    put32 (&boot[36], fat_sectors);
+    put32 (&boot[44], 2);               // root directory cluster
+    put16 (&boot[48], 1);               // FS info sector
+    put16 (&boot[50], 6);               // backup boot sector
+    boot[66] = 0x29;
+    memcpy (&boot[71], "NO NAME    FAT32   ", 19);
+    put16 (&boot[510], 0xaa55);
+
+    uint8_t *info = boot + 512;
+    put32 (&info[0], 0x41615252);
+    put32 (&info[484], 0x61417272);
+    put32 (&info[488], clusters - 1);   // all but the root directory's
+    put32 (&info[492], 3);
+    put16 (&info[510], 0xaa55);
+
+    for (uint8_t fat = 0; fat < 2; fat++)
+    {
+        uint8_t *entries = boot + (RESERVED + fat * fat_sectors) * 512;
+        put32 (&entries[0], 0x0ffffff8);
+        put32 (&entries[4], 0x0fffffff);
+        put32 (&entries[8], 0x0fffffff);  // the root directory
+    }
+
+    const bool ok = write_image (path, image, sectors);
+    free (image);
+    return ok;
+}
+
+
+typedef struct fat32_volume
+{
+    const char *path;
+    uint8_t  *image;
+    uint32_t  sectors_per_cluster;
+    uint32_t  fat_sectors;
+    uint8_t  *fat;           // the first FAT
+    uint8_t  *heap;          // cluster 2
+    uint32_t  clusters;      // data clusters
+    uint32_t *owner;         // a number for what each cluster belongs to
+    uint32_t  objects;
+} fat32_volume;
+
+static uint32_t fat32_next (const fat32_volume *volume, const uint32_t cluster)
+{
+    return get32 (&volume->fat[cluster * 4]) & 0x0fffffff;
+}
+
+static bool fat32_end (const uint32_t cluster)
+{
+    return cluster < 2 || cluster >= 0x0ffffff8;
+}
+
+// claim a chain for a new object; returns its length in clusters
+static uint32_t fat32_claim (fat32_volume *volume, uint32_t cluster)
+{
+    const uint32_t object = ++volume->objects;
+    uint32_t length = 0;
+
+    while (!fat32_end (cluster))
+    {
+        if (cluster >= volume->clusters + 2)
+        {
+            problem (volume->path, "chain runs out of the volume at cluster", cluster);
+            break;
+        }
+
+        if (volume->owner[cluster] != 0)
+        {
+            problem (volume->path, "chains cross (or loop) at cluster", cluster);
+            break;
+        }
+
+        volume->owner[cluster] = object;
+        length++;
+
+        const uint32_t next = fat32_next (volume, cluster);
+        if (next == 0)
+        {
+            problem (volume->path, "chain runs into a free cluster after", cluster);
+            break;
+        }
+        cluster = next;
+    }
+
+    return length;
+}
+
+static void fat32_walk (fat32_volume *volume, const uint32_t first_cluster)
+{
+    const uint32_t cluster_bytes = volume->sectors_per_cluster * 512;
+
+    if (fat32_claim (volume, first_cluster) == 0)
+        problem (volume->path, "directory without clusters at", first_cluster);
+
+    for (uint32_t cluster = first_cluster;
+         !fat32_end (cluster) && cluster < volume->clusters + 2 &&
+         volume->owner[cluster] != 0;
+         cluster = fat32_next (volume, cluster))
+    {
+        const uint8_t *entries = volume->heap + (size_t)(cluster - 2) * cluster_bytes;
+
+        for (uint32_t i = 0; i < cluster_bytes; i += 32)
+        {
+            const uint8_t *entry = &entries[i];
+            const uint8_t attributes = entry[11];
+
+            if (entry[0] == 0)
+                return;  // the end of the directory
+
+            if (entry[0] == 0xe5 || entry[0] == '.' || attributes == 0x0f ||
+                (attributes & 0x18) == 0x08)
+                continue;  // deleted, "." or "..", a long name or the label
+
+            const uint32_t first = ((uint32_t)get16 (&entry[20]) << 16) | get16 (&entry[26]);
+            const uint32_t size = get32 (&entry[28]);
+
+            if (attributes & 0x10)
+            {
+                fat32_walk (volume, first);
+                continue;
+            }
+
+            const uint32_t needed = (size + cluster_bytes - 1) / cluster_bytes;
+            const uint32_t length = fat32_claim (volume, first);
+
+            if (length != needed)
+            {
+                fprintf (stderr, "%s: %.11s is %u bytes in %u clusters\n",
+                         volume->path, (const char*)entry, size, length);
+                failures++;
+            }
+        }
+    }
+}
+
+bool test_image_check_fat32 (const char *path, uint32_t *free_clusters)
+{
+    const uint32_t failed_before = failures;
+    uint32_t sectors;
+    fat32_volume volume;
+
+    *free_clusters = 0;
+
+    volume.path = path;
+    volume.image = read_image (path, &sectors);
+    if (volume.image == 0)
+    {
+        fprintf (stderr, "%s: can't be read\n", path);
+        failures++;
+        return false;
+    }
+
+    const uint32_t start = get32 (&volume.image[446 + 8]);
+    const uint8_t *boot = &volume.image[(size_t)start * 512];
+    const uint16_t reserved = get16 (&boot[14]);
+    const uint8_t fats = boot[16];
+    const uint16_t info_sector = get16 (&boot[48]);
+
+    volume.sectors_per_cluster = boot[13];
+    volume.fat_sectors = get32 (&boot[36]);
+    volume.fat = volume.image + (size_t)(start + reserved) * 512;
+    volume.heap = volume.fat + (size_t)fats * volume.fat_sectors * 512;
+    volume.clusters = (get32 (&boot[32]) - reserved - fats * volume.fat_sectors) /
+                      volume.sectors_per_cluster;
+    volume.owner = calloc (volume.clusters + 2, sizeof (uint32_t));
+    volume.objects = 0;
+
+    for (uint8_t fat = 1; fat < fats; fat++)
+    {
+        const uint8_t *copy = volume.fat + (size_t)fat * volume.fat_sectors * 512;
+
+        for (uint32_t sector = 0; sector < volume.fat_sectors; sector++)
+        {
+            if (memcmp (volume.fat + sector * 512, copy + sector * 512, 512) != 0)
+                problem (path, "backup FAT differs in sector", sector);
+        }
+    }
+
+    fat32_walk (&volume, get32 (&boot[44]));
+
+    uint32_t lost = 0;
+    for (uint32_t cluster = 2; cluster < volume.clusters + 2; cluster++)
+    {
+        if (fat32_next (&volume, cluster) == 0)
+            (*free_clusters)++;
+        else if (volume.owner[cluster] == 0)
+            lost++;
+    }
+
+    if (lost != 0)
+        problem (path, "lost clusters:", lost);
+
+    if (info_sector != 0 && info_sector != 0xffff)
+    {
+        const uint32_t counted = get32 (&boot[info_sector * 512 + 488]);
+
+        if (counted != 0xffffffff && counted != *free_clusters)
+        {
+            fprintf (stderr, "%s: FS info says %u clusters are free, not %u\n",
+                     path, counted, *free_clusters);
+            failures++;
+        }
+    }
+
+    free (volume.owner);
+    free (volume.image);
+    return (failures == failed_before);
+}
+
+
+#define EXFAT_FAT_OFFSET 32  // sectors, after the boot region and its backup
+#define UPCASE_LENGTH    (128 * 2 + 4)
+
+static uint16_t exfat_sum16 (const uint16_t sum, const uint8_t byte)
+{
+    return (uint16_t)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + byte);
+}
+
+static uint32_t exfat_sum32 (const uint32_t sum, const uint8_t byte)
+{
+    return ((sum & 1) ? 0x80000000u : 0) + (sum >> 1) + byte;
+}
+
+// the boot region checksum, over its first 11 sectors bar the volume flags and
+// percent in use
+static uint32_t exfat_boot_checksum (const uint8_t *boot)
+{
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < 11 * 512; i++)
+    {
+        if (i != 106 && i != 107 && i != 112)
+            sum = exfat_sum32 (sum, boot[i]);
+    }
+
+    return sum;
+}
+
+bool test_image_exfat (const char *path, const uint32_t megabytes,
+                       const uint8_t sectors_per_cluster)
+{
+    const uint32_t sectors = megabytes * 2048;
+    const uint32_t volume_sectors = sectors - PARTITION_START;
+    const uint32_t cluster_bytes = (uint32_t)sectors_per_cluster * 512;
+
+    uint8_t shift = 0;
+    while ((1u << shift) < sectors_per_cluster)
+        shift++;
+
+    uint32_t fat_sectors = 1;
+    uint32_t clusters;
+    for (;;)
+    {
+        clusters = (volume_sectors - EXFAT_FAT_OFFSET - fat_sectors) >> shift;
+        const uint32_t needed = ((clusters + 2) * 4 + 511) / 512;
+
+        if (needed <= fat_sectors)
+            break;
+        fat_sectors = needed;
+    }
+
+    uint8_t *image = calloc (sectors, 512);
+    if (image == 0)
+        return false;
+
+    write_mbr (image, sectors, 0x07);
+
+    // the bitmap from cluster 2, then the up-case table, then the root
+    const uint32_t bitmap_bytes = (clusters + 7) / 8;
+    const uint32_t bitmap_clusters = (bitmap_bytes + cluster_bytes - 1) / cluster_bytes;
+    const uint32_t upcase_cluster = 2 + bitmap_clusters;
+    const uint32_t root_cluster = upcase_cluster + 1;
+
+    uint8_t *boot = &image[PARTITION_START * 512];
+    uint8_t *fat = boot + EXFAT_FAT_OFFSET * 512;
+    const uint32_t heap_offset = EXFAT_FAT_OFFSET + fat_sectors;
+    uint8_t *heap = boot + (size_t)heap_offset * 512;
+
+    memcpy (boot, "\xeb\x76\x90" "EXFAT   ", 11);
+    put32 (&boot[72], volume_sectors);  // (a 64-bit field)
+    put32 (&boot[80], EXFAT_FAT_OFFSET);
+    put32 (&boot[84], fat_sectors);
+    put32 (&boot[88], heap_offset);
+    put32 (&boot[92], clusters);
+    put32 (&boot[96], root_cluster);
+    put32 (&boot[100], 0x12345678);
+    put16 (&boot[104], 0x0100);
+    boot[108] = 9;
+    boot[109] = shift;
+    boot[110] = 1;
+    boot[111] = 0x80;
+    boot[112] = 0xff;
+    put16 (&boot[510], 0xaa55);
+
+    for (uint8_t s = 1; s <= 8; s++)
+        put32 (&boot[s * 512 + 508], 0xaa550000);
+
+    const uint32_t boot_sum = exfat_boot_checksum (boot);
+    for (uint16_t i = 0; i < 512; i += 4)
+        put32 (&boot[11 * 512 + i], boot_sum);
+    memcpy (boot + 12 * 512, boot, 12 * 512);
+
+    // ASCII maps to itself bar a-z, and so does the rest of Unicode
+    uint8_t *upcase = heap + (size_t)(upcase_cluster - 2) * cluster_bytes;
+    uint32_t upcase_sum = 0;
+    for (uint16_t c = 0; c < 128; c++)
+        put16 (&upcase[c * 2], (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c);
+    put16 (&upcase[256], 0xffff);
+    put16 (&upcase[258], 0xffff - 127);
+    for (uint16_t i = 0; i < UPCASE_LENGTH; i++)
+        upcase_sum = exfat_sum32 (upcase_sum, upcase[i]);
+
+    uint8_t *root = heap + (size_t)(root_cluster - 2) * cluster_bytes;
+    root[0] = 0x81;
+    put32 (&root[20], 2);
+    put32 (&root[24], bitmap_bytes);
+    root[32] = 0x82;
+    put32 (&root[36], upcase_sum);
+    put32 (&root[52], upcase_cluster);
+    put32 (&root[56], UPCASE_LENGTH);
+
+    put32 (&fat[0], 0xfffffff8);
+    put32 (&fat[4], 0xffffffff);
+    for (uint32_t cluster = 2; cluster <= root_cluster; cluster++)
+    {
+        const bool last = (cluster == 1 + bitmap_clusters || cluster >= upcase_cluster);
+        put32 (&fat[cluster * 4], last ? 0xffffffff : cluster + 1);
+
+        uint8_t *bitmap = heap;
+        bitmap[(cluster - 2) / 8] |= (uint8_t)(1 << ((cluster - 2) % 8));
+    }
+
+    const bool ok = write_image (path, image, sectors);
+    free (image);
+    return ok;
+}
+
+
+typedef struct exfat_volume
+{
+    const char *path;
+    uint8_t  *fat;
+    uint8_t  *heap;
+    uint32_t  cluster_bytes;
+    uint32_t  clusters;
+    uint8_t  *owner;      // each cluster claimed yet
+    uint32_t  contiguous; // files with no FAT chain
+} exfat_volume;
+
+static uint8_t *exfat_cluster (const exfat_volume *volume, const uint32_t cluster)
+{
+    return volume->heap + (size_t)(cluster - 2) * volume->cluster_bytes;
+}
+
+// claim an allocation, contiguous or a chain, of enough clusters for length
+// bytes, listing them in order (list has room for the count needed)
+static uint32_t exfat_claim (exfat_volume *volume, const uint32_t first,
+                             const uint64_t length, const bool no_fat_chain,
+                             uint32_t *list)
+{
+    const uint32_t needed = (uint32_t)((length + volume->cluster_bytes - 1) /
+                                       volume->cluster_bytes);
+    uint32_t cluster = first;
+
+    if (needed == 0)
+        return 0;
+
+    for (uint32_t i = 0; i < needed; i++)
+    {
+        if (cluster < 2 || cluster >= volume->clusters + 2)
+        {
+            problem (volume->path, "allocation runs out of the heap after cluster", first);
+            return i;
+        }
+
+        if (volume->owner[cluster])
+        {
+            problem (volume->path, "allocations cross at cluster", cluster);
+            return i;
+        }
+
+        volume->owner[cluster] = 1;
+        list[i] = cluster;
+
+        const uint32_t next = get32 (&volume->fat[cluster * 4]);
+        if (no_fat_chain)
+        {
+            cluster++;
+        }
+        else if (i + 1 == needed && next != 0xffffffff)
+        {
+            problem (volume->path, "chain doesn't end after the data length at", cluster);
+        }
+        else
+        {
+            cluster = next;
+        }
+    }
+
+    return needed;
+}
+
+static void exfat_walk (exfat_volume *volume, const uint32_t first,
+                        const uint64_t length, const bool no_fat_chain)
+{
+    const uint32_t needed = (uint32_t)(length / volume->cluster_bytes);
+    uint32_t *list = malloc (sizeof (uint32_t) * (needed + 1));
+    const uint32_t count = exfat_claim (volume, first, length, no_fat_chain, list);
+
+    // the entries, gathered in order
+    uint8_t *entries = malloc ((size_t)count * volume->cluster_bytes + 32);
+    for (uint32_t i = 0; i < count; i++)
+        memcpy (entries + (size_t)i * volume->cluster_bytes,
+                exfat_cluster (volume, list[i]), volume->cluster_bytes);
+    memset (entries + (size_t)count * volume->cluster_bytes, 0, 32);
+
+    const uint32_t total = count * volume->cluster_bytes / 32;
+
+    for (uint32_t i = 0; i < total; i++)
+    {
+        const uint8_t *entry = &entries[i * 32];
+
+        if (entry[0] == 0)
+            break;
+        if (entry[0] != 0x85)
+            continue;  // not in use, or not a file's set
+
+        const uint8_t secondary = entry[1];
+        const uint8_t *stream = entry + 32;
+
+        if (secondary < 2 || i + secondary >= total || stream[0] != 0xc0)
+        {
+            problem (volume->path, "bad entry set in a directory at cluster", first);
+            continue;
+        }
+
+        uint16_t sum = 0;
+        for (uint32_t b = 0; b < (uint32_t)(secondary + 1) * 32; b++)
+        {
+            if (b != 2 && b != 3)
+                sum = exfat_sum16 (sum, entry[b]);
+        }
+
+        // the name, up-cased, for the hash (it's ASCII)
+        uint16_t hash = 0;
+        char name[256];
+        const uint8_t name_length = stream[3];
+        for (uint8_t c = 0; c < name_length; c++)
+        {
+            const uint8_t *character = &entry[(2 + c / 15) * 32 + 2 + (c % 15) * 2];
+            const uint8_t upper = (character[0] >= 'a' && character[0] <= 'z' &&
+                                   character[1] == 0) ?
+                                  (uint8_t)(character[0] - 'a' + 'A') : character[0];
+
+            name[c] = (char)character[0];
+            hash = exfat_sum16 (exfat_sum16 (hash, upper), character[1]);
+        }
+        name[name_length] = 0;
+
+        if (sum != get16 (&entry[2]))
+            fprintf (stderr, "%s: %s has a bad set checksum\n", volume->path, name);
+        if (hash != get16 (&stream[4]))
+            fprintf (stderr, "%s: %s has a bad name hash\n", volume->path, name);
+        if (sum != get16 (&entry[2]) || hash != get16 (&stream[4]))
+            failures++;
+
+        const uint32_t valid_length = get32 (&stream[8]);
+        const uint32_t data_length = get32 (&stream[24]);
+        const uint32_t cluster = get32 (&stream[20]);
+        const bool contiguous = (stream[1] & 0x02) != 0;
+
+        if (valid_length > data_length)
+        {
+            fprintf (stderr, "%s: %s has more valid data than data\n", volume->path, name);
+            failures++;
+        }
+
+        if (get16 (&entry[4]) & 0x10)
+        {
+            exfat_walk (volume, cluster, data_length, contiguous);
+        }
+        else
+        {
+            uint32_t *clusters = malloc (sizeof (uint32_t) *
+                                         (data_length / volume->cluster_bytes + 1));
+            exfat_claim (volume, cluster, data_length, contiguous, clusters);
+            free (clusters);
+
+            if (contiguous && data_length != 0)
+                volume->contiguous++;
+        }
+
+        i += secondary;
+    }
+
+    free (entries);
+    free (list);
+}
+
+bool test_image_check_exfat (const char *path, uint32_t *free_clusters,
+                             uint32_t *contiguous)
+{
+    const uint32_t failed_before = failures;
+    uint32_t sectors;
+    exfat_volume volume;
+
+    *free_clusters = 0;
+    *contiguous = 0;
+
+    uint8_t *image = read_image (path, &sectors);
+    if (image == 0)
+    {
+        fprintf (stderr, "%s: can't be read\n", path);
+        failures++;
+        return false;
+    }
+
+    const uint8_t *boot = &image[(size_t)get32 (&image[446 + 8]) * 512];
+
+    if (get32 (&boot[11 * 512]) != exfat_boot_checksum (boot))
+        problem (path, "boot checksum is wrong, it's", get32 (&boot[11 * 512]));
+    if (get16 (&boot[106]) & 0x0002)
+        problem (path, "volume is left dirty, flags", get16 (&boot[106]));
+
+    volume.path = path;
+    volume.fat = (uint8_t*)boot + (size_t)get32 (&boot[80]) * 512;
+    volume.heap = (uint8_t*)boot + (size_t)get32 (&boot[88]) * 512;
+    volume.cluster_bytes = 512u << boot[109];
+    volume.clusters = get32 (&boot[92]);
+    volume.owner = calloc (volume.clusters + 2, 1);
+    volume.contiguous = 0;
+
+    // the root is always a chain; its length is wherever that ends
+    const uint32_t root = get32 (&boot[96]);
+    uint64_t root_length = 0;
+    for (uint32_t cluster = root;
+         cluster >= 2 && cluster < volume.clusters + 2 && root_length < (uint64_t)volume.clusters * volume.cluster_bytes;
+         cluster = get32 (&volume.fat[cluster * 4]))
+    {
+        root_length += volume.cluster_bytes;
+    }
+    exfat_walk (&volume, root, root_length, false);
+
+    // the bitmap and up-case table, from the root's first cluster
+    const uint8_t *bitmap = 0;
+    const uint8_t *entries = exfat_cluster (&volume, root);
+    for (uint32_t i = 0; i < volume.cluster_bytes; i += 32)
+    {
+        const uint8_t type = entries[i];
+
+        if (type == 0x81 || type == 0x82)
+        {
+            const uint32_t first = get32 (&entries[i + 20]);
+            const uint32_t length = get32 (&entries[i + 24]);
+            uint32_t *clusters = malloc (sizeof (uint32_t) *
+                                         (length / volume.cluster_bytes + 1));
+            exfat_claim (&volume, first, length, false, clusters);
+            free (clusters);
+
+            if (type == 0x81)
+                bitmap = exfat_cluster (&volume, first);
+        }
+    }
+
+    if (bitmap == 0)
+    {
+        problem (path, "has no allocation bitmap, root cluster", root);
+    }
+    else
+    {
+        uint32_t unmarked = 0, unused = 0;
+
+        for (uint32_t cluster = 2; cluster < volume.clusters + 2; cluster++)
+        {
+            const bool marked = (bitmap[(cluster - 2) / 8] >> ((cluster - 2) % 8)) & 1;
+
+            if (!marked)
+                (*free_clusters)++;
+
+            if (volume.owner[cluster] && !marked)
+                unmarked++;
+            else if (!volume.owner[cluster] && marked)
+                unused++;
+        }
+
+        if (unmarked != 0)
+            problem (path, "clusters in use but free in the bitmap:", unmarked);
+        if (unused != 0)
+            problem (path, "clusters marked in the bitmap but not used:", unused);
+    }
+
+    *contiguous = volume.contiguous;
+
+    free (volume.owner);
+    free (image);
+    return (failures == failed_before);
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************
+* test_image.h
+* description: Support for the host tests (the *_test.c programs): blank
+*              card images to run the filesystem code on, a consistency
+*              check of what it left behind, and a tally of the checks made.
+*******************************************************************************/
+
+#ifndef TEST_IMAGE_H
+#define TEST_IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// check a condition, reporting it (and carrying on) if it doesn't hold
+#define CHECK(condition) test_check ((condition), #condition, __FILE__, __LINE__)
+
+bool test_check (const bool passed, const char *what, const char *file,
+                 const int line);
+
+// print how many checks were made and failed; returns the exit status
+int test_summary (const char *test_name);
+
+// write a blank card image: an MBR with one FAT32 partition filling the rest
+// of the card, formatted with two FATs and an FS info sector
+bool test_image_fat32 (const char *path, const uint32_t megabytes,
+                       const uint8_t sectors_per_cluster);
+
+// check the FAT32 filesystem in an image (which mustn't be mounted): the FATs
+// match, every file and directory has a chain of its own that's as long as
+// it needs to be and no longer, no clusters are lost, and the FS info free
+// count (if there is one) is right.  Problems are reported, and counted as
+// failed checks.  *free_clusters is set to the number of free clusters.
+bool test_image_check_fat32 (const char *path, uint32_t *free_clusters);
+
+// write a blank card image with one exFAT partition (type 0x07): the boot
+// region and its backup, a FAT, and a root directory holding the allocation
+// bitmap and an up-case table that covers ASCII
+bool test_image_exfat (const char *path, const uint32_t megabytes,
+                       const uint8_t sectors_per_cluster);
+
+// check the exFAT filesystem in an image (which mustn't be mounted): the boot
+// checksum is right and the volume isn't left dirty, every entry set has the
+// right checksum and name hash, every allocation (contiguous or chained) is
+// as long as its data length needs and doesn't cross another, and the
+// allocation bitmap marks exactly the clusters in use.  Problems are reported
+// and counted as failed checks.  *free_clusters is set to the number of free
+// clusters, and *contiguous to the number of files with no FAT chain.
+bool test_image_check_exfat (const char *path, uint32_t *free_clusters,
+                             uint32_t *contiguous);
+
+#endif
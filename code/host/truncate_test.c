@@ -0,0 +1,172 @@
+/*******************************************************************************
+* truncate_test.c
+* description: Regression test for sd_fat32_truncate.  A file is grown and
+*              cut back at and between cluster boundaries, with its seek
+*              position before and after the cut, and rewritten afterwards,
+*              while a copy of what it should hold is kept in RAM.  The
+*              image is checked for leaked or cross-linked clusters and a
+*              wrong free count at the end.
+*
+*              usage: truncate_test (leaves truncate_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <stdio.h>
+
+#define IMAGE "truncate_test.img"
+
+#define MAX_SIZE 400000
+
+static uint8_t expected[MAX_SIZE];
+static uint8_t buffer[MAX_SIZE];
+static uint32_t expected_size = 0;
+
+
+// write length bytes of a pattern at the file's seek position (offset),
+// keeping the copy in step
+static bool write_pattern (const uint8_t file_id, const uint32_t offset,
+                           const uint32_t length, const uint8_t seed)
+{
+    for (uint32_t i = 0; i < length; i++)
+        buffer[i] = (uint8_t)((offset + i) * 7 + (offset + i) / 509 + seed);
+
+    if (!sd_fat32_write_file (file_id, length, buffer))
+        return false;
+
+    for (uint32_t i = 0; i < length; i++)
+        expected[offset + i] = buffer[i];
+    if (offset + length > expected_size)
+        expected_size = offset + length;
+
+    return true;
+}
+
+// the whole file reads back as the copy, and no further
+static bool contents_match (const uint8_t file_id)
+{
+    uint32_t size;
+
+    if (!sd_fat32_seek (file_id, 0) ||
+        !sd_fat32_read_file (file_id, expected_size, buffer))
+        return false;
+
+    for (uint32_t i = 0; i < expected_size; i++)
+    {
+        if (buffer[i] != expected[i])
+        {
+            fprintf (stderr, "byte %u differs\n", i);
+            return false;
+        }
+    }
+
+    return !sd_fat32_read_file (file_id, 1, buffer) &&
+           error_code == ERROR_FAT32_TOO_FAR &&
+           sd_fat32_get_seek_pos (file_id, &size) && size == expected_size;
+}
+
+static bool truncate (const uint8_t file_id, const uint32_t size)
+{
+    if (!sd_fat32_truncate (file_id, size))
+        return false;
+
+    expected_size = size;
+    return true;
+}
+
+static uint32_t extents_of (const char *name, uint32_t *clusters)
+{
+    uint32_t extents = 0;
+
+    if (!sd_fat32_file_extents (name, clusters, &extents))
+        return 0;
+    return extents;
+}
+
+
+int main (void)
+{
+    uint8_t file_id, other_id;
+    uint32_t position, clusters, free_before, free_after;
+
+    if (!CHECK (test_image_fat32 (IMAGE, 16, 2)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_fat32_init()))
+        return test_summary ("truncate_test");
+
+    CHECK (sd_fat32_free_space (&free_before));
+
+    // 1 KB clusters, so 300 KB crosses a couple of FAT sectors
+    CHECK (sd_fat32_open_file ("TRUNC.BIN", CREATE_FILE, &file_id));
+    CHECK (write_pattern (file_id, 0, 300000, 1));
+
+    // between cluster boundaries, with the seek position past the new end
+    CHECK (truncate (file_id, 200001));
+    CHECK (sd_fat32_get_seek_pos (file_id, &position) && position == 200001);
+    CHECK (contents_match (file_id));
+
+    // it only shrinks files, and not read-only ones
+    CHECK (!sd_fat32_truncate (file_id, 200002) && error_code == ERROR_FAT32_TOO_FAR);
+
+    // on a cluster boundary, with the seek position before the cut, where it
+    // stays
+    CHECK (sd_fat32_seek (file_id, 1000));
+    CHECK (truncate (file_id, 150 * 1024));
+    CHECK (sd_fat32_get_seek_pos (file_id, &position) && position == 1000);
+    CHECK (contents_match (file_id));
+
+    // from a seek position in the kept part of the chain, then writing over
+    // the end from there
+    CHECK (sd_fat32_seek (file_id, 30000));
+    CHECK (truncate (file_id, 45000));
+    CHECK (sd_fat32_get_seek_pos (file_id, &position) && position == 30000);
+    CHECK (write_pattern (file_id, 30000, 20000, 2));
+    CHECK (contents_match (file_id));
+
+    CHECK (sd_fat32_close_file (file_id));
+
+    // the kept clusters stayed where they were
+    CHECK (extents_of ("TRUNC.BIN", &clusters) == 1 && clusters == 49);
+
+    // another file takes the clusters after it, so growing it again has to
+    // go around that one
+    CHECK (sd_fat32_open_file ("OTHER.BIN", CREATE_FILE, &other_id));
+    CHECK (sd_fat32_write_file (other_id, 5000, buffer));
+    CHECK (sd_fat32_close_file (other_id));
+
+    CHECK (sd_fat32_open_file ("TRUNC.BIN", APPEND_FILE, &file_id));
+    CHECK (sd_fat32_seek (file_id, expected_size));
+    CHECK (write_pattern (file_id, expected_size, 100000, 3));
+    CHECK (contents_match (file_id));
+    CHECK (truncate (file_id, 60000));
+    CHECK (contents_match (file_id));
+
+    // to nothing, then written again
+    CHECK (truncate (file_id, 0));
+    CHECK (contents_match (file_id));
+    CHECK (write_pattern (file_id, 0, 3000, 4));
+    CHECK (contents_match (file_id));
+    CHECK (sd_fat32_close_file (file_id));
+
+    CHECK (sd_fat32_open_file ("TRUNC.BIN", READ_FILE, &file_id));
+    CHECK (!sd_fat32_truncate (file_id, 0) && error_code == ERROR_FAT32_FILE_READ_ONLY);
+    CHECK (contents_match (file_id));
+    CHECK (sd_fat32_close_file (file_id));
+
+    // the two files' clusters (3 and 5) are all that's gone
+    CHECK (sd_fat32_free_space (&free_after) && free_before - free_after == 8);
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+
+    uint32_t free_clusters;
+    if (CHECK (test_image_check_fat32 (IMAGE, &free_clusters)))
+        CHECK (free_clusters == free_after);
+
+    const int status = test_summary ("truncate_test");
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
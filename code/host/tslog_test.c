@@ -0,0 +1,303 @@
+/*******************************************************************************
+* tslog_test.c
+* description: Regression test for time-series logs (sd_fat32_tslog.c).  A
+*              log is filled with records whose timestamps climb unevenly,
+*              with gaps and with long runs of equal timestamps that cross
+*              from one block into the next, and then a set of times is
+*              looked up: each record's own time, times in the gaps, times
+*              before the first record and after the last.  The lookups are
+*              repeated after the log is reopened, after its index has lost
+*              its last entries, gained entries for blocks that were never
+*              written, or been deleted altogether, each time checking that
+*              the index ends up with an entry for every Nth block.
+*
+*              usage: tslog_test (leaves tslog_test.img if it fails)
+*******************************************************************************/
+
+#include "sd_fat32.h"
+#include "sd_image.h"
+#include "test_image.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define IMAGE "tslog_test.img"
+#define LOG   "SERIES.DAT"
+#define INDEX "SERIES.IDX"
+
+#define INTERVAL 4
+#define RECORDS  2400
+
+// the index file's header is a magic number and the interval
+#define INDEX_HEADER 4
+
+// every record's timestamp, and the number of blocks they fill
+static uint32_t times[RECORDS];
+static uint32_t appended = 0;
+static uint32_t blocks = 0;
+static uint16_t block_used = 512;
+
+static uint8_t record[TSLOG_MAX_RECORD];
+
+
+// timestamps go up by 0 to 9, with a run of 150 equal ones every 700
+// records, which is longer than a block holds
+static uint32_t time_of (const uint32_t n)
+{
+    if (n == 0)
+        return 5000;
+
+    const uint32_t step = (n % 700 < 150) ? 0 : (n * 7) % 10;
+    return times[n - 1] + step;
+}
+
+// record n holds n, then bytes derived from it; most are short, some are as
+// long as a record can be
+static uint16_t make_record (const uint32_t n)
+{
+    const uint16_t length = (n % 211 == 5) ? TSLOG_MAX_RECORD : (uint16_t)(4 + (n * 13) % 70);
+
+    memcpy (record, &n, 4);
+    for (uint16_t i = 4; i < length; i++)
+        record[i] = (uint8_t)(n + i * 3);
+
+    return length;
+}
+
+static bool append_upto (fat32_tslog *log, const uint32_t count)
+{
+    while (appended < count)
+    {
+        const uint32_t n = appended;
+        const uint16_t length = make_record (n);
+
+        times[n] = time_of (n);
+        if (!sd_fat32_tslog_append (log, times[n], record, length))
+            return false;
+
+        // a record starts a new block if it doesn't fit in the last one,
+        // and has 6 bytes of its own ahead of its data
+        if (block_used + 6 + length > 512)
+        {
+            blocks++;
+            block_used = TSLOG_BLOCK_HEADER;
+        }
+        block_used += 6 + length;
+        appended++;
+    }
+
+    return log->blocks == blocks;
+}
+
+// the first record with a timestamp of at least time (appended if none)
+static uint32_t first_at (const uint32_t time)
+{
+    uint32_t n = 0;
+
+    while (n < appended && times[n] < time)
+        n++;
+
+    return n;
+}
+
+// seek to time, and read up to count records from there: they have to be
+// the ones from first_at (time) on, intact
+static bool finds (fat32_tslog *log, const uint32_t time, const uint32_t count)
+{
+    static uint8_t buffer[TSLOG_MAX_RECORD];
+    fat32_tslog_reader reader;
+    uint32_t timestamp, n;
+    uint16_t length;
+
+    if (!sd_fat32_tslog_seek_time (log, &reader, time))
+        return false;
+
+    const uint32_t first = first_at (time);
+    for (uint32_t expected = first; expected < first + count; expected++)
+    {
+        if (!sd_fat32_tslog_read (log, &reader, &timestamp, buffer, sizeof (buffer), &length))
+            return false;
+
+        if (expected >= appended)
+            return length == 0;  // at the end
+
+        memcpy (&n, buffer, 4);
+        if (n != expected || timestamp != times[n] ||
+            length != make_record (n) || memcmp (buffer, record, length) != 0)
+        {
+            fprintf (stderr, "looking up %u, read record %u instead of %u\n",
+                     time, n, expected);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// look up every sort of time
+static void look_up_times (fat32_tslog *log)
+{
+    const uint32_t last = times[appended - 1];
+
+    CHECK (finds (log, 0, 3));
+    CHECK (finds (log, times[0], 3));
+    CHECK (finds (log, last, 3));
+    CHECK (finds (log, last + 1, 1));
+    CHECK (finds (log, 0xffffffff, 1));
+
+    // every distinct time, the one after it (often in a gap), and from the
+    // start of each run of equal times to its end and beyond
+    uint32_t checked = 0;
+    for (uint32_t n = 0; n < appended; n++)
+    {
+        if (n > 0 && times[n] == times[n - 1])
+            continue;
+
+        checked += finds (log, times[n], 2) && finds (log, times[n] + 1, 2);
+        if (n % 700 == 0)
+            CHECK (finds (log, times[n], 160));
+    }
+
+    uint32_t distinct = 0;
+    for (uint32_t n = 0; n < appended; n++)
+        distinct += (n == 0 || times[n] != times[n - 1]);
+    CHECK (checked == distinct);
+
+    // all of it, from the start
+    CHECK (finds (log, times[0], appended + 1));
+}
+
+// the index's size, and its interval
+static bool index_has (const uint32_t entries, const uint16_t interval)
+{
+    uint8_t file_id;
+    uint8_t header[INDEX_HEADER];
+    uint32_t size;
+
+    const bool read = sd_fat32_open_file (INDEX, APPEND_FILE, &file_id) &&
+                      sd_fat32_get_seek_pos (file_id, &size) &&
+                      sd_fat32_seek (file_id, 0) &&
+                      sd_fat32_read_file (file_id, INDEX_HEADER, header);
+
+    return sd_fat32_close_file (file_id) && read &&
+           size == INDEX_HEADER + entries * 4 &&
+           (header[2] | (header[3] << 8)) == interval;
+}
+
+static bool resize_index (const uint32_t entries)
+{
+    uint8_t file_id;
+    uint32_t size;
+
+    if (!sd_fat32_open_file (INDEX, APPEND_FILE, &file_id) ||
+        !sd_fat32_get_seek_pos (file_id, &size))
+        return false;
+
+    if (size > INDEX_HEADER + entries * 4)
+    {
+        if (!sd_fat32_truncate (file_id, INDEX_HEADER + entries * 4))
+            return false;
+    }
+    else
+    {  // entries pointing past the end of the log
+        for (uint32_t i = 0; i < 5 * 4; i++)
+            record[i] = 0xee;
+        if (!sd_fat32_write_file (file_id, INDEX_HEADER + entries * 4 - size, record))
+            return false;
+    }
+
+    return sd_fat32_close_file (file_id);
+}
+
+
+int main (void)
+{
+    fat32_tslog log;
+    uint16_t length;
+    uint32_t timestamp;
+
+    if (!CHECK (test_image_fat32 (IMAGE, 16, 2)) ||
+        !CHECK (sd_image_open (IMAGE)) ||
+        !CHECK (sd_fat32_init()))
+        return test_summary ("tslog_test");
+
+    CHECK (!sd_fat32_tslog_create (LOG, 0) && error_code == ERROR_FAT32_TOO_FAR);
+    CHECK (!sd_fat32_tslog_create ("SERIES.IDX", INTERVAL) &&
+           error_code == ERROR_FAT32_INVALID_NAME);
+    CHECK (sd_fat32_tslog_create (LOG, INTERVAL));
+    CHECK (sd_fat32_tslog_open (LOG, &log));
+
+    // an empty log: any time waits at the end, and a waiting reader sees
+    // records as they're appended
+    fat32_tslog_reader reader;
+    CHECK (sd_fat32_tslog_seek_time (&log, &reader, 0));
+    CHECK (sd_fat32_tslog_read (&log, &reader, &timestamp, record, sizeof (record), &length) &&
+           length == 0);
+    CHECK (append_upto (&log, 2));
+    CHECK (sd_fat32_tslog_read (&log, &reader, &timestamp, record, sizeof (record), &length) &&
+           length == make_record (0) && timestamp == times[0]);
+
+    // records that are too long or empty
+    CHECK (!sd_fat32_tslog_append (&log, times[1], record, TSLOG_MAX_RECORD + 1) &&
+           error_code == ERROR_TOO_FAR);
+    CHECK (!sd_fat32_tslog_append (&log, times[1], record, 0) && error_code == ERROR_TOO_FAR);
+
+    // a record too long for the buffer is left where it is
+    uint8_t small[3];
+    CHECK (!sd_fat32_tslog_read (&log, &reader, &timestamp, small, sizeof (small), &length) &&
+           error_code == ERROR_TOO_FAR);
+    CHECK (sd_fat32_tslog_read (&log, &reader, &timestamp, record, sizeof (record), &length) &&
+           length == make_record (1) && timestamp == times[1]);
+
+    CHECK (append_upto (&log, RECORDS / 2));
+    look_up_times (&log);
+
+    // reopened partway through a block, it carries on filling that block
+    const uint32_t blocks_before = blocks;
+    CHECK (sd_fat32_tslog_close (&log));
+    CHECK (sd_fat32_tslog_open (LOG, &log) && log.blocks == blocks);
+    CHECK (log.header.used == block_used);
+    CHECK (append_upto (&log, RECORDS / 2 + 1) && blocks == blocks_before);
+    CHECK (append_upto (&log, RECORDS));
+    look_up_times (&log);
+
+    const uint32_t entries = (blocks + INTERVAL - 1) / INTERVAL;
+    CHECK (log.entries == entries);
+    CHECK (sd_fat32_tslog_close (&log));
+    CHECK (index_has (entries, INTERVAL));
+
+    // the last few index entries lost: they're added again
+    CHECK (resize_index (entries - 5));
+    CHECK (sd_fat32_tslog_open (LOG, &log) && log.entries == entries);
+    look_up_times (&log);
+    CHECK (sd_fat32_tslog_close (&log));
+    CHECK (index_has (entries, INTERVAL));
+
+    // entries for blocks that never made it: they're dropped
+    CHECK (resize_index (entries + 5));
+    CHECK (sd_fat32_tslog_open (LOG, &log) && log.entries == entries);
+    look_up_times (&log);
+    CHECK (sd_fat32_tslog_close (&log));
+    CHECK (index_has (entries, INTERVAL));
+
+    // no index at all: it's rebuilt, with the default interval
+    CHECK (sd_fat32_delete (INDEX));
+    CHECK (sd_fat32_tslog_open (LOG, &log));
+    CHECK (log.interval == TSLOG_DEFAULT_INTERVAL &&
+           log.entries == (blocks + TSLOG_DEFAULT_INTERVAL - 1) / TSLOG_DEFAULT_INTERVAL);
+    look_up_times (&log);
+    CHECK (sd_fat32_tslog_close (&log));
+    CHECK (index_has ((blocks + TSLOG_DEFAULT_INTERVAL - 1) / TSLOG_DEFAULT_INTERVAL,
+                      TSLOG_DEFAULT_INTERVAL));
+
+    CHECK (sd_fat32_shutdown());
+    sd_image_close();
+
+    uint32_t free_clusters;
+    CHECK (test_image_check_fat32 (IMAGE, &free_clusters));
+
+    const int status = test_summary ("tslog_test");
+    if (status == 0)
+        remove (IMAGE);
+    return status;
+}
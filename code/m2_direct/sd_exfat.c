@@ -0,0 +1 @@
+../common/sd_exfat.c
\ No newline at end of file
@@ -0,0 +1 @@
+../common/sd_exfat.h
\ No newline at end of file
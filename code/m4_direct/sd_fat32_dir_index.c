@@ -0,0 +1 @@
+../common/sd_fat32_dir_index.c
\ No newline at end of file
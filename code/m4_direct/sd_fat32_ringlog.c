@@ -0,0 +1 @@
+../common/sd_fat32_ringlog.c
\ No newline at end of file
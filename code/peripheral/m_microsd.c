@@ -1,15 +1,110 @@
 #include <stdint.h>
+#ifdef HOST
+#include "mbus_sim.h"
+#else
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <util/twi.h>
+#endif
 
 #include "sd_fat32.h"
+#include "fat32_filenames.h"
+
+#ifdef EXFAT
+#include "sd_exfat.h"
+
+// cards that turn out not to be FAT32 are mounted as exFAT (SDXC), and every
+// filesystem call after that goes to the sd_exfat version of the function
+bool exfat_mounted = false;
+#define FS_CALL(function, ...) (exfat_mounted ? sd_exfat_##function (__VA_ARGS__) \
+                                              : sd_fat32_##function (__VA_ARGS__))
+#define FS_NAME_LENGTH EXFAT_NAME_LENGTH
+#else
+#define FS_CALL(function, ...) sd_fat32_##function (__VA_ARGS__)
+#define FS_NAME_LENGTH 12
+#endif
 
 #define I2C_ADDR (0x5D)
 #define TWI_BUFFER_LEN 257
 
+// frame headers are the code and an 8-bit data length, or in bulk mode (see
+// M_SD_SET_MODE) a 16-bit one, so a read can return a whole sector; queued
+// frames also have the master's sequence number after the code
+#define LEGACY_HEADER_LENGTH 2
+#define BULK_HEADER_LENGTH   3
+#define QUEUED_HEADER_LENGTH 4
+
+// the response code when the master reads in queued mode and no order has
+// been finished yet
+#define NO_COMPLETION 0xff
+
+// orders that can be held at once: with more than one, the master can switch
+// to queued frames and send the next order while the last one is processed
+// (so the next part of a write comes in while the last part is written out).
+// The slots share ORDER_BUFFER_LEN bytes of RAM: legacy and bulk frames have
+// all of it in the first slot, and queued frames have QUEUED_SLOT_LEN bytes
+// in each.  The ATmega328 has no room for a second whole buffer alongside its
+// cached sectors, so it splits its one buffer in two
+#ifndef ORDER_SLOTS
+#if defined(ATMEGA168)
+#define ORDER_SLOTS 1
+#elif (defined(ATMEGA328) || defined(HOST))
+#define ORDER_SLOTS 2
+#else
+#error Unknown target
+#endif
+#endif
+
+#if ORDER_SLOTS < 1
+#error Must have at least one order slot
+#endif
+
+#ifndef ORDER_BUFFER_LEN
+#if (defined(ATMEGA168) || defined(ATMEGA328))
+#define ORDER_BUFFER_LEN TWI_BUFFER_LEN
+#elif defined(HOST)
+#define ORDER_BUFFER_LEN (ORDER_SLOTS * TWI_BUFFER_LEN)
+#else
+#error Unknown target
+#endif
+#endif
+
+#if ORDER_BUFFER_LEN < TWI_BUFFER_LEN
+#error The order buffer must hold a whole legacy frame
+#endif
+
+#if ORDER_BUFFER_LEN / ORDER_SLOTS < TWI_BUFFER_LEN
+#define QUEUED_SLOT_LEN (ORDER_BUFFER_LEN / ORDER_SLOTS)
+#else
+#define QUEUED_SLOT_LEN TWI_BUFFER_LEN
+#endif
+
+#if ORDER_SLOTS > 1 && QUEUED_SLOT_LEN < 64
+#error Too many order slots for the order buffer
+#endif
+
+// FAT sectors counted per M_SD_FREE_SPACE order, when the count isn't known
+#define FREE_COUNT_SECTORS 64
+
+// a directory entry response: found flag, size, directory flag and the name
+#define DIR_ENTRY_RESPONSE (6 + FS_NAME_LENGTH + 1)
+
+// M_SD_LIST_DIR: the most entries looked at per order (so a filter that
+// matches little doesn't hold the bus up for long), the flags in a listed
+// entry, and the room an entry can take in the response (the name is listed
+// into place with its terminator, which the next entry then overwrites)
+#define LIST_SCAN_ENTRIES 128
+#define LISTED_DIRECTORY  0x01
+#define LIST_ENTRY_SPACE  (10 + FS_NAME_LENGTH + 1)
+
+// in an M_SD_BATCH step, the file id that stands for the file opened by an
+// earlier step, and the room every step needs for its response (the most any
+// of the fixed-length responses take, other than a directory entry's)
+#define BATCH_FILE       0xfe
+#define BATCH_STEP_SPACE (FS_NAME_LENGTH + 2)
+
 // This code is designed to run on the ATmega168 or ATmega328, not the M2
 #ifdef M2
     #error Peripheral code should not be used on the M2
@@ -29,16 +124,39 @@
 #define GATE_PORT PORTC
 #define GATE_NUM  2
 
-inline void data_led_on (void)
+static inline void data_led_on (void)
 {
     set (DATA_LED_PORT, DATA_LED_NUM);
 }
 
-inline void data_led_off (void)
+static inline void data_led_off (void)
 {
     clear (DATA_LED_PORT, DATA_LED_NUM);
 }
 
+// with READY_LINE defined, a pin that's high while there's a response for the
+// master to read and low while it's still being worked on, so the master can
+// watch it rather than polling over I2C (see M_SD_READY_LINE in the master)
+#ifdef READY_LINE
+#ifndef READY_DDR
+#define READY_DDR  DDRD
+#define READY_PORT PORTD
+#define READY_NUM  2
+#endif
+#endif
+
+static inline void ready_line (const bool ready)
+{
+    #ifdef READY_LINE
+    if (ready)
+        set (READY_PORT, READY_NUM);
+    else
+        clear (READY_PORT, READY_NUM);
+    #else
+    (void)ready;
+    #endif
+}
+
 
 // I2C slave status codes:
 // transmit:
@@ -90,22 +208,138 @@ typedef enum m_microsd_command_type
     M_SD_GET_SEEK,
     M_SD_READ_FILE,
     M_SD_WRITE_FILE,
+    M_SD_COMMIT,
+    M_SD_TRUNCATE,
+    M_SD_FREE_SPACE,
+    M_SD_RINGLOG_CREATE,
+    M_SD_RINGLOG_OPEN,
+    M_SD_RINGLOG_CLOSE,
+    M_SD_RINGLOG_APPEND,
+    M_SD_RINGLOG_REWIND,
+    M_SD_RINGLOG_READ,
+    M_SD_SET_MODE,
+    M_SD_WRITE_MORE,
+    M_SD_BATCH,
+    M_SD_LIST_DIR,
     
     M_SD_NONE = 255
 } m_microsd_command_type;
 
-// we can reuse the same buffer for sending and receiving data, since
-// we will only be doing one of them at a time
-struct
+// frame formats for M_SD_SET_MODE
+typedef enum m_microsd_frame_mode
+{
+    MBUS_LEGACY_FRAMES = 0,
+    MBUS_BULK_FRAMES,
+    MBUS_QUEUED_FRAMES
+} m_microsd_frame_mode;
+
+// options for M_SD_SET_MODE, in an optional second byte
+#define MBUS_WRITE_BEHIND 0x01  // (queued frames only)
+
+// an order, and once it's processed, its response: we can reuse the same
+// buffer for both, since the response is only sent after processing
+typedef struct order_slot
 {
-    uint8_t code;
-    uint8_t data_length;
-    uint8_t data[TWI_BUFFER_LEN];
-} transmission;
+    uint8_t  code;
+    uint8_t  seq;          // the master's sequence number, in queued mode
+    uint16_t data_length;
+    const uint8_t *response_data;  // data, or for a bulk read, the cached sector itself
+    uint8_t *data;         // the slot's part of order_buffer
+} order_slot;
+
+uint8_t order_buffer[ORDER_BUFFER_LEN];
+
+// the first slot starts at the beginning of order_buffer, whatever the frame
+// format; the others are only used with queued frames (see reset_queue)
+order_slot slots[ORDER_SLOTS] = {{ .data = order_buffer }};
+
+// the order being processed; outside of queued mode, every order goes
+// through the first slot
+order_slot *order = &slots[0];
+
+// how much order data each slot can take with the current frame format
+uint16_t slot_length = TWI_BUFFER_LEN;
 
 volatile bool new_order;
 volatile uint8_t TWCR_state;
 
+// the header format of the frame being received or sent, and the one to
+// switch to when the next order starts (so the response to M_SD_SET_MODE
+// still goes out in the old format)
+uint8_t header_length = LEGACY_HEADER_LENGTH;
+volatile uint8_t next_header_length = LEGACY_HEADER_LENGTH;
+
+#if ORDER_SLOTS > 1
+// in queued mode, the ISR takes a free slot for each order it receives and
+// adds it to waiting; the main loop processes the waiting orders in turn and
+// adds them to finished, and the ISR sends those back in turn and frees their
+// slots.  Each ring has one writer and one reader, so neither needs
+// interrupts disabled (the counters run freely, and index mod ORDER_SLOTS)
+volatile bool slot_busy[ORDER_SLOTS];
+volatile uint8_t waiting[ORDER_SLOTS];
+volatile uint8_t waiting_in = 0, waiting_out = 0;
+volatile uint8_t finished[ORDER_SLOTS];
+volatile uint8_t finished_in = 0, finished_out = 0;
+
+// a finished bulk read's data is still in the cache, so nothing else can be
+// processed until it has been sent
+volatile bool view_held = false;
+
+// the ISR is sending a finished order back
+volatile bool sending_finished = false;
+
+#define NO_SLOT ((order_slot*)0)
+
+// with write-behind on (see M_SD_SET_MODE), a queued write is acknowledged as
+// soon as the main loop takes it up, and only then carried out.  Its slot,
+// behind_slot, stays busy until the write is done, even if the ISR has sent
+// the acknowledgement by then (behind_acked).  The first error such a write
+// runs into is held in behind_error until it can be reported: in the response
+// to the next order, which isn't carried out (but a write is, since it has
+// been acknowledged already; the rest of a write that failed is dropped anyway)
+bool write_behind = false;
+uint8_t behind_error = ERROR_NONE;
+order_slot *volatile behind_slot = NO_SLOT;
+volatile bool behind_acked = false;
+#endif
+
+// a bulk write whose M_SD_WRITE_MORE frames are still to come, and the first
+// error it ran into (reported with the last frame)
+uint16_t write_remaining = 0;
+uint8_t write_file_id;
+uint8_t write_error;
+
+// running the steps of an M_SD_BATCH, which use the legacy forms of reads and
+// writes (whole, and copied into the order's buffer)
+bool in_batch = false;
+
+#ifdef IDLE_WORK
+// background work done between orders (see idle_work) stops after an error
+// until the next order, rather than retrying a failing card over and over
+bool idle_failed = false;
+
+// the file id whose next sector is prefetched first, taken round-robin
+uint8_t prefetch_file = 0;
+#endif
+
+#ifdef READ_AHEAD
+// where each file's seek position was left by its last M_SD_READ_FILE (a read
+// that starts there is taken to be part of a stream)
+uint32_t read_end[MAX_FILES];
+
+// the file whose next read is expected, and how much of it (from the seek
+// position) to have cached by then; read_ahead runs between orders
+uint8_t ahead_file;
+uint16_t ahead_length = 0;
+#endif
+
+#ifdef FAT32_RINGLOG
+// the master can have one ring log open at a time
+fat32_ringlog ringlog;
+fat32_ringlog_reader ringlog_reader;
+bool ringlog_open = false;
+#endif
+
 
 #ifdef TEST_FAT32
 
@@ -189,7 +423,9 @@ static void test_copy (void)
 #define TWI_NACK()   {(TWCR = _BV (TWIE) | _BV (TWINT) | _BV (TWEN)); TWCR_state = TWCR;}
 
 void process_order (void);
+void check_for_order (void);
 
+#ifndef HOST
 void voltage_divider_check (void)
 {
     // The voltage divider between VCC and the microSD card ensures
@@ -244,6 +480,11 @@ void main (void)
     set (DATA_LED_DDR, DATA_LED_NUM);
     data_led_off();
     
+    #ifdef READY_LINE
+    set (READY_DDR, READY_NUM);
+    ready_line (false);
+    #endif
+    
     #ifdef TEST_FAT32
     // test the FAT32 interface and then busy-loop
     // LED on: still working
@@ -306,340 +547,1213 @@ void main (void)
     }
     
     for (;;)
+        check_for_order();
+}
+#endif
+
+
+#if ORDER_SLOTS > 1
+// hand a queued order's response (in its slot) to the ISR to send
+static void finish_order (const uint8_t slot)
+{
+    cli();  // (the ISR lowers the ready line as responses are read)
+    finished[finished_in % ORDER_SLOTS] = slot;
+    finished_in++;
+    ready_line (true);
+    sei();
+}
+
+// acknowledge a queued write, with any error held from an earlier one, and
+// then carry it out (from a copy of the slot's header, since the ISR may be
+// sending the acknowledgement from the slot meanwhile)
+static void write_behind_order (const uint8_t slot)
+{
+    order_slot written = slots[slot];
+    const uint8_t code = written.code;
+    const uint8_t earlier_error = write_error;
+    
+    order->code = behind_error;
+    order->data_length = 0;
+    order->response_data = order->data;
+    behind_error = ERROR_NONE;
+    
+    behind_acked = false;
+    behind_slot = order;
+    finish_order (slot);
+    
+    order = &written;
+    process_order();
+    data_led_off();
+    
+    // an error that an earlier part of the same write ran into has been
+    // counted already
+    if (written.code != ERROR_NONE && behind_error == ERROR_NONE &&
+        (code == M_SD_WRITE_FILE || written.code != earlier_error))
+        behind_error = written.code;
+    
+    cli();
+    if (behind_acked)
+        slot_busy[slot] = false;
+    behind_slot = NO_SLOT;
+    sei();
+    
+    order = &slots[slot];
+}
+#endif
+
+
+#if defined(IDLE_WORK) || defined(READ_AHEAD)
+// whether a response that's still to be sent is a view into the cache, which
+// nothing may evict (outside of queued mode, the last response can be read
+// again until the next order arrives)
+static bool view_outstanding (void)
+{
+    #if ORDER_SLOTS > 1
+    if (header_length == QUEUED_HEADER_LENGTH)
+        return view_held;
+    #endif
+    
+    return slots[0].response_data != slots[0].data;
+}
+#endif
+
+#ifdef READ_AHEAD
+// read one more sector of the expected read into the cache; the view being
+// sent is the most recently used sector, so with a bigger cache than that,
+// reading a single sector (as for a bulk read, whose next view starts in one)
+// can't evict it
+static void read_ahead (void)
+{
+    if (CACHED_SECTORS < 2 && view_outstanding())
+        return;
+    
+    bool loaded;
+    if (!sd_fat32_prefetch (ahead_file, ahead_length, &loaded) || !loaded)
+        ahead_length = 0;  // done, or the read will run into the error itself
+}
+#endif
+
+#ifdef IDLE_WORK
+// one unit of background work, for when no order is waiting: the first of
+// these that has anything to do, each of which takes a single sector read or
+// write (copying a FAT sector can read it and then write each backup), so an
+// order that arrives meanwhile isn't held up for longer than that
+static bool idle_unit (void)
+{
+    bool busy;
+    
+    // write out a modified sector, so a later cache miss doesn't have to
+    if (!commit_least_used (&busy) || busy)
+        return (error_code == ERROR_NONE);
+    
+    // copy a modified FAT sector to the backup FATs (mirroring is deferred
+    // with IDLE_WORK, see M_SD_INIT)
+    if (!sd_fat32_mirror_one_fat (&busy) || busy)
+        return (error_code == ERROR_NONE);
+    
+    // read the sector that a file being read will want next
+    for (uint8_t i = 0; i < MAX_FILES; i++)
     {
-        // process any commands received over I2C
+        const uint8_t file_id = prefetch_file;
+        prefetch_file = (prefetch_file + 1) % MAX_FILES;
         
-        if (new_order)
-        {  // there's a new order ready for processing
-            // I2C should be NACKing everything at this point
-            
+        if (files[file_id].open && (!sd_fat32_prefetch (file_id, 1, &busy) || busy))
+            return (error_code == ERROR_NONE);
+    }
+    
+    // count another FAT sector's free clusters, so M_SD_FREE_SPACE is instant
+    return sd_fat32_count_free_clusters (1, &busy);
+}
+#endif
+
+#if defined(IDLE_WORK) || defined(READ_AHEAD)
+// with nothing to process, get ahead on whatever is likely to be wanted next
+static void idle_work (void)
+{
+    if (!fat32_initialized)
+        return;
+    
+    #ifdef READ_AHEAD
+    if (ahead_length > 0)
+    {
+        read_ahead();
+        return;
+    }
+    #endif
+    
+    #ifdef IDLE_WORK
+    if (!idle_failed && !view_outstanding())
+        idle_failed = !idle_unit();
+    #endif
+}
+#endif
+
+
+// process any commands received over I2C
+// (a card image stands in for the card on a PC, and mbus_sim.c calls this)
+void check_for_order (void)
+{
+    if (new_order)
+    {  // there's a new order ready for processing
+        // I2C should be NACKing everything at this point
+        
+        order = &slots[0];
+        process_order();
+        data_led_off();
+        
+        new_order = false;
+        ready_line (true);
+        TWI_ACK();
+    }
+    #if ORDER_SLOTS > 1
+    else if (waiting_in != waiting_out && !view_held)
+    {  // the oldest queued order; the ISR carries on taking more meanwhile
+        const uint8_t slot = waiting[waiting_out % ORDER_SLOTS];
+        waiting_out++;
+        
+        order = &slots[slot];
+        
+        if (write_behind && (order->code == M_SD_WRITE_FILE ||
+                             order->code == M_SD_WRITE_MORE))
+        {
+            write_behind_order (slot);
+        }
+        else
+        {
             process_order();
             data_led_off();
             
-            new_order = false;
-            TWI_ACK();
+            if (order->response_data != order->data)
+                view_held = true;
+            
+            finish_order (slot);
         }
     }
+    #endif
+    #if defined(IDLE_WORK) || defined(READ_AHEAD)
+    else
+        idle_work();
+    #endif
 }
 
 
-void process_order (void)
+#if ORDER_SLOTS > 1
+// forget the queued orders' responses that the master hasn't read, other than
+// one that's already being sent (for M_SD_INIT, from a master that's started
+// again and isn't expecting them)
+static void drop_finished (void)
 {
-    if (transmission.data_length > TWI_BUFFER_LEN)
+    cli();
+    
+    const uint8_t keep = sending_finished ? 1 : 0;
+    
+    while ((uint8_t)(finished_in - finished_out) > keep)
     {
-        transmission.code = ERROR_I2C_COMMAND;
-        transmission.data_length = 0;
-        return;
+        finished_in--;
+        slot_busy[finished[finished_in % ORDER_SLOTS]] = false;
     }
     
-    switch (transmission.code)
+    ready_line (finished_in != finished_out);
+    sei();
+}
+#endif
+
+
+// carry out an order (or a batch's step) whose data is at data, and leave its
+// response there
+static void run_order (uint8_t *const data)
+{
+    #ifdef HOST
+    mbus_sim_order_time();
+    #endif
+    
+    switch (order->code)
     {
         case M_SD_INIT:
+            // a master that's just started sends this in legacy frames, so go
+            // back to them
+            next_header_length = LEGACY_HEADER_LENGTH;
+            write_remaining = 0;
+            #if ORDER_SLOTS > 1
+            drop_finished();
+            write_behind = false;
+            behind_error = ERROR_NONE;
+            #endif
+            #ifdef FAT32_RINGLOG
+            ringlog_open = false;
+            #endif
+            #ifdef IDLE_WORK
+            // the backup FATs are brought up to date between orders instead
+            // (and by every sync)
+            sd_fat32_set_mirror_policy (MIRROR_DEFERRED);
+            #endif
+            #ifdef EXFAT
+            exfat_mounted = false;
+            if (!sd_fat32_init() &&
+                (error_code == ERROR_NO_FAT32 || error_code == ERROR_MBR))
+            {  // no FAT32 partition, try exFAT
+                exfat_mounted = sd_exfat_init();
+            }
+            #else
             sd_fat32_init();
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            #endif
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_SHUTDOWN:
-            sd_fat32_shutdown();
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            #ifdef FAT32_RINGLOG
+            ringlog_open = false;
+            #endif
+            FS_CALL (shutdown);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_GET_SIZE:
             {
-                if (transmission.data_length == 0)
+                if (order->data_length == 0)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
-                if (transmission.data_length > 12)
-                {
-                    transmission.code = ERROR_FAT32_INVALID_NAME;
-                    transmission.data_length = 0;
+                if (order->data_length > 13)
+                {  // more than a name and its terminator
+                    order->code = ERROR_FAT32_INVALID_NAME;
+                    order->data_length = 0;
                     return;
                 }
                 
                 char filename[13];
                 for (uint8_t i = 0; i < 12; i++)
-                    filename[i] = (char)transmission.data[i];
+                    filename[i] = (char)data[i];
                 filename[12] = '\0';
                 
-                sd_fat32_get_size (filename,
-                                   (uint32_t *)transmission.data);
-                transmission.code = error_code;
-                transmission.data_length = 4;
+                FS_CALL (get_size, filename,
+                                   (uint32_t *)data);
+                order->code = error_code;
+                order->data_length = 4;
             }
             break;
         
         case M_SD_OBJECT_EXISTS:
             {
-                if (transmission.data_length == 0)
+                if (order->data_length == 0)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
                 char filename[13];
                 for (uint8_t i = 0; i < 12; i++)
-                    filename[i] = (char)transmission.data[i];
+                    filename[i] = (char)data[i];
                 filename[12] = '\0';
                 
-                bool retval = sd_fat32_object_exists (filename,
-                                                      (bool *)&(transmission.data[1]));
-                transmission.code = error_code;
-                transmission.data[0] = (uint8_t)retval;
-                transmission.data_length = 2;
+                bool retval = FS_CALL (object_exists, filename,
+                                                      (bool *)&(data[1]));
+                order->code = error_code;
+                data[0] = (uint8_t)retval;
+                order->data_length = 2;
             }
             break;
         
         case M_SD_GET_FIRST_ENTRY:
+        case M_SD_GET_NEXT_ENTRY:
+            // data[0] is whether there was another entry, data[1..4] its size
+            // (most significant byte first), data[5] whether it's a directory,
+            // and the rest its name
             {
-                bool retval = sd_fat32_get_dir_entry_first ((char *)&transmission.data[1]);
-                transmission.data[0] = (uint8_t)retval;
-                transmission.code = error_code;
-                transmission.data_length = 13;
+                listed_object object;
+                char *name = (char *)&data[6];
+                
+                bool retval = (order->code == M_SD_GET_FIRST_ENTRY) ?
+                              FS_CALL (list_dir_first, name, &object) :
+                              FS_CALL (list_dir_next, name, &object);
+                
+                if (!retval)
+                {
+                    object.size = 0;
+                    object.is_directory = false;
+                }
+                
+                data[0] = (uint8_t)retval;
+                data[1] = (uint8_t)(object.size >> 24);
+                data[2] = (uint8_t)(object.size >> 16);
+                data[3] = (uint8_t)(object.size >> 8);
+                data[4] = (uint8_t)object.size;
+                data[5] = (uint8_t)object.is_directory;
+                order->code = error_code;
+                order->data_length = DIR_ENTRY_RESPONSE;
             }
             break;
         
-        case M_SD_GET_NEXT_ENTRY:
+        case M_SD_LIST_DIR:
+            // data[0] is 1 to start at the beginning of the current directory
+            // or 0 to carry on from the last listing, and the rest is an
+            // optional pattern for the names (see filename_matches).  The
+            // response is data[0], set once the end of the directory has been
+            // reached, and then as many matching entries as fit, each the
+            // flags, the size and first cluster (least significant byte
+            // first), the length of the name and the name
             {
-                bool retval = sd_fat32_get_dir_entry_next ((char *)&transmission.data[1]);
-                transmission.data[0] = (uint8_t)retval;
-                transmission.code = error_code;
-                transmission.data_length = 13;
+                if (order->data_length == 0 ||
+                    order->data_length > FS_NAME_LENGTH + 1)
+                {
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                char pattern[FS_NAME_LENGTH + 1];
+                const uint8_t pattern_length = (uint8_t)(order->data_length - 1);
+                
+                for (uint8_t i = 0; i < pattern_length; i++)
+                    pattern[i] = (char)data[1 + i];
+                pattern[pattern_length] = '\0';
+                
+                bool first = (data[0] != 0);
+                
+                // legacy frames have an 8-bit length
+                const uint16_t space = (header_length == LEGACY_HEADER_LENGTH &&
+                                        slot_length > 255) ? 255 : slot_length;
+                uint16_t length = 1;
+                
+                data[0] = 0;
+                error_code = ERROR_NONE;
+                
+                for (uint8_t scanned = 0;
+                     scanned < LIST_SCAN_ENTRIES && length + LIST_ENTRY_SPACE <= space;
+                     scanned++)
+                {
+                    uint8_t *const entry = &data[length];
+                    char *const name = (char *)&entry[10];
+                    listed_object object;
+                    
+                    const bool found = first ? FS_CALL (list_dir_first, name, &object)
+                                             : FS_CALL (list_dir_next, name, &object);
+                    first = false;
+                    
+                    if (!found)
+                    {  // the end of the directory, or an error
+                        data[0] = 1;
+                        break;
+                    }
+                    
+                    if (pattern_length > 0 && !filename_matches (name, pattern))
+                        continue;
+                    
+                    uint8_t name_length = 0;
+                    while (name[name_length] != '\0')
+                        name_length++;
+                    
+                    entry[0] = object.is_directory ? LISTED_DIRECTORY : 0;
+                    for (uint8_t i = 0; i < 4; i++)
+                    {
+                        entry[1 + i] = (uint8_t)(object.size >> (8 * i));
+                        entry[5 + i] = (uint8_t)(object.first_cluster >> (8 * i));
+                    }
+                    entry[9] = name_length;
+                    
+                    length += 10 + name_length;
+                }
+                
+                order->code = error_code;
+                order->data_length = (error_code == ERROR_NONE) ? length : 0;
             }
             break;
         
         case M_SD_PUSH:
-            if (transmission.data_length == 0)
+            if (order->data_length == 0)
             {
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
                 return;
             }
             
-            sd_fat32_push ((char *)transmission.data);
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            FS_CALL (push, (char *)data);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_POP:
-            sd_fat32_pop();
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            FS_CALL (pop);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_MKDIR:
-            if (transmission.data_length == 0)
+            if (order->data_length == 0)
             {
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
                 return;
             }
             
-            sd_fat32_mkdir ((char *)transmission.data);
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            FS_CALL (mkdir, (char *)data);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_RMDIR:
-            if (transmission.data_length == 0)
+            if (order->data_length == 0)
             {
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
                 return;
             }
             
-            sd_fat32_rmdir ((char *)transmission.data);
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            FS_CALL (rmdir, (char *)data);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_DELETE:
-            if (transmission.data_length == 0)
+            if (order->data_length == 0)
             {
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
                 return;
             }
             
-            sd_fat32_delete ((char *)transmission.data);
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            FS_CALL (delete, (char *)data);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_OPEN_FILE:
             {
-                if (transmission.data[transmission.data_length - 1] != '\0')
+                if (data[order->data_length - 1] != '\0')
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
-                if (transmission.data[0] > 2)
+                if (data[0] > 2)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
                 uint8_t file_id;
-                sd_fat32_open_file ((char *)&(transmission.data[1]),
-                                    transmission.data[0],
+                FS_CALL (open_file, (char *)&(data[1]),
+                                    data[0],
                                     &file_id);
                 
-                transmission.code = error_code;
-                transmission.data_length = 1;
-                transmission.data[0] = file_id;
+                order->code = error_code;
+                order->data_length = 1;
+                data[0] = file_id;
             }
             break;
         
         case M_SD_CLOSE_FILE:
-            if (transmission.data_length != 1)
+            if (order->data_length != 1)
             {
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
                 return;
             }
             
-            sd_fat32_close_file (transmission.data[0]);
-            transmission.code = error_code;
-            transmission.data_length = 0;
+            FS_CALL (close_file, data[0]);
+            order->code = error_code;
+            order->data_length = 0;
             break;
         
         case M_SD_SEEK:
             {
-                if (transmission.data_length != 5)
+                if (order->data_length != 5)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
-                const uint32_t* seek_ptr = (uint32_t*)&(transmission.data[1]);
-                sd_fat32_seek (transmission.data[0],
+                const uint32_t* seek_ptr = (uint32_t*)&(data[1]);
+                FS_CALL (seek, data[0],
                                *seek_ptr);
                 
-                transmission.code = error_code;
-                transmission.data_length = 0;
+                order->code = error_code;
+                order->data_length = 0;
             }
             break;
         
         case M_SD_GET_SEEK:
             {
-                if (transmission.data_length != 1)
+                if (order->data_length != 1)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
-                const uint8_t file_id = transmission.data[0];
+                const uint8_t file_id = data[0];
                 
-                uint32_t *data_ptr = (uint32_t*)transmission.data;
-                if (!sd_fat32_get_seek_pos (file_id, data_ptr))
+                uint32_t *data_ptr = (uint32_t*)data;
+                if (!FS_CALL (get_seek_pos, file_id, data_ptr))
                 {
-                    transmission.code = error_code;
-                    transmission.data_length = 0;
+                    order->code = error_code;
+                    order->data_length = 0;
                     return;
                 }
                 
-                transmission.code = error_code;
-                transmission.data_length = 4;
+                order->code = error_code;
+                order->data_length = 4;
             }
             break;
         
         case M_SD_READ_FILE:
+            if (header_length != LEGACY_HEADER_LENGTH && !in_batch)
+            {  // data[0] is the file id and data[1..2] how much the master
+               // still wants (all of which has to be in the file); the response
+               // is as much of it as is in the sector at the seek position,
+               // sent straight out of the cache
+                if (order->data_length != 3)
+                {
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                const uint8_t file_id = data[0];
+                const uint16_t length = (uint16_t)data[1] |
+                                        ((uint16_t)data[2] << 8);
+                
+                #ifdef EXFAT
+                if (exfat_mounted)
+                {  // no cache views on exFAT, so copy up to a buffer's worth
+                    const uint16_t chunk = (length < slot_length) ? length : slot_length;
+                    
+                    sd_exfat_read_file (file_id,
+                                        (uint32_t)chunk,
+                                        (uint8_t*)data);
+                    order->code = error_code;
+                    order->data_length = (error_code == ERROR_NONE) ? chunk : 0;
+                    return;
+                }
+                #endif
+                
+                uint32_t position;
+                if (!sd_fat32_get_seek_pos (file_id, &position))
+                {
+                    order->code = error_code;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                if (position + length > files[file_id].size)
+                {
+                    order->code = ERROR_FAT32_TOO_FAR;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                uint16_t viewed;
+                if (!sd_fat32_read_view (file_id, length, &order->response_data, &viewed))
+                {
+                    order->response_data = data;
+                    viewed = 0;
+                }
+                
+                order->code = error_code;
+                order->data_length = viewed;
+                
+                #ifdef READ_AHEAD
+                if (viewed > 0)
+                {  // the master will ask for the rest of what it wants, or
+                   // if it wanted no more, may carry on reading from here as
+                   // it did up to here; the next view is in one sector
+                    const uint32_t end = position + viewed;
+                    uint16_t next = length - viewed;
+                    
+                    if (next == 0 && position == read_end[file_id])
+                        next = length;
+                    
+                    if (next > 0)
+                    {
+                        ahead_file = file_id;
+                        ahead_length = (next > 512 - (end & 511)) ? 512 - (end & 511) : next;
+                    }
+                    
+                    read_end[file_id] = end;
+                }
+                #endif
+            }
+            else
             {
-                if (transmission.data_length != 2)
+                if (order->data_length != 2)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
-                const uint8_t file_id = transmission.data[0];
-                const uint8_t length = transmission.data[1];
+                const uint8_t file_id = data[0];
+                const uint8_t length = data[1];
+                
+                #ifdef READ_AHEAD
+                uint32_t position;
+                const bool positioned = FS_CALL (get_seek_pos, file_id, &position);
+                #endif
                 
-                sd_fat32_read_file (file_id,
+                FS_CALL (read_file, file_id,
                                     (uint32_t)length,
-                                    (uint8_t*)transmission.data);
-                transmission.code = error_code;
+                                    (uint8_t*)data);
+                order->code = error_code;
                 
                 if (error_code == ERROR_NONE)
-                    transmission.data_length = length;
+                    order->data_length = length;
                 else
-                    transmission.data_length = 0;
+                    order->data_length = 0;
+                
+                #ifdef READ_AHEAD
+                if (error_code == ERROR_NONE && positioned)
+                {  // carrying on from the last read of this file: expect
+                   // another read of the same length to follow
+                    if (position == read_end[file_id])
+                    {
+                        ahead_file = file_id;
+                        ahead_length = length;
+                    }
+                    
+                    read_end[file_id] = position + length;
+                }
+                #endif
             }
             break;
         
         case M_SD_WRITE_FILE:
+            if (header_length != LEGACY_HEADER_LENGTH && !in_batch)
+            {  // data[0] is the file id, data[1..2] the length of the whole
+               // write, and the rest is the first part of it; M_SD_WRITE_MORE
+               // frames bring the rest, and only the last one has a response
+                if (order->data_length < 4)
+                {
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                const uint16_t length = (uint16_t)data[1] |
+                                        ((uint16_t)data[2] << 8);
+                const uint16_t chunk = order->data_length - 3;
+                
+                if (chunk > length)
+                {
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                write_file_id = data[0];
+                write_remaining = length - chunk;
+                
+                FS_CALL (write_file, write_file_id,
+                                     (uint32_t)chunk,
+                                     (uint8_t*)&data[3]);
+                write_error = error_code;
+                
+                order->code = write_error;
+                order->data_length = 0;
+            }
+            else
+            {
+                if (order->data_length < 2)
+                {
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                const uint8_t file_id = data[0];
+                
+                FS_CALL (write_file, file_id,
+                                     (uint32_t)order->data_length - 1,
+                                     (uint8_t*)&data[1]);
+                order->code = error_code;
+                order->data_length = 0;
+            }
+            break;
+        
+        case M_SD_WRITE_MORE:
+            // the next part of a bulk write: once an error comes up, the rest
+            // of the write is dropped, and the error is the last frame's response
+            if (order->data_length == 0 ||
+                order->data_length > write_remaining)
+            {
+                write_remaining = 0;
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
+                return;
+            }
+            
+            if (write_error == ERROR_NONE)
+            {
+                FS_CALL (write_file, write_file_id,
+                                     (uint32_t)order->data_length,
+                                     (uint8_t*)data);
+                write_error = error_code;
+            }
+            
+            write_remaining -= order->data_length;
+            
+            order->code = write_error;
+            order->data_length = 0;
+            break;
+        
+        case M_SD_SET_MODE:
+            // data[0] is the frame format to use from the next order on, and
+            // data[1], if it's there, the options (MBUS_WRITE_BEHIND); the
+            // response is the most order data that fits in a frame in that
+            // format, and the number of orders that can be queued
+            if (order->data_length < 1 || order->data_length > 2 ||
+                data[0] > MBUS_QUEUED_FRAMES ||
+                (data[0] == MBUS_QUEUED_FRAMES && ORDER_SLOTS < 2) ||
+                (order->data_length == 2 &&
+                 ((data[1] & ~MBUS_WRITE_BEHIND) ||
+                  (data[1] && data[0] != MBUS_QUEUED_FRAMES))))
+            {
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
+                return;
+            }
+            
+            #if ORDER_SLOTS > 1
+            write_behind = (order->data_length == 2 && (data[1] & MBUS_WRITE_BEHIND));
+            #endif
+            
+            if (data[0] == MBUS_QUEUED_FRAMES)
+                next_header_length = QUEUED_HEADER_LENGTH;
+            else if (data[0] == MBUS_BULK_FRAMES)
+                next_header_length = BULK_HEADER_LENGTH;
+            else
+                next_header_length = LEGACY_HEADER_LENGTH;
+            
+            write_remaining = 0;
+            
+            const uint16_t space = (next_header_length == QUEUED_HEADER_LENGTH) ?
+                                   QUEUED_SLOT_LEN : TWI_BUFFER_LEN;
+            
+            order->code = ERROR_NONE;
+            data[0] = (uint8_t)space;
+            data[1] = (uint8_t)(space >> 8);
+            data[2] = ORDER_SLOTS;
+            order->data_length = 3;
+            break;
+        
+        case M_SD_COMMIT:
+            // with a file id, sync just that file; otherwise, sync everything
+            if (order->data_length == 0)
+            {
+                FS_CALL (sync_all);
+            }
+            else if (order->data_length == 1)
+            {
+                FS_CALL (sync_file, data[0]);
+            }
+            else
+            {
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
+                return;
+            }
+            
+            order->code = error_code;
+            order->data_length = 0;
+            break;
+        
+        case M_SD_TRUNCATE:
             {
-                if (transmission.data_length < 2)
+                if (order->data_length != 5)
                 {
-                    transmission.code = ERROR_I2C_COMMAND;
-                    transmission.data_length = 0;
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
                     return;
                 }
                 
-                const uint8_t file_id = transmission.data[0];
+                const uint32_t* size_ptr = (uint32_t*)&(data[1]);
+                FS_CALL (truncate, data[0],
+                                   *size_ptr);
                 
-                sd_fat32_write_file (file_id,
-                                     (uint32_t)transmission.data_length - 1,
-                                     (uint8_t*)&transmission.data[1]);
-                transmission.code = error_code;
-                transmission.data_length = 0;
+                order->code = error_code;
+                order->data_length = 0;
             }
             break;
         
+        case M_SD_FREE_SPACE:
+            // a FAT32 card without a free cluster count has its FAT counted
+            // a few sectors per order, so the bus isn't held up for long;
+            // data[0] tells the master whether to ask again
+            {
+                bool done = true;
+                uint32_t *free_ptr = (uint32_t*)&(data[1]);
+                
+                #ifdef EXFAT
+                if (exfat_mounted)
+                    sd_exfat_free_space (free_ptr);
+                else
+                #endif
+                if (sd_fat32_count_free_clusters (FREE_COUNT_SECTORS, &done) && done)
+                    sd_fat32_free_space (free_ptr);
+                
+                order->code = error_code;
+                data[0] = (uint8_t)done;
+                order->data_length = 5;
+            }
+            break;
+        
+        #ifdef FAT32_RINGLOG
+        case M_SD_RINGLOG_CREATE:
+            // data[0..3] is the number of blocks, followed by the name
+            if (order->data_length < 6 ||
+                data[order->data_length - 1] != '\0')
+            {
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
+                return;
+            }
+            
+            #ifdef EXFAT
+            if (exfat_mounted)
+            {
+                order->code = ERROR_NO_FAT32;
+                order->data_length = 0;
+                return;
+            }
+            #endif
+            
+            sd_fat32_ringlog_create ((char *)&(data[4]),
+                                     *(uint32_t*)data);
+            order->code = error_code;
+            order->data_length = 0;
+            break;
+        
+        case M_SD_RINGLOG_OPEN:
+            if (order->data_length == 0 ||
+                data[order->data_length - 1] != '\0')
+            {
+                order->code = ERROR_I2C_COMMAND;
+                order->data_length = 0;
+                return;
+            }
+            
+            #ifdef EXFAT
+            if (exfat_mounted)
+            {
+                order->code = ERROR_NO_FAT32;
+                order->data_length = 0;
+                return;
+            }
+            #endif
+            
+            if (ringlog_open)
+            {
+                order->code = ERROR_FAT32_ALREADY_OPEN;
+                order->data_length = 0;
+                return;
+            }
+            
+            if (sd_fat32_ringlog_open ((char *)data, &ringlog))
+            {
+                ringlog_open = true;
+                sd_fat32_ringlog_rewind (&ringlog, &ringlog_reader);
+            }
+            
+            order->code = error_code;
+            order->data_length = 0;
+            break;
+        
+        case M_SD_RINGLOG_CLOSE:
+        case M_SD_RINGLOG_APPEND:
+        case M_SD_RINGLOG_REWIND:
+        case M_SD_RINGLOG_READ:
+            if (!ringlog_open)
+            {
+                order->code = ERROR_FAT32_NOT_OPEN;
+                order->data_length = 0;
+                return;
+            }
+            
+            if (order->code == M_SD_RINGLOG_CLOSE)
+            {
+                if (sd_fat32_ringlog_close (&ringlog))
+                    ringlog_open = false;
+                
+                order->data_length = 0;
+            }
+            else if (order->code == M_SD_RINGLOG_APPEND)
+            {  // the data is the record
+                sd_fat32_ringlog_append (&ringlog,
+                                         data,
+                                         order->data_length);
+                order->data_length = 0;
+            }
+            else if (order->code == M_SD_RINGLOG_REWIND)
+            {
+                sd_fat32_ringlog_rewind (&ringlog, &ringlog_reader);
+                error_code = ERROR_NONE;
+                order->data_length = 0;
+            }
+            else
+            {  // data[0] is the most the master can take, the response is the
+               // record (no data at the end of the log)
+                if (order->data_length != 1)
+                {
+                    order->code = ERROR_I2C_COMMAND;
+                    order->data_length = 0;
+                    return;
+                }
+                
+                const uint16_t max_length = (data[0] < slot_length) ? data[0] : slot_length;
+                
+                uint16_t length;
+                if (sd_fat32_ringlog_read (&ringlog,
+                                           &ringlog_reader,
+                                           data,
+                                           max_length,
+                                           &length))
+                    order->data_length = (uint8_t)length;
+                else
+                    order->data_length = 0;
+            }
+            
+            order->code = error_code;
+            break;
+        #endif
+        
         default:
-            transmission.code = ERROR_I2C_COMMAND;
-            transmission.data_length = 0;
+            order->code = ERROR_I2C_COMMAND;
+            order->data_length = 0;
             break;
     }
 }
 
 
+// the orders that take a file id in data[0]
+static bool takes_file_id (const uint8_t code,
+                           const uint16_t length)
+{
+    switch (code)
+    {
+        case M_SD_CLOSE_FILE:
+        case M_SD_SEEK:
+        case M_SD_GET_SEEK:
+        case M_SD_READ_FILE:
+        case M_SD_WRITE_FILE:
+        case M_SD_TRUNCATE:
+            return (length > 0);
+        
+        case M_SD_COMMIT:
+            return (length == 1);
+        
+        default:
+            return false;
+    }
+}
 
-ISR (TWI_vect)
+// M_SD_BATCH: the data is a list of steps, each an order as it would be sent
+// in a legacy frame (code, 8-bit length, data), which are run one after
+// another until one of them fails.  The response is the steps' responses, in
+// the same form, up to and including the one that failed, whose error is the
+// batch's response code.  A file id of BATCH_FILE in a step stands for the
+// file opened by the last M_SD_OPEN_FILE step before it.
+//
+// It's all done in the order's buffer: the steps are moved to the end of it,
+// and each in turn is copied down to just after the responses so far and run
+// there, so that its response can use the space that it and the steps before
+// it took up.
+static void run_batch (void)
 {
-    static uint8_t *transmission_ptr = (uint8_t *)&transmission;
-    static bool receiving = false;
+    uint8_t *const data = order->data;
+    const uint16_t length = order->data_length;
     
-    const uint8_t status = TWSR & 0b11111000;
+    for (uint16_t i = length; i > 0; i--)
+        data[slot_length - length + i - 1] = data[i - 1];
+    
+    uint16_t next = slot_length - length;  // the next step
+    uint16_t done = 0;                     // the length of the responses so far
+    uint8_t batch_file = BATCH_FILE;
+    uint8_t result = ERROR_NONE;
+    
+    in_batch = true;
+    
+    while (next < slot_length && result == ERROR_NONE)
+    {
+        if (slot_length - next < 2 ||
+            slot_length - next - 2 < data[next + 1])
+        {  // the last step is cut short
+            result = ERROR_I2C_COMMAND;
+            break;
+        }
+        
+        const uint8_t code = data[next];
+        const uint8_t step_length = data[next + 1];
+        uint8_t *const step = &data[done + 2];
+        
+        for (uint8_t i = 0; i < step_length; i++)
+            step[i] = data[next + 2 + i];
+        
+        next += 2 + step_length;
+        
+        // the room there is for the step's response
+        const uint16_t space = next - (done + 2);
+        
+        if (code == M_SD_INIT || code == M_SD_SET_MODE ||
+            code == M_SD_WRITE_MORE || code == M_SD_BATCH ||
+            code == M_SD_LIST_DIR ||
+            space < BATCH_STEP_SPACE ||
+            ((code == M_SD_GET_FIRST_ENTRY || code == M_SD_GET_NEXT_ENTRY) &&
+             space < DIR_ENTRY_RESPONSE) ||
+            (code == M_SD_READ_FILE && step_length == 2 && step[1] > space))
+        {
+            order->code = ERROR_I2C_COMMAND;
+            order->data_length = 0;
+        }
+        else
+        {
+            if (takes_file_id (code, step_length) && step[0] == BATCH_FILE)
+                step[0] = batch_file;
+            
+            if (code == M_SD_RINGLOG_READ && step_length == 1 && step[0] > space)
+                step[0] = (uint8_t)space;
+            
+            order->code = code;
+            order->data_length = step_length;
+            run_order (step);
+            
+            if (code == M_SD_OPEN_FILE && order->code == ERROR_NONE)
+                batch_file = step[0];
+        }
+        
+        data[done] = order->code;
+        data[done + 1] = (uint8_t)order->data_length;
+        done += 2 + order->data_length;
+        
+        result = order->code;
+    }
+    
+    in_batch = false;
+    
+    order->code = result;
+    order->data_length = done;
+}
+
+
+void process_order (void)
+{
+    order->response_data = order->data;
+    
+    #ifdef IDLE_WORK
+    idle_failed = false;
+    #endif
+    
+    #if ORDER_SLOTS > 1
+    if (behind_error != ERROR_NONE && order->code != M_SD_INIT)
+    {  // a write carried out after it was acknowledged failed
+        order->code = behind_error;
+        order->data_length = 0;
+        behind_error = ERROR_NONE;
+        return;
+    }
+    #endif
+    
+    if (order->data_length > slot_length)
+    {
+        order->code = ERROR_I2C_COMMAND;
+        order->data_length = 0;
+        return;
+    }
+    
+    if (order->code == M_SD_BATCH)
+        run_batch();
+    else
+        run_order (order->data);
+}
+
+
+
+// the data length follows the code in the frame header, after the sequence
+// number in queued frames
+#define LENGTH_INDEX ((header_length == QUEUED_HEADER_LENGTH) ? 2 : 1)
+
+// the byte of the response frame at index: the header, then the data, then
+// padding for a master that reads more than it needed to
+static uint8_t response_byte (const order_slot *slot,
+                              const uint16_t index)
+{
+    if (index == 0)
+        return slot->code;
+    
+    if (index < LENGTH_INDEX)
+        return slot->seq;
+    
+    if (index == LENGTH_INDEX)
+        return (uint8_t)slot->data_length;
+    
+    if (index < header_length)
+        return (uint8_t)(slot->data_length >> 8);
+    
+    if (index - header_length < slot->data_length)
+        return slot->response_data[index - header_length];
+    
+    return 0;
+}
+
+// store the byte of the order frame at index, and return true once the whole
+// order is in (or the buffer is full)
+static bool order_byte (order_slot *slot,
+                        const uint16_t index,
+                        const uint8_t byte)
+{
+    if (index == 0)
+        slot->code = byte;
+    else if (index < LENGTH_INDEX)
+        slot->seq = byte;
+    else if (index == LENGTH_INDEX)
+        slot->data_length = byte;
+    else if (index < header_length)
+        slot->data_length |= (uint16_t)byte << 8;
+    else if (index - header_length < slot_length)
+        slot->data[index - header_length] = byte;
+    
+    const uint16_t received = index + 1;
     
+    return (received >= header_length &&
+            received - header_length >= slot->data_length) ||
+           received >= header_length + slot_length;
+}
+
+
+static uint16_t frame_index = 0;  // of the next byte to send or receive
+static bool receiving = false;
+
+// legacy and bulk frames: one order at a time, in the first slot, with
+// everything NACKed while it's processed
+static void direct_twi_event (const uint8_t status)
+{
     switch (status)
     {
         // sending response:
         case TX_ADDR_ACK:
         case TX_ADDR_ACK_ARB_LOST:
             // master wants to read response data
-            transmission_ptr = (uint8_t *)&transmission;
-            TWDR = *transmission_ptr++;
+            frame_index = 0;
+            TWDR = response_byte (&slots[0], frame_index++);
             TWI_ACK();
             break;
         
         case TX_BYTE_ACK:
             // continuing to send data
-            TWDR = *transmission_ptr++;
-            
-            if ( (transmission_ptr >= ((uint8_t *)&transmission) + 2 &&
-                  transmission_ptr >= ((uint8_t *)&transmission) + 2 + transmission.data_length) ||
-                 transmission_ptr >= ((uint8_t *)&transmission) + 2 + TWI_BUFFER_LEN)
-            {  // if we've reached the end of our response
-                transmission_ptr = (uint8_t *)&transmission;  // reset buffer to default address
-            }
+            TWDR = response_byte (&slots[0], frame_index++);
             TWI_ACK();
             break;
         
         case TX_BYTE_NACK:
             // master says that this was the final byte it will read
-            transmission_ptr = (uint8_t *)&transmission;  // reset buffer to default address
+            frame_index = 0;
             TWI_ACK();
             break;
         
@@ -649,20 +1763,17 @@ ISR (TWI_vect)
         case RX_ADDR_ACK_ARB_LOST:
             // beginning to receive an order
             receiving = true;
+            ready_line (false);
             
-            transmission.code = M_SD_NONE;
-            transmission.data_length = 0;
+            slots[0].code = M_SD_NONE;
+            slots[0].data_length = 0;
             
-            transmission_ptr = (uint8_t *)&transmission;
+            frame_index = 0;
             TWI_ACK();
             break;
         
         case RX_ADDR_DATA_ACK:
-            *transmission_ptr++ = TWDR;
-            
-            if ( (transmission_ptr >= ((uint8_t*)&transmission) + 2 &&
-                  transmission_ptr >= ((uint8_t*)&transmission) + 2 + transmission.data_length) ||
-                transmission_ptr >= ((uint8_t*)&transmission) + 2 + TWI_BUFFER_LEN)
+            if (order_byte (&slots[0], frame_index++, TWDR))
             {
                 TWI_NACK();  // don't accept any new commands until processing is complete
                 
@@ -672,13 +1783,7 @@ ISR (TWI_vect)
                 receiving = false;
                 new_order = true;
                 
-                /*
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
-                */
-                
-                transmission_ptr = (uint8_t *)&transmission;  // reset buffer to default address
-                
+                frame_index = 0;
             }
             else
             {
@@ -712,17 +1817,12 @@ ISR (TWI_vect)
                 receiving = false;
                 new_order = true;
                 
-                /*
-                transmission.code = ERROR_I2C_COMMAND;
-                transmission.data_length = 0;
-                */
-                
-                transmission_ptr = (uint8_t *)&transmission;  // reset buffer to default address
+                frame_index = 0;
                 TWI_NACK();
             }
             else
             {
-                transmission_ptr = (uint8_t *)&transmission;
+                frame_index = 0;
                 receiving = false;
                 TWI_ACK();
             }
@@ -731,3 +1831,208 @@ ISR (TWI_vect)
 }
 
 
+#if ORDER_SLOTS > 1
+
+static order_slot *rx_slot = NO_SLOT;  // the queued order being received
+static order_slot *tx_slot = NO_SLOT;  // the finished order being sent
+
+// start over with every slot free, when switching to or from queued frames
+// (with queued frames, each slot has its own part of order_buffer; with the
+// others, the first slot's order can run on into the other slots' parts)
+static void reset_queue (void)
+{
+    for (uint8_t i = 0; i < ORDER_SLOTS; i++)
+    {
+        slots[i].data = &order_buffer[i * QUEUED_SLOT_LEN];
+        slot_busy[i] = false;
+    }
+    
+    waiting_in = waiting_out = 0;
+    finished_in = finished_out = 0;
+    view_held = false;
+    sending_finished = false;
+    rx_slot = tx_slot = NO_SLOT;
+    ready_line (false);
+}
+
+static order_slot *take_free_slot (void)
+{
+    for (uint8_t i = 0; i < ORDER_SLOTS; i++)
+    {
+        if (!slot_busy[i])
+        {
+            slot_busy[i] = true;
+            return &slots[i];
+        }
+    }
+    
+    return NO_SLOT;
+}
+
+// the order in rx_slot is all in: leave it for the main loop, unless it was
+// empty (the slot is freed again).  A master that has started again sends
+// M_SD_INIT in a legacy frame, which is read as a queued order with no data
+static void queue_order (void)
+{
+    receiving = false;
+    
+    if (frame_index == 0)
+    {
+        slot_busy[rx_slot - slots] = false;
+        return;
+    }
+    
+    data_led_on();
+    waiting[waiting_in % ORDER_SLOTS] = rx_slot - slots;
+    waiting_in++;
+}
+
+// the byte of the oldest finished order's response, or if there isn't one,
+// of a header with NO_COMPLETION and the number of orders in hand
+static uint8_t queued_response_byte (const uint16_t index)
+{
+    if (tx_slot != NO_SLOT)
+        return response_byte (tx_slot, index);
+    
+    if (index == 0)
+        return NO_COMPLETION;
+    
+    if (index == 1)
+    {
+        uint8_t busy = 0;
+        for (uint8_t i = 0; i < ORDER_SLOTS; i++)
+        {
+            if (slot_busy[i])
+                busy++;
+        }
+        
+        return busy;
+    }
+    
+    return 0;
+}
+
+// queued frames: orders are taken while others are processed, as long as
+// there's a free slot, and responses are sent back as the master asks for them
+static void queued_twi_event (const uint8_t status)
+{
+    switch (status)
+    {
+        // sending response:
+        case TX_ADDR_ACK:
+        case TX_ADDR_ACK_ARB_LOST:
+            if (finished_in != finished_out)
+            {
+                tx_slot = &slots[finished[finished_out % ORDER_SLOTS]];
+                sending_finished = true;
+            }
+            else
+            {
+                tx_slot = NO_SLOT;
+            }
+            
+            frame_index = 0;
+            TWDR = queued_response_byte (frame_index++);
+            TWI_ACK();
+            break;
+        
+        case TX_BYTE_ACK:
+            TWDR = queued_response_byte (frame_index++);
+            TWI_ACK();
+            break;
+        
+        case TX_BYTE_NACK:
+            // the master has read all it wants of the response, so its slot
+            // (and the cache, for a bulk read) can be used again
+            if (sending_finished)
+            {
+                if (tx_slot->response_data != tx_slot->data)
+                    view_held = false;
+                
+                finished_out++;
+                if (tx_slot == behind_slot)
+                    behind_acked = true;  // freed once the write is done
+                else
+                    slot_busy[tx_slot - slots] = false;
+                sending_finished = false;
+                tx_slot = NO_SLOT;
+                ready_line (finished_in != finished_out);
+            }
+            
+            frame_index = 0;
+            TWI_ACK();
+            break;
+        
+        
+        // receiving order:
+        case RX_ADDR_ACK:
+        case RX_ADDR_ACK_ARB_LOST:
+            // with no free slot, NACK the order's first byte; the master
+            // tries again once it has read a response
+            rx_slot = take_free_slot();
+            frame_index = 0;
+            
+            if (rx_slot != NO_SLOT)
+            {
+                receiving = true;
+                rx_slot->code = M_SD_NONE;
+                rx_slot->seq = 0;
+                rx_slot->data_length = 0;
+                TWI_ACK();
+            }
+            else
+            {
+                receiving = false;
+                TWI_NACK();
+            }
+            break;
+        
+        case RX_ADDR_DATA_ACK:
+            // anything after the end of the order is ignored
+            if (receiving && order_byte (rx_slot, frame_index++, TWDR))
+                queue_order();
+            
+            TWI_ACK();
+            break;
+        
+        
+        // a stop or restart ends the order being received, and after an
+        // error, unknown state, or otherwise, start listening again
+        default:
+            if (receiving)
+                queue_order();
+            
+            frame_index = 0;
+            TWI_ACK();
+            break;
+    }
+}
+
+#endif
+
+
+ISR (TWI_vect)
+{
+    const uint8_t status = TWSR & 0b11111000;
+    
+    if (status == RX_ADDR_ACK || status == RX_ADDR_ACK_ARB_LOST)
+    {  // a new order picks up any change of frame format (see M_SD_SET_MODE)
+        #if ORDER_SLOTS > 1
+        if ((next_header_length == QUEUED_HEADER_LENGTH) !=
+            (header_length == QUEUED_HEADER_LENGTH))
+            reset_queue();
+        
+        slot_length = (next_header_length == QUEUED_HEADER_LENGTH) ?
+                      QUEUED_SLOT_LEN : TWI_BUFFER_LEN;
+        #endif
+        
+        header_length = next_header_length;
+    }
+    
+    #if ORDER_SLOTS > 1
+    if (header_length == QUEUED_HEADER_LENGTH)
+        queued_twi_event (status);
+    else
+    #endif
+    direct_twi_event (status);
+}
@@ -0,0 +1 @@
+../common/sd_fat32_defrag.c
\ No newline at end of file
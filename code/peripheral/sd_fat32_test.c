@@ -333,7 +333,8 @@ int main (void)
     
     /*
     dir_entry_condensed entry;
-    bool continue_reading = sd_fat32_traverse_directory (&entry, READ_DIR_START);
+    dir_cursor cursor;
+    bool continue_reading = sd_fat32_traverse_directory (&cursor, &entry, READ_DIR_START);
     
     m_usb_tx_string ("Root entries:\n");
     
@@ -355,7 +356,7 @@ int main (void)
             m_usb_tx_string ("\n");
         }
         
-        continue_reading = sd_fat32_traverse_directory (&entry, READ_DIR_NEXT);
+        continue_reading = sd_fat32_traverse_directory (&cursor, &entry, READ_DIR_NEXT);
     }
     
     if (!sd_fat32_push ("testdir"))